@@ -0,0 +1,127 @@
+/**
+ * @file access_log.c
+ * @brief Compact binary access log of the webserver
+ *
+ * @author ???
+ */
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+
+#include "access_log.h"
+#include "error.h"
+
+#include <string.h> // for memcmp, strcmp
+#include <time.h> // for clock_gettime
+
+#define FNV_OFFSET UINT32_C(2166136261)
+#define FNV_PRIME UINT32_C(16777619)
+
+static const char* const s_uris[NB_ACCESS] = ACCESS_URIS;
+
+/**
+ * 32-bit FNV-1a of an imgID.
+ */
+uint32_t access_log_hash(const char* img_id)
+{
+    if (img_id == NULL) {
+        return 0;
+    }
+
+    uint32_t hash = FNV_OFFSET;
+
+    for (const unsigned char* p = (const unsigned char*) img_id; *p != '\0'; ++p) {
+        hash = (hash ^ *p) * FNV_PRIME;
+    }
+
+    // 0 stands for requests without imgID
+    return (hash == 0) ? 1 : hash;
+}
+
+/**
+ * Gives the ACCESS_ code of a URI.
+ */
+int access_log_endpoint(const char* uri)
+{
+    for (int i = 0; uri != NULL && i < NB_ACCESS; ++i) {
+        if (i != ACCESS_STATIC && !strcmp(uri, s_uris[i])) {
+            return i;
+        }
+    }
+
+    return ACCESS_STATIC;
+}
+
+/**
+ * Gives the URI of an ACCESS_ code.
+ */
+const char* access_log_uri(int endpoint)
+{
+    return (endpoint < 0 || endpoint >= NB_ACCESS) ? s_uris[ACCESS_STATIC] : s_uris[endpoint];
+}
+
+/**
+ * Wall clock time, in microseconds.
+ */
+uint64_t access_log_now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return (uint64_t) t.tv_sec * 1000000 + (uint64_t) t.tv_nsec / 1000;
+}
+
+/**
+ * Opens an access log for appending, writing its header if it is new.
+ */
+int access_log_open(const char* filename, FILE** log)
+{
+    M_REQUIRE_NON_NULL(filename);
+    M_REQUIRE_NON_NULL(log);
+
+    FILE* file = fopen(filename, "ab");
+    M_EXIT_IF(file == NULL, ERR_IO, "cannot open %s", filename);
+
+    // Check the header of an existing log, write it in a new one
+    if (fseek(file, 0, SEEK_END) == 0 && ftell(file) == 0) {
+        access_log_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ACCESS_LOG_MAGIC, ACCESS_LOG_MAGIC_LEN);
+        header.version = ACCESS_LOG_VERSION;
+        header.record_size = sizeof(access_record);
+
+        M_EXIT_IF_ERR_DO_SOMETHING(fwrite(&header, sizeof(header), 1, file) != 1 ? ERR_IO : ERR_NONE,
+                                   fclose(file));
+    } else {
+        FILE* check = NULL;
+        M_EXIT_IF_ERR_DO_SOMETHING(access_log_open_read(filename, &check), fclose(file));
+        fclose(check);
+    }
+
+    *log = file;
+
+    return ERR_NONE;
+}
+
+/**
+ * Opens an access log for reading and checks its header.
+ */
+int access_log_open_read(const char* filename, FILE** log)
+{
+    M_REQUIRE_NON_NULL(filename);
+    M_REQUIRE_NON_NULL(log);
+
+    FILE* file = fopen(filename, "rb");
+    M_EXIT_IF(file == NULL, ERR_IO, "cannot open %s", filename);
+
+    access_log_header header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, ACCESS_LOG_MAGIC, ACCESS_LOG_MAGIC_LEN)
+        || header.version != ACCESS_LOG_VERSION
+        || header.record_size != sizeof(access_record)) {
+        fclose(file);
+        return ERR_IO;
+    }
+
+    *log = file;
+
+    return ERR_NONE;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+/**
+ * @file access_log.h
+ * @brief Header file for access_log.c.
+ *
+ * Compact binary access log of the webserver: a header, then one fixed-size
+ * record per request, so that traces can be replayed against a server or
+ * the library at their original pace.
+ *
+ * @author ???
+ */
+
+#include <stdio.h> // for FILE
+#include <stdint.h> // for uint32_t, uint64_t
+
+#define ACCESS_LOG_MAGIC "IMGSTLOG"
+#define ACCESS_LOG_MAGIC_LEN 8
+#define ACCESS_LOG_VERSION 1
+
+/* endpoints of the records, by their URI */
+#define ACCESS_LIST 0
+#define ACCESS_READ 1
+#define ACCESS_DELETE 2
+#define ACCESS_INSERT 3
+#define ACCESS_EXISTS 4
+#define ACCESS_LINK 5
+#define ACCESS_UPLOAD 6
+#define ACCESS_MANIFEST 7
+#define ACCESS_BATCH 8
+#define ACCESS_SPRITE 9
+#define ACCESS_SPRITE_MAP 10
+#define ACCESS_EXPORT 11
+#define ACCESS_STATIC 12 // anything served from the web directory
+#define ACCESS_METRICS 13
+#define ACCESS_TRACE 14
+#define ACCESS_STATS 15
+#define NB_ACCESS 16
+
+#define ACCESS_URIS { \
+    "/imgStore/list", "/imgStore/read", "/imgStore/delete", "/imgStore/insert", \
+    "/imgStore/exists", "/imgStore/link", "/imgStore/upload", "/imgStore/manifest", \
+    "/imgStore/batch", "/imgStore/sprite", "/imgStore/sprite/map", "/imgStore/export", \
+    "static", "/metrics", "/trace", "/imgStore/stats" }
+
+/* resolution of a record, beside the RES_ codes */
+#define ACCESS_RES_NONE (-1)
+#define ACCESS_RES_BOX (-2) // read with w= and h=
+
+/**
+ * @brief The header at the start of an access log file.
+ */
+struct access_log_header {
+    char magic[ACCESS_LOG_MAGIC_LEN];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+/**
+ * @brief One request: 32 bytes, with no padding.
+ */
+struct access_record {
+    uint64_t time_us;       // wall clock time of the request, in microseconds
+    uint32_t id_hash;       // access_log_hash of the imgID, 0 if none
+    uint32_t bytes;         // bytes of the reply queued by the handler
+    uint32_t latency_us;    // time spent in the handler
+    uint32_t request_bytes; // bytes of the request body
+    uint32_t offset;        // offset= of an insert chunk
+    uint16_t status;        // HTTP status code of the reply
+    uint8_t endpoint;       // one of the ACCESS_ codes
+    int8_t res;             // one of the RES_ or ACCESS_RES_ codes
+};
+
+typedef struct access_log_header access_log_header;
+typedef struct access_record access_record;
+
+/**
+ * @brief Hashes an imgID for the access log (32-bit FNV-1a).
+ *
+ * @param img_id The imgID, NULL gives 0
+ *
+ * @return The hash, never 0 for an imgID
+ */
+uint32_t access_log_hash(const char* img_id);
+
+/**
+ * @brief Gives the ACCESS_ code of a URI.
+ *
+ * @param uri The URI of a handler
+ *
+ * @return The code, ACCESS_STATIC if it is none of the handlers'
+ */
+int access_log_endpoint(const char* uri);
+
+/**
+ * @brief Gives the URI of an ACCESS_ code.
+ */
+const char* access_log_uri(int endpoint);
+
+/**
+ * @brief Wall clock time, in microseconds.
+ */
+uint64_t access_log_now_us(void);
+
+/**
+ * @brief Opens an access log for appending, writing its header if it is new.
+ *
+ * @param filename The path of the log
+ * @param log Set to the opened file
+ *
+ * @return Some error code. 0 if no error.
+ */
+int access_log_open(const char* filename, FILE** log);
+
+/**
+ * @brief Opens an access log for reading and checks its header.
+ *
+ * @param filename The path of the log
+ * @param log Set to the opened file, positioned at the first record
+ *
+ * @return Some error code. 0 if no error.
+ */
+int access_log_open_read(const char* filename, FILE** log);
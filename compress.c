@@ -0,0 +1,90 @@
+/**
+ * @file compress.c
+ * @brief HTTP content encodings of in-memory buffers
+ *
+ * @author ???
+ */
+
+#include "imgStore.h" // for FREE_DEREF
+#include "compress.h"
+#include "error.h"
+
+#include <stdlib.h> // for malloc
+#include <string.h> // for memcpy
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#define GZIP_WINDOW_BITS (15 + 16) // largest window, with a gzip wrapper
+#define GZIP_MEM_LEVEL 8 // zlib default
+#define GZIP_HEADER_LEN 18 // gzip header and trailer, on top of compressBound
+#define BROTLI_QUALITY 9 // much faster than the maximum, for a close ratio
+
+/**
+ * Compresses a buffer in the gzip format.
+ */
+static int gzip_buffer(const char* in, size_t in_len, char* out, size_t* out_len)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS,
+                     GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    stream.next_in = (Bytef*) in;
+    stream.avail_in = (uInt) in_len;
+    stream.next_out = (Bytef*) out;
+    stream.avail_out = (uInt) *out_len;
+
+    const int ret = deflate(&stream, Z_FINISH);
+    *out_len = stream.total_out;
+    deflateEnd(&stream);
+
+    return ret == Z_STREAM_END ? ERR_NONE : ERR_IO;
+}
+
+int compress_buffer(int encoding, const char* in, size_t in_len, char** out, size_t* out_len)
+{
+    M_REQUIRE_NON_NULL(in);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(out_len);
+    M_EXIT_IF(encoding < 0 || NB_ENC <= encoding, ERR_INVALID_ARGUMENT,
+              "invalid encoding %d", encoding);
+
+    // Room for the worst case of each encoding
+    size_t len = in_len;
+
+    if (encoding == ENC_BROTLI) {
+        len = BrotliEncoderMaxCompressedSize(in_len);
+    } else if (encoding == ENC_GZIP) {
+        len = compressBound((uLong) in_len) + GZIP_HEADER_LEN;
+    }
+
+    M_EXIT_IF(len == 0, ERR_INVALID_ARGUMENT, "cannot compress %zu bytes", in_len);
+
+    char* buffer = NULL;
+    M_EXIT_IF_NULL(buffer = malloc(len), len);
+
+    int ret = ERR_NONE;
+
+    if (encoding == ENC_BROTLI) {
+        ret = BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                    in_len, (const uint8_t*) in, &len, (uint8_t*) buffer)
+              ? ERR_NONE : ERR_IO;
+    } else if (encoding == ENC_GZIP) {
+        ret = gzip_buffer(in, in_len, buffer, &len);
+    } else {
+        memcpy(buffer, in, in_len);
+    }
+
+    if (ret != ERR_NONE) {
+        FREE_DEREF(buffer);
+        return ret;
+    }
+
+    *out = buffer;
+    *out_len = len;
+
+    return ERR_NONE;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+/**
+ * @file compress.h
+ * @brief Header file for compress.c.
+ *
+ * HTTP content encodings of in-memory buffers.
+ *
+ * @author ???
+ */
+
+#include <stddef.h> // for size_t
+
+/* content encodings, by order of preference */
+#define ENC_IDENTITY 0
+#define ENC_BROTLI 1
+#define ENC_GZIP 2
+#define NB_ENC 3
+
+/* names of the encodings in HTTP headers */
+#define ENC_NAMES {"identity", "br", "gzip"}
+
+/**
+ * @brief Compresses a buffer with the given content encoding.
+ *
+ * @param encoding One of the ENC_ codes, ENC_IDENTITY copies the buffer
+ * @param in The buffer to compress
+ * @param in_len Its size
+ * @param out Set to a newly allocated buffer, to be freed by the caller
+ * @param out_len Set to the size of the compressed buffer
+ *
+ * @return Some error code. 0 if no error.
+ */
+int compress_buffer(int encoding, const char* in, size_t in_len, char** out, size_t* out_len);
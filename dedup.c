@@ -10,6 +10,9 @@
 #include "error.h"
 #include "imgStore.h"
 #include <string.h>
+#include <stdlib.h> // for calloc
+
+#define MIN_SHA_BUCKETS 16
 
 
 /**
@@ -36,6 +39,142 @@ int shaCompare(const unsigned char* sha1, const unsigned char* sha2)
     return compareValue;
 }
 
+/**
+ * Bucket of a SHA. SHAs are uniformly distributed, their first bytes will do.
+ */
+static uint32_t sha_bucket(const sha_index* content_index, const unsigned char* sha)
+{
+    uint32_t hash = 0;
+    memcpy(&hash, sha, sizeof(hash));
+    return hash & content_index->mask;
+}
+
+/**
+ * Indexes the valid metadata of an imgStore file by SHA.
+ */
+int sha_index_build(imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    // Twice as many buckets as slots
+    uint32_t nb_buckets = MIN_SHA_BUCKETS;
+
+    while (nb_buckets < 2 * imgstfile->header.max_files) {
+        nb_buckets *= 2;
+    }
+
+    sha_index* t = NULL;
+    M_EXIT_IF_NULL(t = calloc(1, sizeof(sha_index)), sizeof(sha_index));
+
+    t->mask = nb_buckets - 1;
+    t->buckets = calloc(nb_buckets, sizeof(uint32_t));
+    t->chain = calloc(imgstfile->header.max_files, sizeof(uint32_t));
+
+    if (t->buckets == NULL || t->chain == NULL) {
+        FREE_DEREF(t->buckets);
+        FREE_DEREF(t->chain);
+        FREE_DEREF(t);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    memset(t->buckets, 0xFF, nb_buckets * sizeof(uint32_t)); // NO_SLOT
+    imgstfile->content_index = t;
+
+    for (size_t i = 0; i < imgstfile->header.max_files; ++i) {
+        if (imgstfile->metadata[i].is_valid == NON_EMPTY) {
+            sha_index_add(imgstfile, i);
+        }
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Frees the content index.
+ */
+void sha_index_free(imgst_file* imgstfile)
+{
+    if (imgstfile != NULL && imgstfile->content_index != NULL) {
+        FREE_DEREF(imgstfile->content_index->buckets);
+        FREE_DEREF(imgstfile->content_index->chain);
+        FREE_DEREF(imgstfile->content_index);
+    }
+}
+
+/**
+ * Adds a metadata to the content index.
+ */
+void sha_index_add(imgst_file* imgstfile, const size_t index)
+{
+    if (imgstfile == NULL || imgstfile->content_index == NULL
+        || imgstfile->header.max_files <= index) {
+        return;
+    }
+
+    sha_index* t = imgstfile->content_index;
+    const uint32_t bucket = sha_bucket(t, imgstfile->metadata[index].SHA);
+
+    t->chain[index] = t->buckets[bucket];
+    t->buckets[bucket] = (uint32_t) index;
+}
+
+/**
+ * Removes a metadata from the content index.
+ */
+void sha_index_remove(imgst_file* imgstfile, const size_t index)
+{
+    if (imgstfile == NULL || imgstfile->content_index == NULL
+        || imgstfile->header.max_files <= index) {
+        return;
+    }
+
+    sha_index* t = imgstfile->content_index;
+    uint32_t* link = &t->buckets[sha_bucket(t, imgstfile->metadata[index].SHA)];
+
+    while (*link != NO_SLOT && *link != index) {
+        link = &t->chain[*link];
+    }
+
+    if (*link == index) {
+        *link = t->chain[index];
+    }
+}
+
+/**
+ * Finds index in metadata of a valid image with the given content
+ */
+int findContentIndex(size_t* idx, const unsigned char* sha, const imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(idx);
+    M_REQUIRE_NON_NULL(sha);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    const sha_index* t = imgstfile->content_index;
+
+    // Without an index, look at every metadata
+    if (t == NULL) {
+        for (size_t i = 0; i < imgstfile->header.max_files; ++i) {
+            if (imgstfile->metadata[i].is_valid && shaCompare(sha, imgstfile->metadata[i].SHA) == 0) {
+                *idx = i;
+                return ERR_NONE;
+            }
+        }
+
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    for (uint32_t i = t->buckets[sha_bucket(t, sha)]; i != NO_SLOT; i = t->chain[i]) {
+        if (imgstfile->metadata[i].is_valid && shaCompare(sha, imgstfile->metadata[i].SHA) == 0) {
+            *idx = i;
+            return ERR_NONE;
+        }
+    }
+
+    return ERR_FILE_NOT_FOUND;
+}
+
 /**
  * Deduplicates the image at the given index if there exists another with the same content
  */
@@ -56,28 +195,24 @@ int do_name_and_content_dedup(imgst_file* imgstfile, const uint32_t index)
 
     // Loop over valid metadata.
     // If an image has the same name, return an error.
-    // If an image has the same SHA(ie. content) de-duplicate.
-
-    size_t i = 0;
-    size_t has_content_clone = 0;
 
-    while(i < imgstfile->header.max_files) {
+    for (size_t i = 0; i < imgstfile->header.max_files; ++i) {
         if(i != index && imgstfile->metadata[i].is_valid) {
             M_EXIT_IF(!strncmp(id, imgstfile->metadata[i].img_id, MAX_IMG_ID),
                       ERR_DUPLICATE_ID, "image with same imgID exists", );
-
-            if(shaCompare(sha, imgstfile->metadata[i].SHA) == 0) {
-                memcpy(imgstfile->metadata[index].offset, imgstfile->metadata[i].offset, NB_RES * sizeof(uint64_t));
-                memcpy(imgstfile->metadata[index].size, imgstfile->metadata[i].size, NB_RES * sizeof(uint32_t));
-                has_content_clone = 1;
-            }
         }
-
-        ++i;
     }
 
-    // Tells the function caller that metadata[index] is content-unique
-    if(has_content_clone == 0) {
+    // If an image has the same SHA(ie. content) de-duplicate.
+    size_t clone = 0;
+
+    if (findContentIndex(&clone, sha, imgstfile) == ERR_NONE && clone != index) {
+        memcpy(imgstfile->metadata[index].offset, imgstfile->metadata[clone].offset, NB_RES * sizeof(uint64_t));
+        memcpy(imgstfile->metadata[index].size, imgstfile->metadata[clone].size, NB_RES * sizeof(uint32_t));
+        count_dedup_hit();
+
+    } else {
+        // Tells the function caller that metadata[index] is content-unique
         imgstfile->metadata[index].offset[RES_ORIG] = 0;
     }
 
@@ -9,6 +9,23 @@
 
 #include "imgStore.h"
 
+/* marks the end of a chain in the content index */
+#define NO_SLOT UINT32_MAX
+
+struct sha_index {
+    /* The number of buckets minus one (a power of two minus one).
+     */
+    uint32_t mask;
+
+    /* For each bucket, the first slot of its chain.
+     */
+    uint32_t* buckets;
+
+    /* For each slot, the next slot in the chain of its bucket.
+     */
+    uint32_t* chain;
+};
+
 
 /**
  * @brief compares two SHA strings
@@ -26,3 +43,34 @@ int shaCompare(const unsigned char* sha1, const unsigned char* sha2);
  * @param index the index of the images
  */
 int do_name_and_content_dedup(imgst_file* imgstfile, const uint32_t index);
+
+
+/**
+ * @brief Indexes the valid metadata of an imgStore file by SHA.
+ *
+ * @param imgstfile the imgStoreFile, with its metadata read
+ */
+int sha_index_build(imgst_file* imgstfile);
+
+/**
+ * @brief Frees the content index.
+ *
+ * @param imgstfile the imgStoreFile
+ */
+void sha_index_free(imgst_file* imgstfile);
+
+/**
+ * @brief Adds a (now valid) metadata to the content index.
+ *
+ * @param imgstfile the imgStoreFile
+ * @param index the index of the metadata
+ */
+void sha_index_add(imgst_file* imgstfile, const size_t index);
+
+/**
+ * @brief Removes a metadata from the content index.
+ *
+ * @param imgstfile the imgStoreFile
+ * @param index the index of the metadata
+ */
+void sha_index_remove(imgst_file* imgstfile, const size_t index);
@@ -4,14 +4,19 @@
  *
  * @author ???
  */
+#define _POSIX_C_SOURCE 200809L // for flockfile
 
 #include "imgStore.h"
 #include "image_content.h"
+#include "variant.h"
 #include "error.h"
+#include "trace.h"
 
 #include <vips/vips.h>
 #include <stdlib.h>
 
+#define SPRITE_BANDS 3 // sRGB
+
 /**
  * Read a vips image from a file. Responsibility of caller to free buffer later.
  */
@@ -24,13 +29,21 @@ int read_vips_from_file(void** buffer, const size_t size, VipsImage** image, FIL
     // Intermediate buffer to read the file
     M_EXIT_IF_NULL(*buffer = calloc(1, size), size);
 
-    if (fread(*buffer, size, 1, file) != 1) {
+    TRACE_BEGIN(fread);
+    const size_t read = fread(*buffer, size, 1, file);
+    TRACE_END(fread);
+
+    if (read != 1) {
         FREE_DEREF(*buffer);
         return ERR_IO;
     }
 
     // Loading the buffer into a VipsImage as a jpeg
-    if(vips_jpegload_buffer(*buffer, size, image, NULL)) {
+    TRACE_BEGIN(vips_jpegload_buffer);
+    const int load_failed = vips_jpegload_buffer(*buffer, size, image, NULL);
+    TRACE_END(vips_jpegload_buffer);
+
+    if (load_failed) {
         FREE_DEREF(*buffer);
         return ERR_IMGLIB;
     }
@@ -48,14 +61,22 @@ int write_vips_to_file(void** buffer, size_t* size, VipsImage** image, FILE* fil
     M_REQUIRE_NON_NULL(file);
 
     // VipsImage -> Buffer
-    if (vips_jpegsave_buffer(*image, buffer, size, NULL)) {
+    TRACE_BEGIN(vips_jpegsave_buffer);
+    const int save_failed = vips_jpegsave_buffer(*image, buffer, size, NULL);
+    TRACE_END(vips_jpegsave_buffer);
+
+    if (save_failed) {
         FREE_DEREF(*buffer);
         g_object_unref(*image); *image = NULL;
         return ERR_IMGLIB;
     }
 
     // Buffer -> File
-    if (fwrite(*buffer, *size, 1, file) != 1) {
+    TRACE_BEGIN(fwrite);
+    const size_t written = fwrite(*buffer, *size, 1, file);
+    TRACE_END(fwrite);
+
+    if (written != 1) {
         FREE_DEREF(*buffer);
         return ERR_IO;
     }
@@ -74,6 +95,208 @@ double shrink_value(const VipsImage *image, int max_resized_width, int max_resiz
     return h_shrink > v_shrink ? v_shrink : h_shrink ;
 }
 
+/**
+ * Ratio between the original image and the image resized into a box where
+ * 0 means unconstrained. The image is never enlarged.
+ */
+static double box_shrink_value(const VipsImage *image, const uint16_t box[DIMS])
+{
+    double ratio = 1.0;
+
+    if (box[0] != 0 && box[0] < image->Xsize) {
+        ratio = (double) box[0] / (double) image->Xsize;
+    }
+
+    if (box[1] != 0 && box[1] < image->Ysize) {
+        const double v_shrink = (double) box[1] / (double) image->Ysize;
+        ratio = ratio > v_shrink ? v_shrink : ratio;
+    }
+
+    return ratio;
+}
+
+/**
+ * Encodes a vips image into a newly allocated buffer.
+ */
+static int save_vips_to_buffer(VipsImage* image, const int format, void** buffer, size_t* size)
+{
+    int failed = 0;
+
+    switch (format) {
+    case FMT_JPEG: {
+        TRACE_BEGIN(vips_jpegsave_buffer);
+        failed = vips_jpegsave_buffer(image, buffer, size, NULL);
+        TRACE_END(vips_jpegsave_buffer);
+        break;
+    }
+
+    case FMT_WEBP: {
+        TRACE_BEGIN(vips_webpsave_buffer);
+        failed = vips_webpsave_buffer(image, buffer, size, NULL);
+        TRACE_END(vips_webpsave_buffer);
+        break;
+    }
+
+    default:
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    return failed ? ERR_IMGLIB : ERR_NONE;
+}
+
+/**
+ * Resizes a JPEG image held in memory into a box and encodes it.
+ */
+int resize_to_box(const char* image_buffer, const size_t image_size, const uint16_t box[DIMS],
+                  const int format, void** resized_buffer, size_t* resized_size)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(box);
+    M_REQUIRE_NON_NULL(resized_buffer);
+    M_REQUIRE_NON_NULL(resized_size);
+
+    // Load the buffer into a VipsImage. The buffer must outlive it.
+    VipsImage* original_image = NULL;
+
+    TRACE_BEGIN(vips_jpegload_buffer);
+    const int load_failed = vips_jpegload_buffer((void*) image_buffer, image_size, &original_image, NULL);
+    TRACE_END(vips_jpegload_buffer);
+
+    if (load_failed) {
+        return ERR_IMGLIB;
+    }
+
+    // Compute the resized image
+    VipsImage* resized_image = NULL;
+    TRACE_BEGIN(vips_resize);
+    const int resize_failed = vips_resize(original_image, &resized_image,
+                                          box_shrink_value(original_image, box), NULL);
+    TRACE_END(vips_resize);
+    g_object_unref(original_image);
+
+    if (resize_failed) {
+        return ERR_IMGLIB;
+    }
+
+    // Encode it
+    *resized_buffer = NULL;
+    const int ret = save_vips_to_buffer(resized_image, format, resized_buffer, resized_size);
+    g_object_unref(resized_image);
+
+    return ret;
+}
+
+/**
+ * Resizes a JPEG image held in memory to fit in width x height.
+ */
+int resize_to_fit(const char* image_buffer, const size_t image_size, const uint16_t width,
+                  const uint16_t height, void** resized_buffer, size_t* resized_size)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(resized_buffer);
+    M_REQUIRE_NON_NULL(resized_size);
+
+    VipsImage* original_image = NULL;
+
+    TRACE_BEGIN(vips_jpegload_buffer);
+    const int load_failed = vips_jpegload_buffer((void*) image_buffer, image_size, &original_image, NULL);
+    TRACE_END(vips_jpegload_buffer);
+
+    if (load_failed) {
+        return ERR_IMGLIB;
+    }
+
+    VipsImage* resized_image = NULL;
+    TRACE_BEGIN(vips_resize);
+    const int resize_failed = vips_resize(original_image, &resized_image,
+                                          shrink_value(original_image, width, height), NULL);
+    TRACE_END(vips_resize);
+    g_object_unref(original_image);
+
+    if (resize_failed) {
+        return ERR_IMGLIB;
+    }
+
+    *resized_buffer = NULL;
+    const int ret = save_vips_to_buffer(resized_image, FMT_JPEG, resized_buffer, resized_size);
+    g_object_unref(resized_image);
+
+    return ret;
+}
+
+/**
+ * Renders in memory what lazily_resize or lazily_resize_variant would append.
+ */
+int render_resized(const int res_code, const uint16_t* box, const int format,
+                   const imgst_file* imgstfile, const size_t idx,
+                   void** resized_buffer, size_t* resized_size)
+{
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+    M_EXIT_IF_ERR(validMetadataIndex(idx, imgstfile));
+    M_EXIT_IF(box == NULL && res_code != RES_SMALL && res_code != RES_THUMB, ERR_RESOLUTIONS,
+              "invalid resolution code %d", res_code);
+
+    // Without the position of the FILE: other readers may hold the imgStore too
+    char* original = NULL;
+    uint32_t orig_size = 0;
+    M_EXIT_IF_ERR(read_slot_content(&imgstfile->metadata[idx], RES_ORIG, &original, &orig_size, imgstfile));
+
+    const int ret = (box != NULL)
+                    ? resize_to_box(original, orig_size, box, format, resized_buffer, resized_size)
+                    : resize_to_fit(original, orig_size, imgstfile->header.res_resized[2 * res_code],
+                                    imgstfile->header.res_resized[2 * res_code + 1],
+                                    resized_buffer, resized_size);
+    FREE_DEREF(original);
+
+    return ret;
+}
+
+/**
+ * Creates a variant of an image resized into a box and appends it to the imgStore file.
+ */
+int lazily_resize_variant(const uint16_t box[DIMS], const int format, imgst_file* imgstfile,
+                          const size_t idx)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(box);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    // Don't resize an already deleted image or an image which cannot be found
+    M_EXIT_IF_ERR(validMetadataIndex(idx, imgstfile));
+
+    // Check if the variant already exists
+    const img_variant* variant = NULL;
+    M_EXIT_IF(variant_find(&variant, idx, box, format, imgstfile) == ERR_NONE, ERR_NONE,
+              "the variant already exists", );
+
+    // Read the original image
+    const size_t orig_size = imgstfile->metadata[idx].size[RES_ORIG];
+    char* original = NULL;
+    M_EXIT_IF_NULL(original = calloc(1, orig_size), orig_size);
+
+    if (fseek(imgstfile->file, (long) imgstfile->metadata[idx].offset[RES_ORIG], SEEK_SET) != 0
+        || fread(original, orig_size, 1, imgstfile->file) != 1) {
+        FREE_DEREF(original);
+        return ERR_IO;
+    }
+
+    // Render the variant
+    void* resized = NULL;
+    size_t resized_size = 0;
+    M_EXIT_IF_ERR_DO_SOMETHING(resize_to_box(original, orig_size, box, format, &resized, &resized_size),
+                               FREE_DEREF(original));
+    FREE_DEREF(original);
+
+    // Append it with its record
+    M_EXIT_IF_ERR_DO_SOMETHING(variant_append(idx, box, format, resized, resized_size, imgstfile),
+                               FREE_DEREF(resized));
+    FREE_DEREF(resized);
+
+    return ERR_NONE;
+}
+
 /**
  * Creates a resized image and appends it to the imgStore file.
  */
@@ -100,6 +323,9 @@ int lazily_resize(const int res_code, imgst_file* imgstfile, const size_t idx)
               "the resized image already exists", );
 
     /// Create new variant of image in requested resolution
+    // vips is lazy: most of the decoding shows in the vips_jpegsave_buffer span
+    const uint64_t start = monotonic_us();
+    TRACE_BEGIN(lazily_resize);
 
     // Move to position in file of original image
     fseek(imgstfile->file, imgstfile->metadata[idx].offset[RES_ORIG], SEEK_SET);
@@ -119,7 +345,9 @@ int lazily_resize(const int res_code, imgst_file* imgstfile, const size_t idx)
 
     // Compute the resized image with the ratio
     VipsImage* resized_image = NULL;
+    TRACE_BEGIN(vips_resize);
     vips_resize(original_image, &resized_image, ratio, NULL);
+    TRACE_END(vips_resize);
 
     // The original VipsImage* is no longer needed.
     g_object_unref(original_image);
@@ -144,13 +372,171 @@ int lazily_resize(const int res_code, imgst_file* imgstfile, const size_t idx)
     FREE_DEREF(buffer);
 
     // Update the metadata in memory and on disk
+    metadata_begin(idx, imgstfile);
     imgstfile->metadata[idx].offset[res_code] = offset;
     imgstfile->metadata[idx].size[res_code] = resized_size;
+    metadata_publish(idx, imgstfile);
     M_EXIT_IF_ERR(updateMetadata(idx, imgstfile));
 
+    TRACE_END(lazily_resize);
+    count_resize(monotonic_us() - start);
+
     return ERR_NONE;
 }
 
+/**
+ * Converts a thumbnail to the 3-band sRGB of the sprite canvas: greyscale and
+ * CMYK are converted, an alpha band is flattened onto the black background.
+ */
+static int to_sprite_bands(VipsImage* in, VipsImage** out)
+{
+    VipsImage* srgb = NULL;
+
+    if (vips_colourspace(in, &srgb, VIPS_INTERPRETATION_sRGB, NULL)) {
+        return ERR_IMGLIB;
+    }
+
+    if (srgb->Bands == SPRITE_BANDS) {
+        *out = srgb;
+        return ERR_NONE;
+    }
+
+    const int failed = vips_flatten(srgb, out, NULL);
+    g_object_unref(srgb);
+
+    return failed ? ERR_IMGLIB : ERR_NONE;
+}
+
+/**
+ * Composes the thumbnails of images into one sprite image.
+ */
+int make_sprite(const size_t* idx, size_t nb, int format, imgst_file* imgstfile,
+                void** sprite, size_t* sprite_size, uint32_t dims[DIMS], sprite_cell* cells)
+{
+    M_REQUIRE_NON_NULL(idx);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+    M_REQUIRE_NON_NULL(sprite);
+    M_REQUIRE_NON_NULL(sprite_size);
+    M_REQUIRE_NON_NULL(dims);
+    M_REQUIRE_NON_NULL(cells);
+    M_EXIT_IF(nb == 0, ERR_INVALID_ARGUMENT, "empty sprite", );
+
+    // A square-ish grid of cells of the thumbnail resolution
+    size_t columns = 1;
+
+    while (columns * columns < nb) {
+        ++columns;
+    }
+
+    const size_t rows = (nb + columns - 1) / columns;
+    const uint32_t cell[DIMS] = {imgstfile->header.res_resized[2 * RES_THUMB],
+                                 imgstfile->header.res_resized[2 * RES_THUMB + 1]
+                                };
+
+    dims[0] = (uint32_t) columns * cell[0];
+    dims[1] = (uint32_t) rows * cell[1];
+
+    VipsImage* canvas = NULL;
+
+    if (vips_black(&canvas, (int) dims[0], (int) dims[1], "bands", SPRITE_BANDS, NULL)) {
+        return ERR_IMGLIB;
+    }
+
+    // The thumbnails are only decoded when the sprite is saved: their
+    // buffers must outlive the pipeline.
+    char** thumbs = calloc(nb, sizeof(char*));
+
+    if (thumbs == NULL) {
+        g_object_unref(canvas);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int ret = ERR_NONE;
+
+    for (size_t i = 0; ret == ERR_NONE && i < nb; ++i) {
+        const img_metadata* m = &imgstfile->metadata[idx[i]];
+        size_t size = m->size[RES_THUMB];
+
+        // A read-only imgStore cannot keep the thumbnails it lacks
+        if (m->offset[RES_THUMB] == INIT_OFFSET && is_read_only(imgstfile)) {
+            void* thumb = NULL;
+            ret = render_resized(RES_THUMB, NULL, FMT_JPEG, imgstfile, idx[i], &thumb, &size);
+            thumbs[i] = thumb;
+        } else {
+            ret = lazily_resize(RES_THUMB, imgstfile, idx[i]);
+            size = m->size[RES_THUMB];
+
+            if (ret == ERR_NONE && (thumbs[i] = malloc(size)) == NULL) {
+                ret = ERR_OUT_OF_MEMORY;
+            }
+
+            // Other readers share the position of the file
+            if (ret == ERR_NONE) {
+                flockfile(imgstfile->file);
+                if (fseek(imgstfile->file, (long) m->offset[RES_THUMB], SEEK_SET) != 0
+                    || fread(thumbs[i], size, 1, imgstfile->file) != 1) {
+                    ret = ERR_IO;
+                }
+                funlockfile(imgstfile->file);
+            }
+        }
+
+        VipsImage* decoded = NULL;
+        VipsImage* thumb = NULL;
+
+        if (ret == ERR_NONE && vips_jpegload_buffer(thumbs[i], size, &decoded, NULL)) {
+            ret = ERR_IMGLIB;
+        }
+
+        // vips_insert needs the bands of the canvas
+        if (ret == ERR_NONE) {
+            ret = to_sprite_bands(decoded, &thumb);
+            g_object_unref(decoded);
+        }
+
+        if (ret != ERR_NONE) {
+            break;
+        }
+
+        // Place it in the top-left corner of its cell
+        cells[i].position[0] = (uint32_t)(i % columns) * cell[0];
+        cells[i].position[1] = (uint32_t)(i / columns) * cell[1];
+        cells[i].res[0] = (uint32_t) thumb->Xsize;
+        cells[i].res[1] = (uint32_t) thumb->Ysize;
+
+        VipsImage* composed = NULL;
+
+        if (vips_insert(canvas, thumb, &composed, (int) cells[i].position[0],
+                        (int) cells[i].position[1], NULL)) {
+            ret = ERR_IMGLIB;
+        }
+
+        g_object_unref(thumb);
+
+        if (ret == ERR_NONE) {
+            g_object_unref(canvas);
+            canvas = composed;
+        }
+    }
+
+    // Encode it
+    if (ret == ERR_NONE) {
+        *sprite = NULL;
+        ret = save_vips_to_buffer(canvas, format, sprite, sprite_size);
+    }
+
+    g_object_unref(canvas);
+
+    for (size_t i = 0; i < nb; ++i) {
+        FREE_DEREF(thumbs[i]);
+    }
+
+    FREE_DEREF(thumbs);
+
+    return ret;
+}
+
 /**
  * Gets the resolution of a JPEG image
  */
@@ -179,22 +565,58 @@ int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer,
     return ERR_NONE;
 }
 
+/**
+ * Gets the resolution of a JPEG image from its frame header
+ */
+int get_resolution_from_header(uint32_t* height, uint32_t* width,
+                               const unsigned char* image_buffer, const size_t image_size)
+{
+    M_REQUIRE_NON_NULL(height);
+    M_REQUIRE_NON_NULL(width);
+    M_REQUIRE_NON_NULL(image_buffer);
 
+    // Start Of Image
+    if (image_size < 2 || image_buffer[0] != 0xFF || image_buffer[1] != 0xD8) {
+        return ERR_IMGLIB;
+    }
 
+    size_t i = 2;
 
+    // Walk the marker segments up to the Start Of Scan
+    while (i + 4 <= image_size) {
+        if (image_buffer[i] != 0xFF) {
+            return ERR_IMGLIB;
+        }
 
+        const unsigned char marker = image_buffer[i + 1];
 
+        // Fill bytes and segments without a length
+        if (marker == 0xFF) {
+            i += 1; continue;
+        }
 
+        if (marker == 0x01 || (0xD0 <= marker && marker <= 0xD7)) {
+            i += 2; continue;
+        }
 
+        if (marker == 0xDA) {
+            return ERR_IMGLIB;
+        }
 
+        // Start Of Frame: all of 0xC0-0xCF but DHT, JPG and DAC
+        if (0xC0 <= marker && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (i + 9 > image_size) {
+                return ERR_IMGLIB;
+            }
 
+            *height = (uint32_t) image_buffer[i + 5] << 8 | image_buffer[i + 6];
+            *width = (uint32_t) image_buffer[i + 7] << 8 | image_buffer[i + 8];
 
+            return ERR_NONE;
+        }
 
+        i += 2 + ((size_t) image_buffer[i + 2] << 8 | image_buffer[i + 3]);
+    }
 
-
-
-
-
-
-
-
+    return ERR_IMGLIB;
+}
@@ -4,7 +4,7 @@
  * @file image_content.h
  * @brief Header file for image_content.c.
  *
- * Prototypes the lazily_resize method.
+ * Prototypes the lazily_resize methods.
  *
  * @author ???
  */
@@ -12,6 +12,14 @@
 #include "imgStore.h"
 #include <vips/vips.h>
 
+typedef struct sprite_cell sprite_cell;
+
+/* where a thumbnail lies in a sprite */
+struct sprite_cell {
+    uint32_t position[DIMS]; // top-left corner, X x Y
+    uint32_t res[DIMS]; // Width x Height
+};
+
 /**
  * @brief Creates a resized image and appends it to the imgStore file.
  *
@@ -21,6 +29,63 @@
  */
 int lazily_resize(const int res_code, imgst_file* imgstfile, const size_t idx);
 
+/**
+ * @brief Creates a variant of an image resized into a box and appends it,
+ *        with its variant record, to the imgStore file.
+ *
+ * @param box The bounding box, Width x Height, 0 meaning unconstrained.
+ * @param format The encoding of the variant (FMT_ code).
+ * @param imgstfile The imgStore file.
+ * @param idx The index of the image to resize.
+ */
+int lazily_resize_variant(const uint16_t box[DIMS], const int format, imgst_file* imgstfile,
+                          const size_t idx);
+
+/**
+ * @brief Renders in memory what lazily_resize (box NULL) or
+ *        lazily_resize_variant would append, for read-only imgStores. The
+ *        original is read without the position of the FILE.
+ *
+ * @param res_code The resolution code, if box is NULL
+ * @param box The bounding box of a variant, or NULL
+ * @param format The encoding of a variant (FMT_ code)
+ * @param imgstfile The main in-memory structure
+ * @param idx The index of the metadata of the image
+ * @param resized_buffer will point to the (newly allocated) encoded result
+ * @param resized_size will point to the size of the encoded result
+ */
+int render_resized(const int res_code, const uint16_t* box, const int format,
+                   const imgst_file* imgstfile, const size_t idx,
+                   void** resized_buffer, size_t* resized_size);
+
+/**
+ * @brief Resizes a JPEG image held in memory into a box, without enlarging it,
+ *        and encodes the result.
+ *
+ * @param image_buffer pointer to a memory region containing JPEG image
+ * @param image_size size in bytes of the JPEG image
+ * @param box The bounding box, Width x Height, 0 meaning unconstrained.
+ * @param format The encoding of the result (FMT_ code).
+ * @param resized_buffer will point to the (newly allocated) encoded result
+ * @param resized_size will point to the size of the encoded result
+ */
+int resize_to_box(const char* image_buffer, const size_t image_size, const uint16_t box[DIMS],
+                  const int format, void** resized_buffer, size_t* resized_size);
+
+/**
+ * @brief Resizes a JPEG image held in memory to fit in width x height, as
+ *        lazily_resize does for the thumbnail and small resolutions, and
+ *        encodes the result in JPEG. Safe to call from many threads.
+ *
+ * @param image_buffer pointer to a memory region containing JPEG image
+ * @param image_size size in bytes of the JPEG image
+ * @param width The largest width of the result
+ * @param height The largest height of the result
+ * @param resized_buffer will point to the (newly allocated) encoded result
+ * @param resized_size will point to the size of the encoded result
+ */
+int resize_to_fit(const char* image_buffer, const size_t image_size, const uint16_t width,
+                  const uint16_t height, void** resized_buffer, size_t* resized_size);
 
 /**
  * @brief Gets the resolution of a JPEG image
@@ -31,3 +96,35 @@ int lazily_resize(const int res_code, imgst_file* imgstfile, const size_t idx);
  * @param image_size size in bytes of the JPEG image
  */
 int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer, const size_t image_size);
+
+
+/**
+ * @brief Gets the resolution of a JPEG image from the frame header found
+ *        in its first bytes, without decoding it.
+ *
+ * @param height will make point to image height
+ * @param width will make point to image width
+ * @param image_buffer pointer to the first bytes of a JPEG image
+ * @param image_size number of bytes available
+ *
+ * @return ERR_IMGLIB if no frame header was found in the available bytes.
+ */
+int get_resolution_from_header(uint32_t* height, uint32_t* width,
+                               const unsigned char* image_buffer, const size_t image_size);
+
+/**
+ * @brief Composes the thumbnails of images into one sprite image. They are
+ *        laid out in the given order, row by row, in a square-ish grid of
+ *        cells of the thumbnail resolution. Missing thumbnails are created.
+ *
+ * @param idx The indexes of the images
+ * @param nb The number of images
+ * @param format The encoding of the sprite (FMT_ code)
+ * @param imgstfile The imgStore file
+ * @param sprite will point to the (newly allocated) encoded sprite
+ * @param sprite_size will point to the size of the encoded sprite
+ * @param dims will hold the resolution of the sprite, Width x Height
+ * @param cells will hold where each thumbnail lies, nb of them
+ */
+int make_sprite(const size_t* idx, size_t nb, int format, imgst_file* imgstfile,
+                void** sprite, size_t* sprite_size, uint32_t dims[DIMS], sprite_cell* cells);
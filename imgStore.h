@@ -10,6 +10,8 @@
  * structures. The actual content is not defined by these structures
  * because it should be stored as raw bytes appended at the end of the
  * imgStore file and addressed by offsets in the metadata structure.
+ * Variants rendered at arbitrary sizes are appended the same way, each
+ * followed by a variant record; the records are chained from the header.
  *
  * @author Mia Primorac
  */
@@ -23,7 +25,9 @@
                     */
 #include <stdio.h> // for FILE
 #include <stdint.h> // for uint32_t, uint64_t
+#include <stdatomic.h> // for the sequence numbers of the slots
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
+#include <openssl/evp.h> // for EVP_MD_CTX
 
 /// MACROS
 
@@ -62,6 +66,33 @@
 #define MAX_RES_THUMB 128
 #define MAX_RES_SMALL 512
 
+/* default and maximum number of size buckets for arbitrary-width variants */
+#define DEF_VARIANT_BUCKETS {64, 128, 256, 384, 512, 768, 1024, 1536, 2048}
+#define DEF_NB_VARIANT_BUCKETS 9
+#define MAX_VARIANT_BUCKETS 32
+
+/* imgStore library internal codes for variant encodings. */
+#define FMT_JPEG 0
+#define FMT_WEBP 1
+
+/* the number of imgStore library internal codes for variant encodings. */
+#define NB_FMT 2
+
+/* number of leading bytes of a streamed image kept to read its resolution */
+#define INGEST_PREFIX_LEN 65536
+
+/* for do_stats: originals by size, < 1 KiB, < 2 KiB, ..., < 16 MiB, then larger */
+#define STATS_SIZE_BUCKETS 16
+#define STATS_MIN_SIZE 1024
+/* for do_stats: number of largest unreferenced ranges reported */
+#define STATS_GAPS 5
+
+/* change log of the writer of an imgStore, read by its followers (see do_follow) */
+#define CHANGE_LOG_EXT ".changes" // appended to the imgStore file name
+#define CHANGE_LOG_MAGIC "IMGSTCHG"
+#define CHANGE_LOG_MAGIC_LEN 8
+#define CHANGE_LOG_SIZE 4096 // changes kept: followers further behind reload all the metadata
+
 /* initial values for imgst_file fields and subfields*/
 #define INIT_NB_FILES 0
 #define INIT_VER 0
@@ -76,6 +107,17 @@ extern "C" {
 typedef struct imgst_header imgst_header;
 typedef struct img_metadata img_metadata;
 typedef struct imgst_file imgst_file;
+typedef struct img_variant img_variant;
+typedef struct variant_table variant_table;
+typedef struct sha_index sha_index;
+typedef struct imgst_ingest imgst_ingest;
+typedef struct imgst_counters imgst_counters;
+typedef struct imgst_gap imgst_gap;
+typedef struct imgst_stats imgst_stats;
+typedef struct change_log_header change_log_header;
+typedef struct change_record change_record;
+typedef struct change_log change_log;
+typedef struct imgst_follower imgst_follower;
 
 /// STRUCT DEFINTIIONS
 
@@ -101,10 +143,14 @@ struct imgst_header {
      */
     uint16_t res_resized [2 * (NB_RES - 1)];
 
-    /* Unused
+    /* The number of variant records chained from variant_head.
      */
-    uint32_t unused_32;
-    uint64_t unused_64;
+    uint32_t num_variants;
+
+    /* The location in the imgStore file of the most recently appended
+     * variant record (0 if there is none).
+     */
+    uint64_t variant_head;
 };
 
 struct img_metadata {
@@ -137,6 +183,42 @@ struct img_metadata {
     uint16_t unused_16;
 };
 
+struct img_variant {
+    /* The hashcode of the image content the variant was rendered from.
+     */
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+
+    /* The location in the imgStore file of the previously appended
+     * variant record (0 if this is the first one).
+     */
+    uint64_t next;
+
+    /* The location in the imgStore file of the variant content.
+     */
+    uint64_t offset;
+
+    /* The number of bytes in memory of the variant content.
+     */
+    uint32_t size;
+
+    /* The bounding box the image was resized into. Width x Height,
+     * 0 meaning unconstrained.
+     */
+    uint16_t box[DIMS];
+
+    /* The index of the metadata of the image the variant belongs to.
+     */
+    uint32_t slot;
+
+    /* The encoding of the variant content (FMT_ code).
+     */
+    uint16_t format;
+
+    /* Unused.
+     */
+    uint16_t unused_16;
+};
+
 struct imgst_file {
     /* A pointer to the imgStore file.
      */
@@ -149,8 +231,88 @@ struct imgst_file {
     /* A dynamic array containing the image metadata.
      */
     img_metadata* metadata;
+
+    /* The in-memory index of the variant records (NULL if there is none).
+     */
+    variant_table* variants;
+
+    /* The in-memory index of the valid metadata by SHA.
+     */
+    sha_index* content_index;
+
+    /* One sequence number per metadata, odd while it is being changed
+     * (see metadata_begin and read_slot). NULL if not tracked.
+     */
+    _Atomic uint32_t* slot_seq;
+
+    /* The change log written for the followers of the imgStore (NULL if none).
+     */
+    change_log* changes;
+};
+
+struct change_log_header {
+    char magic[CHANGE_LOG_MAGIC_LEN];
+    uint32_t size; // CHANGE_LOG_SIZE of the writer
+    uint32_t unused_32;
+    uint64_t count; // changes ever written: the last ones are in the ring that follows
 };
 
+struct change_record {
+    uint32_t imgst_version; // of the imgStore once the change was made
+    uint32_t slot;
+};
+
+struct change_log {
+    FILE* file;
+    uint64_t count; // as in the header of the file
+    uint32_t pending[CHANGE_LOG_SIZE]; // slots changed since the last change_log_commit
+    size_t nb_pending; // beyond CHANGE_LOG_SIZE, the followers reload all the metadata
+};
+
+struct imgst_follower {
+    /* The change log of the writer (NULL if it keeps none: then the
+     * metadata are all read again whenever imgst_version changes).
+     */
+    FILE* log;
+
+    /* The number of changes of the log applied so far.
+     */
+    uint64_t count;
+
+    /* The header of the imgStore file when it was last read.
+     */
+    imgst_header header;
+
+    /* The path of the imgStore file, to notice when another file replaces it.
+     */
+    char* filename;
+};
+
+
+struct imgst_ingest {
+    /* The ID of the image being streamed.
+     */
+    char img_id[MAX_IMG_ID + 1];
+
+    /* The SHA-256 context, updated with every chunk.
+     */
+    EVP_MD_CTX* sha_ctx;
+
+    /* The extent of the imgStore file reserved for the image, where the
+     * chunks are written as they arrive: its offset and its size.
+     */
+    uint64_t offset;
+    uint64_t reserved;
+
+    /* The number of bytes received so far.
+     */
+    uint64_t size;
+
+    /* The first bytes of the image, where its resolution is to be found.
+     */
+    unsigned char* prefix;
+    size_t prefix_len;
+};
 
 /**
  * @brief Prints imgStore header informations.
@@ -160,6 +322,24 @@ struct imgst_file {
 void print_header(const imgst_header* header);
 
 
+/**
+ * @brief Writes the hexadecimal form of a SHA.
+ *
+ * @param SHA The SHA
+ * @param sha_string The destination, of at least 2 * SHA256_DIGEST_LENGTH + 1 chars
+ */
+void sha_to_string(const unsigned char* SHA, char* sha_string);
+
+/**
+ * @brief Reads a SHA from its hexadecimal form.
+ *
+ * @param sha_string The 2 * SHA256_DIGEST_LENGTH hexadecimal digits
+ * @param SHA The destination, of SHA256_DIGEST_LENGTH bytes
+ *
+ * @return ERR_INVALID_ARGUMENT if the string is not a SHA
+ */
+int sha_from_string(const char* sha_string, unsigned char* SHA);
+
 /**
  * @brief Prints image metadata informations.
  *
@@ -173,6 +353,11 @@ void print_metadata(const img_metadata* metadata);
  * @param imgst_filename Path to the imgStore file
  * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
  * @param imgst_file Structure for header, metadata and file pointer.
+ *
+ * In "rb+" mode, the file is locked (flock) for as long as it is open,
+ * and the change log of the imgStore is kept if it has one.
+ *
+ * @return ERR_IO if another process writes to the imgStore.
  */
 int do_open(const char* imgst_filename, const char* open_mode, imgst_file* imgstfile);
 
@@ -198,6 +383,31 @@ enum do_list_mode {STDOUT, JSON};
  */
 char* do_list(const imgst_file* imgstfile, enum do_list_mode);
 
+/**
+ * @brief Called by do_list_page for each listed image.
+ */
+typedef void (*list_callback)(size_t idx, const img_metadata* metadata, void* arg);
+
+/**
+ * @brief Tells do_list_page whether an image is to be listed.
+ */
+typedef int (*list_filter)(const img_metadata* metadata, const void* arg);
+
+/**
+ * @brief Lists a page of the valid images, in slot order, without allocating.
+ *
+ * @param imgstfile In memory structure with header and metadata.
+ * @param from First slot to consider
+ * @param limit Maximum number of images to list, 0 for no limit
+ * @param filter Selects the images to list, NULL for all
+ * @param callback Called for each listed image
+ * @param arg Passed to the filter and the callback
+ *
+ * @return The slot of the first image to list after the page, max_files if none.
+ */
+size_t do_list_page(const imgst_file* imgstfile, size_t from, size_t limit,
+                    list_filter filter, list_callback callback, void* arg);
+
 /**
  * @brief Creates the imgStore called imgst_filename. Writes the header and the
  *        preallocated empty metadata array to imgStore file.
@@ -245,6 +455,203 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, const int resolution, char** image_buffer,
             uint32_t* image_size, imgst_file* imgstfile);
 
+/**
+ * @brief Reads the content of an image resized into an arbitrary box.
+ *
+ * The variant is rendered and appended to the imgStore the first time it
+ * is requested, and read back from the imgStore afterwards. If the box is
+ * at least as large as the original image, the original is returned.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param box_width The width of the box, 0 if unconstrained.
+ * @param box_height The height of the box, 0 if unconstrained.
+ * @param format The encoding of the variant (FMT_ code).
+ * @param image_buffer Location of the location of the image content
+ * @param image_size Location of the image size variable
+ * @param imgst_file The main in-memory data structure
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_read_variant(const char* img_id, const uint16_t box_width, const uint16_t box_height,
+                    const int format, char** image_buffer, uint32_t* image_size,
+                    imgst_file* imgstfile);
+
+/**
+ * @brief Reads the content of an image at one of the imgStore resolutions,
+ *        in a given encoding. Resized images that are not JPEG are stored
+ *        as variants; the original is always returned as stored (JPEG).
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param format The desired encoding (FMT_ code).
+ * @param image_buffer Location of the location of the image content
+ * @param image_size Location of the image size variable
+ * @param imgst_file The main in-memory data structure
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_read_format(const char* img_id, const int resolution, const int format,
+                   char** image_buffer, uint32_t* image_size, imgst_file* imgstfile);
+
+/**
+ * @brief Tells whether reading an image would first have to render it, and
+ *        so write to the imgStore. Other reads only read the file: several
+ *        threads may do them at once on the same imgst_file.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param box The box of do_read_variant, NULL for a resolution code
+ * @param resolution The resolution of do_read_format, if box is NULL
+ * @param format The encoding (FMT_ code).
+ * @param imgst_file The main in-memory data structure
+ *
+ * @return 1 if the read would render the image, 0 if not, if it would fail,
+ *         or if the imgStore is read-only (rendered in memory, nothing is written).
+ */
+int read_needs_render(const char* img_id, const uint16_t* box, const int resolution,
+                      const int format, const imgst_file* imgstfile);
+
+/**
+ * @brief Copies the metadata of an image without any lock, while another
+ *        thread may insert or delete images. A slot being changed is copied
+ *        again once metadata_publish is done with it.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param copy Set to the metadata of the image
+ * @param imgst_file The main in-memory data structure
+ *
+ * @return Some error code. 0 if no error.
+ */
+int read_slot(const char* img_id, img_metadata* copy, const imgst_file* imgstfile);
+
+/**
+ * @brief Reads a resolution of an image from a copy of its metadata, without
+ *        any lock nor the position of the FILE. Contents are only ever
+ *        appended: they stay where the copy says, even once the image is deleted.
+ *
+ * @param copy The metadata of the image, from read_slot
+ * @param resolution The resolution to read, which the copy has an offset for
+ * @param image_buffer Location of the location of the image content
+ * @param image_size Location of the image size variable
+ * @param imgst_file The main in-memory data structure
+ *
+ * @return Some error code. 0 if no error.
+ */
+int read_slot_content(const img_metadata* copy, const int resolution, char** image_buffer,
+                      uint32_t* image_size, const imgst_file* imgstfile);
+
+/**
+ * @brief Called by do_read_batch for each image, in the order they are read.
+ *        The buffer is freed when the callback returns.
+ */
+typedef void (*batch_callback)(const char* img_id, int err, const char* image_buffer,
+                               uint32_t image_size, const img_metadata* metadata, void* arg);
+
+/**
+ * @brief The state of a batch read, read image by image
+ */
+typedef struct {
+    struct batch_entry* entries; // the images, by offset
+    size_t nb_entries;
+    size_t next;                 // next entry to read
+    uint16_t box[DIMS];          // if has_box, else the resolution code is used
+    int has_box;
+    int resolution;
+    int format;
+    int done;
+} imgst_batch;
+
+/**
+ * @brief Starts a batch read: the images are found in a single pass over the
+ *        metadata and sorted in the order of their offsets in the imgStore
+ *        file; the images that have to be resized first come last.
+ *
+ * @param batch The batch state to initialize
+ * @param img_ids The IDs of the images (may repeat), kept until do_read_batch_end
+ * @param nb_ids Their number
+ * @param box The box to resize the images into, NULL to use the resolution
+ * @param resolution The resolution code, if there is no box
+ * @param format The encoding of the resized images
+ * @param imgstfile The main in-memory structure
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_read_batch_begin(imgst_batch* batch, const char* const* img_ids, size_t nb_ids,
+                        const uint16_t* box, int resolution, int format,
+                        const imgst_file* imgstfile);
+
+/**
+ * @brief Reads the next image of a batch and passes it to the callback
+ *        (then batch->done is set after the last one). An image deleted since
+ *        do_read_batch_begin is reported as not found.
+ *
+ * @param batch The batch state
+ * @param callback Called for the image, with ERR_NONE or the error for it
+ * @param arg Passed to the callback
+ * @param imgstfile The main in-memory structure
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_read_batch_next(imgst_batch* batch, batch_callback callback, void* arg,
+                       imgst_file* imgstfile);
+
+/**
+ * @brief Tells whether do_read_batch_next would render the next image of a
+ *        batch, so write to the imgStore (see read_needs_render).
+ *
+ * @param batch The batch state
+ * @param imgstfile The main in-memory structure
+ *
+ * @return 1 if the next read would render the image, 0 if not.
+ */
+int batch_needs_render(const imgst_batch* batch, const imgst_file* imgstfile);
+
+/**
+ * @brief Releases the batch state.
+ *
+ * @param batch The batch state
+ */
+void do_read_batch_end(imgst_batch* batch);
+
+/**
+ * @brief Reads many images at once. They are found in a single pass over
+ *        the metadata and read in the order of their offsets in the imgStore
+ *        file; the images that have to be resized first come last.
+ *
+ * @param img_ids The IDs of the images (may repeat)
+ * @param nb_ids Their number
+ * @param box The box to resize the images into, NULL to use the resolution
+ * @param resolution The resolution code, if there is no box
+ * @param format The encoding of the resized images
+ * @param callback Called for each image, with ERR_NONE or the error for it
+ * @param arg Passed to the callback
+ * @param imgstfile The main in-memory structure
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_read_batch(const char* const* img_ids, size_t nb_ids, const uint16_t* box,
+                  int resolution, int format, batch_callback callback, void* arg,
+                  imgst_file* imgstfile);
+
+/**
+ * @brief Renders with nb_threads workers the images that do_read_batch,
+ *        given the same arguments, would have to resize, so that it then
+ *        only reads. Originals are read and resized images appended in
+ *        offset order; the rendering itself is concurrent.
+ *
+ * @param img_ids The imgIDs of the images
+ * @param nb_ids The number of imgIDs
+ * @param box The bounding box, NULL to use the resolution code
+ * @param resolution The resolution code, when box is NULL
+ * @param format The encoding (FMT_ code)
+ * @param nb_threads The number of workers
+ * @param imgstfile The main in-memory structure
+ *
+ * @return Some error code. 0 if no error; images that cannot be rendered
+ *         are left for do_read_batch to report.
+ */
+int do_resize_batch(const char* const* img_ids, size_t nb_ids, const uint16_t* box,
+                    int resolution, int format, size_t nb_threads, imgst_file* imgstfile);
+
 /**
  * @brief Insert image in the imgStore file
  *
@@ -257,6 +664,203 @@ int do_read(const char* img_id, const int resolution, char** image_buffer,
 
 int do_insert(const char* image_buffer, size_t image_size, const char* img_id, imgst_file* imgstfile);
 
+/**
+ * @brief Inserts an image whose SHA and resolution were computed beforehand.
+ *        Neither the header nor the metadata are written: the caller flushes
+ *        them, e.g. once for a whole batch of images.
+ *
+ * @param image_buffer Pointer to the raw image content
+ * @param image_size Image size
+ * @param sha SHA256 of the image content
+ * @param width Width of the original image
+ * @param height Height of the original image
+ * @param img_id Image ID
+ * @param imgstfile The imgst_file in memory
+ * @param index Set to the slot of the inserted image
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_prepared(const char* image_buffer, size_t image_size, const unsigned char* sha,
+                       uint32_t width, uint32_t height, const char* img_id,
+                       imgst_file* imgstfile, size_t* index);
+
+/**
+ * @brief Statistics of a bulk import
+ */
+typedef struct {
+    size_t imported;   // images inserted
+    size_t duplicates; // images whose ID was already in the imgStore
+    size_t errors;     // images that could not be read nor inserted
+    uint64_t bytes;    // bytes of the imported images
+} import_stats;
+
+/**
+ * @brief Imports many images at once. The files are read, hashed and probed
+ *        by nb_threads workers; only the inserts themselves are serialized
+ *        and the metadata is flushed once per batch. The ID of an image is
+ *        its file name without extension.
+ *
+ * @param source A directory, or a file listing one image path per line
+ * @param nb_threads Number of worker threads
+ * @param stats Filled with the statistics of the import
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error; images that fail individually
+ *         are counted in stats and do not stop the import.
+ */
+int do_import(const char* source, size_t nb_threads, import_stats* stats, imgst_file* imgstfile);
+
+/**
+ * @brief Receives the bytes of an archive being exported
+ *
+ * @return Some error code. 0 if no error.
+ */
+typedef int (*export_writer)(const void* buffer, size_t size, void* arg);
+
+/**
+ * @brief The state of an export, written entry by entry
+ */
+typedef struct {
+    int fd;                       // the imgStore file, read with pread
+    struct export_entry* entries; // blobs and variants, by offset
+    size_t nb_entries;
+    size_t next;                  // next entry to write, 0 being the manifest
+    char* manifest;               // JSON of the images and variants
+    size_t manifest_size;
+    char* block;                  // buffer of the sequential reads
+    long mtime;                   // modification time of every entry
+    uint64_t size;                // total bytes of the archive
+    int done;
+} imgst_export;
+
+/**
+ * @brief Starts exporting the imgStore as a tar archive: a manifest.json of
+ *        the images, then the content of each original once as blobs/<SHA>,
+ *        and, if asked, each variant as variants/<SHA>/<W>x<H>.<ext>.
+ *        The contents are read in ascending offset order.
+ *
+ * @param export The export state to initialize
+ * @param with_variants Whether to include the variants
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_export_begin(imgst_export* export, int with_variants, const imgst_file* imgstfile);
+
+/**
+ * @brief Writes the next entry of the archive, or its end after the last
+ *        entry (then export->done is set).
+ *
+ * @param export The export state
+ * @param writer Receives the bytes of the entry
+ * @param arg Passed to the writer
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_export_next(imgst_export* export, export_writer writer, void* arg);
+
+/**
+ * @brief Releases the export state.
+ *
+ * @param export The export state
+ */
+void do_export_end(imgst_export* export);
+
+/**
+ * @brief Exports the whole imgStore as a tar archive to a stream.
+ *
+ * @param out The stream to write the archive to
+ * @param with_variants Whether to include the variants
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_export(FILE* out, int with_variants, const imgst_file* imgstfile);
+
+/**
+ * @brief Imports a tar archive made by do_export, read sequentially so that
+ *        it can come from a pipe. Each blob is checked against its SHA before
+ *        being inserted under all the imgIDs the manifest gives it.
+ *
+ * @param in The stream to read the archive from
+ * @param stats Filled with the statistics of the import
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error; images that fail individually
+ *         are counted in stats and do not stop the import.
+ */
+int do_import_archive(FILE* in, import_stats* stats, imgst_file* imgstfile);
+
+/**
+ * @brief Starts streaming an image into the imgStore file. An extent of the
+ *        announced size is reserved at the end of the file, and the chunks
+ *        are written in place as they arrive: whatever is appended meanwhile
+ *        goes after it.
+ *
+ * @param ingest The streaming state to initialize
+ * @param img_id Image ID
+ * @param size Size of the image, in bytes
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_begin(imgst_ingest* ingest, const char* img_id, uint64_t size,
+                    imgst_file* imgstfile);
+
+/**
+ * @brief Resumes streaming an image whose first bytes were written to its
+ *        extent before, e.g. by a server that has been restarted. The bytes
+ *        are hashed again.
+ *
+ * @param ingest The streaming state to initialize
+ * @param img_id Image ID
+ * @param offset Offset of the extent reserved by do_insert_begin
+ * @param reserved Size of the extent
+ * @param size Number of bytes already received
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return ERR_IO if the extent is no longer free, e.g. after a garbage
+ *         collection. Some other error code, or 0 if no error.
+ */
+int do_insert_resume(imgst_ingest* ingest, const char* img_id, uint64_t offset,
+                     uint64_t reserved, uint64_t size, imgst_file* imgstfile);
+
+/**
+ * @brief Writes the next chunk of a streamed image in its extent.
+ *
+ * @param ingest The streaming state
+ * @param chunk The chunk content
+ * @param chunk_size The chunk size
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_append(imgst_ingest* ingest, const char* chunk, size_t chunk_size,
+                     imgst_file* imgstfile);
+
+/**
+ * @brief Commits a streamed image, once all its announced bytes are received:
+ *        de-duplicates it, keeps its extent as the original if it is new,
+ *        and writes its metadata and the header. The streaming state is
+ *        released in any case.
+ *
+ * @param ingest The streaming state
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_commit(imgst_ingest* ingest, imgst_file* imgstfile);
+
+/**
+ * @brief Gives up a streamed image and releases the streaming state. The
+ *        extent is given back if it ends the imgStore file, and left to the
+ *        garbage collector otherwise.
+ *
+ * @param ingest The streaming state
+ * @param imgstfile The imgst_file in memory
+ */
+void do_insert_abort(imgst_ingest* ingest, imgst_file* imgstfile);
+
 /**
  * @brief Finds index in metadata for a given img_id
  *
@@ -268,6 +872,29 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, i
  */
 int findMetadataIndex(size_t* idx, const char* img_id, const imgst_file* imgstfile);
 
+/**
+ * @brief Finds index in metadata of a valid image with the given content
+ *
+ * @param idx Index to point to the correct value
+ * @param sha The SHA of the content
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return ERR_FILE_NOT_FOUND if no valid image has this content
+ */
+int findContentIndex(size_t* idx, const unsigned char* sha, const imgst_file* imgstfile);
+
+/**
+ * @brief Inserts a new image ID for a content already in the imgStore,
+ *        without transferring it again.
+ *
+ * @param sha The SHA of the content
+ * @param img_id The new image ID
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return ERR_FILE_NOT_FOUND if no valid image has this content
+ */
+int do_link(const unsigned char* sha, const char* img_id, imgst_file* imgstfile);
+
 /**
  * @brief Decides whether the index is of a valid metadata
  *
@@ -288,6 +915,109 @@ int validMetadataIndex(const size_t idx, const imgst_file* imgstfile);
  */
 int updateMetadata(const size_t idx, imgst_file* imgstfile);
 
+/**
+ * @brief Opens a change of the in-memory metadata at idx: read_slot waits
+ *        for metadata_publish. The contents the metadata will refer to must
+ *        be written already; they are flushed for readers that bypass the FILE.
+ *
+ * @param idx The index of the metadata
+ * @param imgstfile The imgst_file in memory
+ */
+void metadata_begin(const size_t idx, imgst_file* imgstfile);
+
+/**
+ * @brief Publishes a change of the in-memory metadata at idx.
+ *
+ * @param idx The index of the metadata
+ * @param imgstfile The imgst_file in memory
+ */
+void metadata_publish(const size_t idx, imgst_file* imgstfile);
+
+/**
+ * @brief Tells whether the imgStore file is opened read-only: what has to be
+ *        resized is then rendered in memory for each read, never stored.
+ */
+int is_read_only(const imgst_file* imgstfile);
+
+/**
+ * @brief Opens the change log of the imgStore for its writer: metadata_publish
+ *        notes the changed slots and change_log_commit writes them.
+ *
+ * @param imgst_filename Path to the imgStore file, CHANGE_LOG_EXT is appended
+ * @param create Whether to create the change log if there is none
+ * @param imgstfile The imgst_file in memory, opened in "rb+" mode
+ *
+ * @return ERR_IO if there is none and create is 0, or it is not a change log.
+ */
+int change_log_open(const char* imgst_filename, int create, imgst_file* imgstfile);
+
+/**
+ * @brief Writes the slots changed since the last call to the change log,
+ *        once the imgStore file is flushed: followers read the slots as soon
+ *        as they see the records. do_close calls it.
+ *
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error
+ */
+int change_log_commit(imgst_file* imgstfile);
+
+/**
+ * @brief Opens an imgStore read-only to follow the changes its writer, in
+ *        another process, makes to it.
+ *
+ * @param imgst_filename Path to the imgStore file
+ * @param follower The state of the follower
+ * @param imgstfile Structure for header, metadata and file pointer.
+ *
+ * @return Some error code. 0 if no error
+ */
+int do_follow_open(const char* imgst_filename, imgst_follower* follower, imgst_file* imgstfile);
+
+/**
+ * @brief Tells whether the writer changed the imgStore since the last
+ *        do_follow: two small reads, without changing anything in memory.
+ */
+int follow_pending(const imgst_follower* follower, const imgst_file* imgstfile);
+
+/**
+ * @brief Tells whether the imgStore file opened by do_follow_open was removed
+ *        or replaced by another one, e.g. by imgStoreMgr gc. Its slots then no
+ *        longer tell where the contents of the new file are: do_follow fails
+ *        and the imgStore has to be opened again.
+ */
+int follow_replaced(const imgst_follower* follower, const imgst_file* imgstfile);
+
+/**
+ * @brief Reads again the metadata the writer changed since the last call,
+ *        as listed by its change log, and the variant records if there are
+ *        new ones. Slots are changed as by the writer itself (metadata_begin,
+ *        metadata_publish): read_slot may run meanwhile, but nothing else.
+ *
+ * @param follower The state of the follower
+ * @param imgstfile The imgst_file in memory, opened by do_follow_open
+ * @param nb_changed Set to the number of slots that changed
+ *
+ * @return Some error code. 0 if no error
+ */
+int do_follow(imgst_follower* follower, imgst_file* imgstfile, size_t* nb_changed);
+
+/**
+ * @brief Closes an imgStore opened by do_follow_open.
+ */
+void do_follow_close(imgst_follower* follower, imgst_file* imgstfile);
+
+/**
+ * @brief Updates a range of consecutive metadata in the imgStore file at once
+ *
+ * @param first The index of the first metadata
+ * @param nb The number of metadata to write
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error
+ */
+int updateMetadataRange(const size_t first, const size_t nb, imgst_file* imgstfile);
+
 
 /**
  * @brief Updates the header in the imgStore file
@@ -328,6 +1058,38 @@ int read_disk_image(const char* image_filename, char** buffer, size_t* size);
  */
 int write_disk_image(const char* image_filename, const char* buffer, size_t size);
 
+/**
+ * @brief What the library did since the program started, for monitoring.
+ *        The counters only grow.
+ */
+struct imgst_counters {
+    uint64_t resizes;    // resized images created by lazily_resize
+    uint64_t resize_us;  // microseconds spent creating them
+    uint64_t dedup_hits; // images stored whose content was already there
+};
+
+/**
+ * @brief Copies the counters of the library.
+ *
+ * @param counters will contain the counters
+ */
+void get_counters(imgst_counters* counters);
+
+/**
+ * @brief Counts a resized image created in the given time.
+ */
+void count_resize(uint64_t us);
+
+/**
+ * @brief Counts an image whose content was already stored.
+ */
+void count_dedup_hit(void);
+
+/**
+ * @brief Monotonic time, in microseconds.
+ */
+uint64_t monotonic_us(void);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
@@ -338,6 +1100,48 @@ int write_disk_image(const char* image_filename, const char* buffer, size_t size
  */
 int do_gbcollect (const char *imgst_path, const char *imgst_tmp_bkp_path);
 
+struct imgst_gap {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct imgst_stats {
+    uint32_t num_files;
+    uint32_t max_files;
+
+    uint64_t file_bytes;  // size of the imgStore file
+    uint64_t table_bytes; // header and metadata
+    uint64_t live_bytes;  // contents of the valid images, once each, and their variants
+    uint64_t dead_bytes;  // everything else: deleted images, orphaned variants, aborted uploads
+
+    uint32_t dedup_images;      // valid images whose content is shared with an earlier one
+    uint64_t dedup_saved_bytes; // bytes these would take if their contents were stored again
+
+    uint32_t resized[NB_RES];   // valid images with each resolution stored
+    uint32_t variants;          // variant records
+    uint32_t live_variants;     // those of valid images
+    uint64_t variant_bytes;     // contents and records of the live variants
+
+    uint32_t size_histogram[STATS_SIZE_BUCKETS]; // valid originals, by size
+
+    imgst_gap gaps[STATS_GAPS]; // largest ranges nothing refers to, largest first
+    size_t nb_gaps;
+
+    uint64_t gc_bytes;          // projected size of the file after do_gbcollect, which
+                                // also shares the resized images of a content
+};
+
+/**
+ * @brief Computes the statistics of an imgStore from its metadata and
+ *        variant records, without reading any content.
+ *
+ * @param imgstfile The imgStore file
+ * @param stats will contain the statistics
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_stats(const imgst_file* imgstfile, imgst_stats* stats);
+
 #ifdef __cplusplus
 }
 #endif
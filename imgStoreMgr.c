@@ -6,17 +6,24 @@
  *
  * @author Mia Primorac
  */
+#define _POSIX_C_SOURCE 200809L // for clock_gettime and sysconf
 
 #include "util.h" // for _unused
 #include "imgStore.h"
 #include "error.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <string.h> // for strlen and strcmp
+#include <inttypes.h> // for PRIu32, PRIu64
+#include <time.h> // for clock_gettime
+#include <unistd.h> // for sysconf
+#include <sys/stat.h> // for stat
+#include <sys/resource.h> // for getrusage
 #include <vips/vips.h>
 
 // Constants : commands
-#define NB_COMMANDS 7
+#define NB_COMMANDS 11
 #define MIN_COMMAND_ARGS 2
 
 #define MIN_LIST_ARGS 2
@@ -25,6 +32,25 @@
 #define MIN_READ_ARGS 3
 #define MIN_INSERT_ARGS 4
 #define MIN_GC_ARGS 3
+#define MIN_IMPORT_ARGS 3
+#define MIN_EXPORT_ARGS 3
+#define MIN_SHELL_ARGS 2
+#define MIN_STATS_ARGS 2
+
+// Constants : global options, before the command
+#define TRACE_OPTION "-trace"
+#define TIMING_OPTION "-timing"
+#define TIMING_LONG_OPTION "--timing"
+#define PROC_IO "/proc/self/io" // bytes read and written by the process, on Linux
+#define PROC_IO_LINE_LEN 64
+
+// Constants : import and export of archives
+#define STDIO_NAME "-"
+#define ARCHIVE_EXT ".tar"
+
+// Constants : shell mode
+#define SHELL_MAX_ARGS 16
+#define SHELL_SEPARATORS " \t\r\n"
 
 // Constants : create command
 #define NB_CREATE_OPTIONS 3
@@ -47,6 +73,7 @@ typedef struct option_mapping option_mapping;
 struct command_mapping {
     const char* name;
     command comm;
+    int in_shell; // whether the shell mode can run it
 };
 
 /**
@@ -61,6 +88,39 @@ struct option_mapping {
     void* arguments;     // option arguments
 };
 
+// The imgStore kept open by the shell mode, NULL otherwise
+static imgst_file* s_shared = NULL;
+static struct stat s_shared_stat;
+
+/**
+ * Opens an imgStore, unless it is the one kept open by the shell mode.
+ */
+static int open_store(const char* filename, const char* open_mode, imgst_file* imgstfile)
+{
+    struct stat st;
+
+    if (s_shared != NULL && stat(filename, &st) == 0
+        && st.st_dev == s_shared_stat.st_dev && st.st_ino == s_shared_stat.st_ino) {
+        *imgstfile = *s_shared;
+        return ERR_NONE;
+    }
+
+    return do_open(filename, open_mode, imgstfile);
+}
+
+/**
+ * Closes an imgStore opened by open_store. The one of the shell mode stays
+ * open, with the changes made to it.
+ */
+static void close_store(imgst_file* imgstfile)
+{
+    if (s_shared != NULL && imgstfile->file == s_shared->file) {
+        *s_shared = *imgstfile;
+        return;
+    }
+
+    do_close(imgstfile);
+}
 
 /**
  *  Do garbage collecting
@@ -85,6 +145,74 @@ int do_gbcollect_cmd(int args, char* argv[])
     return ERR_NONE;
 }
 
+/**
+ * Percentage of part in total, 0 if total is 0.
+ */
+static double percent(const uint64_t part, const uint64_t total)
+{
+    return (total == 0) ? 0.0 : 100.0 * (double) part / (double) total;
+}
+
+/**
+ * Opens imgStore file and prints the result of do_stats.
+ */
+int do_stats_cmd(int args, char* argv[])
+{
+    if (args < MIN_STATS_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* filename = argv[1];
+    M_REQUIRE_NON_NULL(filename);
+
+    imgst_file imgstfile;
+    M_EXIT_IF_ERR(open_store(filename, "rb", &imgstfile));
+
+    imgst_stats s;
+    const int ret = do_stats(&imgstfile, &s);
+    close_store(&imgstfile);
+    M_EXIT_IF_ERR(ret);
+
+    static const char* const res_names[NB_RES] = {"thumb", "small", "orig"};
+
+    printf("images:           %" PRIu32 " / %" PRIu32 "\n", s.num_files, s.max_files);
+    printf("file bytes:       %" PRIu64 "\n", s.file_bytes);
+    printf("  header+metadata %" PRIu64 " (%.1f%%)\n", s.table_bytes, percent(s.table_bytes, s.file_bytes));
+    printf("  live            %" PRIu64 " (%.1f%%)\n", s.live_bytes, percent(s.live_bytes, s.file_bytes));
+    printf("  dead            %" PRIu64 " (%.1f%%)\n", s.dead_bytes, percent(s.dead_bytes, s.file_bytes));
+    printf("dedup:            %" PRIu32 " image(s) share content, %" PRIu64 " bytes saved\n",
+           s.dedup_images, s.dedup_saved_bytes);
+
+    for (int res = 0; res < NB_RES; ++res) {
+        printf("%-5s coverage:   %" PRIu32 " (%.1f%%)\n", res_names[res], s.resized[res],
+               percent(s.resized[res], s.num_files));
+    }
+    printf("variants:         %" PRIu32 " live of %" PRIu32 ", %" PRIu64 " bytes\n",
+           s.live_variants, s.variants, s.variant_bytes);
+
+    printf("original sizes:\n");
+    for (size_t b = 0; b < STATS_SIZE_BUCKETS; ++b) {
+        if (s.size_histogram[b] == 0) continue;
+
+        if (b == STATS_SIZE_BUCKETS - 1) {
+            printf("  >= %7lu KiB  %" PRIu32 "\n", 1ul << (b - 1), s.size_histogram[b]);
+        } else {
+            printf("  <  %7lu KiB  %" PRIu32 "\n", 1ul << b, s.size_histogram[b]);
+        }
+    }
+
+    printf("largest gaps:\n");
+    for (size_t g = 0; g < s.nb_gaps; ++g) {
+        printf("  %" PRIu64 " bytes at %" PRIu64 "\n", s.gaps[g].size, s.gaps[g].offset);
+    }
+
+    const uint64_t gain = (s.file_bytes > s.gc_bytes) ? s.file_bytes - s.gc_bytes : 0;
+    printf("after gc:         %" PRIu64 " bytes, %" PRIu64 " freed (%.1f%%)\n",
+           s.gc_bytes, gain, percent(gain, s.file_bytes));
+
+    return ERR_NONE;
+}
+
 /**
  * Opens imgStore file and calls do_list command.
  */
@@ -103,11 +231,11 @@ int do_list_cmd (int args, char* argv[])
     imgst_file imgstfile;
 
     // Open the file with the given filename in binary read mode
-    M_EXIT_IF_ERR(do_open(filename, "rb", &imgstfile));
+    M_EXIT_IF_ERR(open_store(filename, "rb", &imgstfile));
 
     // List the contents and then close the file.
     do_list(&imgstfile, STDOUT);
-    do_close(&imgstfile);
+    close_store(&imgstfile);
 
     return ERR_NONE;
 }
@@ -245,7 +373,12 @@ int do_create_cmd (int args, char* argv[])
  */
 int help (int args _unused, char* argv[] _unused)
 {
-    printf("imgStoreMgr [COMMAND] [ARGUMENTS]\n"
+    printf("imgStoreMgr [-trace <trace_filename>] [-timing] [COMMAND] [ARGUMENTS]\n"
+           "  -trace: write the trace spans of the command to a Chrome trace JSON file\n"
+           "      (chrome://tracing). spans are only recorded by a build with TRACE=1.\n"
+           "  -timing, --timing: print on stderr the wall and CPU time of each phase of\n"
+           "      the command (phases nest: do_read includes lazily_resize, and so on),\n"
+           "      the bytes read and written and the peak RSS.\n"
            "  help: displays this help.\n"
            "  list <imgstore_filename>: list imgStore content.\n"
            "  create <imgstore_filename> [options]: create a new imgStore.\n"
@@ -262,9 +395,30 @@ int help (int args _unused, char* argv[] _unused)
            "  read   <imgstore_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n"
            "      read an image from the imgStore and save it to a file.\n"
            "      default resolution is \"original\".\n"
+           "  read   <imgstore_filename> [imgID ...] [-all] [-res <resolution>] [-out <directory>] [-threads <N>]:\n"
+           "      read many images, or all of them with -all, each to its own file in the\n"
+           "      directory (default: the current one). missing resized images are\n"
+           "      rendered by N threads (default: the number of online processors).\n"
            "  insert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore.\n"
            "  delete <imgstore_filename> <imgID>: delete image imgID from imgStore.\n"
-           "  gc <imgstore_filename> <tmp imgstore_filename>: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore.\n",
+           "  gc <imgstore_filename> <tmp imgstore_filename>: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore.\n"
+           "  stats <imgstore_filename>: report the live and dead bytes, dedup savings,\n"
+           "      resolution and variant coverage, sizes of the originals, largest gaps\n"
+           "      and the size of the imgStore after gc, without reading any image.\n"
+           "  import <imgstore_filename> <directory|list_filename> [-threads <N>]:\n"
+           "      insert all the images of a directory, or listed one per line in a file.\n"
+           "      the imgID of an image is its filename without extension.\n"
+           "      default number of threads is the number of online processors.\n"
+           "  import <imgstore_filename> <archive.tar|->: insert all the images of an\n"
+           "      archive made by export, \"-\" reading it from the standard input.\n"
+           "  export <imgstore_filename> <archive.tar|-> [-variants]: write all the images\n"
+           "      to a tar archive, \"-\" writing it to the standard output.\n"
+           "      -variants also writes the resized variants.\n"
+           "  shell <imgstore_filename> [script_filename]: run commands read line by line,\n"
+           "      from the standard input by default, against the imgStore kept open.\n"
+           "      a line is a command with its arguments as above; each one is followed\n"
+           "      by a result line \"<line> OK\" or \"<line> ERROR <message>\".\n"
+           "      create, gc and shell cannot be run this way.\n",
            DEF_MAX_FILES, MAX_MAX_FILES,
            DEF_RES_THUMB, DEF_RES_THUMB, MAX_RES_THUMB, MAX_RES_THUMB,
            DEF_RES_SMALL, DEF_RES_SMALL, MAX_RES_SMALL, MAX_RES_SMALL);
@@ -294,18 +448,149 @@ int do_delete_cmd (int args, char* argv[])
 
     // Open the file
     imgst_file imgstfile;
-    M_EXIT_IF_ERR(do_open(filename, "rb+", &imgstfile));
+    M_EXIT_IF_ERR(open_store(filename, "rb+", &imgstfile));
 
     // If correctly opened, then delete.
     M_EXIT_IF_ERR_DO_SOMETHING(do_delete(img_id, &imgstfile),
-                               do_close(&imgstfile));
+                               close_store(&imgstfile));
 
     // Clean up the file
-    do_close(&imgstfile);
+    close_store(&imgstfile);
 
     return ERR_NONE;
 }
 
+// Passed to write_read_part
+struct read_output {
+    const char* directory; // NULL for the current one
+    int resolution;
+    int ret; // the first error met
+};
+
+/**
+ * Writes one image of a multi-image read to its own file.
+ */
+static void write_read_part(const char* img_id, int err, const char* image_buffer,
+                            uint32_t image_size, const img_metadata* metadata _unused, void* arg)
+{
+    struct read_output* out = arg;
+    char* name = NULL;
+
+    if (err == ERR_NONE) {
+        err = create_name(img_id, out->resolution, &name);
+    }
+
+    if (err == ERR_NONE) {
+        const size_t len = (out->directory == NULL) ? 0 : strlen(out->directory) + 1;
+        char* path = calloc(len + strlen(name) + 1, sizeof(char));
+
+        if (path == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else {
+            snprintf(path, len + strlen(name) + 1, "%s%s%s", (len > 0) ? out->directory : "",
+                     (len > 0) ? "/" : "", name);
+            err = write_disk_image(path, image_buffer, (size_t) image_size);
+            FREE_DEREF(path);
+        }
+
+        FREE_DEREF(name);
+    }
+
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s: %s\n", img_id, ERR_MESSAGES[err]);
+        out->ret = (out->ret == ERR_NONE) ? err : out->ret;
+    }
+}
+
+/**
+ * Reads many images of a imgStore at once, each to its own file. Missing
+ * resized images are rendered concurrently, then all the images are read
+ * in the order of the imgStore file.
+ */
+static int do_read_many(int args, char* argv[])
+{
+    const char* imgstore_filename = argv[1];
+    M_REQUIRE_NON_NULL(imgstore_filename);
+
+    // Skips "read" and "<imgstore_filename>": imgIDs and options follow
+    args -= 2; argv += 2;
+
+    const char** img_ids = calloc((size_t) args + 1, sizeof(char*));
+    M_EXIT_IF_NULL(img_ids, ((size_t) args + 1) * sizeof(char*));
+
+    size_t nb_ids = 0;
+    int all = 0;
+    int ret = ERR_NONE;
+    struct read_output out = {.resolution = RES_ORIG};
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nb_threads = (online > 0) ? (size_t) online : 1;
+
+    for (int i = 0; i < args && ret == ERR_NONE; ++i) {
+        const int has_value = i + 1 < args;
+
+        if (!strcmp(argv[i], "-all")) {
+            all = 1;
+        } else if (!strcmp(argv[i], "-res") && has_value) {
+            out.resolution = resolution_atoi(argv[++i]);
+            ret = (out.resolution == NOT_RES) ? ERR_RESOLUTIONS : ERR_NONE;
+        } else if (!strcmp(argv[i], "-out") && has_value) {
+            out.directory = argv[++i];
+        } else if (!strcmp(argv[i], "-threads") && has_value) {
+            nb_threads = atouint16(argv[++i]);
+            ret = (nb_threads == 0) ? ERR_INVALID_ARGUMENT : ERR_NONE;
+        } else if (argv[i][0] == '-') {
+            ret = ERR_INVALID_ARGUMENT;
+        } else if (strlen(argv[i]) > MAX_IMG_ID) {
+            ret = ERR_INVALID_IMGID;
+        } else {
+            img_ids[nb_ids++] = argv[i];
+        }
+    }
+
+    imgst_file imgstfile;
+
+    if (ret == ERR_NONE) {
+        ret = open_store(imgstore_filename, "rb+", &imgstfile);
+    }
+
+    if (ret != ERR_NONE) {
+        FREE_DEREF(img_ids);
+        return ret;
+    }
+
+    // -all reads every image, the imgIDs given are then ignored
+    if (all) {
+        const char** all_ids = realloc(img_ids, (imgstfile.header.num_files + 1) * sizeof(char*));
+
+        if (all_ids == NULL) {
+            FREE_DEREF(img_ids);
+            close_store(&imgstfile);
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        img_ids = all_ids;
+        nb_ids = 0;
+
+        for (size_t i = 0; i < imgstfile.header.max_files && nb_ids < imgstfile.header.num_files; ++i) {
+            if (imgstfile.metadata[i].is_valid == NON_EMPTY) {
+                img_ids[nb_ids++] = imgstfile.metadata[i].img_id;
+            }
+        }
+    }
+
+    ret = do_resize_batch(img_ids, nb_ids, NULL, out.resolution, FMT_JPEG, nb_threads, &imgstfile);
+
+    if (ret == ERR_NONE) {
+        ret = do_read_batch(img_ids, nb_ids, NULL, out.resolution, FMT_JPEG,
+                            write_read_part, &out, &imgstfile);
+    }
+
+    FREE_DEREF(img_ids);
+    close_store(&imgstfile);
+
+    return (ret == ERR_NONE) ? out.ret : ret;
+}
+
 /**
  * Reads the content of an image from a imgStore
  */
@@ -317,6 +602,13 @@ int do_read_cmd (int args, char* argv[])
         return ERR_NOT_ENOUGH_ARGUMENTS;
     }
 
+    // Any option reads many images at once
+    for (int i = 2; i < args; ++i) {
+        if (argv[i][0] == '-') {
+            return do_read_many(args, argv);
+        }
+    }
+
     // Get non-null filename argument
     const char* imgstore_filename = argv[1];
     M_REQUIRE_NON_NULL(imgstore_filename);
@@ -332,25 +624,25 @@ int do_read_cmd (int args, char* argv[])
 
     // Open the file
     imgst_file imgstfile;
-    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb+", &imgstfile));
+    M_EXIT_IF_ERR(open_store(imgstore_filename, "rb+", &imgstfile));
 
     // Read into image_buffer and image_size
     char* image_buffer = NULL;
     uint32_t image_size = 0;
     M_EXIT_IF_ERR_DO_SOMETHING(do_read(img_id, resolution, &image_buffer, &image_size, &imgstfile),
-                               do_close(&imgstfile));
+                               close_store(&imgstfile));
 
     // Generate a new name
     char* new_name;
     M_EXIT_IF_ERR_DO_SOMETHING(create_name(img_id, resolution, &new_name),
-                               do_close(&imgstfile);
+                               close_store(&imgstfile);
                                FREE_DEREF(image_buffer));
 
     // Write to jpg in folder where imgStoreMgr is located
     M_EXIT_IF_ERR_DO_SOMETHING(write_disk_image(new_name, image_buffer, (size_t) image_size),
                                FREE_DEREF(new_name);
                                FREE_DEREF(image_buffer);
-                               do_close(&imgstfile));
+                               close_store(&imgstfile));
 
 
 
@@ -359,7 +651,7 @@ int do_read_cmd (int args, char* argv[])
     FREE_DEREF(image_buffer);
 
     // Close the files
-    do_close(&imgstfile);
+    close_store(&imgstfile);
 
     return ERR_NONE;
 }
@@ -391,11 +683,11 @@ int do_insert_cmd (int args, char* argv[])
 
     // Open the imgStore file
     imgst_file imgstfile;
-    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb+", &imgstfile));
+    M_EXIT_IF_ERR(open_store(imgstore_filename, "rb+", &imgstfile));
 
     // Make sure there is enough space
     if (imgstfile.header.num_files >= imgstfile.header.max_files) {
-        do_close(&imgstfile);
+        close_store(&imgstfile);
         return ERR_FULL_IMGSTORE;
     }
 
@@ -403,42 +695,389 @@ int do_insert_cmd (int args, char* argv[])
     char* image_buffer = NULL;
     size_t image_size = 0;
     M_EXIT_IF_ERR_DO_SOMETHING(read_disk_image(image_filename, &image_buffer, &image_size),
-                               do_close(&imgstfile));
+                               close_store(&imgstfile));
 
     // Insert
     M_EXIT_IF_ERR_DO_SOMETHING(do_insert(image_buffer, image_size, img_id, &imgstfile),
                                FREE_DEREF(image_buffer);
-                               do_close(&imgstfile));
+                               close_store(&imgstfile));
 
     // Free buffer and clean up the file
     FREE_DEREF(image_buffer);
+    close_store(&imgstfile);
+
+    return ERR_NONE;
+}
+
+/**
+ * Tells whether an import source is an archive rather than images.
+ */
+static int is_archive_name(const char* name)
+{
+    const size_t len = strlen(name);
+    const size_t ext_len = strlen(ARCHIVE_EXT);
+
+    return !strcmp(name, STDIO_NAME)
+           || (len > ext_len && !strcmp(name + len - ext_len, ARCHIVE_EXT));
+}
+
+/**
+ * Imports many images at once into an imgStore
+ */
+int do_import_cmd (int args, char* argv[])
+{
+    // Import needs at least <imgstore_filename> <directory|list_filename>
+    if (args < MIN_IMPORT_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* imgstore_filename = argv[1];
+    const char* source = argv[2];
+    M_REQUIRE_NON_NULL(imgstore_filename);
+    M_REQUIRE_NON_NULL(source);
+
+    if (is_archive_name(source)) {
+        M_EXIT_IF(args > MIN_IMPORT_ARGS, ERR_INVALID_ARGUMENT, "no option for an archive", );
+    }
+
+    // Parse the only option
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nb_threads = (online > 0) ? (size_t) online : 1;
+
+    if (args > MIN_IMPORT_ARGS) {
+        if (args != MIN_IMPORT_ARGS + 2 || strcmp(argv[3], "-threads")) {
+            return ERR_INVALID_ARGUMENT;
+        }
+
+        nb_threads = atouint16(argv[4]);
+        M_EXIT_IF(nb_threads == 0, ERR_INVALID_ARGUMENT, "invalid number of threads %s", argv[4]);
+    }
+
+    imgst_file imgstfile;
+    M_EXIT_IF_ERR(open_store(imgstore_filename, "rb+", &imgstfile));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    import_stats stats;
+    int ret = ERR_NONE;
+
+    if (!strcmp(source, STDIO_NAME)) {
+        ret = do_import_archive(stdin, &stats, &imgstfile);
+
+    } else if (is_archive_name(source)) {
+        FILE* in = fopen(source, "rb");
+        ret = (in == NULL) ? ERR_IO : do_import_archive(in, &stats, &imgstfile);
+        if (in != NULL) fclose(in);
+
+    } else {
+        ret = do_import(source, nb_threads, &stats, &imgstfile);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close_store(&imgstfile);
+
+    // Report what was done, even if the import stopped early
+    const double seconds = (double)(end.tv_sec - start.tv_sec) + 1e-9 * (double)(end.tv_nsec - start.tv_nsec);
+    printf("imported %zu images (%.1f MB) in %.3f s: %.1f images/s\n",
+           stats.imported, (double) stats.bytes / 1e6, seconds,
+           seconds > 0 ? (double) stats.imported / seconds : 0.0);
+
+    if (stats.duplicates > 0 || stats.errors > 0) {
+        printf("skipped %zu duplicate imgIDs and %zu unreadable images\n",
+               stats.duplicates, stats.errors);
+    }
+
+    return ret;
+}
+
+/**
+ * Exports a whole imgStore as a tar archive
+ */
+int do_export_cmd (int args, char* argv[])
+{
+    // Export needs at least <imgstore_filename> <archive>
+    if (args < MIN_EXPORT_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* imgstore_filename = argv[1];
+    const char* archive = argv[2];
+    M_REQUIRE_NON_NULL(imgstore_filename);
+    M_REQUIRE_NON_NULL(archive);
+
+    int with_variants = 0;
+
+    if (args > MIN_EXPORT_ARGS) {
+        if (args != MIN_EXPORT_ARGS + 1 || strcmp(argv[3], "-variants")) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        with_variants = 1;
+    }
+
+    imgst_file imgstfile;
+    M_EXIT_IF_ERR(open_store(imgstore_filename, "rb", &imgstfile));
+
+    const int to_stdout = !strcmp(archive, STDIO_NAME);
+    FILE* out = to_stdout ? stdout : fopen(archive, "wb");
+
+    if (out == NULL) {
+        close_store(&imgstfile);
+        return ERR_IO;
+    }
+
+    const int ret = do_export(out, with_variants, &imgstfile);
+
+    if (!to_stdout) {
+        fclose(out);
+    }
+    close_store(&imgstfile);
+
+    return ret;
+}
+
+// Defined below, as it runs the other commands
+int do_shell_cmd (int args, char* argv[]);
+
+// Array of struct command_mapping containing all possible commands
+static const command_mapping s_commands[NB_COMMANDS] = {
+    {"list", do_list_cmd, 1},
+    {"create", do_create_cmd, 0},
+    {"help", help, 1},
+    {"delete", do_delete_cmd, 1},
+    {"read", do_read_cmd, 1},
+    {"insert", do_insert_cmd, 1},
+    {"gc", do_gbcollect_cmd, 0},
+    {"import", do_import_cmd, 1},
+    {"export", do_export_cmd, 1},
+    {"shell", do_shell_cmd, 0},
+    {"stats", do_stats_cmd, 1}
+};
+
+/**
+ * Calls the command named by argv[0].
+ */
+static int run_command(int argc, char* argv[], int in_shell)
+{
+    for (size_t i = 0; i < NB_COMMANDS; ++i) {
+        if (!strcmp(s_commands[i].name, argv[0])) {
+            return (in_shell && !s_commands[i].in_shell) ? ERR_INVALID_COMMAND
+                   : s_commands[i].comm(argc, argv);
+        }
+    }
+
+    return ERR_INVALID_COMMAND;
+}
+
+/**
+ * Splits a line of the shell mode in arguments, in place. Arguments are
+ * separated by blanks, or quoted with double quotes.
+ */
+static int split_line(char* line, char* argv[SHELL_MAX_ARGS])
+{
+    int argc = 0;
+    char* p = line + strspn(line, SHELL_SEPARATORS);
+
+    while (*p != '\0' && argc < SHELL_MAX_ARGS) {
+        const int quoted = (*p == '"');
+        p += quoted;
+        argv[argc++] = p;
+
+        p += quoted ? strcspn(p, "\"") : strcspn(p, SHELL_SEPARATORS);
+
+        if (*p != '\0') {
+            *p++ = '\0';
+        }
+
+        p += strspn(p, SHELL_SEPARATORS);
+    }
+
+    return (*p == '\0') ? argc : -1;
+}
+
+/**
+ * Runs commands read line by line against one open imgStore, and prints a
+ * result line after each of them.
+ */
+int do_shell_cmd (int args, char* argv[])
+{
+    // Shell needs at least <imgstore_filename>
+    if (args < MIN_SHELL_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* imgstore_filename = argv[1];
+    M_REQUIRE_NON_NULL(imgstore_filename);
+
+    // Commands come from the standard input, or from a script
+    const int from_stdin = (args == MIN_SHELL_ARGS) || !strcmp(argv[2], STDIO_NAME);
+    FILE* script = from_stdin ? stdin : fopen(argv[2], "r");
+
+    if (script == NULL) {
+        return ERR_IO;
+    }
+
+    imgst_file imgstfile;
+
+    if (stat(imgstore_filename, &s_shared_stat) != 0) {
+        if (!from_stdin) fclose(script);
+        return ERR_IO;
+    }
+
+    M_EXIT_IF_ERR_DO_SOMETHING(do_open(imgstore_filename, "rb+", &imgstfile),
+                               if (!from_stdin) fclose(script));
+    s_shared = &imgstfile;
+
+    char* line = NULL;
+    size_t line_cap = 0;
+    size_t line_nb = 0;
+
+    while (getline(&line, &line_cap, script) != -1) {
+        ++line_nb;
+
+        char* line_argv[SHELL_MAX_ARGS];
+        const int line_argc = split_line(line, line_argv);
+
+        // Empty lines and comments get no result line
+        if (line_argc == 0 || line_argv[0][0] == '#') {
+            continue;
+        }
+
+        const int ret = (line_argc < 0) ? ERR_INVALID_ARGUMENT
+                        : run_command(line_argc, line_argv, 1);
+
+        // Followers of the imgStore see each command as it is done
+        change_log_commit(&imgstfile);
+
+        if (ret == ERR_NONE) {
+            printf("%zu OK\n", line_nb);
+        } else {
+            printf("%zu ERROR %s\n", line_nb, ERR_MESSAGES[ret]);
+        }
+
+        // Whoever reads the results may wait for them before the next command
+        fflush(stdout);
+    }
+
+    FREE_DEREF(line);
+    s_shared = NULL;
     do_close(&imgstfile);
 
+    if (!from_stdin) {
+        fclose(script);
+    }
+
     return ERR_NONE;
 }
 
+/**
+ * What the whole process has used so far, for -timing.
+ */
+struct usage {
+    uint64_t wall_ns;
+    uint64_t cpu_ns; // of all the threads
+    uint64_t read_bytes; // by read system calls, whether from disk or cache
+    uint64_t written_bytes;
+};
+
+static void get_usage(struct usage* usage)
+{
+    struct timespec cpu;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+    usage->wall_ns = trace_now_ns();
+    usage->cpu_ns = (uint64_t) cpu.tv_sec * 1000000000 + (uint64_t) cpu.tv_nsec;
+    usage->read_bytes = 0;
+    usage->written_bytes = 0;
+
+    FILE* io = fopen(PROC_IO, "r");
+    if (io == NULL) {
+        return;
+    }
+
+    char line[PROC_IO_LINE_LEN];
+    unsigned long long value = 0;
+
+    while (fgets(line, sizeof(line), io) != NULL) {
+        if (sscanf(line, "rchar: %llu", &value) == 1) {
+            usage->read_bytes = value;
+        } else if (sscanf(line, "wchar: %llu", &value) == 1) {
+            usage->written_bytes = value;
+        }
+    }
+
+    fclose(io);
+}
+
+/**
+ * Prints the time of each phase of a command, then what it used in all.
+ */
+static void print_timing(const struct usage* start)
+{
+    struct usage end;
+    get_usage(&end);
+
+    struct rusage rusage;
+    getrusage(RUSAGE_SELF, &rusage);
+
+    trace_phase phases[TRACE_MAX_PHASES];
+    const size_t nb = trace_phases(phases, TRACE_MAX_PHASES);
+
+    fprintf(stderr, "%-24s %8s %12s %12s\n", "phase", "calls", "wall_ms", "cpu_ms");
+
+    for (size_t i = 0; i < nb; ++i) {
+        fprintf(stderr, "%-24s %8llu %12.3f %12.3f\n", phases[i].name,
+                (unsigned long long) phases[i].calls,
+                (double) phases[i].wall_ns / 1e6, (double) phases[i].cpu_ns / 1e6);
+    }
+
+    if (nb == 0) {
+        fprintf(stderr, "(no phase: built without TRACE=1)\n");
+    }
+
+    fprintf(stderr, "%-24s %8s %12.3f %12.3f\n", "total", "",
+            (double)(end.wall_ns - start->wall_ns) / 1e6, (double)(end.cpu_ns - start->cpu_ns) / 1e6);
+    fprintf(stderr, "bytes read: %llu, bytes written: %llu, peak RSS: %ld kB\n",
+            (unsigned long long)(end.read_bytes - start->read_bytes),
+            (unsigned long long)(end.written_bytes - start->written_bytes), rusage.ru_maxrss);
+}
+
 /**
  * MAIN
  */
 int main (int argc, char* argv[])
 {
+    const char* program = argv[0];
+    const char* trace_filename = NULL;
+    int timing = 0;
+
+    // The global options come before the command
+    for (;;) {
+        if (argc > MIN_COMMAND_ARGS && !strcmp(argv[1], TRACE_OPTION)) {
+            trace_filename = argv[2];
+            trace_flags |= TRACE_RING;
+            argc -= 2; argv += 2;
+
+        } else if (argc > 1 && (!strcmp(argv[1], TIMING_OPTION) || !strcmp(argv[1], TIMING_LONG_OPTION))) {
+            timing = 1;
+            trace_flags |= TRACE_TIMING;
+            argc--; argv++;
+
+        } else {
+            break;
+        }
+    }
+
+    struct usage start;
+    get_usage(&start);
+
     // VIPS_INIT
-    if (VIPS_INIT(argv[0])) {
+    TRACE_BEGIN(VIPS_INIT);
+    if (VIPS_INIT(program)) {
         vips_error_exit("unable to start VIPS");
         return ERR_IMGLIB;
     }
-
-    // Array of struct command_mapping containing all possible commands
-    const command_mapping commands[NB_COMMANDS] = {
-        {"list", do_list_cmd},
-        {"create", do_create_cmd},
-        {"help", help},
-        {"delete", do_delete_cmd},
-        {"read", do_read_cmd},
-        {"insert", do_insert_cmd},
-        {"gc", do_gbcollect_cmd}
-    };
-
+    TRACE_END(VIPS_INIT);
 
     int ret = ERR_NONE;
 
@@ -449,20 +1088,22 @@ int main (int argc, char* argv[])
     } else {
         argc--; argv++; // skips command call name
 
-        // Loop over commands and call the function if found
-        int found = 0;
+        ret = run_command(argc, argv, 0);
+    }
 
-        for (size_t i = 0; i < NB_COMMANDS && !found; ++i) {
+    // Write the spans even if the command failed: that may be why it is traced
+    if (trace_filename != NULL) {
+        FILE* trace = fopen(trace_filename, "w");
+        int trace_ret = (trace == NULL) ? ERR_IO : trace_write(trace);
 
-            if(!strcmp(commands[i].name, argv[0])) {
-                ret = commands[i].comm(argc, argv);
-                found = 1;
-            }
+        if (trace != NULL && fclose(trace) != 0) {
+            trace_ret = ERR_IO;
         }
+        ret = (ret == ERR_NONE) ? trace_ret : ret;
+    }
 
-        if (!found) {
-            ret = ERR_INVALID_COMMAND;
-        }
+    if (timing) {
+        print_timing(&start);
     }
 
     // Print error message if error is not ERR_NONE
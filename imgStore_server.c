@@ -4,16 +4,27 @@
  *
  * @author ???
  */
+#define _POSIX_C_SOURCE 200809L // for pthread_rwlock_t
 
 #include "imgStore.h"
+#include "variant.h" // for snap_to_bucket, parse_buckets
+#include "compress.h"
+#include "image_content.h" // for make_sprite
+#include "access_log.h"
+#include "trace.h"
 #include "error.h"
 #include "util.h" // for _unused, atouint32
 #include "mongoose.h"
 
 #include <stdlib.h>
+#include <stdarg.h> // for va_list
+#include <inttypes.h> // for PRIu32
 #include <string.h> // for strlen and strcmp
 #include <stdint.h> // for uint32_t, uint64_t
+#include <pthread.h>
+#include <time.h> // for nanosleep
 #include <vips/vips.h>
+#include <json-c/json.h>
 
 // -- Constants --------------------------------------------------------
 
@@ -21,23 +32,89 @@
 #define LISTENING_ADDRESS "localhost:8000"
 #define ROOT "."
 #define POLL_PERIOD_MS 1000
-#define NB_HANDLERS 4
+#define FOLLOW_PERIOD_MS 100 // of a -follow server checking the changes of the writer
+#define MAX_THREADS 64 // event loops of -threads
+#define NB_HANDLERS 15
+#define MAX_UPLOADS 16 // number of images that can be streamed at the same time
+#define SESSION_BYTES 8 // random bytes of an upload session ID
+#define SESSION_ID_LEN (2 * SESSION_BYTES)
+#define UPLOADS_EXT ".uploads" // appended to the imgStore file name
 
 // HTTP Response codes
 #define HTTP_RESPONSE_CODE 200
 #define HTTP_RELOAD_CODE 302
+#define HTTP_NOT_MODIFIED_CODE 304
 #define HTTP_ERROR_CODE 500
 
 // For queries
 #define QUERY_LEN_RESOLUTION 9 // The maximum length of resolution options
 #define QUERY_LEN_OFFSET 10 // ciel(log_10(2^32))
+#define QUERY_LEN_DIM 10 // ciel(log_10(2^32))
+#define QUERY_LEN_SHA (2 * SHA256_DIGEST_LENGTH)
+
+// For the list JSON
+#define JSON_LIST_HEAD "{\"Images\":["
+#define JSON_LIST_TAIL_LEN 40 // "],\"after\":" + size_t + "}"
+#define JSON_ESCAPE_LEN 6 // "\\u001f"
+#define HTTP_HEADERS_LEN 128
+#define JSON_FMT_LEN 160 // longest formatted part of a manifest entry
+
+// ETags are the SHA of the original, with a suffix for WebP
+#define ETAG_WEBP_SUFFIX "-webp"
+#define ETAG_LEN (2 * SHA256_DIGEST_LENGTH + 7) // quotes and suffix
+
+// For batch reads
+#define MAX_BATCH_IDS 1024
+#define BATCH_BOUNDARY_BYTES 16 // random bytes of the multipart boundary
+#define BATCH_BOUNDARY_LEN (2 * BATCH_BOUNDARY_BYTES)
+#define BATCH_PART_HEADERS_LEN (BATCH_BOUNDARY_LEN + MAX_IMG_ID + ETAG_LEN + 128)
+#define MAX_BATCHES 16 // batch reads being streamed at the same time by an event loop
+#define BATCH_HIGH_WATER (4 << 20) // bytes queued for a client before reading more images
+
+// For exports
+#define MAX_EXPORTS 4 // archives being streamed at the same time by an event loop
+#define EXPORT_HIGH_WATER (4 << 20) // bytes queued for a client before reading more
+
+// For sprites
+#define SPRITE_DEFAULT_LIMIT 100 // thumbnails in a sprite, if not given
+#define SPRITE_MAX_LIMIT 400
+#define SPRITE_CACHE_SIZE 8 // sprites kept in memory
+
+// For metrics
+#define METRICS_BUCKETS_US {500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000}
+#define NB_METRICS_BUCKETS 12
+#define METRICS_READ_RES (NB_RES + 1) // the resolutions, and boxes
+#define METRICS_CACHE_LIST 0
+#define METRICS_CACHE_SPRITE 1
+#define METRICS_CACHE_ETAG 2 // conditional reads answered 304
+#define NB_METRICS_CACHES 3
+#define METRICS_CACHE_NAMES {"list", "sprite", "etag"}
+#define METRICS_LINE_LEN 256 // longest line of the metrics page
+
+// How a handler holds the imgStore
+#define STORE_UNLOCKED 0 // the handler takes it itself, if need be
+#define STORE_SHARED 1 // only reads it, alongside other readers
+#define STORE_EXCLUSIVE 2 // writes to it
 
 #define JPG_EXT 4 // strlen(".jpg")
+#define MEDIA_TYPE_WEBP "image/webp"
+#define QVALUE_LEN 5 // "0.125"
 #define ENCODE_URI_SCALE 4 // in index.html, encodeURIComponent may turn 1 character into 4
 
 // This seems like standard use for mongoose programmes.
 static const char* s_listening_address = LISTENING_ADDRESS;
 static const char* s_web_directory = ROOT;
+static size_t s_nb_threads = 1;
+
+// Media types of the FMT_ codes
+static const char* const s_media_types[NB_FMT] = {"image/jpeg", MEDIA_TYPE_WEBP};
+
+// Content codings of the ENC_ codes
+static const char* const s_encodings[NB_ENC] = ENC_NAMES;
+
+// Size buckets that w= and h= are snapped to
+static uint16_t s_buckets[MAX_VARIANT_BUCKETS] = DEF_VARIANT_BUCKETS;
+static size_t s_nb_buckets = DEF_NB_VARIANT_BUCKETS;
 
 // -- Macros -----------------------------------------------------------
 
@@ -78,6 +155,14 @@ typedef void (*handler)(struct mg_connection *nc, struct mg_http_message *hm,
 
 typedef struct handler_mapping handler_mapping;
 typedef struct data data;
+typedef struct upload upload;
+typedef struct upload_record upload_record;
+typedef struct list_cache list_cache;
+typedef struct sprite_entry sprite_entry;
+typedef struct export_stream export_stream;
+typedef struct batch_stream batch_stream;
+typedef struct metrics metrics;
+typedef struct metrics_text metrics_text;
 
 // -- Structs ----------------------------------------------------------
 
@@ -86,6 +171,7 @@ struct handler_mapping {
     const char* uri;
     const char* method;
     handler call;
+    int lock; // how the handler is called: one of the STORE_ modes
 };
 
 // This is intended to be passed to the event handler as fn_data
@@ -94,8 +180,186 @@ struct data {
     imgst_file* imgstfile;
 };
 
+// An image being streamed into the imgStore file by chunks
+struct upload {
+    char session[SESSION_ID_LEN + 1];
+    imgst_ingest ingest;
+    unsigned long last_active; // mg_millis() of the last chunk
+    int active;
+};
+
+// What is kept on disk of an upload, to resume it after a restart
+struct upload_record {
+    char session[SESSION_ID_LEN + 1]; // empty if the entry is free
+    char img_id[MAX_IMG_ID + 1];
+    uint64_t offset; // of the extent reserved in the imgStore file
+    uint64_t reserved;
+    uint64_t size; // bytes received
+};
+
+// The images being streamed
+static upload s_uploads[MAX_UPLOADS];
+
+// One upload_record per entry of s_uploads
+static FILE* s_uploads_file = NULL;
+
+// Binary access log, NULL unless -access_log was given
+static FILE* s_access_log = NULL;
+
+// The state of a -follow server, beside its read-only imgStore
+static imgst_follower s_follower;
+
+// The JSON of the whole list for one version of the imgStore,
+// in each content encoding (NULL until requested)
+struct list_cache {
+    uint32_t version;
+    char* body[NB_ENC];
+    size_t len[NB_ENC];
+};
+
+static list_cache s_list_cache;
+
+// The readers of the imgStore fill the list cache in turn
+static pthread_mutex_t s_list_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The sprite of a list page, for one version of the imgStore
+struct sprite_entry {
+    uint32_t version;
+    size_t from;
+    size_t limit;
+    unsigned long last_used; // mg_millis()
+    size_t* idx; // the slots of the page, NULL if the entry is free
+    size_t nb;
+    size_t next; // the slot starting the next page, max_files if none
+    sprite_cell* cells;
+    uint32_t dims[DIMS];
+    int laid_out; // whether cells and dims are known
+    void* image[NB_FMT]; // in each encoding, NULL until requested
+    size_t image_size[NB_FMT];
+    char* map; // the JSON of the cells, NULL until requested
+    size_t map_len;
+};
+
+static sprite_entry s_sprites[SPRITE_CACHE_SIZE];
+
+// The readers of the imgStore compose the sprites in turn
+static pthread_mutex_t s_sprites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// An archive of the imgStore being streamed to a client
+struct export_stream {
+    struct mg_connection* nc; // NULL if the entry is free
+    imgst_export export;
+};
+
+// Each event loop streams to its own connections
+static _Thread_local export_stream s_exports[MAX_EXPORTS];
+
+// The multipart reply of a batch read, passed to write_batch_part
+struct batch_reply {
+    struct mg_connection* nc;
+    char boundary[BATCH_BOUNDARY_LEN + 1];
+    int format;
+};
+
+// A batch read being streamed to a client
+struct batch_stream {
+    struct mg_connection* nc; // NULL if the entry is free
+    imgst_batch batch;
+    struct batch_reply reply;
+    char* body; // the imgIDs, which the batch points into
+};
+
+static _Thread_local batch_stream s_batches[MAX_BATCHES];
+
+// What the server did since it started, served by /metrics
+struct metrics {
+    uint64_t requests[NB_ACCESS];
+    uint64_t latency_buckets[NB_ACCESS][NB_METRICS_BUCKETS]; // not cumulative
+    uint64_t latency_sum_us[NB_ACCESS];
+    uint64_t errors[NB_ERR];
+    uint64_t read_bytes[METRICS_READ_RES];
+    uint64_t cache_hits[NB_METRICS_CACHES];
+    uint64_t cache_misses[NB_METRICS_CACHES];
+};
+
+static metrics s_metrics;
+
+// The event loops update s_metrics concurrently
+static pthread_mutex_t s_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Handlers that only read the imgStore run at once in the event loops,
+// those that write to it run alone
+static pthread_rwlock_t s_store_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// How the calling thread holds s_store_lock
+static _Thread_local int t_store_lock = STORE_UNLOCKED;
+
+// The metrics page being written
+struct metrics_text {
+    char* buf;
+    size_t len;
+    size_t cap;
+};
+
 // -- Functions --------------------------------------------------------
 
+/**
+ * Takes the imgStore for a handler, shared or to the calling thread alone;
+ * nothing for STORE_UNLOCKED.
+ */
+static void store_lock(int mode)
+{
+    if (mode == STORE_UNLOCKED) {
+        return;
+    }
+
+    if (mode == STORE_SHARED) {
+        pthread_rwlock_rdlock(&s_store_lock);
+    } else {
+        pthread_rwlock_wrlock(&s_store_lock);
+    }
+
+    t_store_lock = mode;
+}
+
+/**
+ * Gives the imgStore back, however the calling thread holds it.
+ */
+static void store_unlock(void)
+{
+    if (t_store_lock != STORE_UNLOCKED) {
+        pthread_rwlock_unlock(&s_store_lock);
+        t_store_lock = STORE_UNLOCKED;
+    }
+}
+
+/**
+ * Takes the imgStore to the calling thread alone, for a reader that has to
+ * write after all. Another writer may run in between: whatever was looked
+ * up under the shared lock must be looked up again.
+ */
+static void store_lock_exclusive(void)
+{
+    if (t_store_lock == STORE_SHARED) {
+        store_unlock();
+        store_lock(STORE_EXCLUSIVE);
+    }
+}
+
+/**
+ * Counts a lookup in one of the METRICS_CACHE_ caches.
+ */
+static void count_cache(int cache, int hit)
+{
+    pthread_mutex_lock(&s_metrics_lock);
+    if (hit) {
+        s_metrics.cache_hits[cache] += 1;
+    } else {
+        s_metrics.cache_misses[cache] += 1;
+    }
+    pthread_mutex_unlock(&s_metrics_lock);
+}
+
 /**
  * Produces a HTTP 302 reply in order to reload the page
  */
@@ -124,6 +388,9 @@ void mg_error_msg(struct mg_connection* nc, int error)
                  nc, ERR_INVALID_ARGUMENT);
 
     // Reply with error message
+    pthread_mutex_lock(&s_metrics_lock);
+    s_metrics.errors[error] += 1;
+    pthread_mutex_unlock(&s_metrics_lock);
     mg_http_reply(nc, HTTP_ERROR_CODE, NULL, "Error: %s\r\n", ERR_MESSAGES[error]);
 }
 
@@ -156,269 +423,2233 @@ char* get_var_from_query(struct mg_connection *nc, struct mg_http_message *hm,
 }
 
 /**
- * Produces an HTTP 200 reply listing an imgStore file as JSON
+ * Gives the quality of the parameters of a header entry, such as
+ * ";level=1;q=0.5": 1 if there is no q parameter.
  */
-void handle_list_call(struct mg_connection *nc, struct mg_http_message *hm _unused,
-                      imgst_file* imgstfile)
+static double entry_quality(struct mg_str params)
 {
-    // Invalid arguments
-    THROW_ERR_IF(nc == NULL || imgstfile == NULL,
-                 nc, ERR_INVALID_ARGUMENT);
-
-    char* store_list = do_list(imgstfile, JSON);
-    THROW_ERR_IF(store_list == NULL,
-                 nc, ERR_IO);
+    while (params.len > 0) {
+        const char* semicolon = memchr(params.ptr, ';', params.len);
+        const size_t len = (semicolon == NULL) ? params.len : (size_t)(semicolon - params.ptr);
+        const struct mg_str param = mg_strstrip(mg_str_n(params.ptr, len));
+
+        if (param.len >= 2 && (param.ptr[0] == 'q' || param.ptr[0] == 'Q') && param.ptr[1] == '=') {
+            char value[QVALUE_LEN + 1] = {0};
+            memcpy(value, param.ptr + 2, (param.len - 2 < QVALUE_LEN) ? param.len - 2 : QVALUE_LEN);
+            return strtod(value, NULL);
+        }
 
-    // If do_list worked, printf a HTTP reply with imgStore file as JSON
-    mg_printf(nc,
-              "HTTP/1.1 %d OK\r\n"
-              "Content-Type: application/json\r\n"
-              "Content-Length: %zu\r\n\r\n"
-              "%s", HTTP_RESPONSE_CODE, strlen(store_list), store_list);
+        params = (semicolon == NULL) ? mg_str_n(NULL, 0)
+                 : mg_str_n(semicolon + 1, params.len - len - 1);
+    }
 
-    free(store_list);
+    return 1.0;
 }
 
 /**
- * Produces an HTTP 200 reply for a read command. Given a resolution code
- * and an imgID for query keys, reads the image in the imgStore and creates
- * a resized version if it doesn't yet exist under the requested resolution.
+ * Tells whether a comma separated header of the request, such as Accept or
+ * Accept-Encoding, lists the given token, as a whole, with a non-zero quality.
  */
-void handle_read_call(struct mg_connection *nc, struct mg_http_message *hm,
-                      imgst_file* imgstfile)
+static int accepts(struct mg_http_message *hm, const char* header, const char* token)
 {
-    // Invalid arguments
-    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL,
-                 nc, ERR_INVALID_ARGUMENT);
+    const struct mg_str* value = mg_http_get_header(hm, header);
 
-    // Get res variable from http message query
-    char* res_str = get_var_from_query(nc, hm, "res", QUERY_LEN_RESOLUTION);
+    if (value == NULL) {
+        return 0;
+    }
 
-    if (res_str == NULL) return; // error sent in get_var
+    // Loop over the comma separated entries
+    struct mg_str rest = *value;
+    const size_t token_len = strlen(token);
 
-    const int res = resolution_atoi(res_str);
-    THROW_ERR_IF_DO(res == NOT_RES,
-                    FREE_DEREF(res_str),
-                    nc, ERR_RESOLUTIONS);
-    FREE_DEREF(res_str);
+    while (rest.len > 0) {
+        const char* comma = memchr(rest.ptr, ',', rest.len);
+        const size_t len = (comma == NULL) ? rest.len : (size_t)(comma - rest.ptr);
+        const struct mg_str entry = mg_strstrip(mg_str_n(rest.ptr, len));
 
-    // Get img_id variable from http message query
-    char* img_id = get_var_from_query(nc, hm, "img_id", MAX_IMG_ID);
+        // The token may be followed by parameters such as ";q=0.5"
+        const char* semicolon = memchr(entry.ptr, ';', entry.len);
+        const struct mg_str name = (semicolon == NULL) ? entry
+                                   : mg_strstrip(mg_str_n(entry.ptr, (size_t)(semicolon - entry.ptr)));
 
-    if (img_id == NULL) return; // error sent in get_var
+        if (name.len == token_len && !mg_ncasecmp(name.ptr, token, token_len)) {
+            // ";q=0" explicitly refuses the token
+            return semicolon == NULL
+                   || entry_quality(mg_str_n(semicolon + 1, entry.len - (size_t)(semicolon + 1 - entry.ptr))) > 0.0;
+        }
 
-    THROW_ERR_IF_DO(strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID,
-                    FREE_DEREF(img_id),
-                    nc, ERR_INVALID_IMGID);
+        rest = (comma == NULL) ? mg_str_n(NULL, 0)
+               : mg_str_n(comma + 1, rest.len - len - 1);
+    }
 
+    return 0;
+}
 
-    // Read image into buffer
-    char* image_buffer = NULL;
-    uint32_t image_size = 0;
-    THROW_IF_CALL_FAILS_DO(do_read(img_id, res, &image_buffer, &image_size, imgstfile),
-                           FREE_DEREF(img_id), nc);
+/**
+ * Picks the encoding of a read reply from the Accept header of the request:
+ * WebP if the client lists it (with a non-zero quality), JPEG otherwise.
+ */
+static int negotiate_format(struct mg_http_message *hm)
+{
+    return accepts(hm, "Accept", MEDIA_TYPE_WEBP) ? FMT_WEBP : FMT_JPEG;
+}
 
-    // Free img_id
-    FREE_DEREF(img_id);
+/**
+ * Picks the content encoding of a reply from the Accept-Encoding header of
+ * the request: the first one of the ENC_ codes that the client lists.
+ */
+static int negotiate_encoding(struct mg_http_message *hm)
+{
+    for (int encoding = ENC_IDENTITY + 1; encoding < NB_ENC; ++encoding) {
+        if (accepts(hm, "Accept-Encoding", s_encodings[encoding])) {
+            return encoding;
+        }
+    }
 
-    // Formatted HTTP reply with imgStore file as JSON
-    mg_printf(nc,
-              "HTTP/1.1 %d OK\r\n"
-              "Content-Type: image/jpeg\r\n"
-              "Content-Length: %zu\r\n\r\n", HTTP_RESPONSE_CODE, (size_t) image_size);
+    return ENC_IDENTITY;
+}
 
+/**
+ * Writes a JSON string to out, or only counts its bytes if out is NULL.
+ * Returns the number of bytes.
+ */
+static size_t json_write_string(char* out, const char* str)
+{
+    size_t len = 0;
+    const char* run = str; // characters that need no escaping are copied at once
 
-    // Send the image to the server!
-    THROW_ERR_IF_DO(mg_send(nc, image_buffer, (size_t) image_size) != (int) image_size,
-                    FREE_DEREF(image_buffer),
-                    nc, ERR_IO);
+    if (out != NULL) out[len] = '"';
+    len += 1;
 
-    // Free rest
-    FREE_DEREF(image_buffer);
+    for (const char* c = str; ; ++c) {
+        const unsigned char u = (unsigned char) *c;
+
+        if (u != '\0' && u != '"' && u != '\\' && u >= 0x20) {
+            continue;
+        }
+
+        if (out != NULL) memcpy(out + len, run, (size_t)(c - run));
+        len += (size_t)(c - run);
+
+        if (u == '\0') {
+            break;
+        }
+
+        char escaped[JSON_ESCAPE_LEN + 1];
+        const int n = (u == '"' || u == '\\') ? snprintf(escaped, sizeof(escaped), "\\%c", u)
+                      : snprintf(escaped, sizeof(escaped), "\\u%04x", u);
+
+        if (out != NULL) memcpy(out + len, escaped, (size_t) n);
+        len += (size_t) n;
+        run = c + 1;
+    }
+
+    if (out != NULL) out[len] = '"';
+
+    return len + 1;
 }
 
 /**
- * Produces an HTTP 200 reply for a delete command. Given an imgID for a
- * query key, deletes the image from the imgStore file.
+ * Returns where to write after len bytes of out, NULL if only counting.
  */
-void handle_delete_call(struct mg_connection *nc, struct mg_http_message *hm,
-                        imgst_file* imgstfile)
+static char* json_at(char* out, size_t len)
 {
-    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL,
-                 nc, ERR_INVALID_ARGUMENT);
-
-    // Get imgID from http message query
-    char* img_id = get_var_from_query(nc, hm, "img_id", MAX_IMG_ID);
+    return out == NULL ? NULL : out + len;
+}
 
-    if (img_id == NULL) return; // error sent in get_var
+/**
+ * Writes formatted JSON of at most JSON_FMT_LEN bytes to out, or only counts
+ * its bytes if out is NULL. Returns the number of bytes.
+ */
+static size_t json_write_fmt(char* out, const char* fmt, ...)
+{
+    char buffer[JSON_FMT_LEN + 1];
 
+    va_list args;
+    va_start(args, fmt);
+    const int n = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
 
-    // Delete the image from the imgStore file
-    THROW_IF_CALL_FAILS_DO(do_delete(img_id, imgstfile),
-                           FREE_DEREF(img_id),
-                           nc);
+    const size_t len = (n < 0) ? 0 : (n > JSON_FMT_LEN) ? JSON_FMT_LEN : (size_t) n;
 
-    // If do_delete went well, reload page.
-    mg_reload_msg(nc);
+    if (out != NULL) memcpy(out, buffer, len);
 
-    // Free rest
-    FREE_DEREF(img_id);
+    return len;
 }
 
 /**
- * Produces an HTTP 200 reply for the insert command. Allows for the insertion
- * of an image into the imgStore file in a 2-phase strategy. First the image
- * is chunked and temporarily stored and then the image is inserted.
+ * Formats the ETag of an image in the given format. The content of every
+ * resolution derives from the original, so its SHA identifies them all.
  */
-void handle_insert_call(struct mg_connection *nc, struct mg_http_message *hm,
-                        imgst_file* imgstfile)
+static void format_etag(char* etag, const unsigned char* sha, int format)
 {
-    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL,
-                 nc, ERR_INVALID_ARGUMENT);
+    char sha_str[2 * SHA256_DIGEST_LENGTH + 1];
+    sha_to_string(sha, sha_str);
+    snprintf(etag, ETAG_LEN + 1, "\"%s%s\"", sha_str, format == FMT_JPEG ? "" : ETAG_WEBP_SUFFIX);
+}
 
-    // Make sure there is enough space
-    THROW_ERR_IF(imgstfile->header.num_files >= imgstfile->header.max_files,
-                 nc, ERR_FULL_IMGSTORE);
+// Writes an entry of a list, or only counts its bytes if out is NULL
+typedef size_t (*entry_writer)(char* out, size_t idx, const img_metadata* metadata,
+                               const imgst_file* imgstfile);
+
+// Passed to do_list_page by write_list
+struct list_writer {
+    char* out; // NULL to only count bytes
+    size_t len;
+    size_t last; // slot of the last listed image
+    const imgst_file* imgstfile;
+    entry_writer entry;
+    list_filter filter;
+    const void* filter_arg;
+};
 
-    // Mode 1: chunk uploading
-    if (hm->body.len != 0) {
+/**
+ * Writes the JSON string of the imgID of an image.
+ */
+static size_t write_id_entry(char* out, size_t idx _unused, const img_metadata* metadata,
+                             const imgst_file* imgstfile _unused)
+{
+    return json_write_string(out, metadata->img_id);
+}
 
-        // Simply upload the chunk
-        THROW_ERR_IF(mg_http_upload(nc, hm, "/tmp") != (int) hm->body.len,
-                     nc, ERR_IO);
+/**
+ * Writes the JSON object describing an image in a manifest.
+ */
+static size_t write_manifest_entry(char* out, size_t idx, const img_metadata* m,
+                                   const imgst_file* imgstfile)
+{
+    char etag[ETAG_LEN + 1];
+    format_etag(etag, m->SHA, FMT_JPEG);
+
+    size_t len = json_write_fmt(out, "{\"img_id\":");
+    len += json_write_string(json_at(out, len), m->img_id);
+
+    // Sizes and existence of each resolution, indexed by RES_ codes
+    len += json_write_fmt(json_at(out, len),
+                          ",\"res_orig\":[%" PRIu32 ",%" PRIu32 "]"
+                          ",\"size\":[%" PRIu32 ",%" PRIu32 ",%" PRIu32 "]"
+                          ",\"exists\":[%s,%s,%s],\"etag\":",
+                          m->res_orig[0], m->res_orig[1],
+                          m->size[RES_THUMB], m->size[RES_SMALL], m->size[RES_ORIG],
+                          m->offset[RES_THUMB] != 0 ? "true" : "false",
+                          m->offset[RES_SMALL] != 0 ? "true" : "false",
+                          m->offset[RES_ORIG] != 0 ? "true" : "false");
+    len += json_write_string(json_at(out, len), etag);
+
+    // The arbitrary-size variants
+    len += json_write_fmt(json_at(out, len), ",\"variants\":[");
+
+    const variant_table* t = imgstfile->variants;
+    int first = 1;
+
+    for (uint32_t i = (t == NULL) ? NO_VARIANT : t->head[idx]; i != NO_VARIANT; i = t->next[i]) {
+        const img_variant* v = &t->records[i];
+
+        // Records left by a previous image in the same slot
+        if (memcmp(v->SHA, m->SHA, SHA256_DIGEST_LENGTH)) {
+            continue;
+        }
 
-        // Mode 2: image insertion
+        len += json_write_fmt(json_at(out, len),
+                              "%s{\"box\":[%" PRIu16 ",%" PRIu16 "],\"format\":\"%s\",\"size\":%" PRIu32 "}",
+                              first ? "" : ",", v->box[0], v->box[1], s_media_types[v->format], v->size);
+        first = 0;
+    }
 
-    } else {
+    return len + json_write_fmt(json_at(out, len), "]}");
+}
 
-        // Get chunk offset. Image size at most 2^32. The offset need not be larger.
-        char* offset_str = get_var_from_query(nc, hm, "offset", QUERY_LEN_OFFSET);
+/**
+ * Writes an entry of the JSON array of a list page.
+ */
+static void write_list_entry(size_t idx, const img_metadata* metadata, void* arg)
+{
+    struct list_writer* w = arg;
 
-        if (offset_str == NULL) return; // error sent get_var
+    if (w->last != SIZE_MAX) {
+        if (w->out != NULL) w->out[w->len] = ',';
+        w->len += 1;
+    }
 
-        uint32_t offset = atouint32(offset_str);
-        FREE_DEREF(offset_str);
+    w->len += w->entry(json_at(w->out, w->len), idx, metadata, w->imgstfile);
+    w->last = idx;
+}
 
-        // Get jpg image file name, scaling for encoding and leaving space for .jpg extension.
-        size_t name_len = ENCODE_URI_SCALE * MAX_IMG_ID + JPG_EXT;
-        char* img_id = get_var_from_query(nc, hm, "name", name_len);
+/**
+ * Passes the filter of a list writer on to do_list_page.
+ */
+static int filter_list_entry(const img_metadata* metadata, const void* arg)
+{
+    const struct list_writer* w = arg;
+    return w->filter == NULL || w->filter(metadata, w->filter_arg);
+}
 
-        if (img_id == NULL) return; // error sent in get_var
+/**
+ * Writes the JSON of a list page to out, or only counts its bytes if out is
+ * NULL. Returns the number of bytes. The writer gives the entries to write.
+ */
+static size_t write_list(char* out, size_t from, size_t limit, struct list_writer w)
+{
+    const size_t head_len = strlen(JSON_LIST_HEAD);
 
-        THROW_ERR_IF_DO(strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID,
-                        FREE_DEREF(img_id),
-                        nc, ERR_INVALID_IMGID);
+    if (out != NULL) memcpy(out, JSON_LIST_HEAD, head_len);
 
-        // Read the temporary image.
-        void* image_buffer = calloc(1, offset);
+    w.out = json_at(out, head_len);
+    w.len = 0;
+    w.last = SIZE_MAX;
+    const size_t next = do_list_page(w.imgstfile, from, limit, filter_list_entry, write_list_entry, &w);
 
-        if (image_buffer == NULL) {
-            FREE_DEREF(img_id);
-            mg_error_msg(nc, ERR_OUT_OF_MEMORY); return;
-        }
+    // The cursor of the next page, if any
+    char tail[JSON_LIST_TAIL_LEN + 1] = "]}";
 
-        // Concatenate to get path /tmp/img_id
-        char* filename = malloc(strlen("/tmp/") + name_len + 1);
-        filename[0] = '\0';
-        strcat(filename, "/tmp/");
-        strcat(filename, img_id);
+    if (next < w.imgstfile->header.max_files) {
+        snprintf(tail, sizeof(tail), "],\"after\":%zu}", w.last);
+    }
 
-        // Open the image file and read it into the buffer
-        FILE* image_file = fopen(filename, "rb");
-        THROW_ERR_IF_DO(image_file == NULL,
-                        FREE_DEREF(filename); FREE_DEREF(img_id); FREE_DEREF(image_buffer),
-                        nc, ERR_IO);
+    if (out != NULL) memcpy(out + head_len + w.len, tail, strlen(tail));
 
-        THROW_ERR_IF_DO(fread(image_buffer, offset, 1, image_file) != 1,
-                        fclose(image_file);
-                        FREE_DEREF(filename); FREE_DEREF(img_id); FREE_DEREF(image_buffer),
-                        nc, ERR_IO);
+    return head_len + w.len + strlen(tail);
+}
 
-        // Insert the image into the imgStore
-        THROW_IF_CALL_FAILS_DO(do_insert(image_buffer, offset, img_id, imgstfile),
-                               fclose(image_file);
-                               FREE_DEREF(filename); FREE_DEREF(img_id); FREE_DEREF(image_buffer),
-                               nc);
+/**
+ * Reads the optional limit and after query keys of a list request.
+ */
+static int get_page_from_query(struct mg_http_message *hm, size_t* limit, size_t* from)
+{
+    char query[QUERY_LEN_OFFSET + 1] = {0};
+    *limit = 0;
+    *from = 0;
 
-        // If do_insert went well, reload page.
-        mg_reload_msg(nc);
+    if (mg_http_get_var(&(hm->query), "limit", query, sizeof(query)) > 0) {
+        *limit = atouint32(query);
+        M_EXIT_IF(*limit == 0, ERR_INVALID_ARGUMENT, "invalid limit %s", query);
+    }
 
-        // Free and close rest
-        fclose(image_file);
-        FREE_DEREF(filename);
-        FREE_DEREF(img_id);
-        FREE_DEREF(image_buffer);
+    if (mg_http_get_var(&(hm->query), "after", query, sizeof(query)) > 0) {
+        const uint32_t after = atouint32(query);
+        M_EXIT_IF(after == 0 && strcmp(query, "0"), ERR_INVALID_ARGUMENT, "invalid cursor %s", query);
+        *from = (size_t) after + 1;
     }
+
+    return ERR_NONE;
 }
 
+/**
+ * Replies with a list page, written straight into the connection buffer,
+ * which is sized once by a first pass counting its bytes.
+ */
+static void mg_list_msg(struct mg_connection* nc, size_t from, size_t limit, const struct list_writer* w)
+{
+    // First pass: count the bytes of the page
+    const size_t body_len = write_list(NULL, from, limit, *w);
+
+    char headers[HTTP_HEADERS_LEN + 1];
+    const int headers_len = snprintf(headers, sizeof(headers),
+                                     "HTTP/1.1 %d OK\r\n"
+                                     "Content-Type: application/json\r\n"
+                                     "Content-Length: %zu\r\n\r\n",
+                                     HTTP_RESPONSE_CODE, body_len);
+
+    // Second pass: write the page into the connection buffer. Not with
+    // mg_send, which resizes the buffer to what it appends
+    mg_iobuf_resize(&(nc->send), nc->send.len + (size_t) headers_len + body_len);
+    THROW_ERR_IF(nc->send.size < nc->send.len + (size_t) headers_len + body_len,
+                 nc, ERR_OUT_OF_MEMORY);
+
+    memcpy(nc->send.buf + nc->send.len, headers, (size_t) headers_len);
+    nc->send.len += (size_t) headers_len;
+    write_list((char*) nc->send.buf + nc->send.len, from, limit, *w);
+    nc->send.len += body_len;
+}
 
 /**
- * Attempts to serve the HTTP message with an appropriate handler.
+ * Returns the unpaginated list in the given encoding, serializing and
+ * compressing it only if the imgStore changed since it was last requested.
+ * Falls back to the identity encoding if compression fails.
  */
-static void imgst_event_handler(struct mg_connection *nc,
-                                int ev,
-                                void *ev_data,
-                                void *fn_data)
+static int get_cached_list(int* encoding, const char** body, size_t* len,
+                           const imgst_file* imgstfile)
 {
-    // If the event is of type HTTP message
-    if (ev == MG_EV_HTTP_MSG) {
-        struct mg_http_message *hm = (struct mg_http_message*) ev_data;
-        data* d = (data*) fn_data;
-        imgst_file* imgstfile = d->imgstfile;
-        const handler_mapping* handlers = d->handlers;
+    list_cache* c = &s_list_cache;
 
-        // Search for a handler
-        int found = 0;
+    // Drop what was cached for another version
+    if (c->version != imgstfile->header.imgst_version || c->body[ENC_IDENTITY] == NULL) {
+        count_cache(METRICS_CACHE_LIST, 0);
 
-        for (size_t i = 0; i < NB_HANDLERS; ++i) {
+        for (size_t i = 0; i < NB_ENC; ++i) {
+            FREE_DEREF(c->body[i]);
+        }
 
-            // The URI and the method type should match
-            const char* method = handlers[i].method;
+        const struct list_writer w = {
+            .imgstfile = imgstfile, .entry = write_id_entry
+        };
 
-            if (mg_http_match_uri(hm, handlers[i].uri)
-                && mg_globmatch(method, strlen(method), hm->method.ptr, hm->method.len)) {
+        c->len[ENC_IDENTITY] = write_list(NULL, 0, 0, w);
+        M_EXIT_IF_NULL(c->body[ENC_IDENTITY] = malloc(c->len[ENC_IDENTITY]), c->len[ENC_IDENTITY]);
+        write_list(c->body[ENC_IDENTITY], 0, 0, w);
+        c->version = imgstfile->header.imgst_version;
+    } else {
+        count_cache(METRICS_CACHE_LIST, 1);
+    }
 
-                handlers[i].call(nc, hm, imgstfile);
-                found = 1;
-            }
-        }
+    if (c->body[*encoding] == NULL
+        && compress_buffer(*encoding, c->body[ENC_IDENTITY], c->len[ENC_IDENTITY],
+                           &c->body[*encoding], &c->len[*encoding]) != ERR_NONE) {
+        *encoding = ENC_IDENTITY;
+    }
 
-        // If no handlers were found, just return static data.
-        if (!found) {
+    *body = c->body[*encoding];
+    *len = c->len[*encoding];
 
-            // No SSI file name pattern, no extra HTTP headers
-            struct mg_http_serve_opts opts = {.root_dir = s_web_directory};
-            mg_http_serve_dir(nc, ev_data, &opts);
-        }
-    }
+    return ERR_NONE;
 }
 
-int main(int argc, char *argv[])
+/**
+ * Produces an HTTP 200 reply listing an imgStore file as JSON. The optional
+ * limit and after query keys give the size of the page and the cursor where
+ * it starts. If there are more images, the reply has the cursor of the next
+ * page, e.g. {"Images": ["pic1", "pic2"], "after": 2}.
+ *
+ * Pages are written straight into the connection buffer, which is sized
+ * once by a first pass counting their bytes. The whole list is cached for
+ * the current version of the imgStore, compressed with the preferred
+ * encoding of the Accept-Encoding header.
+ */
+void handle_list_call(struct mg_connection *nc, struct mg_http_message *hm,
+                      imgst_file* imgstfile)
 {
-    // VIPS_INIT
-    if (VIPS_INIT(argv[0])) {
-        vips_error_exit("unable to start VIPS");
-        return ERR_IMGLIB;
+    // Invalid arguments
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL || imgstfile->metadata == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+
+    // Optional page size and cursor
+    size_t limit = 0, from = 0;
+    THROW_IF_CALL_FAILS_DO(get_page_from_query(hm, &limit, &from), , nc);
+
+    // The whole list, from the cache
+    if (limit == 0 && from == 0) {
+        int encoding = negotiate_encoding(hm);
+        const char* body = NULL;
+        size_t body_len = 0;
+
+        // The body stays in the cache until it is copied to the connection
+        pthread_mutex_lock(&s_list_cache_lock);
+        THROW_IF_CALL_FAILS_DO(get_cached_list(&encoding, &body, &body_len, imgstfile),
+                               pthread_mutex_unlock(&s_list_cache_lock), nc);
+
+        mg_printf(nc,
+                  "HTTP/1.1 %d OK\r\n"
+                  "Content-Type: application/json\r\n"
+                  "%s%s%s"
+                  "Vary: Accept-Encoding\r\n"
+                  "Content-Length: %zu\r\n\r\n", HTTP_RESPONSE_CODE,
+                  encoding == ENC_IDENTITY ? "" : "Content-Encoding: ",
+                  encoding == ENC_IDENTITY ? "" : s_encodings[encoding],
+                  encoding == ENC_IDENTITY ? "" : "\r\n", body_len);
+        mg_send(nc, body, body_len);
+        pthread_mutex_unlock(&s_list_cache_lock);
+
+        return;
     }
 
-    IF_ERR_PRINT_EXIT(argc < MIN_SERVER_ARGS, ERR_NOT_ENOUGH_ARGUMENTS);
+    const struct list_writer w = {
+        .imgstfile = imgstfile, .entry = write_id_entry
+    };
+    mg_list_msg(nc, from, limit, &w);
+}
 
-    argc--; argv++; // skips command call name
+// Bounds of the images listed in a manifest, inclusive
+struct manifest_filter {
+    uint32_t min_res[2];
+    uint32_t max_res[2];
+    uint32_t min_size;
+    uint32_t max_size;
+};
+
+/**
+ * Tells whether an image is within the bounds of a manifest filter.
+ */
+static int filter_manifest_entry(const img_metadata* m, const void* arg)
+{
+    const struct manifest_filter* f = arg;
+
+    return f->min_res[0] <= m->res_orig[0] && m->res_orig[0] <= f->max_res[0]
+           && f->min_res[1] <= m->res_orig[1] && m->res_orig[1] <= f->max_res[1]
+           && f->min_size <= m->size[RES_ORIG] && m->size[RES_ORIG] <= f->max_size;
+}
+
+/**
+ * Reads an optional unsigned bound of the http message query, leaving it
+ * unchanged if absent.
+ */
+static int get_bound_from_query(struct mg_http_message *hm, const char* key, uint32_t* bound)
+{
+    char query[QUERY_LEN_OFFSET + 1] = {0};
+
+    if (mg_http_get_var(&(hm->query), key, query, sizeof(query)) > 0) {
+        *bound = atouint32(query);
+        M_EXIT_IF(*bound == 0 && strcmp(query, "0"), ERR_INVALID_ARGUMENT,
+                  "invalid %s", key);
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Produces an HTTP 200 reply with the manifest of an imgStore file: for
+ * each valid image, its original resolution, the size and existence of
+ * each resolution (indexed by RES_ codes), its ETag and its variants, e.g.
+ * {"Images": [{"img_id": "pic1", "res_orig": [1200, 800],
+ *   "size": [2415, 12000, 72876], "exists": [true, true, true],
+ *   "etag": "\"66ac...\"", "variants": [{"box": [300, 0],
+ *   "format": "image/webp", "size": 9876}]}]}
+ *
+ * The images may be filtered by original width, height and size with the
+ * min_width, max_width, min_height, max_height, min_size and max_size query
+ * keys, and paged like the list.
+ */
+void handle_manifest_call(struct mg_connection *nc, struct mg_http_message *hm,
+                          imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL || imgstfile->metadata == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+
+    size_t limit = 0, from = 0;
+    THROW_IF_CALL_FAILS_DO(get_page_from_query(hm, &limit, &from), , nc);
+
+    struct manifest_filter f = {
+        {0, 0}, {UINT32_MAX, UINT32_MAX}, 0, UINT32_MAX
+    };
+
+    THROW_IF_CALL_FAILS_DO(get_bound_from_query(hm, "min_width", &f.min_res[0]), , nc);
+    THROW_IF_CALL_FAILS_DO(get_bound_from_query(hm, "max_width", &f.max_res[0]), , nc);
+    THROW_IF_CALL_FAILS_DO(get_bound_from_query(hm, "min_height", &f.min_res[1]), , nc);
+    THROW_IF_CALL_FAILS_DO(get_bound_from_query(hm, "max_height", &f.max_res[1]), , nc);
+    THROW_IF_CALL_FAILS_DO(get_bound_from_query(hm, "min_size", &f.min_size), , nc);
+    THROW_IF_CALL_FAILS_DO(get_bound_from_query(hm, "max_size", &f.max_size), , nc);
+
+    const struct list_writer w = {
+        .imgstfile = imgstfile, .entry = write_manifest_entry,
+        .filter = filter_manifest_entry, .filter_arg = &f
+    };
+    mg_list_msg(nc, from, limit, &w);
+}
+
+/**
+ * Returns the bucket for an optional dimension (w= or h=) of the http message
+ * query: 0 if absent, NOT_RES if invalid.
+ */
+static int get_dim_from_query(struct mg_http_message *hm, const char* key)
+{
+    char dim_str[QUERY_LEN_DIM + 1] = {0};
+
+    if (mg_http_get_var(&(hm->query), key, dim_str, sizeof(dim_str)) <= 0) {
+        return 0;
+    }
+
+    const uint32_t dim = atouint32(dim_str);
+
+    return (dim == 0) ? NOT_RES : snap_to_bucket(dim, s_buckets, s_nb_buckets);
+}
+
+/**
+ * Reads the size of the images to read from the http message query: a box
+ * given by w= and/or h=, snapped to the size buckets, or a resolution code
+ * given by res= otherwise.
+ */
+static int get_size_from_query(struct mg_http_message *hm, uint16_t box[DIMS], int* res)
+{
+    // Get optional w and h variables from http message query
+    const int width = get_dim_from_query(hm, "w");
+    const int height = get_dim_from_query(hm, "h");
+    M_EXIT_IF(width == NOT_RES || height == NOT_RES, ERR_RESOLUTIONS, "invalid box", );
+
+    box[0] = (uint16_t) width;
+    box[1] = (uint16_t) height;
+
+    if (width != 0 || height != 0) {
+        return ERR_NONE;
+    }
+
+    // Get res variable from http message query, unless a size was given
+    char res_str[QUERY_LEN_RESOLUTION + 1] = {0};
+    M_EXIT_IF(mg_http_get_var(&(hm->query), "res", res_str, sizeof(res_str)) <= 0,
+              ERR_INVALID_ARGUMENT, "no resolution", );
+
+    *res = resolution_atoi(res_str);
+    M_EXIT_IF(*res == NOT_RES, ERR_RESOLUTIONS, "invalid resolution %s", res_str);
+
+    return ERR_NONE;
+}
+
+/**
+ * Gives the Vary header of an image reply: only a negotiated format varies.
+ */
+static const char* vary_header(int negotiated)
+{
+    return negotiated ? "Vary: Accept\r\n" : "";
+}
+
+/**
+ * Replies 304 if the client already has the content of the ETag.
+ *
+ * @return Whether it replied
+ */
+static int reply_not_modified(struct mg_connection *nc, struct mg_http_message *hm, const char* etag,
+                              int negotiated)
+{
+    const struct mg_str* if_none_match = mg_http_get_header(hm, "If-None-Match");
+
+    if (if_none_match == NULL) {
+        return 0;
+    }
+
+    const int hit = mg_strstr(*if_none_match, mg_str(etag)) != NULL;
+    count_cache(METRICS_CACHE_ETAG, hit);
+
+    if (hit) {
+        mg_printf(nc,
+                  "HTTP/1.1 %d Not Modified\r\n"
+                  "ETag: %s\r\n"
+                  "%s\r\n", HTTP_NOT_MODIFIED_CODE, etag, vary_header(negotiated));
+    }
+
+    return hit;
+}
+
+/**
+ * Replies with an image, and frees it.
+ */
+static void reply_image(struct mg_connection *nc, int format, int negotiated, const char* etag,
+                        char* image_buffer, uint32_t image_size)
+{
+    // Formatted HTTP reply with the image. The same URI may be answered
+    // with another encoding depending on the Accept header, unless it is
+    // an original.
+    mg_printf(nc,
+              "HTTP/1.1 %d OK\r\n"
+              "Content-Type: %s\r\n"
+              "ETag: %s\r\n"
+              "%s"
+              "Content-Length: %zu\r\n\r\n", HTTP_RESPONSE_CODE,
+              s_media_types[format], etag, vary_header(negotiated), (size_t) image_size);
+
+
+    // Send the image to the server!
+    THROW_ERR_IF_DO(mg_send(nc, image_buffer, (size_t) image_size) != (int) image_size,
+                    FREE_DEREF(image_buffer),
+                    nc, ERR_IO);
+
+    // Free rest
+    FREE_DEREF(image_buffer);
+}
+
+/**
+ * Produces an HTTP 200 reply for a read command. Given a resolution code
+ * and an imgID for query keys, reads the image in the imgStore and creates
+ * a resized version if it doesn't yet exist under the requested resolution.
+ * Given w= and/or h= instead of a resolution code, the image is resized into
+ * the box of the nearest size buckets. Resized images are encoded in WebP
+ * if the Accept header of the request allows it.
+ *
+ * Images already stored in JPEG at the resolution are read from a copy of
+ * their metadata, without waiting for inserts and deletes; other reads share
+ * the imgStore with the other readers, or have it alone to render.
+ */
+void handle_read_call(struct mg_connection *nc, struct mg_http_message *hm,
+                      imgst_file* imgstfile)
+{
+    // Invalid arguments
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+
+    // Get the size to read
+    uint16_t box[DIMS] = {0, 0};
+    int res = RES_ORIG;
+    THROW_IF_CALL_FAILS_DO(get_size_from_query(hm, box, &res), , nc);
+
+    const int sized = box[0] != 0 || box[1] != 0;
+
+    // Get img_id variable from http message query
+    char* img_id = get_var_from_query(nc, hm, "img_id", MAX_IMG_ID);
+
+    if (img_id == NULL) return; // error sent in get_var
+
+    THROW_ERR_IF_DO(strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID,
+                    FREE_DEREF(img_id),
+                    nc, ERR_INVALID_IMGID);
+
+
+    // Originals are always sent as stored
+    const int negotiated = sized || res != RES_ORIG;
+    const int format = negotiated ? negotiate_format(hm) : FMT_JPEG;
+
+    char etag[ETAG_LEN + 1];
+    char* image_buffer = NULL;
+    uint32_t image_size = 0;
+
+    // Without any lock, unless the image has yet to be resized
+    if (!sized && format == FMT_JPEG) {
+        img_metadata copy;
+        THROW_IF_CALL_FAILS_DO(read_slot(img_id, &copy, imgstfile),
+                               FREE_DEREF(img_id), nc);
+
+        if (copy.offset[res] != INIT_OFFSET) {
+            FREE_DEREF(img_id);
+            format_etag(etag, copy.SHA, format);
+
+            if (reply_not_modified(nc, hm, etag, negotiated)) return;
+
+            THROW_IF_CALL_FAILS_DO(read_slot_content(&copy, res, &image_buffer, &image_size, imgstfile), , nc);
+            reply_image(nc, format, negotiated, etag, image_buffer, image_size);
+            return;
+        }
+    }
+
+    // Rendering writes to the imgStore
+    store_lock(STORE_SHARED);
+
+    if (read_needs_render(img_id, sized ? box : NULL, res, format, imgstfile)) {
+        store_lock_exclusive();
+    }
+
+    // Nothing to send if the client has the same content
+    size_t idx = 0;
+    THROW_IF_CALL_FAILS_DO(findMetadataIndex(&idx, img_id, imgstfile),
+                           FREE_DEREF(img_id), nc);
+
+    format_etag(etag, imgstfile->metadata[idx].SHA, format);
+
+    if (reply_not_modified(nc, hm, etag, negotiated)) {
+        FREE_DEREF(img_id);
+        return;
+    }
+
+    // Read image into buffer
+    if (sized) {
+        THROW_IF_CALL_FAILS_DO(do_read_variant(img_id, box[0], box[1], format,
+                                               &image_buffer, &image_size, imgstfile),
+                               FREE_DEREF(img_id), nc);
+    } else {
+        THROW_IF_CALL_FAILS_DO(do_read_format(img_id, res, format, &image_buffer, &image_size, imgstfile),
+                               FREE_DEREF(img_id), nc);
+    }
+
+    // Free img_id
+    FREE_DEREF(img_id);
+
+    reply_image(nc, format, negotiated, etag, image_buffer, image_size);
+}
+
+/**
+ * Writes one image of a batch read as a part of the multipart reply, in a
+ * chunk of its own.
+ */
+static void write_batch_part(const char* img_id, int err, const char* image_buffer,
+                             uint32_t image_size, const img_metadata* metadata, void* arg)
+{
+    const struct batch_reply* r = arg;
+    char headers[BATCH_PART_HEADERS_LEN + 1];
+    int len = 0;
+
+    // Images that cannot be read get a part with the error message
+    if (err != ERR_NONE) {
+        image_buffer = ERR_MESSAGES[err];
+        image_size = (uint32_t) strlen(ERR_MESSAGES[err]);
+        len = snprintf(headers, sizeof(headers),
+                       "--%s\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-ID: <%s>\r\n"
+                       "Content-Length: %" PRIu32 "\r\n\r\n",
+                       r->boundary, img_id, image_size);
+    } else {
+        char etag[ETAG_LEN + 1];
+        format_etag(etag, metadata->SHA, r->format);
+        len = snprintf(headers, sizeof(headers),
+                       "--%s\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-ID: <%s>\r\n"
+                       "ETag: %s\r\n"
+                       "Content-Length: %" PRIu32 "\r\n\r\n",
+                       r->boundary, s_media_types[r->format], img_id, etag, image_size);
+    }
+
+    mg_printf(r->nc, "%zx\r\n", (size_t) len + image_size + 2);
+    mg_send(r->nc, headers, (size_t) len);
+    mg_send(r->nc, image_buffer, image_size);
+    mg_send(r->nc, "\r\n\r\n", 4); // ends the part, then the chunk
+}
+
+/**
+ * Releases a batch entry.
+ */
+static void end_batch(batch_stream* b)
+{
+    do_read_batch_end(&b->batch);
+    FREE_DEREF(b->body);
+    b->nc = NULL;
+}
+
+/**
+ * Returns the batch read streamed to a connection, NULL if there is none.
+ */
+static batch_stream* find_batch(const struct mg_connection* nc)
+{
+    for (size_t i = 0; i < MAX_BATCHES; ++i) {
+        if (s_batches[i].nc == nc) {
+            return &s_batches[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Queues the next images of a batch read until enough bytes wait for the
+ * client; called again each time some of them are sent.
+ */
+static void continue_batch(batch_stream* b, imgst_file* imgstfile)
+{
+    while (!b->batch.done && b->nc->send.len < BATCH_HIGH_WATER) {
+        // Rendering writes to the imgStore
+        if (batch_needs_render(&b->batch, imgstfile)) {
+            store_lock_exclusive();
+        }
+
+        if (do_read_batch_next(&b->batch, write_batch_part, &b->reply, imgstfile) != ERR_NONE) {
+            // Headers are sent: the best that can be done is to cut the reply
+            b->nc->is_draining = 1;
+            break;
+        }
+    }
+
+    if (b->batch.done && !b->nc->is_draining) {
+        mg_http_printf_chunk(b->nc, "--%s--\r\n", b->reply.boundary);
+        mg_http_write_chunk(b->nc, "", 0);
+    }
+
+    if (b->batch.done || b->nc->is_draining) {
+        end_batch(b);
+    }
+}
+
+/**
+ * Produces an HTTP 200 reply with many images at once. Given a resolution
+ * code, or a box, for query keys, and the imgIDs one per line in the body,
+ * replies with a multipart/mixed body with a part per image, identified by
+ * its Content-ID. The images are sent in the order they are read, which is
+ * the order of the imgStore file. The reply is streamed: images are read as
+ * the client receives the previous ones.
+ */
+void handle_batch_call(struct mg_connection *nc, struct mg_http_message *hm,
+                       imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+
+    uint16_t box[DIMS] = {0, 0};
+    int res = RES_ORIG;
+    THROW_IF_CALL_FAILS_DO(get_size_from_query(hm, box, &res), , nc);
+
+    const int sized = box[0] != 0 || box[1] != 0;
+    const int negotiated = sized || res != RES_ORIG;
+    const int format = negotiated ? negotiate_format(hm) : FMT_JPEG;
+
+    // Split the body in place, in a copy ending with a null character
+    char* body = calloc(hm->body.len + 1, sizeof(char));
+    THROW_ERR_IF(body == NULL, nc, ERR_OUT_OF_MEMORY);
+    memcpy(body, hm->body.ptr, hm->body.len);
+
+    const char* img_ids[MAX_BATCH_IDS];
+    size_t nb_ids = 0;
+
+    for (char* line = body; *line != '\0'; ) {
+        const size_t len = strcspn(line, "\r\n");
+        char* end = line + len;
+
+        if (len > 0) {
+            THROW_ERR_IF_DO(nb_ids == MAX_BATCH_IDS || len > MAX_IMG_ID,
+                            FREE_DEREF(body), nc, ERR_INVALID_ARGUMENT);
+            img_ids[nb_ids++] = line;
+        }
+
+        line = end + (*end != '\0');
+        *end = '\0';
+    }
+
+    THROW_ERR_IF_DO(nb_ids == 0, FREE_DEREF(body), nc, ERR_INVALID_ARGUMENT);
+
+    batch_stream* b = find_batch(NULL);
+    THROW_ERR_IF_DO(b == NULL, FREE_DEREF(body), nc, ERR_IO);
+
+    THROW_IF_CALL_FAILS_DO(do_read_batch_begin(&b->batch, img_ids, nb_ids, sized ? box : NULL,
+                                               res, format, imgstfile),
+                           FREE_DEREF(body), nc);
+    b->nc = nc;
+    b->body = body;
+
+    // A random boundary, unlikely to be found in the images
+    b->reply.nc = nc;
+    b->reply.format = format;
+    unsigned char bytes[BATCH_BOUNDARY_BYTES];
+    mg_random(bytes, BATCH_BOUNDARY_BYTES);
+
+    for (size_t i = 0; i < BATCH_BOUNDARY_BYTES; ++i) {
+        snprintf(&b->reply.boundary[2 * i], 3, "%02x", bytes[i]);
+    }
+
+    // The length is not known in advance: each part is a chunk
+    mg_printf(nc,
+              "HTTP/1.1 %d OK\r\n"
+              "Content-Type: multipart/mixed; boundary=%s\r\n"
+              "%s"
+              "Transfer-Encoding: chunked\r\n\r\n", HTTP_RESPONSE_CODE, b->reply.boundary,
+              vary_header(negotiated));
+
+    continue_batch(b, imgstfile);
+}
+
+/**
+ * Frees a sprite cache entry.
+ */
+static void free_sprite(sprite_entry* e)
+{
+    FREE_DEREF(e->idx);
+    FREE_DEREF(e->cells);
+    FREE_DEREF(e->map);
+
+    for (size_t f = 0; f < NB_FMT; ++f) {
+        FREE_DEREF(e->image[f]);
+    }
+
+    memset(e, 0, sizeof(sprite_entry));
+}
+
+/**
+ * Adds a listed slot to the page of a sprite.
+ */
+static void collect_sprite_slot(size_t idx, const img_metadata* metadata _unused, void* arg)
+{
+    sprite_entry* e = arg;
+    e->idx[e->nb++] = idx;
+}
+
+/**
+ * Finds the sprite entry of a list page for the current version of the
+ * imgStore. If there is none, the least recently used entry is reused.
+ */
+static int get_sprite(sprite_entry** entry, size_t from, size_t limit, const imgst_file* imgstfile)
+{
+    sprite_entry* e = &s_sprites[0];
+
+    for (size_t i = 0; i < SPRITE_CACHE_SIZE; ++i) {
+        sprite_entry* c = &s_sprites[i];
+
+        if (c->idx != NULL && c->version == imgstfile->header.imgst_version
+            && c->from == from && c->limit == limit) {
+            count_cache(METRICS_CACHE_SPRITE, 1);
+            c->last_used = mg_millis();
+            *entry = c;
+            return ERR_NONE;
+        }
+
+        if (c->idx == NULL || (e->idx != NULL && c->last_used < e->last_used)) {
+            e = c;
+        }
+    }
+
+    count_cache(METRICS_CACHE_SPRITE, 0);
+    free_sprite(e);
+
+    // The slots of the page
+    M_EXIT_IF_NULL(e->idx = calloc(limit, sizeof(size_t)), limit * sizeof(size_t));
+    e->next = do_list_page(imgstfile, from, limit, NULL, collect_sprite_slot, e);
+
+    e->cells = calloc(e->nb == 0 ? 1 : e->nb, sizeof(sprite_cell));
+
+    if (e->cells == NULL) {
+        free_sprite(e);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    e->version = imgstfile->header.imgst_version;
+    e->from = from;
+    e->limit = limit;
+    e->laid_out = e->nb == 0;
+    e->last_used = mg_millis();
+    *entry = e;
+
+    return ERR_NONE;
+}
+
+/**
+ * Tells whether a listed slot lacks its thumbnail.
+ */
+static void check_sprite_slot(size_t idx _unused, const img_metadata* metadata, void* arg)
+{
+    int* needs_render = arg;
+    *needs_render |= metadata->offset[RES_THUMB] == INIT_OFFSET;
+}
+
+/**
+ * Takes the imgStore to the calling thread alone if composing the sprite of
+ * a list page resizes thumbnails, which writes them to the imgStore. Called
+ * before s_sprites_lock is taken: a writer waits for the readers to leave.
+ */
+static void lock_sprite_page(size_t from, size_t limit, const imgst_file* imgstfile)
+{
+    int needs_render = 0;
+
+    if (!is_read_only(imgstfile)) {
+        do_list_page(imgstfile, from, limit, NULL, check_sprite_slot, &needs_render);
+    }
+
+    if (needs_render) {
+        store_lock_exclusive();
+    }
+}
+
+/**
+ * Composes the sprite of an entry in the given encoding, if not done yet.
+ */
+static int get_sprite_image(sprite_entry* e, int format, imgst_file* imgstfile)
+{
+    M_EXIT_IF(e->nb == 0, ERR_FILE_NOT_FOUND, "empty page", );
+
+    if (e->image[format] == NULL) {
+        M_EXIT_IF_ERR(make_sprite(e->idx, e->nb, format, imgstfile, &e->image[format],
+                                  &e->image_size[format], e->dims, e->cells));
+        e->laid_out = 1;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes the JSON map of a sprite to out, or only counts its bytes if out
+ * is NULL. Returns the number of bytes.
+ */
+static size_t write_sprite_map(char* out, const sprite_entry* e, const imgst_file* imgstfile)
+{
+    size_t len = json_write_fmt(out, "{\"width\":%" PRIu32 ",\"height\":%" PRIu32 ",\"Images\":[",
+                                e->dims[0], e->dims[1]);
+
+    for (size_t i = 0; i < e->nb; ++i) {
+        const sprite_cell* c = &e->cells[i];
+
+        len += json_write_fmt(json_at(out, len), "%s{\"img_id\":", i == 0 ? "" : ",");
+        len += json_write_string(json_at(out, len), imgstfile->metadata[e->idx[i]].img_id);
+        len += json_write_fmt(json_at(out, len),
+                              ",\"x\":%" PRIu32 ",\"y\":%" PRIu32 ",\"w\":%" PRIu32 ",\"h\":%" PRIu32 "}",
+                              c->position[0], c->position[1], c->res[0], c->res[1]);
+    }
+
+    // The cursor of the next page, if any
+    if (e->next < imgstfile->header.max_files) {
+        return len + json_write_fmt(json_at(out, len), "],\"after\":%zu}", e->idx[e->nb - 1]);
+    }
+
+    return len + json_write_fmt(json_at(out, len), "]}");
+}
+
+/**
+ * Reads the page of a sprite request: limit and after query keys, as for
+ * the list, with a default and maximum number of thumbnails.
+ */
+static int get_sprite_page_from_query(struct mg_http_message *hm, size_t* limit, size_t* from)
+{
+    M_EXIT_IF_ERR(get_page_from_query(hm, limit, from));
+
+    if (*limit == 0) {
+        *limit = SPRITE_DEFAULT_LIMIT;
+    }
+
+    M_EXIT_IF(*limit > SPRITE_MAX_LIMIT, ERR_INVALID_ARGUMENT,
+              "more than %d thumbnails in a sprite", SPRITE_MAX_LIMIT);
+
+    return ERR_NONE;
+}
+
+/**
+ * Produces an HTTP 200 reply with the sprite of a list page: one image with
+ * the thumbnails of its images. The page is given as for the list, with
+ * SPRITE_DEFAULT_LIMIT images by default. The sprite is encoded in WebP if
+ * the Accept header allows it, and kept for the current version of the
+ * imgStore. Where each thumbnail lies is given by /imgStore/sprite/map.
+ */
+void handle_sprite_call(struct mg_connection *nc, struct mg_http_message *hm,
+                        imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL || imgstfile->metadata == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+
+    size_t limit = 0, from = 0;
+    THROW_IF_CALL_FAILS_DO(get_sprite_page_from_query(hm, &limit, &from), , nc);
+
+    const int format = negotiate_format(hm);
+
+    lock_sprite_page(from, limit, imgstfile);
+    pthread_mutex_lock(&s_sprites_lock);
+
+    sprite_entry* e = NULL;
+    THROW_IF_CALL_FAILS_DO(get_sprite(&e, from, limit, imgstfile),
+                           pthread_mutex_unlock(&s_sprites_lock), nc);
+    THROW_IF_CALL_FAILS_DO(get_sprite_image(e, format, imgstfile),
+                           pthread_mutex_unlock(&s_sprites_lock), nc);
+
+    mg_printf(nc,
+              "HTTP/1.1 %d OK\r\n"
+              "Content-Type: %s\r\n"
+              "Vary: Accept\r\n"
+              "Content-Length: %zu\r\n\r\n", HTTP_RESPONSE_CODE,
+              s_media_types[format], e->image_size[format]);
+    mg_send(nc, e->image[format], e->image_size[format]);
+    pthread_mutex_unlock(&s_sprites_lock);
+}
+
+/**
+ * Produces an HTTP 200 reply with the map of the sprite of a list page,
+ * given as for /imgStore/sprite, e.g. {"width": 640, "height": 640,
+ * "Images": [{"img_id": "pic1", "x": 0, "y": 0, "w": 64, "h": 43}],
+ * "after": 99}.
+ */
+void handle_sprite_map_call(struct mg_connection *nc, struct mg_http_message *hm,
+                            imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL || imgstfile->metadata == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+
+    size_t limit = 0, from = 0;
+    THROW_IF_CALL_FAILS_DO(get_sprite_page_from_query(hm, &limit, &from), , nc);
+
+    lock_sprite_page(from, limit, imgstfile);
+    pthread_mutex_lock(&s_sprites_lock);
+
+    sprite_entry* e = NULL;
+    THROW_IF_CALL_FAILS_DO(get_sprite(&e, from, limit, imgstfile),
+                           pthread_mutex_unlock(&s_sprites_lock), nc);
+
+    if (e->map == NULL) {
+        // The thumbnails are only measured when the sprite is composed
+        if (!e->laid_out) {
+            THROW_IF_CALL_FAILS_DO(get_sprite_image(e, FMT_JPEG, imgstfile),
+                                   pthread_mutex_unlock(&s_sprites_lock), nc);
+        }
+
+        e->map_len = write_sprite_map(NULL, e, imgstfile);
+        e->map = malloc(e->map_len);
+        THROW_ERR_IF_DO(e->map == NULL, pthread_mutex_unlock(&s_sprites_lock), nc, ERR_OUT_OF_MEMORY);
+        write_sprite_map(e->map, e, imgstfile);
+    }
+
+    mg_printf(nc,
+              "HTTP/1.1 %d OK\r\n"
+              "Content-Type: application/json\r\n"
+              "Content-Length: %zu\r\n\r\n", HTTP_RESPONSE_CODE, e->map_len);
+    mg_send(nc, e->map, e->map_len);
+    pthread_mutex_unlock(&s_sprites_lock);
+}
+
+/**
+ * Produces an HTTP 200 reply for a delete command. Given an imgID for a
+ * query key, deletes the image from the imgStore file.
+ */
+void handle_delete_call(struct mg_connection *nc, struct mg_http_message *hm,
+                        imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+
+    // Followers leave the changes to the writer
+    THROW_ERR_IF(is_read_only(imgstfile), nc, ERR_INVALID_COMMAND);
+
+    // Get imgID from http message query
+    char* img_id = get_var_from_query(nc, hm, "img_id", MAX_IMG_ID);
+
+    if (img_id == NULL) return; // error sent in get_var
+
+
+    // Delete the image from the imgStore file
+    THROW_IF_CALL_FAILS_DO(do_delete(img_id, imgstfile),
+                           FREE_DEREF(img_id),
+                           nc);
+
+    // If do_delete went well, reload page.
+    mg_reload_msg(nc);
+
+    // Free rest
+    FREE_DEREF(img_id);
+}
+
+/**
+ * Writes the state of an upload to the uploads file. The received bytes are
+ * already flushed to the imgStore file, so that the record never announces
+ * more than was written.
+ */
+static void save_upload(const upload* u)
+{
+    if (s_uploads_file == NULL) {
+        return;
+    }
+
+    upload_record record;
+    memset(&record, 0, sizeof(record));
+
+    if (u->active) {
+        strncpy(record.session, u->session, SESSION_ID_LEN);
+        strncpy(record.img_id, u->ingest.img_id, MAX_IMG_ID);
+        record.offset = u->ingest.offset;
+        record.reserved = u->ingest.reserved;
+        record.size = u->ingest.size;
+    }
+
+    // Not much to do if it fails: the upload just cannot be resumed after a restart
+    if (fseek(s_uploads_file, (long)((size_t)(u - s_uploads) * sizeof(upload_record)), SEEK_SET) != 0
+        || fwrite(&record, sizeof(upload_record), 1, s_uploads_file) != 1
+        || fflush(s_uploads_file) != 0) {
+        fprintf(stderr, "could not save upload session %s\n", u->session);
+    }
+}
+
+/**
+ * Opens the uploads file of the imgStore and resumes the uploads it records.
+ * Returns the number of resumed uploads.
+ */
+static size_t load_uploads(const char* imgstore_filename, imgst_file* imgstfile)
+{
+    const size_t len = strlen(imgstore_filename) + strlen(UPLOADS_EXT) + 1;
+    char* filename = calloc(len, sizeof(char));
+
+    if (filename == NULL) {
+        return 0;
+    }
+
+    snprintf(filename, len, "%s%s", imgstore_filename, UPLOADS_EXT);
+
+    s_uploads_file = fopen(filename, "rb+");
+
+    if (s_uploads_file == NULL) {
+        s_uploads_file = fopen(filename, "wb+");
+    }
+
+    FREE_DEREF(filename);
+
+    size_t resumed = 0;
+
+    for (size_t i = 0; s_uploads_file != NULL && i < MAX_UPLOADS; ++i) {
+        upload_record record;
+        memset(&record, 0, sizeof(record));
+
+        if (fseek(s_uploads_file, (long)(i * sizeof(upload_record)), SEEK_SET) != 0
+            || fread(&record, sizeof(upload_record), 1, s_uploads_file) != 1
+            || record.session[0] == '\0') {
+            continue;
+        }
+
+        record.session[SESSION_ID_LEN] = '\0';
+        record.img_id[MAX_IMG_ID] = '\0';
+
+        upload* u = &s_uploads[i];
+
+        if (do_insert_resume(&(u->ingest), record.img_id, record.offset, record.reserved,
+                             record.size, imgstfile) == ERR_NONE) {
+            strncpy(u->session, record.session, SESSION_ID_LEN);
+            u->active = 1;
+            u->last_active = mg_millis();
+            ++resumed;
+        } else {
+            // Forget the uploads whose bytes are gone
+            save_upload(u);
+        }
+    }
+
+    return resumed;
+}
+
+/**
+ * Finds the most recently active upload of the image with the given ID,
+ * NULL if there is none.
+ */
+static upload* find_upload(const char* img_id)
+{
+    upload* found = NULL;
+
+    for (size_t i = 0; i < MAX_UPLOADS; ++i) {
+        if (s_uploads[i].active && !strcmp(s_uploads[i].ingest.img_id, img_id)
+            && (found == NULL || s_uploads[i].last_active > found->last_active)) {
+            found = &s_uploads[i];
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Finds the upload with the given session ID, NULL if there is none.
+ */
+static upload* find_session(const char* session)
+{
+    for (size_t i = 0; i < MAX_UPLOADS; ++i) {
+        if (s_uploads[i].active && !strcmp(s_uploads[i].session, session)) {
+            return &s_uploads[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Gives up an upload.
+ */
+static void abort_upload(upload* u, imgst_file* imgstfile)
+{
+    do_insert_abort(&(u->ingest), imgstfile);
+    u->active = 0;
+    save_upload(u);
+}
+
+/**
+ * Starts the upload of an image of the given size in a new session. If as
+ * many images are already being uploaded, the one which has been idle for
+ * the longest time is given up.
+ */
+static int start_upload(upload** started, const char* img_id, uint64_t size,
+                        imgst_file* imgstfile)
+{
+    // Pick a free entry, or the least recently active one
+    upload* u = &s_uploads[0];
+
+    for (size_t i = 0; i < MAX_UPLOADS && u->active; ++i) {
+        if (!s_uploads[i].active || s_uploads[i].last_active < u->last_active) {
+            u = &s_uploads[i];
+        }
+    }
+
+    if (u->active) {
+        abort_upload(u, imgstfile);
+    }
+
+    // Random session ID, so that uploads of the same imgID do not mix
+    char session[SESSION_ID_LEN + 1] = {0};
+    unsigned char bytes[SESSION_BYTES];
+    mg_random(bytes, SESSION_BYTES);
+
+    for (size_t i = 0; i < SESSION_BYTES; ++i) {
+        snprintf(&session[2 * i], 3, "%02x", bytes[i]);
+    }
+
+    M_EXIT_IF_ERR(do_insert_begin(&(u->ingest), img_id, size, imgstfile));
+
+    memcpy(u->session, session, sizeof(session));
+    u->active = 1;
+    u->last_active = mg_millis();
+    save_upload(u);
+    *started = u;
+
+    return ERR_NONE;
+}
+
+/**
+ * Produces an HTTP 200 reply with the session ID of an upload and the number
+ * of bytes received so far, which is where the upload resumes.
+ */
+static void mg_upload_msg(struct mg_connection* nc, const upload* u)
+{
+    struct json_object* object = json_object_new_object();
+    THROW_ERR_IF(object == NULL, nc, ERR_OUT_OF_MEMORY);
+
+    json_object_object_add(object, "session", json_object_new_string(u->session));
+    json_object_object_add(object, "name", json_object_new_string(u->ingest.img_id));
+    json_object_object_add(object, "offset", json_object_new_int64((int64_t) u->ingest.size));
+
+    mg_http_reply(nc, HTTP_RESPONSE_CODE, "Content-Type: application/json\r\n",
+                  "%s", json_object_to_json_string(object));
+
+    json_object_put(object);
+}
+
+/**
+ * Produces an HTTP 200 reply for the insert command. Allows for the insertion
+ * of an image into the imgStore file in a 2-phase strategy. First the image
+ * chunks are written as they arrive, in an extent of the imgStore file
+ * reserved for the image, and then the image is committed.
+ *
+ * The first chunk gives the size of the image with the size query key, and
+ * opens an upload session, whose ID is in the reply. Passing
+ * it back with the session query key, chunks may be sent again from any
+ * offset up to the number of bytes received: what was already received is
+ * skipped. Without it, the upload of the same name is continued.
+ */
+void handle_insert_call(struct mg_connection *nc, struct mg_http_message *hm,
+                        imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+    THROW_ERR_IF(is_read_only(imgstfile), nc, ERR_INVALID_COMMAND);
+
+    // Make sure there is enough space
+    THROW_ERR_IF(imgstfile->header.num_files >= imgstfile->header.max_files,
+                 nc, ERR_FULL_IMGSTORE);
+
+    // Get chunk offset. Image size at most 2^32. The offset need not be larger.
+    char* offset_str = get_var_from_query(nc, hm, "offset", QUERY_LEN_OFFSET);
+
+    if (offset_str == NULL) return; // error sent get_var
+
+    const uint32_t offset = atouint32(offset_str);
+    FREE_DEREF(offset_str);
+
+    // Get jpg image file name, scaling for encoding and leaving space for .jpg extension.
+    size_t name_len = ENCODE_URI_SCALE * MAX_IMG_ID + JPG_EXT;
+    char* img_id = get_var_from_query(nc, hm, "name", name_len);
+
+    if (img_id == NULL) return; // error sent in get_var
+
+    THROW_ERR_IF_DO(strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID,
+                    FREE_DEREF(img_id),
+                    nc, ERR_INVALID_IMGID);
+
+    // Find the upload by session, or by name if there is no session
+    char session[SESSION_ID_LEN + 1] = {0};
+    upload* u = NULL;
+
+    if (mg_http_get_var(&(hm->query), "session", session, sizeof(session)) > 0) {
+        u = find_session(session);
+        THROW_ERR_IF_DO(u == NULL,
+                        FREE_DEREF(img_id),
+                        nc, ERR_FILE_NOT_FOUND);
+        THROW_ERR_IF_DO(strcmp(u->ingest.img_id, img_id),
+                        FREE_DEREF(img_id),
+                        nc, ERR_INVALID_ARGUMENT);
+
+    } else if (hm->body.len != 0 && offset == 0) {
+        // The first chunk opens a session, reserving the size of the image
+        char size_str[QUERY_LEN_OFFSET + 1] = {0};
+        THROW_ERR_IF_DO(mg_http_get_var(&(hm->query), "size", size_str, sizeof(size_str)) <= 0,
+                        FREE_DEREF(img_id),
+                        nc, ERR_INVALID_ARGUMENT);
+        THROW_IF_CALL_FAILS_DO(start_upload(&u, img_id, atouint32(size_str), imgstfile),
+                               FREE_DEREF(img_id), nc);
+    } else {
+        u = find_upload(img_id);
+        THROW_ERR_IF_DO(u == NULL,
+                        FREE_DEREF(img_id),
+                        nc, ERR_FILE_NOT_FOUND);
+    }
+
+    FREE_DEREF(img_id);
+
+    // Mode 1: chunk uploading
+    if (hm->body.len != 0) {
+
+        // Chunks cannot leave gaps, and what was already received is skipped
+        THROW_ERR_IF(offset > u->ingest.size, nc, ERR_INVALID_ARGUMENT);
+        const size_t received = (size_t)(u->ingest.size - offset);
+
+        if (received < hm->body.len) {
+            // Write the rest of the chunk in place
+            THROW_IF_CALL_FAILS_DO(do_insert_append(&(u->ingest), hm->body.ptr + received,
+                                   hm->body.len - received, imgstfile),
+                                   abort_upload(u, imgstfile), nc);
+            save_upload(u);
+        }
+
+        u->last_active = mg_millis();
+        mg_upload_msg(nc, u);
+
+        // Mode 2: image insertion
+
+    } else {
+
+        // All the announced bytes must have been received. If not, the
+        // session is kept so that the missing ones can still be sent.
+        THROW_ERR_IF(u->ingest.size != offset, nc, ERR_IO);
+
+        // Insert the image into the imgStore
+        u->active = 0;
+        const int ret = do_insert_commit(&(u->ingest), imgstfile);
+        save_upload(u);
+        THROW_IF_CALL_FAILS_DO(ret, , nc);
+
+        // If the commit went well, reload page.
+        mg_reload_msg(nc);
+    }
+}
+
+/**
+ * Produces an HTTP 200 reply telling where an upload resumes. Given a
+ * session for query key, replies with a JSON object such as
+ * {"session": "<ID>", "name": "<imgID>", "offset": <bytes received>}.
+ */
+void handle_upload_call(struct mg_connection *nc, struct mg_http_message *hm,
+                        imgst_file* imgstfile _unused)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL, nc, ERR_INVALID_ARGUMENT);
+
+    char session[SESSION_ID_LEN + 1] = {0};
+    THROW_ERR_IF(mg_http_get_var(&(hm->query), "session", session, sizeof(session)) <= 0,
+                 nc, ERR_INVALID_ARGUMENT);
+
+    const upload* u = find_session(session);
+    THROW_ERR_IF(u == NULL, nc, ERR_FILE_NOT_FOUND);
+
+    mg_upload_msg(nc, u);
+}
+
+/**
+ * Reads the SHA given as hexadecimal string for the sha query key.
+ */
+static int get_sha_from_query(struct mg_http_message *hm, unsigned char* sha)
+{
+    char sha_str[QUERY_LEN_SHA + 1] = {0};
+
+    if (mg_http_get_var(&(hm->query), "sha", sha_str, sizeof(sha_str)) <= 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    return sha_from_string(sha_str, sha);
+}
+
+/**
+ * Produces an HTTP 200 reply telling whether a content is already stored.
+ * Given a SHA (and optionally an imgID) for query keys, replies with a JSON
+ * object such as {"exists": true, "img_id": "<an ID with this content>"},
+ * plus, if an imgID was given, whether it is taken and has this content.
+ */
+void handle_exists_call(struct mg_connection *nc, struct mg_http_message *hm,
+                        imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    THROW_IF_CALL_FAILS_DO(get_sha_from_query(hm, sha), , nc);
+
+    // Build the reply
+    struct json_object* object = json_object_new_object();
+    THROW_ERR_IF(object == NULL, nc, ERR_OUT_OF_MEMORY);
+
+    size_t idx = 0;
+    const int exists = findContentIndex(&idx, sha, imgstfile) == ERR_NONE;
+    json_object_object_add(object, "exists", json_object_new_boolean(exists));
+
+    if (exists) {
+        json_object_object_add(object, "img_id", json_object_new_string(imgstfile->metadata[idx].img_id));
+    }
+
+    // Optional imgID
+    char img_id[MAX_IMG_ID + 1] = {0};
+
+    if (mg_http_get_var(&(hm->query), "img_id", img_id, sizeof(img_id)) > 0) {
+        const int taken = findMetadataIndex(&idx, img_id, imgstfile) == ERR_NONE;
+        json_object_object_add(object, "id_exists", json_object_new_boolean(taken));
+        json_object_object_add(object, "id_same_content", json_object_new_boolean(
+                                   taken && !memcmp(imgstfile->metadata[idx].SHA, sha, SHA256_DIGEST_LENGTH)));
+    }
+
+    mg_http_reply(nc, HTTP_RESPONSE_CODE, "Content-Type: application/json\r\n",
+                  "%s", json_object_to_json_string(object));
+
+    json_object_put(object);
+}
+
+/**
+ * Produces an HTTP 200 reply for the link command. Given a SHA and an imgID
+ * for query keys, inserts the imgID for a content already in the imgStore.
+ */
+void handle_link_call(struct mg_connection *nc, struct mg_http_message *hm,
+                      imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+    THROW_ERR_IF(is_read_only(imgstfile), nc, ERR_INVALID_COMMAND);
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    THROW_IF_CALL_FAILS_DO(get_sha_from_query(hm, sha), , nc);
+
+    // Get imgID from http message query
+    char* img_id = get_var_from_query(nc, hm, "img_id", MAX_IMG_ID);
+
+    if (img_id == NULL) return; // error sent in get_var
+
+    THROW_IF_CALL_FAILS_DO(do_link(sha, img_id, imgstfile),
+                           FREE_DEREF(img_id), nc);
+
+    // If do_link went well, reload page.
+    mg_reload_msg(nc);
+
+    FREE_DEREF(img_id);
+}
+
+/**
+ * Queues bytes of an archive, for do_export_next.
+ */
+static int export_writer_send(const void* buffer, size_t size, void* arg)
+{
+    struct mg_connection* nc = arg;
+
+    return (size == 0 || mg_send(nc, buffer, size) == (int) size) ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * Releases an export entry.
+ */
+static void end_export(export_stream* x)
+{
+    do_export_end(&x->export);
+    x->nc = NULL;
+}
+
+/**
+ * Returns the export streamed to a connection, NULL if there is none.
+ */
+static export_stream* find_export(const struct mg_connection* nc)
+{
+    for (size_t i = 0; i < MAX_EXPORTS; ++i) {
+        if (s_exports[i].nc == nc) {
+            return &s_exports[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Queues the next entries of an archive until enough bytes wait for the
+ * client; called again each time some of them are sent.
+ */
+static void continue_export(export_stream* x)
+{
+    while (!x->export.done && x->nc->send.len < EXPORT_HIGH_WATER) {
+        if (do_export_next(&x->export, export_writer_send, x->nc) != ERR_NONE) {
+            // Headers are sent: the best that can be done is to cut the reply
+            x->nc->is_draining = 1;
+            break;
+        }
+    }
+
+    if (x->export.done || x->nc->is_draining) {
+        end_export(x);
+    }
+}
+
+/**
+ * Produces an HTTP 200 reply with the whole imgStore as a tar archive, with
+ * the variants too if variants=1 is given. The archive is streamed: its
+ * contents are read as the client receives them.
+ */
+void handle_export_call(struct mg_connection *nc, struct mg_http_message *hm,
+                        imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL || imgstfile == NULL,
+                 nc, ERR_INVALID_ARGUMENT);
+
+    char variants[2] = {0};
+    const int with_variants = mg_http_get_var(&hm->query, "variants", variants, sizeof(variants)) > 0
+                              && variants[0] == '1';
+
+    // There are few exports at once: they are long reads of the whole file
+    export_stream* x = find_export(NULL);
+    THROW_ERR_IF(x == NULL, nc, ERR_IO);
+
+    THROW_IF_CALL_FAILS_DO(do_export_begin(&x->export, with_variants, imgstfile), , nc);
+    x->nc = nc;
+
+    mg_printf(nc,
+              "HTTP/1.1 %d OK\r\n"
+              "Content-Type: application/x-tar\r\n"
+              "Content-Disposition: attachment; filename=\"imgStore.tar\"\r\n"
+              "Content-Length: %" PRIu64 "\r\n\r\n", HTTP_RESPONSE_CODE, x->export.size);
+
+    continue_export(x);
+}
+
+/**
+ * Gives the resolution a request asks for: a RES_ code, ACCESS_RES_BOX for
+ * w= and h=, or ACCESS_RES_NONE.
+ */
+static int get_res_of_query(struct mg_http_message *hm)
+{
+    char value[QUERY_LEN_RESOLUTION + 1] = {0};
+
+    if (mg_http_get_var(&(hm->query), "res", value, sizeof(value)) > 0) {
+        return resolution_atoi(value);
+    }
+
+    if (mg_http_get_var(&(hm->query), "w", value, sizeof(value)) > 0
+        || mg_http_get_var(&(hm->query), "h", value, sizeof(value)) > 0) {
+        return ACCESS_RES_BOX;
+    }
+
+    return ACCESS_RES_NONE;
+}
+
+/**
+ * Counts a request served in the given time, and the bytes of the reply to
+ * a read, queued past sent_before.
+ */
+static void count_request(struct mg_connection *nc, struct mg_http_message *hm, int endpoint,
+                          uint64_t latency_us, size_t sent_before)
+{
+    static const uint64_t bounds[NB_METRICS_BUCKETS] = METRICS_BUCKETS_US;
+
+    const int res = (endpoint == ACCESS_READ) ? get_res_of_query(hm) : ACCESS_RES_NONE;
+
+    pthread_mutex_lock(&s_metrics_lock);
+    s_metrics.requests[endpoint] += 1;
+    s_metrics.latency_sum_us[endpoint] += latency_us;
+
+    size_t b = 0;
+    while (b < NB_METRICS_BUCKETS && latency_us > bounds[b]) ++b;
+    if (b < NB_METRICS_BUCKETS) s_metrics.latency_buckets[endpoint][b] += 1;
+
+    if (endpoint == ACCESS_READ && nc->send.len > sent_before) {
+        const size_t i = (res == ACCESS_RES_BOX) ? NB_RES : (res >= 0 && res < NB_RES) ? (size_t) res : NB_RES + 1;
+
+        if (i < METRICS_READ_RES) {
+            s_metrics.read_bytes[i] += nc->send.len - sent_before;
+        }
+    }
+    pthread_mutex_unlock(&s_metrics_lock);
+}
+
+/**
+ * Appends a line to the metrics page.
+ */
+static void metrics_printf(metrics_text* t, const char* fmt, ...)
+{
+    if (t->buf == NULL || t->cap - t->len < METRICS_LINE_LEN) {
+        const size_t cap = (t->cap == 0) ? 16 * METRICS_LINE_LEN : 2 * t->cap;
+        char* grown = realloc(t->buf, cap);
+
+        if (grown == NULL) {
+            return;
+        }
+
+        t->buf = grown;
+        t->cap = cap;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    const int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, args);
+    va_end(args);
+
+    if (n > 0) {
+        t->len += ((size_t) n < t->cap - t->len) ? (size_t) n : t->cap - t->len - 1;
+    }
+}
+
+/**
+ * Produces an HTTP 200 reply with the metrics of the server and of its
+ * imgStore, in the Prometheus text format.
+ */
+void handle_metrics_call(struct mg_connection *nc, struct mg_http_message *hm _unused,
+                         imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || imgstfile == NULL, nc, ERR_INVALID_ARGUMENT);
+
+    static const char* const uris[NB_ACCESS] = ACCESS_URIS;
+    static const uint64_t bounds[NB_METRICS_BUCKETS] = METRICS_BUCKETS_US;
+    static const char* const res_names[METRICS_READ_RES] = {"thumb", "small", "orig", "box"};
+    static const char* const cache_names[NB_METRICS_CACHES] = METRICS_CACHE_NAMES;
+
+    metrics_text t = {NULL, 0, 0};
+
+    pthread_mutex_lock(&s_metrics_lock);
+    const metrics m = s_metrics;
+    pthread_mutex_unlock(&s_metrics_lock);
+
+    // Requests, by route
+    metrics_printf(&t, "# HELP imgstore_requests_total Requests served, by route.\n"
+                   "# TYPE imgstore_requests_total counter\n");
+    for (size_t e = 0; e < NB_ACCESS; ++e) {
+        metrics_printf(&t, "imgstore_requests_total{route=\"%s\"} %" PRIu64 "\n", uris[e], m.requests[e]);
+    }
+
+    metrics_printf(&t, "# HELP imgstore_request_duration_seconds Time spent in the handlers, by route.\n"
+                   "# TYPE imgstore_request_duration_seconds histogram\n");
+    for (size_t e = 0; e < NB_ACCESS; ++e) {
+        uint64_t cumulative = 0;
+
+        for (size_t b = 0; b < NB_METRICS_BUCKETS; ++b) {
+            cumulative += m.latency_buckets[e][b];
+            metrics_printf(&t, "imgstore_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+                           uris[e], (double) bounds[b] / 1e6, cumulative);
+        }
+
+        metrics_printf(&t, "imgstore_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+                       "imgstore_request_duration_seconds_sum{route=\"%s\"} %.6f\n"
+                       "imgstore_request_duration_seconds_count{route=\"%s\"} %" PRIu64 "\n",
+                       uris[e], m.requests[e], uris[e],
+                       (double) m.latency_sum_us[e] / 1e6, uris[e], m.requests[e]);
+    }
+
+    // Errors, by code
+    metrics_printf(&t, "# HELP imgstore_errors_total Error replies, by error code.\n"
+                   "# TYPE imgstore_errors_total counter\n");
+    for (int err = ERR_NONE + 1; err < NB_ERR; ++err) {
+        metrics_printf(&t, "imgstore_errors_total{code=\"%d\",message=\"%s\"} %" PRIu64 "\n",
+                       err, ERR_MESSAGES[err], m.errors[err]);
+    }
+
+    // Bytes of the read replies, by resolution
+    metrics_printf(&t, "# HELP imgstore_read_bytes_total Bytes of the read replies, by resolution.\n"
+                   "# TYPE imgstore_read_bytes_total counter\n");
+    for (size_t r = 0; r < METRICS_READ_RES; ++r) {
+        metrics_printf(&t, "imgstore_read_bytes_total{resolution=\"%s\"} %" PRIu64 "\n",
+                       res_names[r], m.read_bytes[r]);
+    }
+
+    // Caches
+    metrics_printf(&t, "# HELP imgstore_cache_hits_total Requests answered from a cache.\n"
+                   "# TYPE imgstore_cache_hits_total counter\n");
+    for (size_t c = 0; c < NB_METRICS_CACHES; ++c) {
+        metrics_printf(&t, "imgstore_cache_hits_total{cache=\"%s\"} %" PRIu64 "\n", cache_names[c], m.cache_hits[c]);
+    }
+
+    metrics_printf(&t, "# HELP imgstore_cache_misses_total Requests a cache could not answer.\n"
+                   "# TYPE imgstore_cache_misses_total counter\n");
+    for (size_t c = 0; c < NB_METRICS_CACHES; ++c) {
+        metrics_printf(&t, "imgstore_cache_misses_total{cache=\"%s\"} %" PRIu64 "\n", cache_names[c], m.cache_misses[c]);
+    }
+
+    metrics_printf(&t, "# HELP imgstore_cache_hit_ratio Hits over lookups since the start.\n"
+                   "# TYPE imgstore_cache_hit_ratio gauge\n");
+    for (size_t c = 0; c < NB_METRICS_CACHES; ++c) {
+        const uint64_t lookups = m.cache_hits[c] + m.cache_misses[c];
+        metrics_printf(&t, "imgstore_cache_hit_ratio{cache=\"%s\"} %.4f\n", cache_names[c],
+                       (lookups == 0) ? 0.0 : (double) m.cache_hits[c] / (double) lookups);
+    }
+
+    // The library
+    imgst_counters counters;
+    get_counters(&counters);
+    metrics_printf(&t, "# HELP imgstore_resizes_total Resized images created by lazily_resize.\n"
+                   "# TYPE imgstore_resizes_total counter\n"
+                   "imgstore_resizes_total %" PRIu64 "\n"
+                   "# HELP imgstore_resize_seconds_total Time spent creating them.\n"
+                   "# TYPE imgstore_resize_seconds_total counter\n"
+                   "imgstore_resize_seconds_total %.6f\n"
+                   "# HELP imgstore_dedup_hits_total Inserted images whose content was already stored.\n"
+                   "# TYPE imgstore_dedup_hits_total counter\n"
+                   "imgstore_dedup_hits_total %" PRIu64 "\n",
+                   counters.resizes, (double) counters.resize_us / 1e6, counters.dedup_hits);
+
+    // The imgStore
+    imgst_stats stats;
+    THROW_ERR_IF_DO(do_stats(imgstfile, &stats) != ERR_NONE, FREE_DEREF(t.buf), nc, ERR_IO);
+
+    metrics_printf(&t, "# HELP imgstore_num_files Images in the imgStore.\n"
+                   "# TYPE imgstore_num_files gauge\n"
+                   "imgstore_num_files %" PRIu32 "\n"
+                   "# HELP imgstore_max_files Slots of the imgStore.\n"
+                   "# TYPE imgstore_max_files gauge\n"
+                   "imgstore_max_files %" PRIu32 "\n"
+                   "# HELP imgstore_file_bytes Size of the imgStore file.\n"
+                   "# TYPE imgstore_file_bytes gauge\n"
+                   "imgstore_file_bytes %" PRIu64 "\n"
+                   "# HELP imgstore_dead_bytes Bytes of the imgStore file no valid image refers to.\n"
+                   "# TYPE imgstore_dead_bytes gauge\n"
+                   "imgstore_dead_bytes %" PRIu64 "\n"
+                   "# HELP imgstore_gc_projected_bytes Projected size of the imgStore file after a garbage collection.\n"
+                   "# TYPE imgstore_gc_projected_bytes gauge\n"
+                   "imgstore_gc_projected_bytes %" PRIu64 "\n",
+                   stats.num_files, stats.max_files, stats.file_bytes, stats.dead_bytes, stats.gc_bytes);
+
+    THROW_ERR_IF(t.buf == NULL, nc, ERR_OUT_OF_MEMORY);
+
+    mg_printf(nc,
+              "HTTP/1.1 %d OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: %zu\r\n\r\n", HTTP_RESPONSE_CODE, t.len);
+    mg_send(nc, t.buf, t.len);
+    FREE_DEREF(t.buf);
+}
+
+/**
+ * Adds a uint64_t to a JSON object.
+ */
+static void json_add_u64(struct json_object* object, const char* key, const uint64_t value)
+{
+    json_object_object_add(object, key, json_object_new_int64((int64_t) value));
+}
+
+/**
+ * Produces an HTTP 200 reply with the statistics of the imgStore (see
+ * do_stats), as JSON.
+ */
+void handle_stats_call(struct mg_connection *nc, struct mg_http_message *hm _unused,
+                       imgst_file* imgstfile)
+{
+    THROW_ERR_IF(nc == NULL || imgstfile == NULL, nc, ERR_INVALID_ARGUMENT);
+
+    imgst_stats s;
+    THROW_IF_CALL_FAILS_DO(do_stats(imgstfile, &s), , nc);
+
+    struct json_object* object = json_object_new_object();
+    struct json_object* resized = json_object_new_object();
+    struct json_object* sizes = json_object_new_array();
+    struct json_object* gaps = json_object_new_array();
+
+    THROW_ERR_IF_DO(object == NULL || resized == NULL || sizes == NULL || gaps == NULL,
+                    json_object_put(object); json_object_put(resized);
+                    json_object_put(sizes); json_object_put(gaps),
+                    nc, ERR_OUT_OF_MEMORY);
+
+    static const char* const res_names[NB_RES] = {"thumb", "small", "orig"};
+
+    json_add_u64(object, "num_files", s.num_files);
+    json_add_u64(object, "max_files", s.max_files);
+    json_add_u64(object, "file_bytes", s.file_bytes);
+    json_add_u64(object, "table_bytes", s.table_bytes);
+    json_add_u64(object, "live_bytes", s.live_bytes);
+    json_add_u64(object, "dead_bytes", s.dead_bytes);
+    json_add_u64(object, "dedup_images", s.dedup_images);
+    json_add_u64(object, "dedup_saved_bytes", s.dedup_saved_bytes);
+
+    for (int res = 0; res < NB_RES; ++res) {
+        json_add_u64(resized, res_names[res], s.resized[res]);
+    }
+    json_object_object_add(object, "resolutions", resized);
+
+    json_add_u64(object, "variants", s.variants);
+    json_add_u64(object, "live_variants", s.live_variants);
+    json_add_u64(object, "variant_bytes", s.variant_bytes);
+
+    // Bucket b holds the originals below 2^b KiB, the last one all the larger ones
+    for (size_t b = 0; b < STATS_SIZE_BUCKETS; ++b) {
+        json_object_array_add(sizes, json_object_new_int64(s.size_histogram[b]));
+    }
+    json_object_object_add(object, "size_histogram", sizes);
+
+    for (size_t g = 0; g < s.nb_gaps; ++g) {
+        struct json_object* gap = json_object_new_object();
+        if (gap == NULL) continue;
+
+        json_add_u64(gap, "offset", s.gaps[g].offset);
+        json_add_u64(gap, "size", s.gaps[g].size);
+        json_object_array_add(gaps, gap);
+    }
+    json_object_object_add(object, "gaps", gaps);
+
+    json_add_u64(object, "gc_bytes", s.gc_bytes);
+
+    mg_http_reply(nc, HTTP_RESPONSE_CODE, "Content-Type: application/json\r\n",
+                  "%s", json_object_to_json_string(object));
+
+    json_object_put(object);
+}
+
+/**
+ * Produces an HTTP 200 reply with the trace spans recorded so far, as Chrome
+ * trace JSON. With reset=1, they are forgotten afterwards. Spans are only
+ * recorded by a server started with -trace and built with TRACE=1.
+ */
+void handle_trace_call(struct mg_connection *nc, struct mg_http_message *hm,
+                       imgst_file* imgstfile _unused)
+{
+    THROW_ERR_IF(nc == NULL || hm == NULL, nc, ERR_INVALID_ARGUMENT);
+
+    char* json = NULL;
+    size_t len = 0;
+    THROW_IF_CALL_FAILS_DO(trace_dump(&json, &len), , nc);
+
+    char reset[2] = {0};
+    if (mg_http_get_var(&(hm->query), "reset", reset, sizeof(reset)) > 0 && reset[0] == '1') {
+        trace_reset();
+    }
+
+    mg_printf(nc,
+              "HTTP/1.1 %d OK\r\n"
+              "Content-Type: application/json\r\n"
+              "Content-Length: %zu\r\n\r\n", HTTP_RESPONSE_CODE, len);
+    mg_send(nc, json, len);
+    FREE_DEREF(json);
+}
+
+/**
+ * Appends a record of a request to the access log. The reply is the part of
+ * the send buffer past sent_before, queued by the handler.
+ */
+static void log_access(struct mg_connection *nc, struct mg_http_message *hm, int endpoint,
+                       uint64_t start, size_t sent_before)
+{
+    access_record record;
+    memset(&record, 0, sizeof(record));
+    record.time_us = start;
+    record.latency_us = (uint32_t)(access_log_now_us() - start);
+    record.endpoint = (uint8_t) endpoint;
+    record.request_bytes = (uint32_t) hm->body.len;
+
+    if (nc->send.len > sent_before) {
+        record.bytes = (uint32_t)(nc->send.len - sent_before);
+        int status = 0;
+        char head[sizeof("HTTP/1.1 000")] = {0};
+        memcpy(head, nc->send.buf + sent_before,
+               (record.bytes < sizeof(head) - 1) ? record.bytes : sizeof(head) - 1);
+        if (sscanf(head, "HTTP/1.%*d %d", &status) == 1) {
+            record.status = (uint16_t) status;
+        }
+    }
+
+    char value[ENCODE_URI_SCALE * MAX_IMG_ID + JPG_EXT + 1] = {0};
+
+    if (mg_http_get_var(&(hm->query), "img_id", value, sizeof(value)) > 0
+        || mg_http_get_var(&(hm->query), "name", value, sizeof(value)) > 0) {
+        record.id_hash = access_log_hash(value);
+    }
+
+    record.res = (int8_t) get_res_of_query(hm);
+
+    if (endpoint == ACCESS_INSERT && mg_http_get_var(&(hm->query), "offset", value, sizeof(value)) > 0) {
+        record.offset = atouint32(value);
+    }
+
+    fwrite(&record, sizeof(record), 1, s_access_log);
+}
+
+/**
+ * Attempts to serve the HTTP message with an appropriate handler.
+ */
+static void imgst_event_handler(struct mg_connection *nc,
+                                int ev,
+                                void *ev_data,
+                                void *fn_data)
+{
+    // Exports and batch reads go on as their bytes are sent, and stop with their connection
+    if (ev == MG_EV_WRITE || ev == MG_EV_POLL || ev == MG_EV_CLOSE) {
+        export_stream* x = find_export(nc);
+        batch_stream* b = find_batch(nc);
+
+        if (x != NULL) {
+            store_lock(STORE_SHARED);
+            if (ev == MG_EV_CLOSE) {
+                end_export(x);
+            } else {
+                continue_export(x);
+            }
+            store_unlock();
+        }
+
+        if (b != NULL) {
+            store_lock(STORE_SHARED);
+            if (ev == MG_EV_CLOSE) {
+                end_batch(b);
+            } else {
+                continue_batch(b, ((data*) fn_data)->imgstfile);
+
+                // Rendered variants are seen by the followers like those of a handler
+                if (t_store_lock == STORE_EXCLUSIVE) {
+                    change_log_commit(((data*) fn_data)->imgstfile);
+                }
+            }
+            store_unlock();
+        }
+    }
+
+    // If the event is of type HTTP message
+    if (ev == MG_EV_HTTP_MSG) {
+        struct mg_http_message *hm = (struct mg_http_message*) ev_data;
+        data* d = (data*) fn_data;
+        imgst_file* imgstfile = d->imgstfile;
+        const handler_mapping* handlers = d->handlers;
+
+        // Search for a handler
+        int found = 0;
+        int endpoint = ACCESS_STATIC;
+        const uint64_t logged = (s_access_log != NULL) ? access_log_now_us() : 0;
+        const uint64_t start = monotonic_us();
+        const size_t sent_before = nc->send.len;
+
+        for (size_t i = 0; i < NB_HANDLERS; ++i) {
+
+            // The URI and the method type should match
+            const char* method = handlers[i].method;
+
+            if (mg_http_match_uri(hm, handlers[i].uri)
+                && mg_globmatch(method, strlen(method), hm->method.ptr, hm->method.len)) {
+
+                store_lock(handlers[i].lock);
+                handlers[i].call(nc, hm, imgstfile);
+
+                // The followers see the changes once the handler is done with them
+                if (t_store_lock == STORE_EXCLUSIVE) {
+                    change_log_commit(imgstfile);
+                }
+                store_unlock();
+                endpoint = access_log_endpoint(handlers[i].uri);
+                found = 1;
+            }
+        }
+
+        // If no handlers were found, just return static data.
+        if (!found) {
+
+            // No SSI file name pattern, no extra HTTP headers
+            struct mg_http_serve_opts opts = {.root_dir = s_web_directory};
+            mg_http_serve_dir(nc, ev_data, &opts);
+        }
+
+        count_request(nc, hm, endpoint, monotonic_us() - start, sent_before);
+
+        if (s_access_log != NULL) {
+            log_access(nc, hm, endpoint, logged, sent_before);
+        }
+    }
+}
+
+/**
+ * Polls the event handler of a manager every second.
+ */
+static void* run_event_loop(void* arg)
+{
+    struct mg_mgr* mgr = arg;
+
+    for (;;) {
+        mg_mgr_poll(mgr, POLL_PERIOD_MS);
+        if (s_access_log != NULL) fflush(s_access_log);
+    }
+
+    return NULL;
+}
+
+/**
+ * Applies the changes of the writer of the imgStore, for a -follow server,
+ * with the imgStore to this thread alone while slots change.
+ */
+static void* run_follower(void* arg)
+{
+    imgst_file* imgstfile = arg;
+    const struct timespec period = {0, FOLLOW_PERIOD_MS * 1000000L};
+    int reported = ERR_NONE;
+
+    for (;;) {
+        nanosleep(&period, NULL);
+
+        // After imgStoreMgr gc, say, the slots no longer match the new file.
+        // The readers run without lock, so it cannot be swapped under them:
+        // stop, for the follower to be started again on the new file.
+        if (follow_replaced(&s_follower, imgstfile)) {
+            fprintf(stderr, "The imgStore file was replaced: stopping the follower\n");
+            if (s_access_log != NULL) fflush(s_access_log);
+            exit(ERR_IO);
+        }
+
+        if (!follow_pending(&s_follower, imgstfile)) {
+            continue;
+        }
+
+        size_t changed = 0;
+        store_lock(STORE_EXCLUSIVE);
+        const int err = do_follow(&s_follower, imgstfile, &changed);
+        store_unlock();
+
+        // Once per error, not at every period
+        if (err != ERR_NONE && err != reported) {
+            fprintf(stderr, "Error following the imgStore: %s\n", ERR_MESSAGES[err]);
+        }
+        reported = err;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    // VIPS_INIT
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("unable to start VIPS");
+        return ERR_IMGLIB;
+    }
+
+    IF_ERR_PRINT_EXIT(argc < MIN_SERVER_ARGS, ERR_NOT_ENOUGH_ARGUMENTS);
+
+    argc--; argv++; // skips command call name
 
     // Get the name of the imgStore file
     const char* imgstore_filename = argv[0];
     IF_ERR_PRINT_EXIT(imgstore_filename == NULL, ERR_INVALID_ARGUMENT);
 
-    // Open the imgStore file
+    argc--; argv++; // skips imgStore file name
+
+    // Parse the options
+    int follow = 0;
+    int trace = 0;
+
+    while (argc > 0) {
+        if (!strcmp(argv[0], "-buckets")) {
+            IF_ERR_PRINT_EXIT(argc < 2, ERR_NOT_ENOUGH_ARGUMENTS);
+            IF_ERR_PRINT_EXIT(parse_buckets(argv[1], s_buckets, &s_nb_buckets) != ERR_NONE,
+                              ERR_INVALID_ARGUMENT);
+            argc -= 2; argv += 2;
+
+        } else if (!strcmp(argv[0], "-threads")) {
+            IF_ERR_PRINT_EXIT(argc < 2, ERR_NOT_ENOUGH_ARGUMENTS);
+            s_nb_threads = atouint32(argv[1]);
+            IF_ERR_PRINT_EXIT(s_nb_threads == 0 || s_nb_threads > MAX_THREADS, ERR_INVALID_ARGUMENT);
+            argc -= 2; argv += 2;
+
+        } else if (!strcmp(argv[0], "-address")) {
+            IF_ERR_PRINT_EXIT(argc < 2, ERR_NOT_ENOUGH_ARGUMENTS);
+            s_listening_address = argv[1];
+            argc -= 2; argv += 2;
+
+        } else if (!strcmp(argv[0], "-follow")) {
+            follow = 1;
+            argc -= 1; argv += 1;
+
+        } else if (!strcmp(argv[0], "-trace")) {
+            trace = 1;
+            argc -= 1; argv += 1;
+
+        } else if (!strcmp(argv[0], "-access_log")) {
+            IF_ERR_PRINT_EXIT(argc < 2, ERR_NOT_ENOUGH_ARGUMENTS);
+            IF_ERR_PRINT_EXIT(access_log_open(argv[1], &s_access_log) != ERR_NONE, ERR_IO);
+            argc -= 2; argv += 2;
+
+        } else {
+            IF_ERR_PRINT_EXIT(1, ERR_INVALID_ARGUMENT);
+        }
+    }
+
+    // Keep the trace spans for /trace, only when asked to
+    if (trace) {
+        trace_flags |= TRACE_RING;
+    }
+
+    // Open the imgStore file: a follower only reads it, after its one writer
     imgst_file imgstfile;
-    IF_ERR_PRINT_EXIT(do_open(imgstore_filename, "rb+", &imgstfile) != ERR_NONE, ERR_IO);
+    size_t resumed = 0;
+
+    if (follow) {
+        IF_ERR_PRINT_EXIT(do_follow_open(imgstore_filename, &s_follower, &imgstfile) != ERR_NONE, ERR_IO);
+    } else {
+        IF_ERR_PRINT_EXIT(do_open(imgstore_filename, "rb+", &imgstfile) != ERR_NONE, ERR_IO);
+        IF_ERR_PRINT_EXIT(change_log_open(imgstore_filename, 1, &imgstfile) != ERR_NONE, ERR_IO);
+
+        // Resume the uploads that were in progress
+        resumed = load_uploads(imgstore_filename, &imgstfile);
+        change_log_commit(&imgstfile);
+    }
 
     // Map the handlers
     handler_mapping handlers[NB_HANDLERS] = {
-        {"/imgStore/list", "GET", handle_list_call},
-        {"/imgStore/read", "GET", handle_read_call},
-        {"/imgStore/delete", "GET", handle_delete_call},
-        {"/imgStore/insert", "POST", handle_insert_call},
+        {"/imgStore/list", "GET", handle_list_call, STORE_SHARED},
+        {"/imgStore/read", "GET", handle_read_call, STORE_UNLOCKED},
+        {"/imgStore/delete", "GET", handle_delete_call, STORE_EXCLUSIVE},
+        {"/imgStore/insert", "POST", handle_insert_call, STORE_EXCLUSIVE},
+        {"/imgStore/exists", "GET", handle_exists_call, STORE_SHARED},
+        {"/imgStore/link", "POST", handle_link_call, STORE_EXCLUSIVE},
+        {"/imgStore/upload", "GET", handle_upload_call, STORE_EXCLUSIVE},
+        {"/imgStore/manifest", "GET", handle_manifest_call, STORE_SHARED},
+        {"/imgStore/batch", "POST", handle_batch_call, STORE_SHARED},
+        {"/imgStore/sprite", "GET", handle_sprite_call, STORE_SHARED},
+        {"/imgStore/sprite/map", "GET", handle_sprite_map_call, STORE_SHARED},
+        {"/imgStore/export", "GET", handle_export_call, STORE_SHARED},
+        {"/metrics", "GET", handle_metrics_call, STORE_SHARED},
+        {"/trace", "GET", handle_trace_call, STORE_SHARED},
+        {"/imgStore/stats", "GET", handle_stats_call, STORE_SHARED},
     };
 
     // Create the data structure to be sent to the event handler!
@@ -426,24 +2657,72 @@ int main(int argc, char *argv[])
         handlers, &imgstfile
     };
 
-    // Create the server
-    struct mg_mgr mgr;
-    mg_mgr_init(&mgr);
+    // Create the server: one manager per event loop, all on the same port
+    struct mg_mgr mgrs[MAX_THREADS];
+
+    for (size_t i = 0; i < s_nb_threads; ++i) {
+        mg_mgr_init(&mgrs[i]);
+
+        // Only the loops of this server share the port: another server on it is refused
+        mgrs[i].reuseport = s_nb_threads > 1;
+
+        if (mg_http_listen(&mgrs[i], s_listening_address, imgst_event_handler, &d) == NULL) {
+            fprintf(stderr, "Error starting server on address %s\n", s_listening_address);
 
-    if (mg_http_listen(&mgr, s_listening_address, imgst_event_handler, &d) == NULL) {
-        fprintf(stderr, "Error starting server on address %s\n", s_listening_address);
+            for (size_t j = 0; j <= i; ++j) {
+                mg_mgr_free(&mgrs[j]);
+            }
+            return ERR_IO;
+        }
     }
 
     // Print once after server starts.
     fprintf(stdout, "Starting imgStore server on http://%s\n", s_listening_address);
     print_header(&(imgstfile.header));
 
-    // Poll the event handler every second.
-    for (;;) mg_mgr_poll(&mgr, POLL_PERIOD_MS);
+    if (resumed > 0) {
+        fprintf(stdout, "Resumed %zu upload(s)\n", resumed);
+    }
+
+    // The other event loops run in threads of their own, the first one in this one.
+    // The listener of a loop that cannot start must not take connections.
+    size_t started = 1;
+
+    for (size_t i = 1; i < s_nb_threads; ++i) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, run_event_loop, &mgrs[i]) == 0) {
+            pthread_detach(thread);
+            ++started;
+        } else {
+            mg_mgr_free(&mgrs[i]);
+        }
+    }
+
+    if (s_nb_threads > 1) {
+        fprintf(stdout, "Running %zu event loops\n", started);
+    }
+
+    if (follow) {
+        pthread_t thread;
+        IF_ERR_PRINT_EXIT(pthread_create(&thread, NULL, run_follower, &imgstfile) != 0, ERR_IO);
+        pthread_detach(thread);
+        fprintf(stdout, "Following the writer of %s\n", imgstore_filename);
+    }
+
+    run_event_loop(&mgrs[0]);
 
     // Shut down the server
-    mg_mgr_free(&mgr);
-    do_close(&imgstfile);
+    for (size_t i = 0; i < s_nb_threads; ++i) {
+        mg_mgr_free(&mgrs[i]);
+    }
+    if (s_uploads_file != NULL) fclose(s_uploads_file);
+    if (s_access_log != NULL) fclose(s_access_log);
+    if (follow) {
+        do_follow_close(&s_follower, &imgstfile);
+    } else {
+        do_close(&imgstfile);
+    }
 
     // Shut down VIPS
     vips_shutdown();
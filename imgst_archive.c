@@ -0,0 +1,785 @@
+/**
+ * @file imgst_archive.c
+ * @brief imgStore library: export and import of a whole imgStore as a tar archive
+ *
+ * @author ???
+ */
+#define _POSIX_C_SOURCE 200809L // for pread, posix_fadvise and fileno
+
+#include "imgStore.h"
+#include "variant.h" // for variant_find, variant_append
+#include "error.h"
+
+#include <stdlib.h> // for calloc, qsort, strtoull
+#include <string.h> // for memset, memcmp, strncmp
+#include <inttypes.h> // for PRIo64
+#include <time.h> // for time
+#include <fcntl.h> // for posix_fadvise
+#include <unistd.h> // for dup, pread, close
+#include <json-c/json.h>
+#include <openssl/sha.h> // for SHA256
+
+// The parts of a ustar header that are used
+#define TAR_BLOCK 512
+#define TAR_NAME_LEN 100
+#define TAR_MODE 100
+#define TAR_UID 108
+#define TAR_GID 116
+#define TAR_SIZE 124
+#define TAR_SIZE_LEN 12
+#define TAR_MTIME 136
+#define TAR_CHKSUM 148
+#define TAR_CHKSUM_LEN 8
+#define TAR_TYPEFLAG 156
+#define TAR_MAGIC 257
+#define TAR_VERSION 263
+#define TAR_REGULAR '0'
+
+#define MANIFEST_NAME "manifest.json"
+#define BLOBS_DIR "blobs/"
+#define VARIANTS_DIR "variants/"
+
+#define EXPORT_READ_BLOCK (1 << 20) // bytes read at once from the imgStore file
+#define ARCHIVE_FLUSH 64 // inserts between two writes of the metadata
+
+static const char* const s_format_ext[NB_FMT] = {"jpg", "webp"};
+
+/**
+ * A content to export: an original or a variant.
+ */
+struct export_entry {
+    uint64_t offset;
+    uint32_t size;
+    unsigned char sha[SHA256_DIGEST_LENGTH]; // of the original
+    uint16_t box[DIMS];
+    int format; // -1 for an original
+};
+
+/**
+ * An image of the manifest being imported.
+ */
+typedef struct {
+    char img_id[MAX_IMG_ID + 1];
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    uint32_t res[DIMS];
+    int seen; // whether its blob was found
+} archive_image;
+
+/**
+ * The metadata written by an import but not yet flushed.
+ */
+typedef struct {
+    size_t first;
+    size_t last;
+    size_t nb;
+} dirty_range;
+
+// ======================================================================
+// Tar headers
+
+/**
+ * Rounds a size up to a whole number of blocks.
+ */
+static uint64_t tar_padded(uint64_t size)
+{
+    return (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+/**
+ * Fills a ustar header for a regular file.
+ */
+static void tar_header(char block[TAR_BLOCK], const char* name, uint64_t size, long mtime)
+{
+    memset(block, 0, TAR_BLOCK);
+    strncpy(block, name, TAR_NAME_LEN - 1);
+    snprintf(block + TAR_MODE, 8, "%07o", 0644);
+    snprintf(block + TAR_UID, 8, "%07o", 0);
+    snprintf(block + TAR_GID, 8, "%07o", 0);
+    snprintf(block + TAR_SIZE, TAR_SIZE_LEN, "%011" PRIo64, size);
+    snprintf(block + TAR_MTIME, 12, "%011lo", (unsigned long) mtime);
+    block[TAR_TYPEFLAG] = TAR_REGULAR;
+    memcpy(block + TAR_MAGIC, "ustar", 6);
+    memcpy(block + TAR_VERSION, "00", 2);
+
+    // The checksum is computed with its own field made of spaces
+    memset(block + TAR_CHKSUM, ' ', TAR_CHKSUM_LEN);
+    unsigned int sum = 0;
+
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        sum += (unsigned char) block[i];
+    }
+
+    snprintf(block + TAR_CHKSUM, TAR_CHKSUM_LEN - 1, "%06o", sum);
+    block[TAR_CHKSUM + TAR_CHKSUM_LEN - 1] = ' ';
+}
+
+/**
+ * Checks a ustar header and reads its name, size and type. Returns
+ * ERR_FILE_NOT_FOUND for the zero block that ends an archive.
+ */
+static int tar_parse(const char block[TAR_BLOCK], char name[TAR_NAME_LEN + 1],
+                     uint64_t* size, char* type)
+{
+    unsigned int sum = 0;
+    int zero = 1;
+
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        const int in_chksum = i >= TAR_CHKSUM && i < TAR_CHKSUM + TAR_CHKSUM_LEN;
+        sum += in_chksum ? ' ' : (unsigned char) block[i];
+        zero &= block[i] == '\0';
+    }
+
+    if (zero) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    char field[TAR_SIZE_LEN + 1] = {0};
+    memcpy(field, block + TAR_CHKSUM, TAR_CHKSUM_LEN);
+    M_EXIT_IF(strtoul(field, NULL, 8) != sum || strncmp(block + TAR_MAGIC, "ustar", 5),
+              ERR_INVALID_ARGUMENT, "not a tar header", );
+
+    memcpy(name, block, TAR_NAME_LEN);
+    name[TAR_NAME_LEN] = '\0';
+
+    memset(field, 0, sizeof(field));
+    memcpy(field, block + TAR_SIZE, TAR_SIZE_LEN);
+    *size = strtoull(field, NULL, 8);
+    *type = block[TAR_TYPEFLAG];
+
+    return ERR_NONE;
+}
+
+// ======================================================================
+// Export
+
+/**
+ * Compares two entries by SHA, then format and box, to find duplicates.
+ */
+static int entry_content_compare(const void* a, const void* b)
+{
+    const struct export_entry* e1 = a;
+    const struct export_entry* e2 = b;
+    const int c = memcmp(e1->sha, e2->sha, SHA256_DIGEST_LENGTH);
+
+    if (c != 0) return c;
+    if (e1->format != e2->format) return (e1->format < e2->format) ? -1 : 1;
+    if (e1->box[0] != e2->box[0]) return (e1->box[0] < e2->box[0]) ? -1 : 1;
+    if (e1->box[1] != e2->box[1]) return (e1->box[1] < e2->box[1]) ? -1 : 1;
+
+    return 0;
+}
+
+/**
+ * Compares two entries by offset.
+ */
+static int entry_offset_compare(const void* a, const void* b)
+{
+    const struct export_entry* e1 = a;
+    const struct export_entry* e2 = b;
+
+    return (e1->offset > e2->offset) - (e1->offset < e2->offset);
+}
+
+/**
+ * Builds the list of the contents to export, each one once, by offset.
+ */
+static int export_entries(imgst_export* export, int with_variants, const imgst_file* imgstfile)
+{
+    const variant_table* t = imgstfile->variants;
+    const size_t max = imgstfile->header.max_files + ((with_variants && t != NULL) ? t->nb : 0);
+
+    if (max == 0) {
+        return ERR_NONE;
+    }
+
+    struct export_entry* entries = calloc(max, sizeof(struct export_entry));
+    M_EXIT_IF_NULL(entries, max * sizeof(struct export_entry));
+
+    size_t nb = 0;
+
+    for (size_t i = 0; i < imgstfile->header.max_files; ++i) {
+        const img_metadata* m = &imgstfile->metadata[i];
+
+        if (m->is_valid == NON_EMPTY) {
+            entries[nb].offset = m->offset[RES_ORIG];
+            entries[nb].size = m->size[RES_ORIG];
+            memcpy(entries[nb].sha, m->SHA, SHA256_DIGEST_LENGTH);
+            entries[nb].format = -1;
+            ++nb;
+        }
+    }
+
+    // Only the variants of the images still in their slot
+    for (uint32_t i = 0; with_variants && t != NULL && i < t->nb; ++i) {
+        const img_variant* v = &t->records[i];
+        const img_metadata* m = &imgstfile->metadata[v->slot];
+
+        if (m->is_valid == NON_EMPTY && !memcmp(v->SHA, m->SHA, SHA256_DIGEST_LENGTH)) {
+            entries[nb].offset = v->offset;
+            entries[nb].size = v->size;
+            memcpy(entries[nb].sha, v->SHA, SHA256_DIGEST_LENGTH);
+            memcpy(entries[nb].box, v->box, sizeof(v->box));
+            entries[nb].format = v->format;
+            ++nb;
+        }
+    }
+
+    // A content shared by many images is written once
+    qsort(entries, nb, sizeof(struct export_entry), entry_content_compare);
+    size_t unique = 0;
+
+    for (size_t i = 0; i < nb; ++i) {
+        if (unique == 0 || entry_content_compare(&entries[unique - 1], &entries[i]) != 0) {
+            entries[unique++] = entries[i];
+        }
+    }
+
+    qsort(entries, unique, sizeof(struct export_entry), entry_offset_compare);
+
+    export->entries = entries;
+    export->nb_entries = unique;
+
+    return ERR_NONE;
+}
+
+/**
+ * Adds a pair of unsigned integers to a JSON object.
+ */
+static void json_add_pair(struct json_object* object, const char* key, uint32_t a, uint32_t b)
+{
+    struct json_object* pair = json_object_new_array();
+    json_object_array_add(pair, json_object_new_int64(a));
+    json_object_array_add(pair, json_object_new_int64(b));
+    json_object_object_add(object, key, pair);
+}
+
+/**
+ * Writes the manifest: the images with their SHA and resolution, and the
+ * variants that are exported.
+ */
+static int export_manifest(imgst_export* export, const imgst_file* imgstfile)
+{
+    struct json_object* root = json_object_new_object();
+    struct json_object* images = json_object_new_array();
+    struct json_object* variants = json_object_new_array();
+
+    if (root == NULL || images == NULL || variants == NULL) {
+        json_object_put(root);
+        json_object_put(images);
+        json_object_put(variants);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    json_object_object_add(root, "max_files", json_object_new_int64(imgstfile->header.max_files));
+    json_object_object_add(root, "images", images);
+    json_object_object_add(root, "variants", variants);
+
+    char sha[2 * SHA256_DIGEST_LENGTH + 1];
+
+    for (size_t i = 0; i < imgstfile->header.max_files; ++i) {
+        const img_metadata* m = &imgstfile->metadata[i];
+
+        if (m->is_valid == NON_EMPTY) {
+            struct json_object* image = json_object_new_object();
+            sha_to_string(m->SHA, sha);
+            json_object_object_add(image, "img_id", json_object_new_string(m->img_id));
+            json_object_object_add(image, "sha", json_object_new_string(sha));
+            json_add_pair(image, "res_orig", m->res_orig[0], m->res_orig[1]);
+            json_object_array_add(images, image);
+        }
+    }
+
+    for (size_t i = 0; i < export->nb_entries; ++i) {
+        const struct export_entry* e = &export->entries[i];
+
+        if (e->format >= 0) {
+            struct json_object* variant = json_object_new_object();
+            sha_to_string(e->sha, sha);
+            json_object_object_add(variant, "sha", json_object_new_string(sha));
+            json_add_pair(variant, "box", e->box[0], e->box[1]);
+            json_object_object_add(variant, "format", json_object_new_string(s_format_ext[e->format]));
+            json_object_array_add(variants, variant);
+        }
+    }
+
+    // Copy the string before it goes away with the JSON object
+    const char* json = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PLAIN);
+    export->manifest_size = strlen(json);
+    export->manifest = calloc(export->manifest_size + 1, sizeof(char));
+
+    if (export->manifest != NULL) {
+        memcpy(export->manifest, json, export->manifest_size);
+    }
+
+    json_object_put(root);
+    M_EXIT_IF_NULL(export->manifest, export->manifest_size + 1);
+
+    return ERR_NONE;
+}
+
+/**
+ * Starts exporting the imgStore as a tar archive.
+ */
+int do_export_begin(imgst_export* export, int with_variants, const imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(export);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->file);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    memset(export, 0, sizeof(imgst_export));
+    export->fd = -1;
+    export->mtime = (long) time(NULL);
+
+    // The contents are read with a descriptor of their own, which does not
+    // move the position of the imgStore stream
+    if (fflush(imgstfile->file) != 0 || (export->fd = dup(fileno(imgstfile->file))) < 0) {
+        return ERR_IO;
+    }
+
+    // The whole file is read once, from its beginning to its end
+    posix_fadvise(export->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int ret = export_entries(export, with_variants, imgstfile);
+
+    if (ret == ERR_NONE) {
+        ret = export_manifest(export, imgstfile);
+    }
+
+    // Known beforehand, so that it can be announced
+    export->size = TAR_BLOCK + tar_padded(export->manifest_size) + 2 * TAR_BLOCK;
+
+    for (size_t i = 0; i < export->nb_entries; ++i) {
+        export->size += TAR_BLOCK + tar_padded(export->entries[i].size);
+    }
+
+    if (ret == ERR_NONE && (export->block = malloc(EXPORT_READ_BLOCK)) == NULL) {
+        ret = ERR_OUT_OF_MEMORY;
+    }
+
+    if (ret != ERR_NONE) {
+        do_export_end(export);
+    }
+
+    return ret;
+}
+
+/**
+ * Writes the zero bytes that pad an entry to a whole number of blocks.
+ */
+static int export_padding(uint64_t size, export_writer writer, void* arg)
+{
+    static const char zeros[TAR_BLOCK] = {0};
+    const size_t padding = (size_t)(tar_padded(size) - size);
+
+    return (padding == 0) ? ERR_NONE : writer(zeros, padding, arg);
+}
+
+/**
+ * Writes a content read from the imgStore file.
+ */
+static int export_content(imgst_export* export, const struct export_entry* e,
+                          export_writer writer, void* arg)
+{
+    char name[TAR_NAME_LEN];
+    char sha[2 * SHA256_DIGEST_LENGTH + 1];
+    sha_to_string(e->sha, sha);
+
+    if (e->format < 0) {
+        snprintf(name, sizeof(name), BLOBS_DIR "%s", sha);
+    } else {
+        snprintf(name, sizeof(name), VARIANTS_DIR "%s/%ux%u.%s", sha,
+                 (unsigned) e->box[0], (unsigned) e->box[1], s_format_ext[e->format]);
+    }
+
+    char header[TAR_BLOCK];
+    tar_header(header, name, e->size, export->mtime);
+    M_EXIT_IF_ERR(writer(header, TAR_BLOCK, arg));
+
+    // Large sequential reads, as the entries follow each other in the file
+    for (uint64_t done = 0; done < e->size; ) {
+        const size_t len = (e->size - done < EXPORT_READ_BLOCK) ? (size_t)(e->size - done) : EXPORT_READ_BLOCK;
+        const ssize_t got = pread(export->fd, export->block, len, (off_t)(e->offset + done));
+
+        if (got <= 0) {
+            return ERR_IO;
+        }
+
+        M_EXIT_IF_ERR(writer(export->block, (size_t) got, arg));
+        done += (uint64_t) got;
+    }
+
+    return export_padding(e->size, writer, arg);
+}
+
+/**
+ * Writes the next entry of the archive, or its end.
+ */
+int do_export_next(imgst_export* export, export_writer writer, void* arg)
+{
+    M_REQUIRE_NON_NULL(export);
+    M_REQUIRE_NON_NULL(writer);
+
+    if (export->done) {
+        return ERR_NONE;
+    }
+
+    // Step 1: the manifest, so that an import knows the images beforehand
+    if (export->next == 0) {
+        char header[TAR_BLOCK];
+        tar_header(header, MANIFEST_NAME, export->manifest_size, export->mtime);
+        M_EXIT_IF_ERR(writer(header, TAR_BLOCK, arg));
+        M_EXIT_IF_ERR(writer(export->manifest, export->manifest_size, arg));
+        M_EXIT_IF_ERR(export_padding(export->manifest_size, writer, arg));
+
+    // Step 2: the contents
+    } else if (export->next <= export->nb_entries) {
+        M_EXIT_IF_ERR(export_content(export, &export->entries[export->next - 1], writer, arg));
+
+    // Step 3: two zero blocks end the archive
+    } else {
+        static const char end[2 * TAR_BLOCK] = {0};
+        M_EXIT_IF_ERR(writer(end, sizeof(end), arg));
+        export->done = 1;
+    }
+
+    export->next += 1;
+
+    return ERR_NONE;
+}
+
+/**
+ * Releases the export state.
+ */
+void do_export_end(imgst_export* export)
+{
+    if (export == NULL) {
+        return;
+    }
+
+    if (export->fd >= 0) {
+        close(export->fd);
+    }
+
+    FREE_DEREF(export->entries);
+    FREE_DEREF(export->manifest);
+    FREE_DEREF(export->block);
+    export->fd = -1;
+}
+
+/**
+ * Writes to a stream, for do_export.
+ */
+static int file_writer(const void* buffer, size_t size, void* arg)
+{
+    return (size == 0 || fwrite(buffer, size, 1, (FILE*) arg) == 1) ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * Exports the whole imgStore as a tar archive to a stream.
+ */
+int do_export(FILE* out, int with_variants, const imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(out);
+
+    imgst_export export;
+    M_EXIT_IF_ERR(do_export_begin(&export, with_variants, imgstfile));
+
+    int ret = ERR_NONE;
+
+    while (ret == ERR_NONE && !export.done) {
+        ret = do_export_next(&export, file_writer, out);
+    }
+
+    do_export_end(&export);
+
+    return (ret == ERR_NONE && fflush(out) != 0) ? ERR_IO : ret;
+}
+
+// ======================================================================
+// Import
+
+/**
+ * Reads exactly size bytes of a stream.
+ */
+static int read_exactly(FILE* in, void* buffer, size_t size)
+{
+    return (size == 0 || fread(buffer, size, 1, in) == 1) ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * Reads the content of an entry and the padding after it.
+ */
+static int read_entry(FILE* in, char** buffer, uint64_t size)
+{
+    M_EXIT_IF(size > UINT32_MAX, ERR_INVALID_ARGUMENT, "entry of %" PRIu64 " bytes", size);
+
+    *buffer = malloc(size + 1);
+    M_EXIT_IF_NULL(*buffer, (size_t) size + 1);
+    (*buffer)[size] = '\0';
+
+    char padding[TAR_BLOCK];
+    const size_t padding_size = (size_t)(tar_padded(size) - size);
+
+    if (read_exactly(in, *buffer, size) != ERR_NONE
+        || read_exactly(in, padding, padding_size) != ERR_NONE) {
+        FREE_DEREF(*buffer);
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Compares two archive images by SHA.
+ */
+static int image_sha_compare(const void* a, const void* b)
+{
+    return memcmp(((const archive_image*) a)->sha, ((const archive_image*) b)->sha,
+                  SHA256_DIGEST_LENGTH);
+}
+
+/**
+ * Reads the images of the manifest, sorted by SHA.
+ */
+static int parse_manifest(const char* json, archive_image** images, size_t* nb_images)
+{
+    struct json_object* root = json_tokener_parse(json);
+    struct json_object* array = NULL;
+
+    if (root == NULL || !json_object_object_get_ex(root, "images", &array)
+        || !json_object_is_type(array, json_type_array)) {
+        json_object_put(root);
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const size_t nb = json_object_array_length(array);
+    archive_image* list = calloc(nb + 1, sizeof(archive_image));
+
+    if (list == NULL) {
+        json_object_put(root);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int ret = ERR_NONE;
+
+    for (size_t i = 0; i < nb && ret == ERR_NONE; ++i) {
+        struct json_object* image = json_object_array_get_idx(array, i);
+        struct json_object* img_id = NULL;
+        struct json_object* sha = NULL;
+        struct json_object* res = NULL;
+
+        if (!json_object_object_get_ex(image, "img_id", &img_id)
+            || !json_object_object_get_ex(image, "sha", &sha)
+            || !json_object_object_get_ex(image, "res_orig", &res)
+            || json_object_array_length(res) != DIMS
+            || strlen(json_object_get_string(img_id)) > MAX_IMG_ID
+            || sha_from_string(json_object_get_string(sha), list[i].sha) != ERR_NONE) {
+            ret = ERR_INVALID_ARGUMENT;
+            continue;
+        }
+
+        strncpy(list[i].img_id, json_object_get_string(img_id), MAX_IMG_ID);
+        list[i].res[0] = (uint32_t) json_object_get_int64(json_object_array_get_idx(res, 0));
+        list[i].res[1] = (uint32_t) json_object_get_int64(json_object_array_get_idx(res, 1));
+    }
+
+    json_object_put(root);
+
+    if (ret != ERR_NONE) {
+        FREE_DEREF(list);
+        return ret;
+    }
+
+    qsort(list, nb, sizeof(archive_image), image_sha_compare);
+    *images = list;
+    *nb_images = nb;
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes the metadata inserted since the last flush, then the header.
+ */
+static int flush_dirty(dirty_range* dirty, imgst_file* imgstfile)
+{
+    if (dirty->nb == 0) {
+        return ERR_NONE;
+    }
+
+    M_EXIT_IF_ERR(updateMetadataRange(dirty->first, dirty->last - dirty->first + 1, imgstfile));
+    M_EXIT_IF_ERR(updateHeader(imgstfile));
+
+    dirty->first = imgstfile->header.max_files;
+    dirty->last = 0;
+    dirty->nb = 0;
+
+    return ERR_NONE;
+}
+
+/**
+ * Inserts a blob under all the imgIDs the manifest gives it.
+ */
+static int import_blob(const char* sha_string, const char* buffer, uint32_t size,
+                       archive_image* images, size_t nb_images, import_stats* stats,
+                       dirty_range* dirty, imgst_file* imgstfile)
+{
+    // The content must be the one its name tells
+    archive_image key;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+
+    if (sha_from_string(sha_string, key.sha) != ERR_NONE
+        || memcmp(SHA256((const unsigned char*) buffer, size, sha), key.sha, SHA256_DIGEST_LENGTH)) {
+        debug_print("corrupted blob %s", sha_string);
+        stats->errors += 1;
+        return ERR_NONE;
+    }
+
+    // Go to the first image with this SHA
+    archive_image* image = bsearch(&key, images, nb_images, sizeof(archive_image), image_sha_compare);
+
+    while (image != NULL && image > images && !image_sha_compare(image - 1, &key)) {
+        --image;
+    }
+
+    for (; image != NULL && image < images + nb_images && !image_sha_compare(image, &key); ++image) {
+        size_t index = 0;
+        const int err = do_insert_prepared(buffer, size, image->sha, image->res[0], image->res[1],
+                                           image->img_id, imgstfile, &index);
+        image->seen = 1;
+
+        switch (err) {
+        case ERR_NONE:
+            dirty->first = (index < dirty->first) ? index : dirty->first;
+            dirty->last = (index > dirty->last) ? index : dirty->last;
+            dirty->nb += 1;
+            stats->imported += 1;
+            stats->bytes += size;
+            break;
+        case ERR_DUPLICATE_ID:
+            stats->duplicates += 1;
+            break;
+        case ERR_FULL_IMGSTORE:
+        case ERR_IO:
+            return err;
+        default:
+            stats->errors += 1;
+        }
+    }
+
+    return (dirty->nb >= ARCHIVE_FLUSH) ? flush_dirty(dirty, imgstfile) : ERR_NONE;
+}
+
+/**
+ * Appends a variant to the image that has its original, unless it is there.
+ */
+static int import_variant(const char* name, const char* buffer, uint32_t size,
+                          import_stats* stats, imgst_file* imgstfile)
+{
+    char sha_string[2 * SHA256_DIGEST_LENGTH + 1] = {0};
+    char ext[5] = {0};
+    unsigned int width = 0, height = 0;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    size_t idx = 0;
+    int format = -1;
+
+    if (sscanf(name, VARIANTS_DIR "%64[0-9a-f]/%ux%u.%4s", sha_string, &width, &height, ext) == 4) {
+        for (int f = 0; f < NB_FMT; ++f) {
+            format = strcmp(ext, s_format_ext[f]) ? format : f;
+        }
+    }
+
+    if (format < 0 || width > UINT16_MAX || height > UINT16_MAX
+        || sha_from_string(sha_string, sha) != ERR_NONE
+        || findContentIndex(&idx, sha, imgstfile) != ERR_NONE) {
+        stats->errors += 1;
+        return ERR_NONE;
+    }
+
+    const uint16_t box[DIMS] = {(uint16_t) width, (uint16_t) height};
+    const img_variant* variant = NULL;
+
+    if (variant_find(&variant, idx, box, format, imgstfile) == ERR_NONE) {
+        return ERR_NONE;
+    }
+
+    return variant_append(idx, box, format, buffer, size, imgstfile);
+}
+
+/**
+ * Imports a tar archive made by do_export.
+ */
+int do_import_archive(FILE* in, import_stats* stats, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(in);
+    M_REQUIRE_NON_NULL(stats);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    memset(stats, 0, sizeof(import_stats));
+
+    archive_image* images = NULL;
+    size_t nb_images = 0;
+    dirty_range dirty = {.first = imgstfile->header.max_files};
+    int ret = ERR_NONE;
+
+    for (;;) {
+        char block[TAR_BLOCK];
+        char name[TAR_NAME_LEN + 1];
+        uint64_t size = 0;
+        char type = 0;
+
+        if ((ret = read_exactly(in, block, TAR_BLOCK)) != ERR_NONE
+            || (ret = tar_parse(block, name, &size, &type)) != ERR_NONE) {
+            break;
+        }
+
+        char* buffer = NULL;
+
+        if ((ret = read_entry(in, &buffer, size)) != ERR_NONE) {
+            break;
+        }
+
+        // Step 1: the manifest comes first
+        if (images == NULL) {
+            ret = (type == TAR_REGULAR && !strcmp(name, MANIFEST_NAME))
+                  ? parse_manifest(buffer, &images, &nb_images) : ERR_INVALID_ARGUMENT;
+
+        // Step 2: originals, then variants once their original is inserted
+        } else if (type == TAR_REGULAR && !strncmp(name, BLOBS_DIR, strlen(BLOBS_DIR))) {
+            ret = import_blob(name + strlen(BLOBS_DIR), buffer, (uint32_t) size,
+                              images, nb_images, stats, &dirty, imgstfile);
+
+        } else if (type == TAR_REGULAR && !strncmp(name, VARIANTS_DIR, strlen(VARIANTS_DIR))) {
+            ret = flush_dirty(&dirty, imgstfile);
+
+            if (ret == ERR_NONE) {
+                ret = import_variant(name, buffer, (uint32_t) size, stats, imgstfile);
+            }
+        }
+
+        FREE_DEREF(buffer);
+
+        if (ret != ERR_NONE) {
+            break;
+        }
+    }
+
+    // The zero block that ends the archive is the expected way out
+    if (ret == ERR_FILE_NOT_FOUND) {
+        ret = (images == NULL) ? ERR_INVALID_ARGUMENT : ERR_NONE;
+    }
+
+    // Whatever happened, the images inserted so far are committed
+    const int flushed = flush_dirty(&dirty, imgstfile);
+    ret = (ret == ERR_NONE) ? flushed : ret;
+
+    // Images whose blob is missing could not be imported
+    for (size_t i = 0; i < nb_images; ++i) {
+        stats->errors += !images[i].seen;
+    }
+
+    FREE_DEREF(images);
+
+    return ret;
+}
@@ -6,6 +6,7 @@
  */
 
 #include "imgStore.h"
+#include "dedup.h" // for sha_index_build
 #include "error.h" // for errors
 
 #include <string.h> // for strncpy
@@ -31,10 +32,22 @@ int do_create(const char* imgst_filename, imgst_file* imgstfile)
     imgstfile->header.imgst_version = INIT_VER;
     imgstfile->header.num_files = INIT_NB_FILES;
 
+    // No variant record yet
+    imgstfile->header.num_variants = 0;
+    imgstfile->header.variant_head = INIT_OFFSET;
+    imgstfile->variants = NULL;
+
     /// Explicitly initialize the metadata member
     M_EXIT_IF_NULL(imgstfile->metadata = calloc(imgstfile->header.max_files, sizeof(img_metadata)),
                    sizeof(img_metadata));
 
+    // Empty content index, no reader without lock nor follower
+    imgstfile->content_index = NULL;
+    imgstfile->slot_seq = NULL;
+    imgstfile->changes = NULL;
+    M_EXIT_IF_ERR_DO_SOMETHING(sha_index_build(imgstfile),
+                               FREE_DEREF(imgstfile->metadata));
+
     /// Explicitly initialize the file member
 
     // The pointer to the file we write to
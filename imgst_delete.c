@@ -6,6 +6,7 @@
  */
 
 #include "imgStore.h"
+#include "dedup.h"
 
 #include <string.h>
 
@@ -27,7 +28,10 @@ int do_delete(const char* img_id, imgst_file* imgstfile)
     /// Deletion
 
     // "Delete" the file
+    sha_index_remove(imgstfile, idx);
+    metadata_begin(idx, imgstfile);
     imgstfile->metadata[idx].is_valid = EMPTY;
+    metadata_publish(idx, imgstfile);
 
     // Update the file's copy of the metadata
     M_EXIT_IF_ERR(updateMetadata(idx, imgstfile));
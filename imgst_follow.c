@@ -0,0 +1,315 @@
+/**
+ * @file imgst_follow.c
+ * @brief imgStore library: followers of an imgStore written by another process
+ *
+ * @author ???
+ */
+#define _POSIX_C_SOURCE 200809L // for pread and fileno
+
+#include "imgStore.h"
+#include "variant.h"
+#include "dedup.h"
+#include "error.h"
+#include "trace.h"
+
+#include <stdlib.h> // for calloc
+#include <string.h> // for memcmp, strlen
+#include <unistd.h> // for pread
+#include <sys/stat.h> // for fstat, stat
+
+/**
+ * Reads size bytes at offset of a file, without its FILE position.
+ */
+static int pread_all(FILE* file, void* buffer, const size_t size, const uint64_t offset)
+{
+    const int fd = fileno(file);
+    size_t done = 0;
+
+    while (done < size) {
+        const ssize_t n = pread(fd, (char*) buffer + done, size - done, (off_t)(offset + done));
+        if (n <= 0) {
+            return ERR_IO;
+        }
+        done += (size_t) n;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the count of the change log, 0 if there is none.
+ */
+static int read_log_count(FILE* log, uint64_t* count)
+{
+    *count = 0;
+
+    if (log == NULL) {
+        return ERR_NONE;
+    }
+
+    change_log_header header;
+    M_EXIT_IF_ERR(pread_all(log, &header, sizeof(change_log_header), 0));
+    M_EXIT_IF(memcmp(header.magic, CHANGE_LOG_MAGIC, CHANGE_LOG_MAGIC_LEN) || header.size != CHANGE_LOG_SIZE,
+              ERR_IO, "not a change log", );
+
+    *count = header.count;
+
+    return ERR_NONE;
+}
+
+/**
+ * Opens an imgStore read-only, with the change log of its writer.
+ */
+int do_follow_open(const char* imgst_filename, imgst_follower* follower, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(follower);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    memset(follower, 0, sizeof(imgst_follower));
+
+    const size_t name_len = strlen(imgst_filename) + 1;
+    M_EXIT_IF_NULL(follower->filename = calloc(name_len, sizeof(char)), name_len);
+    memcpy(follower->filename, imgst_filename, name_len);
+
+    const size_t len = strlen(imgst_filename) + strlen(CHANGE_LOG_EXT) + 1;
+    char* filename = NULL;
+    M_EXIT_IF_NULL(filename = calloc(len, sizeof(char)), len);
+    snprintf(filename, len, "%s%s", imgst_filename, CHANGE_LOG_EXT);
+
+    follower->log = fopen(filename, "rb");
+    FREE_DEREF(filename);
+
+    // The count before the metadata: changes made in between are read twice, none is missed
+    M_EXIT_IF_ERR_DO_SOMETHING(read_log_count(follower->log, &follower->count),
+                               do_follow_close(follower, NULL));
+    M_EXIT_IF_ERR_DO_SOMETHING(do_open(imgst_filename, "rb", imgstfile),
+                               do_follow_close(follower, NULL));
+
+    follower->header = imgstfile->header;
+
+    return ERR_NONE;
+}
+
+/**
+ * Tells whether the imgStore file is no longer the one at its path.
+ */
+int follow_replaced(const imgst_follower* follower, const imgst_file* imgstfile)
+{
+    if (follower == NULL || follower->filename == NULL || imgstfile == NULL || imgstfile->file == NULL) {
+        return 0;
+    }
+
+    struct stat opened;
+    struct stat named;
+
+    if (fstat(fileno(imgstfile->file), &opened) != 0) {
+        return 0;
+    }
+
+    return opened.st_nlink == 0 || stat(follower->filename, &named) != 0
+           || opened.st_dev != named.st_dev || opened.st_ino != named.st_ino;
+}
+
+/**
+ * Tells whether the writer changed the imgStore since the last do_follow.
+ */
+int follow_pending(const imgst_follower* follower, const imgst_file* imgstfile)
+{
+    if (follower == NULL || imgstfile == NULL || imgstfile->file == NULL) {
+        return 0;
+    }
+
+    uint64_t count = 0;
+    imgst_header header;
+
+    // A log that cannot be read, or another file, is for do_follow to report
+    if (read_log_count(follower->log, &count) != ERR_NONE || follow_replaced(follower, imgstfile)) {
+        return 1;
+    }
+
+    return count != follower->count
+           || pread_all(imgstfile->file, &header, sizeof(imgst_header), 0) != ERR_NONE
+           || memcmp(&header, &follower->header, sizeof(imgst_header));
+}
+
+/**
+ * Sets the metadata at idx as the writer wrote it, if it changed.
+ */
+static size_t apply_slot(const size_t idx, const img_metadata* metadata, imgst_file* imgstfile)
+{
+    img_metadata* m = &imgstfile->metadata[idx];
+
+    if (!memcmp(m, metadata, sizeof(img_metadata))) {
+        return 0;
+    }
+
+    if (m->is_valid != EMPTY) {
+        sha_index_remove(imgstfile, idx);
+    }
+
+    metadata_begin(idx, imgstfile);
+    *m = *metadata;
+    metadata_publish(idx, imgstfile);
+
+    if (m->is_valid != EMPTY) {
+        sha_index_add(imgstfile, idx);
+    }
+
+    return 1;
+}
+
+/**
+ * Reads the metadata of a slot again.
+ */
+static int follow_slot(const size_t idx, imgst_file* imgstfile, size_t* nb_changed)
+{
+    img_metadata metadata;
+    M_EXIT_IF_ERR(pread_all(imgstfile->file, &metadata, sizeof(img_metadata),
+                            sizeof(imgst_header) + idx * sizeof(img_metadata)));
+
+    *nb_changed += apply_slot(idx, &metadata, imgstfile);
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads all the metadata again, in one read.
+ */
+static int follow_all(imgst_file* imgstfile, size_t* nb_changed)
+{
+    const size_t max_files = imgstfile->header.max_files;
+    img_metadata* metadata = NULL;
+    M_EXIT_IF_NULL(metadata = calloc(max_files, sizeof(img_metadata)), max_files * sizeof(img_metadata));
+
+    M_EXIT_IF_ERR_DO_SOMETHING(pread_all(imgstfile->file, metadata, max_files * sizeof(img_metadata),
+                                         sizeof(imgst_header)),
+                               FREE_DEREF(metadata));
+
+    for (size_t i = 0; i < max_files; ++i) {
+        *nb_changed += apply_slot(i, &metadata[i], imgstfile);
+    }
+
+    FREE_DEREF(metadata);
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the slots of the changes from follower->count to count. Sets all if
+ * the writer went on so far meanwhile that they may have been overwritten.
+ */
+static int follow_log(const imgst_follower* follower, const uint64_t count, imgst_file* imgstfile,
+                      int* all, size_t* nb_changed)
+{
+    const size_t nb = (size_t)(count - follower->count);
+    change_record* records = NULL;
+    M_EXIT_IF_NULL(records = calloc(nb, sizeof(change_record)), nb * sizeof(change_record));
+
+    int ret = ERR_NONE;
+
+    for (size_t i = 0; ret == ERR_NONE && i < nb; ++i) {
+        const uint64_t at = sizeof(change_log_header)
+                            + ((follower->count + i) % CHANGE_LOG_SIZE) * sizeof(change_record);
+        ret = pread_all(follower->log, &records[i], sizeof(change_record), at);
+    }
+
+    // The writer may have overwritten the oldest records while they were read
+    uint64_t after = count;
+
+    if (ret == ERR_NONE) {
+        ret = read_log_count(follower->log, &after);
+    }
+
+    if (ret == ERR_NONE && after - follower->count > CHANGE_LOG_SIZE) {
+        *all = 1;
+    }
+
+    for (size_t i = 0; ret == ERR_NONE && !*all && i < nb; ++i) {
+        if (records[i].slot >= imgstfile->header.max_files) {
+            ret = ERR_IO;
+        } else {
+            ret = follow_slot(records[i].slot, imgstfile, nb_changed);
+        }
+    }
+
+    FREE_DEREF(records);
+
+    return ret;
+}
+
+/**
+ * Reads again what the writer changed since the last call.
+ */
+int do_follow(imgst_follower* follower, imgst_file* imgstfile, size_t* nb_changed)
+{
+    M_REQUIRE_NON_NULL(follower);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->file);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+    M_REQUIRE_NON_NULL(nb_changed);
+
+    *nb_changed = 0;
+
+    M_EXIT_IF(follow_replaced(follower, imgstfile), ERR_IO, "the imgStore file was replaced", );
+
+    uint64_t count = 0;
+    imgst_header header;
+    M_EXIT_IF_ERR(read_log_count(follower->log, &count));
+    M_EXIT_IF_ERR(pread_all(imgstfile->file, &header, sizeof(imgst_header), 0));
+    M_EXIT_IF(header.max_files != imgstfile->header.max_files, ERR_IO,
+              "the imgStore file was replaced", );
+
+    TRACE_BEGIN(do_follow);
+
+    // Drop what the FILE read ahead: the writer may have rewritten the tail since
+    fflush(imgstfile->file);
+
+    // A log that was created again counts from 0: too far either way
+    int all = (follower->log != NULL) ? count - follower->count > CHANGE_LOG_SIZE
+              : header.imgst_version != follower->header.imgst_version;
+    int ret = ERR_NONE;
+
+    if (!all && count != follower->count) {
+        ret = follow_log(follower, count, imgstfile, &all, nb_changed);
+    }
+
+    if (ret == ERR_NONE && all) {
+        ret = follow_all(imgstfile, nb_changed);
+    }
+
+    if (ret == ERR_NONE) {
+        const int new_variants = header.num_variants != follower->header.num_variants
+                                 || header.variant_head != follower->header.variant_head;
+
+        imgstfile->header = header;
+        follower->header = header;
+        follower->count = count;
+
+        if (new_variants) {
+            variant_free(imgstfile);
+            ret = variant_load(imgstfile);
+        }
+    }
+
+    TRACE_END(do_follow);
+
+    return ret;
+}
+
+/**
+ * Closes an imgStore opened by do_follow_open.
+ */
+void do_follow_close(imgst_follower* follower, imgst_file* imgstfile)
+{
+    if (follower != NULL && follower->log != NULL) {
+        fclose(follower->log);
+        follower->log = NULL;
+    }
+
+    if (follower != NULL) {
+        FREE_DEREF(follower->filename);
+    }
+
+    do_close(imgstfile);
+}
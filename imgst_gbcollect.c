@@ -8,7 +8,47 @@
 #include "error.h"
 #include "imgStore.h"
 #include "image_content.h"
+#include "variant.h"
 #include <stdio.h> // for remove and rename
+#include <stdlib.h> // for calloc
+
+
+/**
+ * Copies the variants of the image at index idx of src to the image at index
+ * temp_idx of dst. The content is copied as is, not rendered again.
+ */
+static int copy_variants(imgst_file* src, const size_t idx, imgst_file* dst, const size_t temp_idx)
+{
+    const variant_table* t = src->variants;
+
+    if (t == NULL) {
+        return ERR_NONE;
+    }
+
+    for (uint32_t i = t->head[idx]; i != NO_VARIANT; i = t->next[i]) {
+        const img_variant* v = &t->records[i];
+
+        // Skip the records of a previous image in the same slot
+        if (memcmp(v->SHA, src->metadata[idx].SHA, SHA256_DIGEST_LENGTH) != 0) {
+            continue;
+        }
+
+        char* buffer = NULL;
+        M_EXIT_IF_NULL(buffer = calloc(1, v->size), (size_t) v->size);
+
+        if (fseek(src->file, (long) v->offset, SEEK_SET) != 0
+            || fread(buffer, v->size, 1, src->file) != 1) {
+            FREE_DEREF(buffer);
+            return ERR_IO;
+        }
+
+        M_EXIT_IF_ERR_DO_SOMETHING(variant_append(temp_idx, v->box, v->format, buffer, v->size, dst),
+                                   FREE_DEREF(buffer));
+        FREE_DEREF(buffer);
+    }
+
+    return ERR_NONE;
+}
 
 
 /**
@@ -27,6 +67,7 @@ int do_gbcollect (const char *imgst_path, const char *imgst_tmp_bkp_path)
 
     // Initialize the backup imgStore
     imgst_file imgstfile_temp;
+    memset(&imgstfile_temp.header, 0, sizeof(imgst_header));
     imgstfile_temp.header.max_files = imgstfile_orig.header.max_files;
     memcpy(imgstfile_temp.header.res_resized, imgstfile_orig.header.res_resized,
            2 * (NB_RES - 1) * sizeof(uint16_t));
@@ -70,17 +111,20 @@ int do_gbcollect (const char *imgst_path, const char *imgst_tmp_bkp_path)
                 M_EXIT_IF_ERR_DO_SOMETHING(lazily_resize(RES_SMALL, &imgstfile_temp, temp_idx),
                                            do_close(&imgstfile_orig); do_close(&imgstfile_temp));
             }
+
+            // Keep the variants rendered at other sizes
+            M_EXIT_IF_ERR_DO_SOMETHING(copy_variants(&imgstfile_orig, i, &imgstfile_temp, temp_idx),
+                                       do_close(&imgstfile_orig); do_close(&imgstfile_temp));
         }
     }
 
-    // Closes
-    do_close(&imgstfile_orig);
     do_close(&imgstfile_temp);
 
-    // Make the backup imgStore the new imgStore and delete the old imgStore
-    M_EXIT_IF_ERR(remove(imgst_path));
-    M_EXIT_IF_ERR(rename(imgst_tmp_bkp_path, imgst_path));
-
+    // Make the backup imgStore the new imgStore, replacing the old one at once.
+    // The old one stays open, and so locked, until then: no writer can slip in.
+    const int renamed = rename(imgst_tmp_bkp_path, imgst_path);
+    do_close(&imgstfile_orig);
+    M_EXIT_IF(renamed != 0, ERR_IO, "cannot rename %s", imgst_tmp_bkp_path);
 
     return ERR_NONE;
 
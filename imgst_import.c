@@ -0,0 +1,372 @@
+/**
+ * @file imgst_import.c
+ * @brief imgStore library: bulk import of many images
+ *
+ * @author ???
+ */
+#define _POSIX_C_SOURCE 200809L // for getline
+
+#include "imgStore.h"
+#include "error.h"
+#include "image_content.h"
+
+#include <stdlib.h> // for calloc, realloc, qsort
+#include <string.h> // for strrchr, strcspn, strdup
+#include <dirent.h> // for opendir, readdir
+#include <sys/stat.h> // for stat
+#include <pthread.h>
+#include <openssl/sha.h> // for SHA256
+
+#define IMPORT_BATCH 64 // images read in memory and committed at once
+#define PROBE_SIZE 65536 // bytes searched for a JPEG frame header
+
+/**
+ * An image being imported: filled by the workers, committed by the caller.
+ */
+typedef struct {
+    const char* path;
+    char img_id[MAX_IMG_ID + 1];
+    char* buffer;
+    size_t size;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    uint32_t width;
+    uint32_t height;
+    int err;
+} import_item;
+
+/**
+ * The batch shared by the workers: each one takes the next item to prepare.
+ */
+typedef struct {
+    import_item* items;
+    size_t nb;
+    size_t next;
+    pthread_mutex_t lock;
+} import_batch;
+
+/**
+ * A growable list of paths to import.
+ */
+typedef struct {
+    char** paths;
+    size_t nb;
+    size_t cap;
+} path_list;
+
+/**
+ * Adds a copy of path at the end of the list.
+ */
+static int path_list_add(path_list* list, const char* path)
+{
+    if (list->nb == list->cap) {
+        const size_t cap = (list->cap == 0) ? IMPORT_BATCH : 2 * list->cap;
+        char** paths = realloc(list->paths, cap * sizeof(char*));
+        M_EXIT_IF_NULL(paths, cap * sizeof(char*));
+        list->paths = paths;
+        list->cap = cap;
+    }
+
+    M_EXIT_IF_NULL(list->paths[list->nb] = strdup(path), strlen(path) + 1);
+    list->nb += 1;
+
+    return ERR_NONE;
+}
+
+/**
+ * Frees the list and all its paths.
+ */
+static void path_list_free(path_list* list)
+{
+    for (size_t i = 0; i < list->nb; ++i) {
+        FREE_DEREF(list->paths[i]);
+    }
+    FREE_DEREF(list->paths);
+    list->nb = list->cap = 0;
+}
+
+/**
+ * Compares two paths, to import the files of a directory in a stable order.
+ */
+static int path_compare(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+/**
+ * Lists the regular files of a directory, hidden files excepted.
+ */
+static int list_directory(const char* dirname, path_list* list)
+{
+    DIR* dir = opendir(dirname);
+
+    if (dir == NULL) {
+        return ERR_IO;
+    }
+
+    int ret = ERR_NONE;
+    const struct dirent* entry = NULL;
+
+    while (ret == ERR_NONE && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        const size_t len = strlen(dirname) + strlen(entry->d_name) + 2;
+        char* path = calloc(1, len);
+
+        if (path == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+            continue;
+        }
+        snprintf(path, len, "%s/%s", dirname, entry->d_name);
+
+        struct stat st;
+
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            ret = path_list_add(list, path);
+        }
+        FREE_DEREF(path);
+    }
+
+    closedir(dir);
+
+    if (ret == ERR_NONE && list->nb > 1) {
+        qsort(list->paths, list->nb, sizeof(char*), path_compare);
+    }
+
+    return ret;
+}
+
+/**
+ * Lists the paths of a file with one path per line, empty lines excepted.
+ */
+static int list_file(const char* filename, path_list* list)
+{
+    FILE* file = fopen(filename, "r");
+
+    if (file == NULL) {
+        return ERR_IO;
+    }
+
+    int ret = ERR_NONE;
+    char* line = NULL;
+    size_t line_cap = 0;
+
+    while (ret == ERR_NONE && getline(&line, &line_cap, file) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (line[0] != '\0') {
+            ret = path_list_add(list, line);
+        }
+    }
+
+    FREE_DEREF(line);
+    fclose(file);
+
+    return ret;
+}
+
+/**
+ * Sets the imgID of an image: its file name without directory nor extension.
+ */
+static int import_id(import_item* item)
+{
+    const char* name = strrchr(item->path, '/');
+    name = (name == NULL) ? item->path : name + 1;
+
+    const char* dot = strrchr(name, '.');
+    const size_t len = (dot == NULL || dot == name) ? strlen(name) : (size_t)(dot - name);
+
+    if (len == 0 || len > MAX_IMG_ID) {
+        return ERR_INVALID_IMGID;
+    }
+
+    memset(item->img_id, 0, sizeof(item->img_id));
+    memcpy(item->img_id, name, len);
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads, hashes and probes the resolution of an image. This does not touch
+ * the imgStore, so many images can be prepared at once.
+ */
+static int import_prepare(import_item* item)
+{
+    M_EXIT_IF_ERR(import_id(item));
+    M_EXIT_IF_ERR(read_disk_image(item->path, &item->buffer, &item->size));
+
+    SHA256((const unsigned char*) item->buffer, item->size, item->sha);
+
+    // Most JPEG images give their resolution away without being decoded
+    const size_t probe = (item->size < PROBE_SIZE) ? item->size : PROBE_SIZE;
+
+    if (get_resolution_from_header(&item->height, &item->width,
+                                   (const unsigned char*) item->buffer, probe) == ERR_NONE) {
+        return ERR_NONE;
+    }
+
+    return get_resolution(&item->height, &item->width, item->buffer, item->size);
+}
+
+/**
+ * Worker: prepares the items of the batch until there are none left.
+ */
+static void* import_worker(void* arg)
+{
+    import_batch* batch = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        const size_t i = batch->next;
+        batch->next += (i < batch->nb);
+        pthread_mutex_unlock(&batch->lock);
+
+        if (i >= batch->nb) {
+            return NULL;
+        }
+
+        batch->items[i].err = import_prepare(&batch->items[i]);
+    }
+}
+
+/**
+ * Prepares a whole batch with up to nb_threads workers, the calling thread
+ * being one of them.
+ */
+static void import_prepare_batch(import_batch* batch, size_t nb_threads, pthread_t* threads)
+{
+    batch->next = 0;
+
+    size_t started = 0;
+
+    for (size_t i = 1; i < nb_threads && i < batch->nb; ++i) {
+        if (pthread_create(&threads[started], NULL, import_worker, batch) == 0) {
+            ++started;
+        }
+    }
+
+    import_worker(batch);
+
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * Inserts the prepared items of a batch in order, then flushes the metadata
+ * they use with a single write, followed by the header.
+ */
+static int import_commit_batch(import_batch* batch, import_stats* stats, imgst_file* imgstfile)
+{
+    int ret = ERR_NONE;
+    size_t first = imgstfile->header.max_files;
+    size_t last = 0;
+
+    for (size_t i = 0; i < batch->nb && ret == ERR_NONE; ++i) {
+        import_item* item = &batch->items[i];
+
+        // A source that could not be read nor decoded is only skipped
+        if (item->err != ERR_NONE) {
+            debug_print("could not read %s", item->path);
+            stats->errors += 1;
+            continue;
+        }
+
+        size_t index = 0;
+        item->err = do_insert_prepared(item->buffer, item->size, item->sha,
+                                       item->width, item->height, item->img_id,
+                                       imgstfile, &index);
+
+        switch (item->err) {
+        case ERR_NONE:
+            first = (index < first) ? index : first;
+            last = (index > last) ? index : last;
+            stats->imported += 1;
+            stats->bytes += item->size;
+            break;
+        case ERR_DUPLICATE_ID:
+            stats->duplicates += 1;
+            break;
+        case ERR_FULL_IMGSTORE:
+        case ERR_IO:
+            // The imgStore cannot take more images: stop there
+            ret = item->err;
+            break;
+        default:
+            debug_print("could not import %s", item->path);
+            stats->errors += 1;
+        }
+    }
+
+    // Whatever happened, the images inserted so far are committed
+    if (first <= last) {
+        M_EXIT_IF_ERR(updateMetadataRange(first, last - first + 1, imgstfile));
+        M_EXIT_IF_ERR(updateHeader(imgstfile));
+    }
+
+    return ret;
+}
+
+/**
+ * Imports many images at once.
+ */
+int do_import(const char* source, size_t nb_threads, import_stats* stats, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(source);
+    M_REQUIRE_NON_NULL(stats);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    memset(stats, 0, sizeof(import_stats));
+    nb_threads = (nb_threads == 0) ? 1 : nb_threads;
+
+    // Step 1: list the files to import
+    struct stat st;
+    M_EXIT_IF(stat(source, &st) != 0, ERR_IO, "cannot stat %s", source);
+
+    path_list list = {0};
+    M_EXIT_IF_ERR_DO_SOMETHING(S_ISDIR(st.st_mode) ? list_directory(source, &list)
+                               : list_file(source, &list),
+                               path_list_free(&list));
+
+    // Step 2: prepare and commit the images batch by batch
+    import_batch batch = {0};
+    pthread_t* threads = NULL;
+    batch.items = calloc(IMPORT_BATCH, sizeof(import_item));
+    threads = calloc(nb_threads, sizeof(pthread_t));
+
+    if (batch.items == NULL || threads == NULL) {
+        FREE_DEREF(batch.items);
+        FREE_DEREF(threads);
+        path_list_free(&list);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    pthread_mutex_init(&batch.lock, NULL);
+
+    int ret = ERR_NONE;
+
+    for (size_t done = 0; done < list.nb && ret == ERR_NONE; done += batch.nb) {
+        batch.nb = (list.nb - done < IMPORT_BATCH) ? list.nb - done : IMPORT_BATCH;
+        memset(batch.items, 0, IMPORT_BATCH * sizeof(import_item));
+
+        for (size_t i = 0; i < batch.nb; ++i) {
+            batch.items[i].path = list.paths[done + i];
+        }
+
+        import_prepare_batch(&batch, nb_threads, threads);
+        ret = import_commit_batch(&batch, stats, imgstfile);
+
+        for (size_t i = 0; i < batch.nb; ++i) {
+            FREE_DEREF(batch.items[i].buffer);
+        }
+    }
+
+    pthread_mutex_destroy(&batch.lock);
+    FREE_DEREF(batch.items);
+    FREE_DEREF(threads);
+    path_list_free(&list);
+
+    return ret;
+}
@@ -4,48 +4,113 @@
  *
  * @author ???
  */
+#define _POSIX_C_SOURCE 200809L // for fileno and ftruncate
+
 #include "imgStore.h"
 #include "dedup.h"
+#include "variant.h" // for overlaps_content
 #include "error.h"
 #include "image_content.h"
+#include "trace.h"
 #include <stdlib.h> // for realloc
+#include <unistd.h> // for ftruncate
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH and SHA256()
+#include <openssl/evp.h> // for EVP_Digest*
 
-int do_insert(const char* image_buffer, size_t image_size, const char* img_id, imgst_file* imgstfile)
+#define INGEST_COPY_BLOCK 65536 // bytes hashed at once when resuming a streamed image
+
+/**
+ * Finds the index of an empty slot (ie. isValid == 0), max_files if there is none.
+ */
+static size_t find_empty_slot(const imgst_file* imgstfile)
 {
+    size_t index = 0;
+
+    while(index < imgstfile->header.max_files
+          && imgstfile->metadata[index].is_valid != 0) {
+
+        ++index;
+    }
 
+    return index;
+}
+
+/**
+ * Marks the metadata at index as valid and counts it in the in-memory header.
+ */
+static void fill_slot(const size_t index, const size_t image_size, const uint32_t width,
+                      const uint32_t height, imgst_file* imgstfile)
+{
+    // Readers without lock find the image from now on
+    metadata_begin(index, imgstfile);
+    imgstfile->metadata[index].res_orig[0] = width;
+    imgstfile->metadata[index].res_orig[1] = height;
+
+    // Rest: metadata fields that don't depend on being a duplicate (or overlap)
+    imgstfile->metadata[index].is_valid = NON_EMPTY;
+    imgstfile->metadata[index].size[RES_ORIG] = (uint32_t)image_size;
+    metadata_publish(index, imgstfile);
+
+    // Update header
+    imgstfile->header.imgst_version += 1;
+    imgstfile->header.num_files += 1;
+
+    // The content can now be found by SHA
+    sha_index_add(imgstfile, index);
+}
+
+/**
+ * Marks the metadata at index as valid, then writes it and the updated header to disk.
+ */
+static int commit_slot(const size_t index, const size_t image_size, const uint32_t width,
+                       const uint32_t height, imgst_file* imgstfile)
+{
+    fill_slot(index, image_size, width, height, imgstfile);
+
+    // Write change of header and metadata to disk
+    M_EXIT_IF_ERR(updateHeader(imgstfile));
+    M_EXIT_IF_ERR(updateMetadata(index, imgstfile));
+
+    return ERR_NONE;
+}
+
+/**
+ * Inserts an image whose SHA and resolution are already known, without
+ * writing the header nor the metadata.
+ */
+int do_insert_prepared(const char* image_buffer, size_t image_size, const unsigned char* sha,
+                       const uint32_t width, const uint32_t height, const char* img_id,
+                       imgst_file* imgstfile, size_t* index)
+{
     // Null-pointer checks
     M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(sha);
     M_REQUIRE_NON_NULL(img_id);
     M_REQUIRE_NON_NULL(imgstfile);
     M_REQUIRE_NON_NULL(imgstfile->metadata);
+    M_REQUIRE_NON_NULL(index);
 
     // Check if database is full
     M_EXIT_IF(imgstfile->header.num_files >= imgstfile->header.max_files,
               ERR_FULL_IMGSTORE, "insert with full imgstore", );
 
     // Find index of empty slot (ie. isValid == 0) which is guarenteed to exist!
-    size_t index = 0;
-
-    while(index < imgstfile->header.max_files
-          && imgstfile->metadata[index].is_valid != 0) {
-
-        ++index;
-    }
+    const size_t slot = find_empty_slot(imgstfile);
 
     /// Initialize the metadata for the image to insert.
 
-    // Get SHA and ID and check against all other images for duplicates
-    unsigned char sha[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char *)image_buffer, image_size, sha);
-    memcpy(imgstfile->metadata[index].SHA, sha, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
-    memcpy(imgstfile->metadata[index].img_id, img_id, (MAX_IMG_ID + 1) * sizeof(char));
+    // Set SHA and ID and check against all other images for duplicates
+    memcpy(imgstfile->metadata[slot].SHA, sha, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+    memcpy(imgstfile->metadata[slot].img_id, img_id, (MAX_IMG_ID + 1) * sizeof(char));
 
     // De-dup if content-duplicate, or exit if name-duplicate
-    M_EXIT_IF_ERR(do_name_and_content_dedup(imgstfile, index));
+    TRACE_BEGIN(dedup);
+    const int dedup = do_name_and_content_dedup(imgstfile, slot);
+    TRACE_END(dedup);
+    M_EXIT_IF_ERR(dedup);
 
     // If content-original then the previous function sets offset[RES_ORIG] to 0
-    if(imgstfile->metadata[index].offset[RES_ORIG] == 0) {
+    if(imgstfile->metadata[slot].offset[RES_ORIG] == 0) {
 
         // If the image content is new, add it to end of file
         if (fseek(imgstfile->file, 0, SEEK_END) != 0) {
@@ -55,42 +120,413 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, i
         const long offset_endfile = ftell(imgstfile->file);
 
         // Initialize the metadata to 0 in case old content is still there.
-        imgstfile->metadata[index].offset[RES_SMALL] = 0;
-        imgstfile->metadata[index].offset[RES_THUMB] = 0;
-        imgstfile->metadata[index].size[RES_THUMB] = 0;
-        imgstfile->metadata[index].size[RES_THUMB] = 0;
+        imgstfile->metadata[slot].offset[RES_SMALL] = 0;
+        imgstfile->metadata[slot].offset[RES_THUMB] = 0;
+        imgstfile->metadata[slot].size[RES_THUMB] = 0;
+        imgstfile->metadata[slot].size[RES_THUMB] = 0;
 
         // Update offset metadata field with the location in file of the newly inserted image
-        imgstfile->metadata[index].offset[RES_ORIG] = offset_endfile;
+        imgstfile->metadata[slot].offset[RES_ORIG] = offset_endfile;
 
         // Append the original image to the store
         size_t num_image_written = 0;
+        TRACE_BEGIN(fwrite);
         num_image_written += fwrite(image_buffer, image_size, 1, imgstfile->file);
+        TRACE_END(fwrite);
 
         if(num_image_written != 1) {
             return ERR_IO;
         }
     }
 
-    // Get resolution of the image and update the metadatum accordingly
-    uint32_t height = 0, width = 0;
-    M_EXIT_IF_ERR(get_resolution(&height, &width, image_buffer, image_size));
+    fill_slot(slot, image_size, width, height, imgstfile);
+    *index = slot;
 
-    imgstfile->metadata[index].res_orig[0] = width;
-    imgstfile->metadata[index].res_orig[1] = height;
+    return ERR_NONE;
+}
 
-    // Rest: metadata fields that don't depend on being a duplicate (or overlap)
-    imgstfile->metadata[index].is_valid = NON_EMPTY;
-    imgstfile->metadata[index].size[RES_ORIG] = (uint32_t)image_size;
+int do_insert(const char* image_buffer, size_t image_size, const char* img_id, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
 
-    // Update header
-    imgstfile->header.imgst_version += 1;
-    imgstfile->header.num_files += 1;
+    TRACE_BEGIN(do_insert);
+
+    // Get SHA and resolution of the image before touching the store
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    TRACE_BEGIN(SHA256);
+    SHA256((unsigned char *)image_buffer, image_size, sha);
+    TRACE_END(SHA256);
+
+    uint32_t height = 0, width = 0;
+    TRACE_BEGIN(get_resolution);
+    const int resolution = get_resolution(&height, &width, image_buffer, image_size);
+    TRACE_END(get_resolution);
+    M_EXIT_IF_ERR(resolution);
+
+    size_t index = 0;
+    M_EXIT_IF_ERR(do_insert_prepared(image_buffer, image_size, sha, width, height,
+                                     img_id, imgstfile, &index));
 
     // Write change of header and metadata to disk
     M_EXIT_IF_ERR(updateHeader(imgstfile));
-    M_EXIT_IF_ERR(updateMetadata(index, imgstfile));
+
+    const int ret = updateMetadata(index, imgstfile);
+    TRACE_END(do_insert);
+
+    return ret;
+}
+
+/**
+ * Tells whether a range of the imgStore file holds content of an image or
+ * of a variant.
+ */
+static int overlaps_content(const uint64_t offset, const uint64_t size, const imgst_file* imgstfile)
+{
+    for (size_t i = 0; i < imgstfile->header.max_files; ++i) {
+        const img_metadata* m = &imgstfile->metadata[i];
+
+        for (size_t res = 0; m->is_valid == NON_EMPTY && res < NB_RES; ++res) {
+            if (m->offset[res] != 0 && m->offset[res] < offset + size
+                && offset < m->offset[res] + m->size[res]) {
+                return 1;
+            }
+        }
+    }
+
+    const variant_table* t = imgstfile->variants;
+
+    for (uint32_t i = 0; t != NULL && i < t->nb; ++i) {
+        // A variant content is directly followed by its record
+        const img_variant* v = &t->records[i];
+
+        if (v->offset < offset + size && offset < v->offset + v->size + sizeof(img_variant)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Releases the streaming state and, unless it is kept for a later resume,
+ * gives the reserved extent back by truncating the imgStore file if nothing
+ * was appended after it. Otherwise it is left for the garbage collector.
+ */
+static void ingest_release(imgst_ingest* ingest, imgst_file* imgstfile, const int keep_extent)
+{
+    if (!keep_extent && ingest->reserved > 0 && fflush(imgstfile->file) == 0
+        && fseek(imgstfile->file, 0, SEEK_END) == 0
+        && (uint64_t) ftell(imgstfile->file) == ingest->offset + ingest->reserved
+        && ftruncate(fileno(imgstfile->file), (off_t) ingest->offset) != 0) {
+        debug_print("could not truncate %s", ingest->img_id);
+    }
+
+    EVP_MD_CTX_free(ingest->sha_ctx);
+    ingest->sha_ctx = NULL;
+    FREE_DEREF(ingest->prefix);
+}
+
+/**
+ * Checks that an image can be streamed and initializes the streaming state
+ * for an extent of reserved bytes at offset.
+ */
+static int ingest_init(imgst_ingest* ingest, const char* img_id, const uint64_t offset,
+                       const uint64_t reserved, imgst_file* imgstfile)
+{
+    M_EXIT_IF(strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID,
+              ERR_INVALID_IMGID, "invalid imgID %s", img_id);
+
+    // Sizes are stored on 32 bits
+    M_EXIT_IF(reserved == 0 || reserved > UINT32_MAX, ERR_INVALID_ARGUMENT,
+              "streamed image of %" PRIu64 " bytes", reserved);
+
+    // Fail before anything is transferred if the image cannot be inserted
+    M_EXIT_IF(imgstfile->header.num_files >= imgstfile->header.max_files,
+              ERR_FULL_IMGSTORE, "insert with full imgstore", );
+
+    size_t idx = 0;
+    M_EXIT_IF(findMetadataIndex(&idx, img_id, imgstfile) == ERR_NONE,
+              ERR_DUPLICATE_ID, "image with same imgID exists", );
+
+    memset(ingest, 0, sizeof(imgst_ingest));
+    strncpy(ingest->img_id, img_id, MAX_IMG_ID);
+    ingest->offset = offset;
+    ingest->reserved = reserved;
+
+    ingest->prefix = malloc(INGEST_PREFIX_LEN);
+    ingest->sha_ctx = EVP_MD_CTX_new();
+
+    if (ingest->prefix == NULL || ingest->sha_ctx == NULL
+        || !EVP_DigestInit_ex(ingest->sha_ctx, EVP_sha256(), NULL)) {
+        ingest_release(ingest, imgstfile, 1);
+        return ERR_OUT_OF_MEMORY;
+    }
 
     return ERR_NONE;
 }
 
+/**
+ * Hashes received bytes and keeps the first ones.
+ */
+static int ingest_hash(imgst_ingest* ingest, const char* chunk, size_t chunk_size)
+{
+    M_EXIT_IF(!EVP_DigestUpdate(ingest->sha_ctx, chunk, chunk_size), ERR_IO,
+              "cannot hash %zu bytes", chunk_size);
+
+    if (ingest->prefix_len < INGEST_PREFIX_LEN) {
+        const size_t len = (chunk_size < INGEST_PREFIX_LEN - ingest->prefix_len)
+                           ? chunk_size : INGEST_PREFIX_LEN - ingest->prefix_len;
+        memcpy(ingest->prefix + ingest->prefix_len, chunk, len);
+        ingest->prefix_len += len;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Starts streaming an image into an extent reserved at the end of the imgStore file.
+ */
+int do_insert_begin(imgst_ingest* ingest, const char* img_id, const uint64_t size,
+                    imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(ingest);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    M_EXIT_IF(fflush(imgstfile->file) != 0 || fseek(imgstfile->file, 0, SEEK_END) != 0,
+              ERR_IO, "cannot seek to the end of the imgStore", );
+
+    const long end = ftell(imgstfile->file);
+    M_EXIT_IF(end < 0, ERR_IO, "cannot tell the end of the imgStore", );
+
+    M_EXIT_IF_ERR(ingest_init(ingest, img_id, (uint64_t) end, size, imgstfile));
+
+    // Whatever is appended later goes after the extent, which stays a hole until written
+    if (ftruncate(fileno(imgstfile->file), (off_t)(ingest->offset + ingest->reserved)) != 0) {
+        ingest_release(ingest, imgstfile, 1);
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Resumes streaming an image whose first bytes are already in its extent.
+ */
+int do_insert_resume(imgst_ingest* ingest, const char* img_id, const uint64_t offset,
+                     const uint64_t reserved, const uint64_t size, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(ingest);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    M_EXIT_IF(size > reserved, ERR_INVALID_ARGUMENT,
+              "%" PRIu64 " bytes received for %" PRIu64 " reserved", size, reserved);
+
+    // The garbage collector does not keep the extent, and may have put other content there
+    M_EXIT_IF(fflush(imgstfile->file) != 0 || fseek(imgstfile->file, 0, SEEK_END) != 0
+              || (uint64_t) ftell(imgstfile->file) < offset + reserved
+              || overlaps_content(offset, reserved, imgstfile),
+              ERR_IO, "the extent of %s is gone", img_id);
+
+    M_EXIT_IF_ERR(ingest_init(ingest, img_id, offset, reserved, imgstfile));
+
+    // Hash the bytes again
+    char* block = malloc(INGEST_COPY_BLOCK);
+
+    if (block == NULL) {
+        ingest_release(ingest, imgstfile, 1);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int ret = (fseek(imgstfile->file, (long) offset, SEEK_SET) == 0) ? ERR_NONE : ERR_IO;
+
+    for (uint64_t read = 0; ret == ERR_NONE && read < size; read += INGEST_COPY_BLOCK) {
+        const size_t len = (size - read < INGEST_COPY_BLOCK) ? (size_t)(size - read) : INGEST_COPY_BLOCK;
+
+        if (fread(block, len, 1, imgstfile->file) != 1) {
+            ret = ERR_IO;
+        } else {
+            ret = ingest_hash(ingest, block, len);
+        }
+    }
+
+    FREE_DEREF(block);
+
+    if (ret != ERR_NONE) {
+        ingest_release(ingest, imgstfile, 1);
+        return ret;
+    }
+
+    ingest->size = size;
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes the next chunk of a streamed image in place, in its extent.
+ */
+int do_insert_append(imgst_ingest* ingest, const char* chunk, size_t chunk_size,
+                     imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(ingest);
+    M_REQUIRE_NON_NULL(ingest->sha_ctx);
+    M_REQUIRE_NON_NULL(chunk);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    M_EXIT_IF(ingest->size + chunk_size > ingest->reserved, ERR_INVALID_ARGUMENT,
+              "streamed image larger than the %" PRIu64 " bytes announced", ingest->reserved);
+
+    TRACE_BEGIN(fwrite);
+    const int written = fseek(imgstfile->file, (long)(ingest->offset + ingest->size), SEEK_SET) == 0
+                        && fwrite(chunk, chunk_size, 1, imgstfile->file) == 1;
+    TRACE_END(fwrite);
+
+    // The chunk is on disk before the caller records it as received
+    if (!written || fflush(imgstfile->file) != 0) {
+        return ERR_IO;
+    }
+
+    // Hash the chunk and keep the first bytes
+    M_EXIT_IF_ERR(ingest_hash(ingest, chunk, chunk_size));
+
+    ingest->size += chunk_size;
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the resolution of a streamed image, from its first bytes if
+ * possible and from the whole image otherwise.
+ */
+static int ingest_resolution(const imgst_ingest* ingest, uint32_t* height, uint32_t* width,
+                             imgst_file* imgstfile)
+{
+    if (get_resolution_from_header(height, width, ingest->prefix, ingest->prefix_len) == ERR_NONE) {
+        return ERR_NONE;
+    }
+
+    char* image_buffer = NULL;
+    M_EXIT_IF_NULL(image_buffer = malloc(ingest->size), (size_t) ingest->size);
+
+    if (fseek(imgstfile->file, (long) ingest->offset, SEEK_SET) != 0
+        || fread(image_buffer, ingest->size, 1, imgstfile->file) != 1) {
+        FREE_DEREF(image_buffer);
+        return ERR_IO;
+    }
+
+    const int ret = get_resolution(height, width, image_buffer, ingest->size);
+    FREE_DEREF(image_buffer);
+
+    return ret;
+}
+
+/**
+ * Commits a streamed image.
+ */
+int do_insert_commit(imgst_ingest* ingest, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(ingest);
+    M_REQUIRE_NON_NULL(ingest->sha_ctx);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    if (ingest->size != ingest->reserved) {
+        ingest_release(ingest, imgstfile, 0);
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // The imgStore may have filled up while the image was streamed
+    if (imgstfile->header.num_files >= imgstfile->header.max_files) {
+        ingest_release(ingest, imgstfile, 0);
+        return ERR_FULL_IMGSTORE;
+    }
+
+    // Read the resolution before the slot is touched
+    uint32_t height = 0, width = 0;
+    M_EXIT_IF_ERR_DO_SOMETHING(ingest_resolution(ingest, &height, &width, imgstfile),
+                               ingest_release(ingest, imgstfile, 0));
+
+    const size_t index = find_empty_slot(imgstfile);
+
+    // Set SHA and ID and check against all other images for duplicates
+    unsigned int sha_len = 0;
+
+    if (!EVP_DigestFinal_ex(ingest->sha_ctx, imgstfile->metadata[index].SHA, &sha_len)) {
+        ingest_release(ingest, imgstfile, 0);
+        return ERR_IO;
+    }
+
+    memcpy(imgstfile->metadata[index].img_id, ingest->img_id, (MAX_IMG_ID + 1) * sizeof(char));
+
+    // De-dup if content-duplicate, or exit if name-duplicate
+    M_EXIT_IF_ERR_DO_SOMETHING(do_name_and_content_dedup(imgstfile, index),
+                               ingest_release(ingest, imgstfile, 0));
+
+    // If content-original, the extent becomes the original image, where it was written
+    const int original = imgstfile->metadata[index].offset[RES_ORIG] == 0;
+
+    if (original) {
+        memset(imgstfile->metadata[index].offset, 0, NB_RES * sizeof(uint64_t));
+        memset(imgstfile->metadata[index].size, 0, NB_RES * sizeof(uint32_t));
+        imgstfile->metadata[index].offset[RES_ORIG] = ingest->offset;
+    }
+
+    const size_t image_size = ingest->size;
+    ingest_release(ingest, imgstfile, original);
+
+    return commit_slot(index, image_size, width, height, imgstfile);
+}
+
+/**
+ * Gives up a streamed image.
+ */
+void do_insert_abort(imgst_ingest* ingest, imgst_file* imgstfile)
+{
+    if (ingest != NULL && imgstfile != NULL) {
+        ingest_release(ingest, imgstfile, 0);
+    }
+}
+
+/**
+ * Inserts a new image ID for a content already in the imgStore.
+ */
+int do_link(const unsigned char* sha, const char* img_id, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(sha);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    M_EXIT_IF(strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID,
+              ERR_INVALID_IMGID, "invalid imgID %s", img_id);
+
+    // Check if database is full
+    M_EXIT_IF(imgstfile->header.num_files >= imgstfile->header.max_files,
+              ERR_FULL_IMGSTORE, "link with full imgstore", );
+
+    // The content must already be there
+    size_t existing = 0;
+    M_EXIT_IF_ERR(findContentIndex(&existing, sha, imgstfile));
+
+    const size_t index = find_empty_slot(imgstfile);
+
+    memcpy(imgstfile->metadata[index].SHA, sha, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+    memset(imgstfile->metadata[index].img_id, 0, (MAX_IMG_ID + 1) * sizeof(char));
+    strncpy(imgstfile->metadata[index].img_id, img_id, MAX_IMG_ID);
+
+    // Shares the offsets of the content, or exits if name-duplicate
+    M_EXIT_IF_ERR(do_name_and_content_dedup(imgstfile, index));
+
+    const img_metadata* content = &imgstfile->metadata[existing];
+
+    return commit_slot(index, content->size[RES_ORIG], content->res_orig[0], content->res_orig[1],
+                       imgstfile);
+}
@@ -100,3 +100,32 @@ char* do_list(const imgst_file* imgstfile, enum do_list_mode mode)
     }
     }
 }
+
+/**
+ * Lists a page of the valid images, from a slot on, through a callback.
+ */
+size_t do_list_page(const imgst_file* imgstfile, size_t from, size_t limit,
+                    list_filter filter, list_callback callback, void* arg)
+{
+    if (imgstfile == NULL || imgstfile->metadata == NULL || callback == NULL) {
+        return 0;
+    }
+
+    size_t listed = 0;
+    size_t idx = from;
+
+    // Stop at the first image to list that does not fit in the page
+    for (; idx < imgstfile->header.max_files; ++idx) {
+        if (imgstfile->metadata[idx].is_valid == NON_EMPTY
+            && (filter == NULL || filter(&(imgstfile->metadata[idx]), arg))) {
+            if (limit != 0 && listed == limit) {
+                break;
+            }
+
+            callback(idx, &(imgstfile->metadata[idx]), arg);
+            ++listed;
+        }
+    }
+
+    return idx < imgstfile->header.max_files ? idx : imgstfile->header.max_files;
+}
@@ -4,13 +4,84 @@
  *
  * @author ???
  */
+#define _POSIX_C_SOURCE 200809L // for pthread
 
 #include "imgStore.h"
 #include "image_content.h"
+#include "variant.h"
 #include "error.h"
+#include "trace.h"
 
-#include <stdlib.h> // for calloc
+#include <stdlib.h> // for calloc, qsort, bsearch
 #include <stdint.h> // for uint8_t
+#include <pthread.h>
+#include <unistd.h> // for pread
+#include <string.h> // for strcmp
+
+#define RESIZE_BATCH 32 // images held in memory at once by do_resize_batch
+
+/**
+ * Reads size bytes at offset in the imgStore file into a new buffer
+ */
+static int read_content(const uint64_t offset, const uint32_t size, char** image_buffer,
+                        imgst_file* imgstfile)
+{
+    void* buffer = NULL;
+    M_EXIT_IF_NULL(buffer = calloc(1, size), (size_t) size);
+
+    // Read the 1 image from the file. Threads reading at once share the
+    // position of the file: the seek and the read must go together.
+    TRACE_BEGIN(fread);
+    flockfile(imgstfile->file);
+    fseek(imgstfile->file, (long) offset, SEEK_SET);
+    const int read = (fread(buffer, size, 1, imgstfile->file) == 1) ? ERR_NONE : ERR_IO;
+    funlockfile(imgstfile->file);
+    TRACE_END(fread);
+    M_EXIT_IF_ERR_DO_SOMETHING(read, FREE_DEREF(buffer));
+
+    *image_buffer = buffer;
+
+    return ERR_NONE;
+}
+
+/**
+ * Renders the image at index idx for this read only, in a read-only imgStore.
+ */
+static int read_rendered(const size_t idx, const int resolution, const uint16_t* box,
+                         const int format, char** image_buffer, uint32_t* image_size,
+                         const imgst_file* imgstfile)
+{
+    void* buffer = NULL;
+    size_t size = 0;
+    M_EXIT_IF_ERR(render_resized(resolution, box, format, imgstfile, idx, &buffer, &size));
+
+    *image_buffer = buffer;
+    *image_size = (uint32_t) size;
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the content of the image at index idx, at one of the imgStore resolutions.
+ */
+static int read_resolution(const size_t idx, const int resolution, char** image_buffer,
+                           uint32_t* image_size, imgst_file* imgstfile)
+{
+    // Resize if the image doesn't exist in the requested resolution
+    if (resolution != RES_ORIG && imgstfile->metadata[idx].offset[resolution] == INIT_OFFSET) {
+        if (is_read_only(imgstfile)) {
+            return read_rendered(idx, resolution, NULL, FMT_JPEG, image_buffer, image_size, imgstfile);
+        }
+
+        M_EXIT_IF_ERR(lazily_resize(resolution, imgstfile, idx));
+    }
+
+    // Let image_size point to the location of the size value
+    *image_size = imgstfile->metadata[idx].size[resolution];
+
+    return read_content(imgstfile->metadata[idx].offset[resolution], *image_size,
+                        image_buffer, imgstfile);
+}
 
 /**
  * Reads the content of an image from a imgStore
@@ -28,28 +99,718 @@ int do_read(const char* img_id, const int resolution, char** image_buffer,
     M_EXIT_IF(resolution != RES_SMALL && resolution != RES_THUMB && resolution != RES_ORIG,
               ERR_RESOLUTIONS, "called do_read with an invalid error code", );
 
+    TRACE_BEGIN(do_read);
+
     // Find the metadata index for the img_id.
     size_t idx = 0;
     M_EXIT_IF_ERR(findMetadataIndex(&idx, img_id, imgstfile));
 
-    // Resize if the image doesn't exist in the requested resolution
-    if (resolution != RES_ORIG && imgstfile->metadata[idx].offset[resolution] == INIT_OFFSET) {
-        M_EXIT_IF_ERR(lazily_resize(resolution, imgstfile, idx));
+    const int ret = read_resolution(idx, resolution, image_buffer, image_size, imgstfile);
+    TRACE_END(do_read);
+
+    return ret;
+}
+
+/**
+ * Tells whether the original of the image at index idx is read for a box:
+ * when it is in JPEG and already fits.
+ */
+static int box_keeps_original(const size_t idx, const uint16_t box[DIMS], const int format,
+                              const imgst_file* imgstfile)
+{
+    const uint32_t* res_orig = imgstfile->metadata[idx].res_orig;
+
+    return format == FMT_JPEG
+           && (box[0] == 0 || box[0] >= res_orig[0])
+           && (box[1] == 0 || box[1] >= res_orig[1]);
+}
+
+/**
+ * Reads the content of the image at index idx, resized into a box.
+ */
+static int read_variant(const size_t idx, const uint16_t box[DIMS], const int format,
+                        char** image_buffer, uint32_t* image_size, imgst_file* imgstfile)
+{
+    // The original already fits in the box
+    if (box_keeps_original(idx, box, format, imgstfile)) {
+        return read_resolution(idx, RES_ORIG, image_buffer, image_size, imgstfile);
     }
 
-    // Let image_size point to the location of the size value
-    *image_size = imgstfile->metadata[idx].size[resolution];
+    // Render the variant if it doesn't exist yet
+    const img_variant* variant = NULL;
 
-    // Let image_buffer point to the image data
-    void* buffer = NULL;
-    M_EXIT_IF_NULL(buffer = calloc(1, *image_size), *image_size);
+    if (variant_find(&variant, idx, box, format, imgstfile) != ERR_NONE) {
+        if (is_read_only(imgstfile)) {
+            return read_rendered(idx, NOT_RES, box, format, image_buffer, image_size, imgstfile);
+        }
+
+        M_EXIT_IF_ERR(lazily_resize_variant(box, format, imgstfile, idx));
+        M_EXIT_IF_ERR(variant_find(&variant, idx, box, format, imgstfile));
+    }
+
+    *image_size = variant->size;
 
-    // Read the 1 image from the file
-    fseek(imgstfile->file, imgstfile->metadata[idx].offset[resolution], SEEK_SET);
-    M_EXIT_IF_ERR_DO_SOMETHING((fread(buffer, *image_size, 1, imgstfile->file) == 1) ? ERR_NONE : ERR_IO,
-                               FREE_DEREF(buffer));
+    return read_content(variant->offset, variant->size, image_buffer, imgstfile);
+}
+
+/**
+ * Reads the content of an image resized into an arbitrary box.
+ */
+int do_read_variant(const char* img_id, const uint16_t box_width, const uint16_t box_height,
+                    const int format, char** image_buffer, uint32_t* image_size,
+                    imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    // Check if valid format code
+    M_EXIT_IF(format < 0 || NB_FMT <= format, ERR_INVALID_ARGUMENT,
+              "invalid format code %d", format);
+
+    // Find the metadata index for the img_id.
+    size_t idx = 0;
+    M_EXIT_IF_ERR(findMetadataIndex(&idx, img_id, imgstfile));
+
+    const uint16_t box[DIMS] = {box_width, box_height};
+
+    return read_variant(idx, box, format, image_buffer, image_size, imgstfile);
+}
+
+/**
+ * Reads the content of an image at one of the imgStore resolutions, in a given encoding.
+ */
+int do_read_format(const char* img_id, const int resolution, const int format,
+                   char** image_buffer, uint32_t* image_size, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    // JPEG and the original are the fixed resolutions of the imgStore
+    if (format == FMT_JPEG || resolution == RES_ORIG) {
+        return do_read(img_id, resolution, image_buffer, image_size, imgstfile);
+    }
+
+    // Check if valid resolution code
+    M_EXIT_IF(resolution != RES_SMALL && resolution != RES_THUMB,
+              ERR_RESOLUTIONS, "called do_read_format with an invalid resolution code", );
+
+    // Other encodings are variants in the box of the resolution
+    const uint16_t* res_resized = imgstfile->header.res_resized;
+
+    return do_read_variant(img_id, res_resized[2 * resolution], res_resized[2 * resolution + 1],
+                           format, image_buffer, image_size, imgstfile);
+}
+
+/**
+ * Tells whether reading an image would first have to render it: the same
+ * decisions as do_read_format and do_read_variant, without the writes.
+ * Read-only imgStores render in memory, without writing either.
+ */
+int read_needs_render(const char* img_id, const uint16_t* box, const int resolution,
+                      const int format, const imgst_file* imgstfile)
+{
+    size_t idx = 0;
+
+    if (img_id == NULL || imgstfile == NULL || imgstfile->metadata == NULL
+        || findMetadataIndex(&idx, img_id, imgstfile) != ERR_NONE
+        || is_read_only(imgstfile)) {
+        return 0;
+    }
+
+    if (box == NULL) {
+        if (resolution != RES_SMALL && resolution != RES_THUMB) {
+            return 0;
+        }
+
+        if (format == FMT_JPEG) {
+            return imgstfile->metadata[idx].offset[resolution] == INIT_OFFSET;
+        }
+
+        box = &imgstfile->header.res_resized[2 * resolution];
+    }
+
+    const img_variant* variant = NULL;
+
+    return !box_keeps_original(idx, box, format, imgstfile)
+           && variant_find(&variant, idx, box, format, imgstfile) != ERR_NONE;
+}
+
+/**
+ * Copies the metadata at idx as it was between two changes (seqlock read):
+ * again as long as a writer was in the slot meanwhile.
+ */
+static void copy_slot(const size_t idx, img_metadata* copy, const imgst_file* imgstfile)
+{
+    if (imgstfile->slot_seq == NULL) {
+        *copy = imgstfile->metadata[idx];
+        return;
+    }
+
+    for (;;) {
+        const uint32_t before = atomic_load_explicit(&imgstfile->slot_seq[idx], memory_order_acquire);
+
+        // The writer only stores a few fields: wait for it
+        if (before & 1) {
+            continue;
+        }
+
+        memcpy(copy, &imgstfile->metadata[idx], sizeof(img_metadata));
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&imgstfile->slot_seq[idx], memory_order_relaxed) == before) {
+            return;
+        }
+    }
+}
+
+/**
+ * Copies the metadata of an image without any lock.
+ */
+int read_slot(const char* img_id, img_metadata* copy, const imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(copy);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    TRACE_BEGIN(read_slot);
+
+    // Slots may change under the first test: only the copy of a match is trusted
+    for (size_t i = 0; i < imgstfile->header.max_files; ++i) {
+        const img_metadata* m = &imgstfile->metadata[i];
+
+        if (m->is_valid == EMPTY || strncmp(m->img_id, img_id, MAX_IMG_ID + 1)) {
+            continue;
+        }
+
+        copy_slot(i, copy, imgstfile);
+
+        if (copy->is_valid != EMPTY && !strncmp(copy->img_id, img_id, MAX_IMG_ID + 1)) {
+            TRACE_END(read_slot);
+            return ERR_NONE;
+        }
+    }
+
+    TRACE_END(read_slot);
+
+    return ERR_FILE_NOT_FOUND;
+}
+
+/**
+ * Reads a resolution of an image from a copy of its metadata, at its offset
+ * in the file descriptor of the imgStore.
+ */
+int read_slot_content(const img_metadata* copy, const int resolution, char** image_buffer,
+                      uint32_t* image_size, const imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(copy);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->file);
+
+    M_EXIT_IF(resolution != RES_SMALL && resolution != RES_THUMB && resolution != RES_ORIG,
+              ERR_RESOLUTIONS, "called read_slot_content with an invalid resolution code", );
+    M_EXIT_IF(copy->offset[resolution] == INIT_OFFSET, ERR_RESOLUTIONS,
+              "the image is not resized at resolution %d yet", resolution);
+
+    const uint32_t size = copy->size[resolution];
+    char* buffer = NULL;
+    M_EXIT_IF_NULL(buffer = calloc(1, size), (size_t) size);
+
+    TRACE_BEGIN(pread);
+    const int fd = fileno(imgstfile->file);
+    size_t done = 0;
+
+    while (done < size) {
+        const ssize_t n = pread(fd, buffer + done, size - done, (off_t)(copy->offset[resolution] + done));
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t) n;
+    }
+
+    TRACE_END(pread);
+    M_EXIT_IF_ERR_DO_SOMETHING(done == size ? ERR_NONE : ERR_IO, FREE_DEREF(buffer));
 
     *image_buffer = buffer;
+    *image_size = size;
+
+    return ERR_NONE;
+}
+
+// One image of a batch read
+struct batch_entry {
+    const char* img_id;
+    size_t idx; // max_files if not found
+    uint64_t offset; // where it is read from, UINT64_MAX if yet to be resized
+};
+
+/**
+ * Orders batch entries by imgID.
+ */
+static int compare_batch_ids(const void* a, const void* b)
+{
+    return strcmp(((const struct batch_entry*) a)->img_id, ((const struct batch_entry*) b)->img_id);
+}
+
+/**
+ * Orders batch entries by offset. Missing images come first, images yet to
+ * be resized last since they are appended.
+ */
+static int compare_batch_offsets(const void* a, const void* b)
+{
+    const struct batch_entry* x = a;
+    const struct batch_entry* y = b;
+
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/**
+ * Finds where the image at index idx is read from, without resizing it.
+ */
+static uint64_t batch_offset(const size_t idx, const uint16_t* box, const int resolution,
+                             const int format, const imgst_file* imgstfile)
+{
+    const img_metadata* m = &imgstfile->metadata[idx];
+
+    if (box == NULL) {
+        return m->offset[resolution] != 0 ? m->offset[resolution] : UINT64_MAX;
+    }
+
+    // Only an original that fits is read for a box
+    if (box_keeps_original(idx, box, format, imgstfile)) {
+        return m->offset[RES_ORIG];
+    }
+
+    const img_variant* variant = NULL;
+
+    return variant_find(&variant, idx, box, format, imgstfile) == ERR_NONE
+           ? variant->offset : UINT64_MAX;
+}
+
+/**
+ * Checks the arguments shared by do_read_batch and do_resize_batch.
+ */
+static int check_batch(const uint16_t* box, const int resolution, const int format)
+{
+    M_EXIT_IF(format < 0 || NB_FMT <= format, ERR_INVALID_ARGUMENT,
+              "invalid format code %d", format);
+    M_EXIT_IF(box == NULL && resolution != RES_SMALL && resolution != RES_THUMB && resolution != RES_ORIG,
+              ERR_RESOLUTIONS, "called do_read_batch with an invalid resolution code", );
+
+    return ERR_NONE;
+}
+
+/**
+ * Other encodings than JPEG are variants in the box of the resolution.
+ */
+static const uint16_t* batch_box(const uint16_t* box, const int resolution, const int format,
+                                 const imgst_file* imgstfile)
+{
+    if (box == NULL && format != FMT_JPEG && resolution != RES_ORIG) {
+        return &imgstfile->header.res_resized[2 * resolution];
+    }
+
+    return box;
+}
+
+/**
+ * Finds all the images of a batch in one pass over the metadata. The
+ * entries are sorted by imgID; idx is max_files for those not found.
+ */
+static int find_batch(const char* const* img_ids, const size_t nb_ids,
+                      struct batch_entry** found_entries, const imgst_file* imgstfile)
+{
+    struct batch_entry* entries = NULL;
+    M_EXIT_IF_NULL(entries = calloc(nb_ids, sizeof(struct batch_entry)),
+                   nb_ids * sizeof(struct batch_entry));
+
+    for (size_t i = 0; i < nb_ids; ++i) {
+        entries[i].img_id = img_ids[i];
+        entries[i].idx = imgstfile->header.max_files;
+    }
+
+    qsort(entries, nb_ids, sizeof(struct batch_entry), compare_batch_ids);
+
+    for (size_t idx = 0; idx < imgstfile->header.max_files; ++idx) {
+        if (imgstfile->metadata[idx].is_valid != NON_EMPTY) {
+            continue;
+        }
+
+        struct batch_entry key = {imgstfile->metadata[idx].img_id, 0, 0};
+        struct batch_entry* found = bsearch(&key, entries, nb_ids, sizeof(struct batch_entry),
+                                            compare_batch_ids);
+
+        // The same imgID may be asked for more than once
+        while (found != NULL && found > entries && !compare_batch_ids(found - 1, &key)) {
+            --found;
+        }
+
+        for (; found != NULL && found < entries + nb_ids && !compare_batch_ids(found, &key); ++found) {
+            found->idx = idx;
+        }
+    }
+
+    *found_entries = entries;
 
     return ERR_NONE;
 }
+
+/**
+ * Finds the images of a batch read and sorts them in the order of the file.
+ */
+int do_read_batch_begin(imgst_batch* batch, const char* const* img_ids, const size_t nb_ids,
+                        const uint16_t* box, const int resolution, const int format,
+                        const imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(batch);
+    M_REQUIRE_NON_NULL(img_ids);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    M_EXIT_IF_ERR(check_batch(box, resolution, format));
+
+    memset(batch, 0, sizeof(imgst_batch));
+    batch->resolution = resolution;
+    batch->format = format;
+    batch->done = nb_ids == 0;
+
+    if (nb_ids == 0) {
+        return ERR_NONE;
+    }
+
+    // Kept by copy: the box of the caller may not live as long as the batch
+    box = batch_box(box, resolution, format, imgstfile);
+
+    if (box != NULL) {
+        memcpy(batch->box, box, sizeof(batch->box));
+        batch->has_box = 1;
+    }
+
+    M_EXIT_IF_ERR(find_batch(img_ids, nb_ids, &batch->entries, imgstfile));
+    batch->nb_entries = nb_ids;
+
+    // Read in the order of the file
+    for (size_t i = 0; i < nb_ids; ++i) {
+        struct batch_entry* e = &batch->entries[i];
+        e->offset = (e->idx == imgstfile->header.max_files) ? 0
+                    : batch_offset(e->idx, batch->has_box ? batch->box : NULL, resolution, format,
+                                   imgstfile);
+    }
+
+    qsort(batch->entries, nb_ids, sizeof(struct batch_entry), compare_batch_offsets);
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the next image of a batch and passes it to the callback.
+ */
+int do_read_batch_next(imgst_batch* batch, batch_callback callback, void* arg,
+                       imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(batch);
+    M_REQUIRE_NON_NULL(callback);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    if (batch->done) {
+        return ERR_NONE;
+    }
+
+    const struct batch_entry* e = &batch->entries[batch->next];
+    const img_metadata* m = (e->idx < imgstfile->header.max_files) ? &imgstfile->metadata[e->idx] : NULL;
+
+    // The image may have been deleted since the batch began
+    if (m == NULL || m->is_valid != NON_EMPTY || strcmp(m->img_id, e->img_id)) {
+        callback(e->img_id, ERR_FILE_NOT_FOUND, NULL, 0, NULL, arg);
+    } else {
+        char* buffer = NULL;
+        uint32_t size = 0;
+
+        const int err = batch->has_box
+                        ? read_variant(e->idx, batch->box, batch->format, &buffer, &size, imgstfile)
+                        : read_resolution(e->idx, batch->resolution, &buffer, &size, imgstfile);
+
+        callback(e->img_id, err, buffer, size, m, arg);
+        FREE_DEREF(buffer);
+    }
+
+    batch->done = ++batch->next == batch->nb_entries;
+
+    return ERR_NONE;
+}
+
+/**
+ * Tells whether the next read of a batch would render its image.
+ */
+int batch_needs_render(const imgst_batch* batch, const imgst_file* imgstfile)
+{
+    if (batch == NULL || batch->done) {
+        return 0;
+    }
+
+    return read_needs_render(batch->entries[batch->next].img_id, batch->has_box ? batch->box : NULL,
+                             batch->resolution, batch->format, imgstfile);
+}
+
+/**
+ * Releases the state of a batch read.
+ */
+void do_read_batch_end(imgst_batch* batch)
+{
+    if (batch != NULL) {
+        FREE_DEREF(batch->entries);
+        batch->nb_entries = 0;
+    }
+}
+
+/**
+ * Reads many images at once, in the order of their offsets in the imgStore file.
+ */
+int do_read_batch(const char* const* img_ids, const size_t nb_ids, const uint16_t* box,
+                  const int resolution, const int format, batch_callback callback, void* arg,
+                  imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(callback);
+
+    imgst_batch batch;
+    M_EXIT_IF_ERR(do_read_batch_begin(&batch, img_ids, nb_ids, box, resolution, format, imgstfile));
+
+    int ret = ERR_NONE;
+
+    while (ret == ERR_NONE && !batch.done) {
+        ret = do_read_batch_next(&batch, callback, arg, imgstfile);
+    }
+
+    do_read_batch_end(&batch);
+
+    return ret;
+}
+
+// An image rendered by do_resize_batch
+struct resize_job {
+    size_t idx;
+    uint64_t offset; // of the original
+    char* original;
+    void* resized;
+    size_t resized_size;
+    int err;
+};
+
+// The jobs shared by the workers: each one takes the next job to render
+struct resize_pool {
+    struct resize_job* jobs;
+    size_t nb;
+    size_t next;
+    pthread_mutex_t lock;
+    const uint16_t* box; // NULL for a resolution code
+    const uint16_t* dims; // of the resolution code
+    int format;
+    const imgst_file* imgstfile;
+};
+
+/**
+ * Worker: renders the jobs of the pool until there are none left.
+ */
+static void* resize_worker(void* arg)
+{
+    struct resize_pool* pool = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        const size_t i = pool->next;
+        pool->next += (i < pool->nb);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (i >= pool->nb) {
+            return NULL;
+        }
+
+        struct resize_job* job = &pool->jobs[i];
+        const uint32_t size = pool->imgstfile->metadata[job->idx].size[RES_ORIG];
+
+        job->err = (pool->box != NULL)
+                   ? resize_to_box(job->original, size, pool->box, pool->format,
+                                   &job->resized, &job->resized_size)
+                   : resize_to_fit(job->original, size, pool->dims[0], pool->dims[1],
+                                   &job->resized, &job->resized_size);
+    }
+}
+
+/**
+ * Orders jobs by the offset of their original.
+ */
+static int compare_jobs(const void* a, const void* b)
+{
+    const uint64_t x = ((const struct resize_job*) a)->offset;
+    const uint64_t y = ((const struct resize_job*) b)->offset;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Appends an image rendered at a resolution code, whose metadata is written later.
+ */
+static int append_resized(const struct resize_job* job, const int resolution, imgst_file* imgstfile)
+{
+    if (fseek(imgstfile->file, 0, SEEK_END) != 0) {
+        return ERR_IO;
+    }
+
+    const long offset = ftell(imgstfile->file);
+
+    if (fwrite(job->resized, job->resized_size, 1, imgstfile->file) != 1) {
+        return ERR_IO;
+    }
+
+    metadata_begin(job->idx, imgstfile);
+    imgstfile->metadata[job->idx].offset[resolution] = (uint64_t) offset;
+    imgstfile->metadata[job->idx].size[resolution] = (uint32_t) job->resized_size;
+    metadata_publish(job->idx, imgstfile);
+
+    return ERR_NONE;
+}
+
+/**
+ * Renders one chunk of jobs: originals read in order, resized concurrently,
+ * appended in order.
+ */
+static int resize_chunk(struct resize_pool* pool, const int resolution, const size_t nb_threads,
+                        pthread_t* threads, imgst_file* imgstfile)
+{
+    // Step 1: read the originals, in the order of the file
+    for (size_t i = 0; i < pool->nb; ++i) {
+        struct resize_job* job = &pool->jobs[i];
+        job->err = read_content(imgstfile->metadata[job->idx].offset[RES_ORIG],
+                                imgstfile->metadata[job->idx].size[RES_ORIG],
+                                &job->original, imgstfile);
+    }
+
+    // Step 2: render them, the calling thread being one of the workers
+    pool->next = 0;
+    size_t started = 0;
+
+    for (size_t i = 1; i < nb_threads && i < pool->nb; ++i) {
+        if (pthread_create(&threads[started], NULL, resize_worker, pool) == 0) {
+            ++started;
+        }
+    }
+
+    resize_worker(pool);
+
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Step 3: append them, writing the metadata they change at once
+    int ret = ERR_NONE;
+    size_t first = imgstfile->header.max_files;
+    size_t last = 0;
+
+    for (size_t i = 0; i < pool->nb && ret == ERR_NONE; ++i) {
+        const struct resize_job* job = &pool->jobs[i];
+
+        if (job->err != ERR_NONE) {
+            continue;
+        }
+
+        if (pool->box != NULL) {
+            ret = variant_append(job->idx, pool->box, pool->format, job->resized,
+                                 job->resized_size, imgstfile);
+        } else {
+            ret = append_resized(job, resolution, imgstfile);
+            first = (job->idx < first) ? job->idx : first;
+            last = (job->idx > last) ? job->idx : last;
+        }
+    }
+
+    if (first <= last) {
+        const int flushed = updateMetadataRange(first, last - first + 1, imgstfile);
+        ret = (ret == ERR_NONE) ? flushed : ret;
+    }
+
+    for (size_t i = 0; i < pool->nb; ++i) {
+        FREE_DEREF(pool->jobs[i].original);
+        FREE_DEREF(pool->jobs[i].resized);
+    }
+
+    return ret;
+}
+
+/**
+ * Renders concurrently the images a batch read would have to resize.
+ */
+int do_resize_batch(const char* const* img_ids, const size_t nb_ids, const uint16_t* box,
+                    const int resolution, const int format, size_t nb_threads,
+                    imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(img_ids);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+    M_EXIT_IF_ERR(check_batch(box, resolution, format));
+
+    if (nb_ids == 0 || (box == NULL && resolution == RES_ORIG)) {
+        return ERR_NONE;
+    }
+
+    box = batch_box(box, resolution, format, imgstfile);
+    nb_threads = (nb_threads == 0) ? 1 : nb_threads;
+
+    struct batch_entry* entries = NULL;
+    M_EXIT_IF_ERR(find_batch(img_ids, nb_ids, &entries, imgstfile));
+
+    // Step 1: the images to render, each one once
+    struct resize_job* jobs = calloc(nb_ids, sizeof(struct resize_job));
+    pthread_t* threads = calloc(nb_threads, sizeof(pthread_t));
+
+    if (jobs == NULL || threads == NULL) {
+        FREE_DEREF(entries);
+        FREE_DEREF(jobs);
+        FREE_DEREF(threads);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    size_t nb_jobs = 0;
+
+    for (size_t i = 0; i < nb_ids; ++i) {
+        const size_t idx = entries[i].idx;
+
+        if (idx != imgstfile->header.max_files
+            && (i == 0 || idx != entries[i - 1].idx)
+            && batch_offset(idx, box, resolution, format, imgstfile) == UINT64_MAX) {
+            jobs[nb_jobs].idx = idx;
+            jobs[nb_jobs].offset = imgstfile->metadata[idx].offset[RES_ORIG];
+            ++nb_jobs;
+        }
+    }
+
+    FREE_DEREF(entries);
+
+    qsort(jobs, nb_jobs, sizeof(struct resize_job), compare_jobs);
+
+    // Step 2: render them chunk by chunk, to bound the memory used
+    struct resize_pool pool = {
+        .box = box,
+        .dims = box == NULL ? &imgstfile->header.res_resized[2 * resolution] : NULL,
+        .format = format,
+        .imgstfile = imgstfile
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+
+    int ret = ERR_NONE;
+
+    for (size_t done = 0; done < nb_jobs && ret == ERR_NONE; done += pool.nb) {
+        pool.jobs = &jobs[done];
+        pool.nb = (nb_jobs - done < RESIZE_BATCH) ? nb_jobs - done : RESIZE_BATCH;
+        ret = resize_chunk(&pool, resolution, nb_threads, threads, imgstfile);
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    FREE_DEREF(jobs);
+    FREE_DEREF(threads);
+
+    return ret;
+}
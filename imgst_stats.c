@@ -0,0 +1,260 @@
+/**
+ * @file imgst_stats.c
+ * @brief imgStore library: do_stats implementation
+ *
+ * @author ???
+ */
+#define _POSIX_C_SOURCE 200809L // for flockfile
+
+#include "imgStore.h"
+#include "variant.h"
+#include "error.h"
+
+#include <stdlib.h> // for calloc, qsort
+#include <string.h> // for memset, memcmp
+
+/**
+ * A range of the imgStore file that a valid image refers to.
+ */
+struct extent {
+    uint64_t offset;
+    uint64_t size;
+    int is_orig; // the original of an image, for dedup_images
+};
+
+/**
+ * A valid image, by the location of its original.
+ */
+struct content {
+    uint64_t offset;
+    uint32_t slot;
+};
+
+static int compare_extents(const void* a, const void* b)
+{
+    const struct extent* x = a;
+    const struct extent* y = b;
+
+    if (x->offset != y->offset) {
+        return (x->offset < y->offset) ? -1 : 1;
+    }
+
+    return (x->size > y->size) ? -1 : (x->size < y->size);
+}
+
+static int compare_contents(const void* a, const void* b)
+{
+    const struct content* x = a;
+    const struct content* y = b;
+
+    if (x->offset != y->offset) {
+        return (x->offset < y->offset) ? -1 : 1;
+    }
+
+    return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+/**
+ * The bucket of the size histogram of an original.
+ */
+static size_t size_bucket(const uint32_t size)
+{
+    size_t bucket = 0;
+
+    for (uint32_t kib = size / STATS_MIN_SIZE; kib > 0 && bucket < STATS_SIZE_BUCKETS - 1; kib >>= 1) {
+        ++bucket;
+    }
+
+    return bucket;
+}
+
+/**
+ * Keeps a range nothing refers to if it is among the largest ones.
+ */
+static void add_gap(imgst_stats* stats, const uint64_t offset, const uint64_t size)
+{
+    size_t i = stats->nb_gaps;
+
+    if (i == STATS_GAPS && stats->gaps[i - 1].size >= size) {
+        return;
+    }
+
+    i -= (i == STATS_GAPS);
+    for (; i > 0 && stats->gaps[i - 1].size < size; --i) {
+        stats->gaps[i] = stats->gaps[i - 1];
+    }
+
+    stats->gaps[i] = (imgst_gap) {
+        offset, size
+    };
+    stats->nb_gaps += (stats->nb_gaps < STATS_GAPS);
+}
+
+/**
+ * Lists the ranges referred to by the valid images and their variants.
+ */
+static size_t collect_extents(const imgst_file* imgstfile, struct extent* extents, imgst_stats* stats)
+{
+    size_t nb = 0;
+
+    for (uint32_t i = 0; i < imgstfile->header.max_files; ++i) {
+        const img_metadata* m = &imgstfile->metadata[i];
+
+        if (m->is_valid != NON_EMPTY) {
+            continue;
+        }
+
+        stats->size_histogram[size_bucket(m->size[RES_ORIG])] += 1;
+
+        for (int res = 0; res < NB_RES; ++res) {
+            if (m->offset[res] != INIT_OFFSET) {
+                stats->resized[res] += 1;
+                extents[nb++] = (struct extent) {
+                    m->offset[res], m->size[res], res == RES_ORIG
+                };
+            }
+        }
+    }
+
+    const variant_table* t = imgstfile->variants;
+
+    for (uint32_t v = 0; t != NULL && v < t->nb; ++v) {
+        const img_variant* record = &t->records[v];
+        stats->variants += 1;
+
+        // Like do_gbcollect, only keep the variants of the current content of a slot
+        if (record->slot >= imgstfile->header.max_files
+            || imgstfile->metadata[record->slot].is_valid != NON_EMPTY
+            || memcmp(record->SHA, imgstfile->metadata[record->slot].SHA, SHA256_DIGEST_LENGTH)) {
+            continue;
+        }
+
+        // The record directly follows the content
+        const uint64_t size = record->size + sizeof(img_variant);
+        stats->live_variants += 1;
+        stats->variant_bytes += size;
+        extents[nb++] = (struct extent) {
+            record->offset, size, 0
+        };
+    }
+
+    return nb;
+}
+
+/**
+ * Projects the bytes of contents after do_gbcollect. It inserts the images
+ * again: all the images of a content then share one original, and one
+ * resized image of each resolution that any of them had.
+ */
+static int project_gc(const imgst_file* imgstfile, imgst_stats* stats)
+{
+    const img_metadata* metadata = imgstfile->metadata;
+    struct content* contents = NULL;
+    M_EXIT_IF_NULL(contents = calloc((size_t) stats->max_files + 1, sizeof(struct content)),
+                   ((size_t) stats->max_files + 1) * sizeof(struct content));
+
+    size_t nb = 0;
+    for (uint32_t i = 0; i < stats->max_files; ++i) {
+        if (metadata[i].is_valid == NON_EMPTY) {
+            contents[nb++] = (struct content) {
+                metadata[i].offset[RES_ORIG], i
+            };
+        }
+    }
+
+    qsort(contents, nb, sizeof(struct content), compare_contents);
+
+    uint64_t bytes = stats->table_bytes + stats->variant_bytes;
+
+    for (size_t first = 0, last = 0; first < nb; first = last) {
+        uint32_t sizes[NB_RES] = {0};
+
+        for (last = first; last < nb && contents[last].offset == contents[first].offset; ++last) {
+            const img_metadata* m = &metadata[contents[last].slot];
+
+            for (int res = 0; res < NB_RES; ++res) {
+                if (sizes[res] == 0 && m->offset[res] != INIT_OFFSET) {
+                    sizes[res] = m->size[res];
+                }
+            }
+        }
+
+        for (int res = 0; res < NB_RES; ++res) {
+            bytes += sizes[res];
+        }
+    }
+
+    FREE_DEREF(contents);
+    stats->gc_bytes = bytes;
+
+    return ERR_NONE;
+}
+
+/**
+ * Computes the statistics of an imgStore from its metadata and variant records.
+ */
+int do_stats(const imgst_file* imgstfile, imgst_stats* stats)
+{
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->file);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+    M_REQUIRE_NON_NULL(stats);
+
+    memset(stats, 0, sizeof(imgst_stats));
+    stats->num_files = imgstfile->header.num_files;
+    stats->max_files = imgstfile->header.max_files;
+    stats->table_bytes = sizeof(imgst_header) + (uint64_t) stats->max_files * sizeof(img_metadata);
+
+    // Size of the file, leaving the position as it was for concurrent readers
+    flockfile(imgstfile->file);
+    const long position = ftell(imgstfile->file);
+    const int seek = fseek(imgstfile->file, 0, SEEK_END);
+    stats->file_bytes = (uint64_t) ftell(imgstfile->file);
+    fseek(imgstfile->file, position, SEEK_SET);
+    funlockfile(imgstfile->file);
+    M_EXIT_IF(seek != 0, ERR_IO, "cannot seek end of file", );
+
+    // At most every resolution of every image, and every variant
+    const size_t max_extents = (size_t) stats->max_files * NB_RES
+                               + ((imgstfile->variants != NULL) ? imgstfile->variants->nb : 0);
+    struct extent* extents = NULL;
+    M_EXIT_IF_NULL(extents = calloc(max_extents + 1, sizeof(struct extent)),
+                   (max_extents + 1) * sizeof(struct extent));
+
+    const size_t nb = collect_extents(imgstfile, extents, stats);
+    qsort(extents, nb, sizeof(struct extent), compare_extents);
+
+    // Walk the file in order: contents shared by several images come in a row
+    uint64_t end = stats->table_bytes;
+
+    for (size_t i = 0; i < nb; ++i) {
+        const struct extent* e = &extents[i];
+
+        if (i > 0 && e->offset == extents[i - 1].offset && e->size <= extents[i - 1].size) {
+            stats->dedup_saved_bytes += e->size;
+            stats->dedup_images += e->is_orig;
+            continue;
+        }
+
+        if (e->offset > end) {
+            add_gap(stats, end, e->offset - end);
+        }
+
+        const uint64_t e_end = e->offset + e->size;
+        if (e_end > end) {
+            stats->live_bytes += e_end - ((e->offset > end) ? e->offset : end);
+            end = e_end;
+        }
+    }
+
+    if (stats->file_bytes > end) {
+        add_gap(stats, end, stats->file_bytes - end);
+    }
+
+    FREE_DEREF(extents);
+
+    const uint64_t used = stats->table_bytes + stats->live_bytes;
+    stats->dead_bytes = (stats->file_bytes > used) ? stats->file_bytes - used : 0;
+
+    return project_gc(imgstfile, stats);
+}
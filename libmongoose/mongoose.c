@@ -2636,9 +2636,10 @@ static void mg_set_non_blocking_mode(SOCKET fd) {
 #endif
 }
 
-SOCKET mg_open_listener(const char *url) {
+SOCKET mg_open_listener(const char *url, int reuseport) {
   struct mg_addr addr;
   SOCKET fd = INVALID_SOCKET;
+  (void) reuseport;
 
   memset(&addr, 0, sizeof(addr));
   addr.port = mg_htons(mg_url_port(url));
@@ -2665,6 +2666,11 @@ SOCKET mg_open_listener(const char *url) {
         // SO_EXCLUSIVEADDRUSE is supported and set on a socket.
         !setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on)) &&
 #endif
+#if MG_ENABLE_REUSEPORT && defined(SO_REUSEPORT)
+        // The kernel spreads the connections among the listeners of the port
+        (!reuseport ||
+         !setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on))) &&
+#endif
 #if defined(_WIN32) && defined(SO_EXCLUSIVEADDRUSE) && !defined(WINCE)
         // "Using SO_REUSEADDR and SO_EXCLUSIVEADDRUSE"
         //! setsockopt(fd, SOL_SOCKET, SO_BROADCAST, (char *) &on, sizeof(on))
@@ -2909,7 +2915,7 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
                                 mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = NULL;
   int is_udp = strncmp(url, "udp:", 4) == 0;
-  SOCKET fd = mg_open_listener(url);
+  SOCKET fd = mg_open_listener(url, mgr->reuseport);
   if (fd == INVALID_SOCKET) {
   } else if ((c = alloc_conn(mgr, 0, fd)) == NULL) {
     LOG(LL_ERROR, ("OOM %s", url));
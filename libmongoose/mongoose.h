@@ -330,6 +330,12 @@ typedef int socklen_t;
 #define MG_ENABLE_SOCKETPAIR 0
 #endif
 
+// Let several listeners bind the same port, e.g. one per thread, when their
+// mg_mgr asks for it with reuseport
+#ifndef MG_ENABLE_REUSEPORT
+#define MG_ENABLE_REUSEPORT 0
+#endif
+
 // Granularity of the send/recv IO buffer growth
 #ifndef MG_IO_SIZE
 #define MG_IO_SIZE 512
@@ -600,6 +606,7 @@ struct mg_mgr {
   struct mg_dns dns6;           // DNS for IPv6
   int dnstimeout;               // DNS resolve timeout in milliseconds
   unsigned long nextid;         // Next connection ID
+  int reuseport;                // SO_REUSEPORT on listeners, if MG_ENABLE_REUSEPORT
 #if MG_ARCH == MG_ARCH_FREERTOS
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
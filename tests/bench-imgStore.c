@@ -0,0 +1,389 @@
+/**
+ * @file bench-imgStore.c
+ * @brief microbenchmarks of the core imgStore library operations.
+ *   Builds a synthetic imgStore of max_files slots filled up to a ratio,
+ *   times each operation many times and writes one CSV line per operation
+ *   with percentiles and the peak resident set size.
+ *
+ * @author ???
+ */
+#define _POSIX_C_SOURCE 200809L // for clock_gettime, dup, dup2
+
+#include "imgStore.h"
+#include "image_content.h" // for lazily_resize
+#include "error.h"
+#include "util.h" // for atouint32
+
+#include <stdio.h>
+#include <inttypes.h> // for PRIu32
+#include <stdlib.h> // for qsort, rand
+#include <string.h>
+#include <time.h> // for clock_gettime
+#include <fcntl.h> // for open
+#include <unistd.h> // for dup, dup2, unlink
+#include <sys/resource.h> // for getrusage
+#include <vips/vips.h>
+
+#define BENCH_DEF_MAX_FILES 1000
+#define BENCH_DEF_FILL 0.5
+#define BENCH_DEF_REPS 200
+#define BENCH_DEF_OUT "bench.csv"
+#define BENCH_STORE "bench.imgst"
+#define BENCH_STORE_GC "bench-gc.imgst"
+#define BENCH_IMAGE "tests/data/papillon.jpg"
+#define BENCH_SEED 42
+#define BENCH_TRAILER_LEN 16 // hexadecimal digits making an image unique
+
+#define BENCH_HEADER "operation,max_files,fill,samples,mean_us,p50_us,p90_us,p99_us,max_us,peak_rss_kb"
+
+// The durations of one operation
+typedef struct {
+    double* us;
+    size_t nb;
+    size_t cap;
+} samples;
+
+// What every operation is measured against
+typedef struct {
+    FILE* csv;
+    uint32_t max_files;
+    double fill;
+    size_t reps;
+    char* image;      // a JPEG made unique per insert by a trailer
+    size_t image_size;
+    size_t trailer;   // offset of the trailer in image
+} bench;
+
+/**
+ * Current time, in microseconds.
+ */
+static double now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return 1e6 * (double) t.tv_sec + 1e-3 * (double) t.tv_nsec;
+}
+
+/**
+ * Adds a duration to the samples.
+ */
+static void add_sample(samples* s, double us)
+{
+    if (s->nb == s->cap) {
+        const size_t cap = (s->cap == 0) ? 64 : 2 * s->cap;
+        double* grown = realloc(s->us, cap * sizeof(double));
+
+        if (grown == NULL) {
+            return;
+        }
+
+        s->us = grown;
+        s->cap = cap;
+    }
+
+    s->us[s->nb++] = us;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Writes the CSV line of an operation and forgets its samples.
+ */
+static void report(const bench* b, const char* operation, samples* s)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (s->nb == 0) {
+        fprintf(b->csv, "%s,%" PRIu32 ",%.2f,0,,,,,,%ld\n", operation, b->max_files, b->fill,
+                usage.ru_maxrss);
+        return;
+    }
+
+    qsort(s->us, s->nb, sizeof(double), compare_doubles);
+
+    double sum = 0;
+
+    for (size_t i = 0; i < s->nb; ++i) {
+        sum += s->us[i];
+    }
+
+#define PERCENTILE(p) s->us[(size_t)((double)(s->nb - 1) * (p) / 100.0)]
+    fprintf(b->csv, "%s,%" PRIu32 ",%.2f,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%ld\n",
+            operation, b->max_files, b->fill, s->nb, sum / (double) s->nb,
+            PERCENTILE(50), PERCENTILE(90), PERCENTILE(99), s->us[s->nb - 1], usage.ru_maxrss);
+#undef PERCENTILE
+
+    fflush(b->csv);
+    FREE_DEREF(s->us);
+    s->nb = s->cap = 0;
+}
+
+/**
+ * The imgID of the i-th synthetic image.
+ */
+static void bench_id(char id[MAX_IMG_ID + 1], size_t i)
+{
+    snprintf(id, MAX_IMG_ID + 1, "img%07zu", i);
+}
+
+/**
+ * Makes the content of the image unique: decoders ignore what follows
+ * the end of a JPEG.
+ */
+static void make_unique(bench* b, size_t i)
+{
+    // The buffer has room for the null character after the image
+    snprintf(b->image + b->trailer, BENCH_TRAILER_LEN + 1, "%016zx", i);
+}
+
+/**
+ * Creates the imgStore and fills it, timing do_insert.
+ */
+static int bench_fill(bench* b, size_t* nb_images)
+{
+    imgst_file imgstfile;
+    memset(&imgstfile, 0, sizeof(imgstfile));
+    imgstfile.header.max_files = b->max_files;
+    imgstfile.header.res_resized[0] = imgstfile.header.res_resized[1] = DEF_RES_THUMB;
+    imgstfile.header.res_resized[2] = imgstfile.header.res_resized[3] = DEF_RES_SMALL;
+    M_EXIT_IF_ERR(do_create(BENCH_STORE, &imgstfile));
+
+    const size_t target = (size_t)((double) b->max_files * b->fill);
+    samples s = {0};
+    char id[MAX_IMG_ID + 1];
+    int ret = ERR_NONE;
+
+    for (size_t i = 0; i < target && ret == ERR_NONE; ++i) {
+        bench_id(id, i);
+        make_unique(b, i);
+
+        const double start = now_us();
+        ret = do_insert(b->image, b->image_size, id, &imgstfile);
+        add_sample(&s, now_us() - start);
+    }
+
+    do_close(&imgstfile);
+    report(b, "do_insert", &s);
+    *nb_images = target;
+
+    return ret;
+}
+
+/**
+ * Times opening and closing the imgStore.
+ */
+static int bench_open(bench* b)
+{
+    samples s = {0};
+
+    for (size_t r = 0; r < b->reps; ++r) {
+        imgst_file imgstfile;
+        const double start = now_us();
+        M_EXIT_IF_ERR(do_open(BENCH_STORE, "rb+", &imgstfile));
+        add_sample(&s, now_us() - start);
+        do_close(&imgstfile);
+    }
+
+    report(b, "do_open", &s);
+
+    return ERR_NONE;
+}
+
+/**
+ * Times the operations done on an open imgStore.
+ */
+static int bench_operations(bench* b, size_t nb_images)
+{
+    imgst_file imgstfile;
+    M_EXIT_IF_ERR(do_open(BENCH_STORE, "rb+", &imgstfile));
+
+    samples s = {0};
+    char id[MAX_IMG_ID + 1];
+    const size_t reps = (nb_images < b->reps) ? nb_images : b->reps;
+
+    // findMetadataIndex, on images spread over the store
+    for (size_t r = 0; r < b->reps && nb_images > 0; ++r) {
+        size_t idx = 0;
+        bench_id(id, (size_t) rand() % nb_images);
+        const double start = now_us();
+        findMetadataIndex(&idx, id, &imgstfile);
+        add_sample(&s, now_us() - start);
+    }
+    report(b, "findMetadataIndex", &s);
+
+    // do_read of the original, for images that exist and for images that don't
+    for (size_t r = 0; r < b->reps && nb_images > 0; ++r) {
+        char* buffer = NULL;
+        uint32_t size = 0;
+        bench_id(id, (size_t) rand() % nb_images);
+        const double start = now_us();
+        do_read(id, RES_ORIG, &buffer, &size, &imgstfile);
+        add_sample(&s, now_us() - start);
+        FREE_DEREF(buffer);
+    }
+    report(b, "do_read_hit", &s);
+
+    for (size_t r = 0; r < b->reps; ++r) {
+        char* buffer = NULL;
+        uint32_t size = 0;
+        bench_id(id, b->max_files + r);
+        const double start = now_us();
+        do_read(id, RES_ORIG, &buffer, &size, &imgstfile);
+        add_sample(&s, now_us() - start);
+        FREE_DEREF(buffer);
+    }
+    report(b, "do_read_miss", &s);
+
+    // lazily_resize, the first time each image is asked for at each resolution
+    static const char* const names[NB_RES] = {"lazily_resize_thumb", "lazily_resize_small", NULL};
+
+    for (int res = RES_THUMB; res <= RES_SMALL; ++res) {
+        for (size_t i = 0; i < reps; ++i) {
+            size_t idx = 0;
+            bench_id(id, i);
+
+            if (findMetadataIndex(&idx, id, &imgstfile) == ERR_NONE) {
+                const double start = now_us();
+                lazily_resize(res, &imgstfile, idx);
+                add_sample(&s, now_us() - start);
+            }
+        }
+        report(b, names[res], &s);
+    }
+
+    // do_list, with its output thrown away in STDOUT mode
+    fflush(stdout);
+    const int saved_stdout = dup(STDOUT_FILENO);
+    const int null_fd = open("/dev/null", O_WRONLY);
+
+    for (size_t r = 0; r < b->reps && saved_stdout >= 0 && null_fd >= 0; ++r) {
+        dup2(null_fd, STDOUT_FILENO);
+        const double start = now_us();
+        do_list(&imgstfile, STDOUT);
+        fflush(stdout);
+        add_sample(&s, now_us() - start);
+        dup2(saved_stdout, STDOUT_FILENO);
+    }
+    report(b, "do_list_stdout", &s);
+
+    if (null_fd >= 0) close(null_fd);
+    if (saved_stdout >= 0) close(saved_stdout);
+
+    for (size_t r = 0; r < b->reps; ++r) {
+        const double start = now_us();
+        char* json = do_list(&imgstfile, JSON);
+        add_sample(&s, now_us() - start);
+        FREE_DEREF(json);
+    }
+    report(b, "do_list_json", &s);
+
+    // do_delete, of the last images inserted
+    for (size_t i = 0; i < reps; ++i) {
+        bench_id(id, nb_images - 1 - i);
+        const double start = now_us();
+        do_delete(id, &imgstfile);
+        add_sample(&s, now_us() - start);
+    }
+    report(b, "do_delete", &s);
+
+    do_close(&imgstfile);
+
+    return ERR_NONE;
+}
+
+/**
+ * Times the garbage collection of the imgStore, once.
+ */
+static int bench_gbcollect(bench* b)
+{
+    samples s = {0};
+    const double start = now_us();
+    const int ret = do_gbcollect(BENCH_STORE, BENCH_STORE_GC);
+    add_sample(&s, now_us() - start);
+    report(b, "do_gbcollect", &s);
+
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("unable to start VIPS");
+        return ERR_IMGLIB;
+    }
+
+    bench b = {.max_files = BENCH_DEF_MAX_FILES, .fill = BENCH_DEF_FILL, .reps = BENCH_DEF_REPS};
+    const char* out = BENCH_DEF_OUT;
+
+    // Parse the options
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-max_files")) {
+            b.max_files = atouint32(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-fill")) {
+            b.fill = atof(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-reps")) {
+            b.reps = atouint32(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-out")) {
+            out = argv[i + 1];
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    if (b.max_files == 0 || b.max_files > MAX_MAX_FILES || b.fill < 0 || b.fill > 1 || b.reps == 0) {
+        fprintf(stderr, "usage: %s [-max_files 1..%d] [-fill 0..1] [-reps N] [-out file.csv]\n",
+                argv[0], MAX_MAX_FILES);
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // The image, with room for a trailer
+    char* jpeg = NULL;
+    size_t jpeg_size = 0;
+
+    if (read_disk_image(BENCH_IMAGE, &jpeg, &jpeg_size) != ERR_NONE) {
+        fprintf(stderr, "cannot read %s\n", BENCH_IMAGE);
+        return ERR_IO;
+    }
+
+    b.trailer = jpeg_size;
+    b.image_size = jpeg_size + BENCH_TRAILER_LEN;
+    b.image = calloc(1, b.image_size + 1);
+
+    if (b.image == NULL || (b.csv = fopen(out, "w")) == NULL) {
+        FREE_DEREF(jpeg);
+        FREE_DEREF(b.image);
+        return ERR_IO;
+    }
+
+    memcpy(b.image, jpeg, jpeg_size);
+    FREE_DEREF(jpeg);
+
+    srand(BENCH_SEED);
+    fprintf(b.csv, BENCH_HEADER "\n");
+
+    size_t nb_images = 0;
+    int ret = bench_fill(&b, &nb_images);
+
+    if (ret == ERR_NONE) ret = bench_open(&b);
+    if (ret == ERR_NONE) ret = bench_operations(&b, nb_images);
+    if (ret == ERR_NONE) ret = bench_gbcollect(&b);
+
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[ret]);
+    }
+
+    fclose(b.csv);
+    FREE_DEREF(b.image);
+    unlink(BENCH_STORE);
+    vips_shutdown();
+
+    return ret;
+}
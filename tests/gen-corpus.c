@@ -0,0 +1,408 @@
+/**
+ * @file gen-corpus.c
+ * @brief generates reproducible JPEG corpora for benchmarks and stress tests.
+ *   The same seed and options always give the same images, with the same
+ *   imgIDs, whether they are written as files or straight into an imgStore.
+ *
+ * @author ???
+ */
+#define _POSIX_C_SOURCE 200809L // for mkdir
+
+#include "imgStore.h"
+#include "error.h"
+#include "util.h" // for atouint32
+
+#include <stdio.h>
+#include <stdlib.h> // for strtod, strtoul
+#include <string.h>
+#include <inttypes.h> // for PRIu64
+#include <sys/stat.h> // for mkdir
+#include <vips/vips.h>
+
+#define GEN_DEF_COUNT 100
+#define GEN_DEF_SEED 1
+#define GEN_DEF_RES "640x480:1"
+#define GEN_MAX_RES 16     // max. number of resolutions in a distribution
+#define GEN_MAX_SIDE 16384 // max. width or height of an image
+#define GEN_BANDS 3
+
+/**
+ * A resolution and how often it is drawn, relatively to the others.
+ */
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    double weight;
+} gen_res;
+
+/**
+ * An inclusive range of values, drawn uniformly.
+ */
+typedef struct {
+    uint32_t min;
+    uint32_t max;
+} gen_range;
+
+typedef struct {
+    uint64_t seed;
+    uint32_t count;
+    gen_res res[GEN_MAX_RES];
+    size_t nb_res;
+    gen_range quality;  // JPEG quality: the lower, the smaller
+    gen_range detail;   // number of shapes drawn: the more, the bigger
+    gen_range id_len;   // length of the imgIDs
+    double dup_ratio;   // share of images with the content of a previous one
+    const char* out_dir;
+    const char* store;
+    uint32_t max_files;
+} gen_options;
+
+/**
+ * splitmix64: small, fast and, above all, the same on every platform.
+ */
+static uint64_t gen_next(uint64_t* state)
+{
+    uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+/**
+ * A uniform double in [0, 1).
+ */
+static double gen_unit(uint64_t* state)
+{
+    return (double)(gen_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * A uniform integer in the range.
+ */
+static uint32_t gen_in(uint64_t* state, gen_range range)
+{
+    return range.min + (uint32_t)(gen_next(state) % ((uint64_t) range.max - range.min + 1));
+}
+
+/**
+ * The state of the generator of one image, independent of all the others,
+ * so that a duplicate can render its original again instead of keeping it.
+ */
+static uint64_t gen_image_seed(uint64_t seed, uint32_t index)
+{
+    uint64_t state = seed ^ ((uint64_t) index << 32);
+    return gen_next(&state);
+}
+
+/**
+ * Renders the image of the given seed as a JPEG: blocks of random grey
+ * levels on each band, their number setting how well the image compresses.
+ */
+static int gen_render(const gen_options* options, uint64_t image_seed, void** jpeg, size_t* size)
+{
+    uint64_t state = image_seed;
+
+    // Step 1: draw the resolution
+    double total = 0;
+    for (size_t i = 0; i < options->nb_res; ++i) {
+        total += options->res[i].weight;
+    }
+
+    double pick = gen_unit(&state) * total;
+    size_t r = 0;
+    while (r + 1 < options->nb_res && pick >= options->res[r].weight) {
+        pick -= options->res[r].weight;
+        ++r;
+    }
+
+    const int width = (int) options->res[r].width;
+    const int height = (int) options->res[r].height;
+    const int quality = (int) gen_in(&state, options->quality);
+    const uint32_t detail = gen_in(&state, options->detail);
+
+    // Step 2: draw the bands
+    VipsImage* bands[GEN_BANDS] = {NULL};
+    int ret = ERR_NONE;
+
+    for (int b = 0; b < GEN_BANDS && ret == ERR_NONE; ++b) {
+        if (vips_black(&bands[b], width, height, NULL)) {
+            ret = ERR_IMGLIB;
+            break;
+        }
+
+        vips_draw_rect1(bands[b], (double)(gen_next(&state) % 256), 0, 0, width, height,
+                        "fill", 1, NULL);
+
+        for (uint32_t d = 0; d < detail && ret == ERR_NONE; ++d) {
+            const int w = 1 + (int)(gen_next(&state) % (uint64_t) width);
+            const int h = 1 + (int)(gen_next(&state) % (uint64_t) height);
+            const int left = (int)(gen_next(&state) % (uint64_t)(width - w + 1));
+            const int top = (int)(gen_next(&state) % (uint64_t)(height - h + 1));
+
+            if (vips_draw_rect1(bands[b], (double)(gen_next(&state) % 256), left, top, w, h,
+                                "fill", 1, NULL)) {
+                ret = ERR_IMGLIB;
+            }
+        }
+    }
+
+    // Step 3: join and compress them
+    VipsImage* image = NULL;
+
+    if (ret == ERR_NONE && vips_bandjoin(bands, &image, GEN_BANDS, NULL)) {
+        ret = ERR_IMGLIB;
+    }
+
+    for (int b = 0; b < GEN_BANDS; ++b) {
+        if (bands[b] != NULL) g_object_unref(bands[b]);
+    }
+
+    if (ret == ERR_NONE) {
+        if (vips_jpegsave_buffer(image, jpeg, size, "Q", quality, NULL)) {
+            ret = ERR_IMGLIB;
+        }
+        g_object_unref(image);
+    }
+
+    return ret;
+}
+
+/**
+ * The imgID of an image: random letters followed by its index, which keeps
+ * imgIDs unique whatever their length.
+ */
+static void gen_id(const gen_options* options, uint64_t* state, uint32_t index,
+                   char id[MAX_IMG_ID + 1])
+{
+    char digits[16];
+    const int nb_digits = snprintf(digits, sizeof(digits), "%" PRIu32, index);
+    uint32_t len = gen_in(state, options->id_len);
+    len = (len < (uint32_t) nb_digits) ? (uint32_t) nb_digits : len;
+
+    const uint32_t nb_letters = len - (uint32_t) nb_digits;
+
+    for (uint32_t i = 0; i < nb_letters; ++i) {
+        id[i] = (char)('a' + gen_next(state) % 26);
+    }
+
+    memcpy(id + nb_letters, digits, (size_t) nb_digits + 1);
+}
+
+/**
+ * Parses a range given as "min:max", or as a single value.
+ */
+static int parse_range(const char* str, gen_range* range, uint32_t max)
+{
+    char* end = NULL;
+    const unsigned long min = strtoul(str, &end, 10);
+    unsigned long top = min;
+
+    if (*end == ':') {
+        top = strtoul(end + 1, &end, 10);
+    }
+
+    M_EXIT_IF(*end != '\0' || min > top || top > max, ERR_INVALID_ARGUMENT,
+              "invalid range %s", str);
+
+    range->min = (uint32_t) min;
+    range->max = (uint32_t) top;
+
+    return ERR_NONE;
+}
+
+/**
+ * Parses a resolution distribution given as "WxH:weight,WxH:weight,...".
+ */
+static int parse_res(const char* str, gen_options* options)
+{
+    options->nb_res = 0;
+
+    while (*str != '\0') {
+        M_EXIT_IF(options->nb_res == GEN_MAX_RES, ERR_INVALID_ARGUMENT, "too many resolutions%s", "");
+
+        gen_res* res = &options->res[options->nb_res];
+        char* end = NULL;
+        res->width = (uint32_t) strtoul(str, &end, 10);
+        M_EXIT_IF(*end != 'x', ERR_INVALID_ARGUMENT, "invalid resolution %s", str);
+        res->height = (uint32_t) strtoul(end + 1, &end, 10);
+        res->weight = 1;
+
+        if (*end == ':') {
+            res->weight = strtod(end + 1, &end);
+        }
+
+        M_EXIT_IF(res->width == 0 || res->height == 0 || res->width > GEN_MAX_SIDE
+                  || res->height > GEN_MAX_SIDE || !(res->weight > 0)
+                  || (*end != ',' && *end != '\0'),
+                  ERR_INVALID_ARGUMENT, "invalid resolution %s", str);
+
+        options->nb_res += 1;
+        str = (*end == ',') ? end + 1 : end;
+    }
+
+    M_EXIT_IF(options->nb_res == 0, ERR_INVALID_ARGUMENT, "no resolution%s", "");
+
+    return ERR_NONE;
+}
+
+static int parse_options(int argc, char* argv[], gen_options* options)
+{
+    M_EXIT_IF_ERR(parse_res(GEN_DEF_RES, options));
+
+    for (int i = 1; i < argc; i += 2) {
+        M_EXIT_IF(i + 1 >= argc, ERR_NOT_ENOUGH_ARGUMENTS, "%s needs a value", argv[i]);
+        const char* value = argv[i + 1];
+
+        if (!strcmp(argv[i], "-seed")) {
+            options->seed = strtoull(value, NULL, 10);
+        } else if (!strcmp(argv[i], "-count")) {
+            options->count = atouint32(value);
+        } else if (!strcmp(argv[i], "-res")) {
+            M_EXIT_IF_ERR(parse_res(value, options));
+        } else if (!strcmp(argv[i], "-quality")) {
+            M_EXIT_IF_ERR(parse_range(value, &options->quality, 100));
+        } else if (!strcmp(argv[i], "-detail")) {
+            M_EXIT_IF_ERR(parse_range(value, &options->detail, 100000));
+        } else if (!strcmp(argv[i], "-idlen")) {
+            M_EXIT_IF_ERR(parse_range(value, &options->id_len, MAX_IMG_ID));
+        } else if (!strcmp(argv[i], "-dup")) {
+            options->dup_ratio = atof(value);
+        } else if (!strcmp(argv[i], "-out")) {
+            options->out_dir = value;
+        } else if (!strcmp(argv[i], "-store")) {
+            options->store = value;
+        } else if (!strcmp(argv[i], "-max_files")) {
+            options->max_files = atouint32(value);
+        } else {
+            M_EXIT_IF(1, ERR_INVALID_ARGUMENT, "unknown option %s", argv[i]);
+        }
+    }
+
+    M_EXIT_IF(options->count == 0 || options->quality.min == 0 || options->id_len.min == 0
+              || options->dup_ratio < 0 || options->dup_ratio > 1
+              || (options->out_dir == NULL && options->store == NULL),
+              ERR_INVALID_ARGUMENT, "invalid options%s", "");
+
+    if (options->max_files == 0) {
+        options->max_files = (options->count > MAX_MAX_FILES) ? MAX_MAX_FILES : options->count;
+    }
+    M_EXIT_IF(options->max_files > MAX_MAX_FILES, ERR_INVALID_ARGUMENT, "max_files above %d",
+              MAX_MAX_FILES);
+
+    return ERR_NONE;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s (-out <dir> | -store <imgstore>) [options]\n"
+            "  -seed N                 seed of the corpus (default %d)\n"
+            "  -count N                number of images (default %d)\n"
+            "  -res WxH:w,WxH:w,...    resolutions with their weights (default %s)\n"
+            "  -quality MIN:MAX        JPEG quality (default 75:90)\n"
+            "  -detail MIN:MAX         shapes drawn per band, i.e. size (default 4:64)\n"
+            "  -idlen MIN:MAX          length of the imgIDs (default 8:16)\n"
+            "  -dup RATIO              ratio of duplicated contents (default 0)\n"
+            "  -max_files N            slots of the new imgStore (default: count)\n",
+            name, GEN_DEF_SEED, GEN_DEF_COUNT, GEN_DEF_RES);
+}
+
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("unable to start VIPS");
+        return ERR_IMGLIB;
+    }
+
+    gen_options options = {
+        .seed = GEN_DEF_SEED, .count = GEN_DEF_COUNT,
+        .quality = {75, 90}, .detail = {4, 64}, .id_len = {8, 16}
+    };
+
+    int ret = parse_options(argc, argv, &options);
+
+    if (ret != ERR_NONE) {
+        usage(argv[0]);
+        vips_shutdown();
+        return ret;
+    }
+
+    // Step 1: open what the images go to
+    imgst_file imgstfile;
+    memset(&imgstfile, 0, sizeof(imgstfile));
+
+    if (options.out_dir != NULL && mkdir(options.out_dir, 0755) != 0) {
+        struct stat st;
+        if (stat(options.out_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            ret = ERR_IO;
+        }
+    }
+
+    if (ret == ERR_NONE && options.store != NULL) {
+        imgstfile.header.max_files = options.max_files;
+        imgstfile.header.res_resized[0] = imgstfile.header.res_resized[1] = DEF_RES_THUMB;
+        imgstfile.header.res_resized[2] = imgstfile.header.res_resized[3] = DEF_RES_SMALL;
+        ret = do_create(options.store, &imgstfile);
+    }
+
+    // Step 2: generate the images one after the other
+    uint32_t* origins = calloc(options.count, sizeof(uint32_t));
+    if (ret == ERR_NONE && origins == NULL) {
+        ret = ERR_OUT_OF_MEMORY;
+    }
+
+    uint64_t state = options.seed;
+    uint32_t duplicates = 0;
+    uint64_t bytes = 0;
+    uint32_t i = 0;
+
+    for (; i < options.count && ret == ERR_NONE; ++i) {
+        char id[MAX_IMG_ID + 1] = {0};
+        gen_id(&options, &state, i, id);
+
+        // A duplicate renders the content of an earlier image once more
+        origins[i] = i;
+        if (i > 0 && gen_unit(&state) < options.dup_ratio) {
+            origins[i] = origins[gen_next(&state) % i];
+            ++duplicates;
+        }
+
+        void* jpeg = NULL;
+        size_t size = 0;
+        ret = gen_render(&options, gen_image_seed(options.seed, origins[i]), &jpeg, &size);
+
+        if (ret == ERR_NONE && options.out_dir != NULL) {
+            char path[FILENAME_MAX];
+            snprintf(path, sizeof(path), "%s/%s.jpg", options.out_dir, id);
+            FILE* file = fopen(path, "wb");
+
+            if (file == NULL || fwrite(jpeg, size, 1, file) != 1) {
+                ret = ERR_IO;
+            }
+            if (file != NULL) fclose(file);
+        }
+
+        if (ret == ERR_NONE && options.store != NULL) {
+            ret = do_insert(jpeg, size, id, &imgstfile);
+        }
+
+        bytes += size;
+        g_free(jpeg);
+    }
+
+    FREE_DEREF(origins);
+
+    if (options.store != NULL && imgstfile.file != NULL) {
+        do_close(&imgstfile);
+    }
+
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[ret]);
+    }
+
+    printf("%" PRIu32 " images (%" PRIu32 " duplicated contents), %" PRIu64 " bytes\n",
+           i - (ret != ERR_NONE), duplicates, bytes);
+
+    vips_shutdown();
+
+    return ret;
+}
@@ -0,0 +1,309 @@
+#pragma once
+
+/**
+ * @file http_client.h
+ * @brief minimal blocking HTTP/1.1 client of the load and replay tools,
+ *   talking to an imgStore_server on the loopback interface.
+ *
+ * @author ???
+ */
+
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // for strncasecmp
+#include <time.h> // for nanosleep
+#include <signal.h> // for kill
+#include <fcntl.h> // for open
+#include <unistd.h> // for fork, execl, close
+#include <sys/socket.h>
+#include <sys/time.h> // for struct timeval
+#include <sys/wait.h> // for waitpid
+#include <netinet/in.h>
+#include <netinet/tcp.h> // for TCP_NODELAY
+#include <arpa/inet.h> // for htons
+#include <json-c/json.h>
+
+#define HTTP_DEF_PORT 8000
+#define HTTP_SERVER "./imgStore_server"
+#define HTTP_SPAWN_WAIT_MS 5000
+#define HTTP_TIMEOUT_S 30
+#define HTTP_HEAD_MAX 4096
+#define HTTP_REQUEST_MAX 512
+#define HTTP_ADDRESS_MAX 32 // "127.0.0.1:<port>"
+
+static inline int http_connect(uint16_t port)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const int one = 1;
+    const struct timeval timeout = {HTTP_TIMEOUT_S, 0};
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static inline int http_send_all(int fd, const void* data, size_t len)
+{
+    const char* p = data;
+
+    while (len > 0) {
+        const ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return ERR_IO;
+        p += n;
+        len -= (size_t) n;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Finds a header of the response head, case insensitively.
+ */
+static inline const char* http_find_header(const char* head, const char* name)
+{
+    const size_t len = strlen(name);
+
+    for (const char* line = strstr(head, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, len) == 0 && line[2 + len] == ':') {
+            return line + 3 + len;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Sends a request on the connection in *fd, opening it if it is -1, and
+ * reads the whole response. The connection is closed and *fd set to -1
+ * unless the server keeps it alive. The body is kept only if asked for.
+ */
+static inline int http_request(int* fd, uint16_t port, const char* method, const char* target,
+                               const void* body, size_t body_len, int* status, char** reply)
+{
+    if (*fd < 0 && (*fd = http_connect(port)) < 0) {
+        return ERR_IO;
+    }
+
+    char request[HTTP_REQUEST_MAX];
+    const int len = snprintf(request, sizeof(request),
+                             "%s %s HTTP/1.1\r\nHost: localhost\r\nContent-Length: %zu\r\n\r\n",
+                             method, target, body_len);
+
+    int ret = http_send_all(*fd, request, (size_t) len);
+    if (ret == ERR_NONE && body_len > 0) ret = http_send_all(*fd, body, body_len);
+
+    // Read the head
+    char head[HTTP_HEAD_MAX + 1];
+    size_t got = 0;
+    char* end = NULL;
+
+    while (ret == ERR_NONE && end == NULL) {
+        const ssize_t n = recv(*fd, head + got, HTTP_HEAD_MAX - got, 0);
+        if (n <= 0) {
+            ret = ERR_IO;
+            break;
+        }
+        got += (size_t) n;
+        head[got] = '\0';
+        end = strstr(head, "\r\n\r\n");
+        if (end == NULL && got == HTTP_HEAD_MAX) ret = ERR_IO;
+    }
+
+    if (ret != ERR_NONE || sscanf(head, "HTTP/1.%*d %d", status) != 1) {
+        close(*fd);
+        *fd = -1;
+        return ERR_IO;
+    }
+
+    *end = '\0';
+    const size_t body_start = (size_t)(end + 4 - head);
+    const char* length = http_find_header(head, "Content-Length");
+    const char* connection = http_find_header(head, "Connection");
+    const long long expected = (length != NULL) ? atoll(length) : -1;
+    int keep = length != NULL && !(connection != NULL && strstr(connection, "close") != NULL);
+
+    // Read the body: up to its length, or until the server closes
+    size_t cap = (expected >= 0) ? (size_t) expected + 1 : HTTP_HEAD_MAX;
+    char* buf = malloc(cap);
+    size_t have = got - body_start;
+
+    if (buf == NULL) {
+        close(*fd);
+        *fd = -1;
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    memcpy(buf, head + body_start, have);
+
+    while (expected < 0 || have < (size_t) expected) {
+        if (have + 1 >= cap) {
+            char* grown = realloc(buf, 2 * cap);
+            if (grown == NULL) {
+                ret = ERR_OUT_OF_MEMORY;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+
+        const ssize_t n = recv(*fd, buf + have, cap - have - 1, 0);
+        if (n <= 0) {
+            keep = 0;
+            if (expected >= 0) ret = ERR_IO;
+            break;
+        }
+        have += (size_t) n;
+    }
+
+    buf[have] = '\0';
+
+    if (!keep) {
+        close(*fd);
+        *fd = -1;
+    }
+
+    if (reply != NULL && ret == ERR_NONE) {
+        *reply = buf;
+    } else {
+        free(buf);
+    }
+
+    return ret;
+}
+
+/**
+ * Percent-encodes an imgID for a query string.
+ */
+static inline void http_url_encode(const char* in, char* out, size_t out_size)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t o = 0;
+
+    for (; *in != '\0' && o + 4 < out_size; ++in) {
+        const unsigned char ch = (unsigned char) *in;
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')
+            || ch == '-' || ch == '_' || ch == '.' || ch == '~') {
+            out[o++] = (char) ch;
+        } else {
+            out[o++] = '%';
+            out[o++] = hex[ch >> 4];
+            out[o++] = hex[ch & 15];
+        }
+    }
+
+    out[o] = '\0';
+}
+
+/**
+ * Starts a server on the given imgStore, listening on the given port, with
+ * the given extra arguments (NULL-terminated, possibly NULL), and waits until
+ * it accepts connections.
+ *
+ * @return Its process ID, -1 if it did not start
+ */
+static inline pid_t http_spawn_server(const char* store, uint16_t port, char* const* extra)
+{
+    char address[HTTP_ADDRESS_MAX];
+    snprintf(address, sizeof(address), "127.0.0.1:%u", (unsigned) port);
+
+    char* argv[16] = {HTTP_SERVER, (char*) store, "-address", address};
+    for (size_t i = 0; extra != NULL && extra[i] != NULL && i + 5 < 16; ++i) {
+        argv[i + 4] = extra[i];
+    }
+
+    const pid_t pid = fork();
+
+    if (pid == 0) {
+        const int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+        execv(HTTP_SERVER, argv);
+        _exit(127);
+    }
+
+    for (int waited = 0; pid > 0 && waited < HTTP_SPAWN_WAIT_MS; waited += 50) {
+        const int fd = http_connect(port);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+
+        const struct timespec pause = {0, 50 * 1000 * 1000};
+        nanosleep(&pause, NULL);
+    }
+
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+
+    return -1;
+}
+
+/**
+ * Stops a server started by http_spawn_server.
+ */
+static inline void http_stop_server(pid_t pid)
+{
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/**
+ * Gets all the imgIDs of the server, in the order of its list.
+ */
+static inline int http_list_ids(uint16_t port, char*** ids, size_t* nb_ids)
+{
+    int fd = -1;
+    int status = 0;
+    char* reply = NULL;
+
+    M_EXIT_IF_ERR(http_request(&fd, port, "GET", "/imgStore/list", NULL, 0, &status, &reply));
+    if (fd >= 0) close(fd);
+
+    struct json_object* root = json_tokener_parse(reply);
+    free(reply);
+    M_EXIT_IF(status != 200 || root == NULL, ERR_IO, "cannot list the imgStore (HTTP %d)", status);
+
+    struct json_object* images = NULL;
+    int ret = ERR_NONE;
+    *ids = NULL;
+    *nb_ids = 0;
+
+    if (json_object_object_get_ex(root, "Images", &images)
+        && json_object_is_type(images, json_type_array)) {
+        const size_t nb = json_object_array_length(images);
+
+        if ((*ids = calloc(nb + 1, sizeof(char*))) == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+        }
+
+        for (size_t i = 0; i < nb && ret == ERR_NONE; ++i) {
+            const char* id = json_object_get_string(json_object_array_get_idx(images, i));
+            if (id != NULL && ((*ids)[*nb_ids] = strdup(id)) != NULL) {
+                *nb_ids += 1;
+            }
+        }
+    }
+
+    json_object_put(root);
+
+    return ret;
+}
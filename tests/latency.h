@@ -0,0 +1,132 @@
+#pragma once
+
+/**
+ * @file latency.h
+ * @brief HDR-style latency histograms for the load and replay tools.
+ *   Values up to 2^LATENCY_SUB_BITS microseconds are counted exactly, larger
+ *   ones in buckets of about 3% of their value, whatever their magnitude.
+ *
+ * @author ???
+ */
+
+#include <stdint.h> // for uint64_t
+#include <stdio.h> // for FILE
+
+#define LATENCY_SUB_BITS 6 // values below 2^6 us are exact
+#define LATENCY_EXACT (1u << LATENCY_SUB_BITS)
+#define LATENCY_HALF (LATENCY_EXACT / 2)
+#define LATENCY_MAX_EXP 40 // about 12 days in us
+#define LATENCY_BUCKETS (LATENCY_EXACT + (LATENCY_MAX_EXP - LATENCY_SUB_BITS + 1) * LATENCY_HALF)
+
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+} latency_hist;
+
+/**
+ * Index of the most significant bit of a non-zero value.
+ */
+static inline unsigned latency_msb(uint64_t v)
+{
+    unsigned msb = 0;
+    while (v >>= 1) ++msb;
+    return msb;
+}
+
+/**
+ * The bucket of a value, in microseconds.
+ */
+static inline size_t latency_bucket(uint64_t us)
+{
+    if (us < LATENCY_EXACT) {
+        return (size_t) us;
+    }
+
+    unsigned exp = latency_msb(us);
+    if (exp > LATENCY_MAX_EXP) {
+        exp = LATENCY_MAX_EXP;
+        us = (UINT64_C(1) << (LATENCY_MAX_EXP + 1)) - 1;
+    }
+
+    const unsigned shift = exp - LATENCY_SUB_BITS + 1;
+    return LATENCY_EXACT + (size_t)(exp - LATENCY_SUB_BITS) * LATENCY_HALF
+           + (size_t)((us >> shift) - LATENCY_HALF);
+}
+
+/**
+ * The highest value of a bucket, in microseconds.
+ */
+static inline uint64_t latency_value(size_t bucket)
+{
+    if (bucket < LATENCY_EXACT) {
+        return bucket;
+    }
+
+    const unsigned exp = LATENCY_SUB_BITS + (unsigned)((bucket - LATENCY_EXACT) / LATENCY_HALF);
+    const uint64_t mantissa = LATENCY_HALF + (bucket - LATENCY_EXACT) % LATENCY_HALF;
+    const unsigned shift = exp - LATENCY_SUB_BITS + 1;
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static inline void latency_record(latency_hist* h, uint64_t us)
+{
+    h->counts[latency_bucket(us)] += 1;
+    h->total += 1;
+    h->sum += (double) us;
+    h->max = (us > h->max) ? us : h->max;
+}
+
+static inline void latency_merge(latency_hist* into, const latency_hist* from)
+{
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    into->max = (from->max > into->max) ? from->max : into->max;
+}
+
+/**
+ * The value below which the given fraction of the values fall.
+ */
+static inline uint64_t latency_percentile(const latency_hist* h, double fraction)
+{
+    if (h->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(fraction * (double) h->total + 0.5);
+    rank = (rank == 0) ? 1 : rank;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            const uint64_t value = latency_value(i);
+            return (value < h->max) ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+#define LATENCY_CSV_HEADER "operation,requests,errors,throughput_rps,mean_us,p50_us,p99_us,p999_us,max_us"
+
+/**
+ * Writes a CSV line for the histogram of an operation.
+ */
+static inline void latency_print(FILE* out, const char* operation, const latency_hist* h,
+                                 uint64_t errors, double seconds)
+{
+    fprintf(out, "%s,%llu,%llu,%.1f,%.1f,%llu,%llu,%llu,%llu\n", operation,
+            (unsigned long long) h->total, (unsigned long long) errors,
+            (seconds > 0) ? (double) h->total / seconds : 0.0,
+            (h->total > 0) ? h->sum / (double) h->total : 0.0,
+            (unsigned long long) latency_percentile(h, 0.50),
+            (unsigned long long) latency_percentile(h, 0.99),
+            (unsigned long long) latency_percentile(h, 0.999),
+            (unsigned long long) h->max);
+}
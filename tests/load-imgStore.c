@@ -0,0 +1,506 @@
+/**
+ * @file load-imgStore.c
+ * @brief closed-loop HTTP load generator for imgStore_server.
+ *   Each client thread keeps one request in flight on its own connection to
+ *   a server on the loopback interface, for a given time or number of
+ *   requests, and records the latency of each operation in HDR-style
+ *   histograms.
+ *
+ * @author ???
+ */
+#define _POSIX_C_SOURCE 200809L // for clock_gettime, kill
+
+#include "imgStore.h"
+#include "error.h"
+#include "util.h" // for atouint32
+#include "latency.h"
+#include "http_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h> // for pow
+#include <time.h> // for clock_gettime
+#include <pthread.h>
+
+#define LOAD_DEF_CLIENTS 8
+#define LOAD_DEF_DURATION 10 // seconds
+#define LOAD_DEF_MIX "90:8:2:0"
+#define LOAD_DEF_RES "6:3:1"
+#define LOAD_DEF_ZIPF 0.99
+#define LOAD_DEF_IMAGE "tests/data/papillon.jpg"
+#define LOAD_ID_PREFIX "load"
+
+enum load_op { OP_READ, OP_INSERT, OP_DELETE, OP_LIST, NB_OPS };
+static const char* const s_op_names[NB_OPS] = {"read", "insert", "delete", "list"};
+static const char* const s_res_names[NB_RES] = {"thumb", "small", "orig"};
+
+typedef struct {
+    uint16_t port;
+    size_t clients;
+    double duration;    // seconds, if requests is 0
+    uint64_t requests;  // in total
+    double mix[NB_OPS];
+    double res[NB_RES];
+    double zipf;
+    uint64_t seed;
+    const char* image;
+    const char* spawn;  // imgStore to start a server on
+    const char* csv;
+} load_options;
+
+/**
+ * What the clients share: the imgIDs to read, their popularity and the
+ * image inserted.
+ */
+typedef struct {
+    const load_options* options;
+    char** ids;         // by decreasing popularity
+    size_t nb_ids;
+    double* zipf_cdf;
+    char* image;
+    size_t image_size;
+    double deadline;    // in us
+    uint64_t issued;    // requests started, against options->requests
+    pthread_mutex_t lock;
+} load_shared;
+
+/**
+ * A client: its connection, random state, and the images it inserted,
+ * which it is the only one to delete.
+ */
+typedef struct {
+    load_shared* shared;
+    size_t index;
+    int fd;
+    uint64_t rng;
+    char** inserted;
+    size_t nb_inserted;
+    size_t cap_inserted;
+    uint64_t next_id;
+    latency_hist hist[NB_OPS];
+    uint64_t errors[NB_OPS];
+} load_client;
+
+static double now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return 1e6 * (double) t.tv_sec + 1e-3 * (double) t.tv_nsec;
+}
+
+/**
+ * splitmix64, as in gen-corpus.
+ */
+static uint64_t rng_next(uint64_t* state)
+{
+    uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+static double rng_unit(uint64_t* state)
+{
+    return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Draws an index according to the given weights.
+ */
+static size_t rng_pick(uint64_t* state, const double* weights, size_t nb)
+{
+    double total = 0;
+    for (size_t i = 0; i < nb; ++i) total += weights[i];
+
+    double pick = rng_unit(state) * total;
+    size_t i = 0;
+    while (i + 1 < nb && (weights[i] == 0 || pick >= weights[i])) {
+        pick -= weights[i];
+        ++i;
+    }
+
+    return i;
+}
+
+/**
+ * Draws the rank of an imgID from the Zipf distribution.
+ */
+static size_t zipf_pick(const load_shared* shared, uint64_t* state)
+{
+    const double u = rng_unit(state);
+    size_t lo = 0, hi = shared->nb_ids - 1;
+
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (shared->zipf_cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+// ======================================================================
+// Operations
+
+#define ENCODED_ID_LEN (3 * MAX_IMG_ID + 1)
+
+static int op_read(load_client* c)
+{
+    const load_shared* s = c->shared;
+    if (s->nb_ids == 0) return ERR_FILE_NOT_FOUND;
+
+    char id[ENCODED_ID_LEN];
+    char target[HTTP_REQUEST_MAX];
+    http_url_encode(s->ids[zipf_pick(s, &c->rng)], id, sizeof(id));
+    snprintf(target, sizeof(target), "/imgStore/read?res=%s&img_id=%s",
+             s_res_names[rng_pick(&c->rng, s->options->res, NB_RES)], id);
+
+    int status = 0;
+    M_EXIT_IF_ERR(http_request(&c->fd, c->shared->options->port, "GET", target, NULL, 0, &status, NULL));
+
+    return (status == 200) ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * Uploads a fresh image in one chunk, then commits it.
+ */
+static int op_insert(load_client* c)
+{
+    char id[MAX_IMG_ID + 1];
+    snprintf(id, sizeof(id), LOAD_ID_PREFIX "%zu-%llu", c->index, (unsigned long long) c->next_id++);
+
+    // The content differs from the other inserts, after the end of the JPEG
+    load_shared* s = c->shared;
+    char* image = malloc(s->image_size + 32);
+    M_EXIT_IF_NULL(image, s->image_size + 32);
+    memcpy(image, s->image, s->image_size);
+    const int trailer = snprintf(image + s->image_size, 32, "%s", id);
+
+    char target[HTTP_REQUEST_MAX];
+    int status = 0;
+    snprintf(target, sizeof(target), "/imgStore/insert?offset=0&size=%zu&name=%s",
+             s->image_size + (size_t) trailer, id);
+    int ret = http_request(&c->fd, c->shared->options->port, "POST", target, image, s->image_size + (size_t) trailer, &status, NULL);
+    free(image);
+
+    if (ret == ERR_NONE && status == 200) {
+        snprintf(target, sizeof(target), "/imgStore/insert?offset=%zu&name=%s",
+                 s->image_size + (size_t) trailer, id);
+        ret = http_request(&c->fd, c->shared->options->port, "POST", target, NULL, 0, &status, NULL);
+    }
+
+    M_EXIT_IF_ERR(ret);
+    M_EXIT_IF(status != 302, ERR_IO, "insert of %s refused", id);
+
+    // Remember it, to delete it later
+    if (c->nb_inserted == c->cap_inserted) {
+        const size_t cap = (c->cap_inserted == 0) ? 64 : 2 * c->cap_inserted;
+        char** grown = realloc(c->inserted, cap * sizeof(char*));
+        M_EXIT_IF_NULL(grown, cap * sizeof(char*));
+        c->inserted = grown;
+        c->cap_inserted = cap;
+    }
+    M_EXIT_IF_NULL(c->inserted[c->nb_inserted] = strdup(id), sizeof(id));
+    c->nb_inserted += 1;
+
+    return ERR_NONE;
+}
+
+/**
+ * Deletes the last image the client inserted; there must be one.
+ */
+static int op_delete(load_client* c)
+{
+    char* id = c->inserted[--c->nb_inserted];
+    char target[HTTP_REQUEST_MAX];
+    snprintf(target, sizeof(target), "/imgStore/delete?img_id=%s", id);
+    free(id);
+
+    int status = 0;
+    M_EXIT_IF_ERR(http_request(&c->fd, c->shared->options->port, "GET", target, NULL, 0, &status, NULL));
+
+    return (status == 302) ? ERR_NONE : ERR_IO;
+}
+
+static int op_list(load_client* c)
+{
+    int status = 0;
+    M_EXIT_IF_ERR(http_request(&c->fd, c->shared->options->port, "GET", "/imgStore/list", NULL, 0, &status, NULL));
+
+    return (status == 200) ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * Whether the client may start one more request.
+ */
+static int load_go_on(load_shared* s)
+{
+    if (s->options->requests == 0) {
+        return now_us() < s->deadline;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    const int go_on = s->issued < s->options->requests;
+    s->issued += (uint64_t) go_on;
+    pthread_mutex_unlock(&s->lock);
+
+    return go_on;
+}
+
+static void* load_client_run(void* arg)
+{
+    load_client* c = arg;
+    const load_options* options = c->shared->options;
+
+    while (load_go_on(c->shared)) {
+        size_t op = rng_pick(&c->rng, options->mix, NB_OPS);
+
+        // Nothing to delete yet: insert instead, and count it as an insert
+        if (op == OP_DELETE && c->nb_inserted == 0) {
+            op = OP_INSERT;
+        }
+
+        const double start = now_us();
+        int ret = ERR_NONE;
+
+        switch (op) {
+        case OP_READ:   ret = op_read(c);   break;
+        case OP_INSERT: ret = op_insert(c); break;
+        case OP_DELETE: ret = op_delete(c); break;
+        default:        ret = op_list(c);   break;
+        }
+
+        latency_record(&c->hist[op], (uint64_t)(now_us() - start));
+        c->errors[op] += (ret != ERR_NONE);
+    }
+
+    if (c->fd >= 0) close(c->fd);
+
+    return NULL;
+}
+
+// ======================================================================
+// Set up
+
+/**
+ * Gets the imgIDs of the imgStore, shuffled so that popularity does not
+ * follow insertion order, and builds the Zipf distribution over them.
+ */
+static int load_ids(load_shared* s)
+{
+    M_EXIT_IF_ERR(http_list_ids(s->options->port, &s->ids, &s->nb_ids));
+    M_EXIT_IF_NULL(s->zipf_cdf = calloc(s->nb_ids + 1, sizeof(double)), (s->nb_ids + 1) * sizeof(double));
+
+    uint64_t rng = s->options->seed;
+    for (size_t i = s->nb_ids; i > 1; --i) {
+        const size_t j = (size_t)(rng_next(&rng) % i);
+        char* tmp = s->ids[i - 1];
+        s->ids[i - 1] = s->ids[j];
+        s->ids[j] = tmp;
+    }
+
+    double total = 0;
+    for (size_t i = 0; i < s->nb_ids; ++i) {
+        total += 1.0 / pow((double)(i + 1), s->options->zipf);
+        s->zipf_cdf[i] = total;
+    }
+    for (size_t i = 0; i < s->nb_ids; ++i) {
+        s->zipf_cdf[i] /= total;
+    }
+
+    return ERR_NONE;
+}
+
+static int parse_weights(const char* str, double* weights, size_t nb)
+{
+    memset(weights, 0, nb * sizeof(double));
+    double total = 0;
+
+    for (size_t i = 0; i < nb && *str != '\0'; ++i) {
+        char* end = NULL;
+        weights[i] = strtod(str, &end);
+        M_EXIT_IF(end == str || weights[i] < 0, ERR_INVALID_ARGUMENT, "invalid weights %s", str);
+        total += weights[i];
+        str = (*end == ':') ? end + 1 : end;
+    }
+
+    M_EXIT_IF(*str != '\0' || !(total > 0), ERR_INVALID_ARGUMENT, "invalid weights %s", str);
+
+    return ERR_NONE;
+}
+
+static int parse_options(int argc, char* argv[], load_options* o)
+{
+    M_EXIT_IF_ERR(parse_weights(LOAD_DEF_MIX, o->mix, NB_OPS));
+    M_EXIT_IF_ERR(parse_weights(LOAD_DEF_RES, o->res, NB_RES));
+
+    for (int i = 1; i < argc; i += 2) {
+        M_EXIT_IF(i + 1 >= argc, ERR_NOT_ENOUGH_ARGUMENTS, "%s needs a value", argv[i]);
+        const char* value = argv[i + 1];
+
+        if (!strcmp(argv[i], "-port")) {
+            o->port = atouint16(value);
+        } else if (!strcmp(argv[i], "-clients")) {
+            o->clients = atouint32(value);
+        } else if (!strcmp(argv[i], "-duration")) {
+            o->duration = atof(value);
+        } else if (!strcmp(argv[i], "-requests")) {
+            o->requests = strtoull(value, NULL, 10);
+        } else if (!strcmp(argv[i], "-mix")) {
+            M_EXIT_IF_ERR(parse_weights(value, o->mix, NB_OPS));
+        } else if (!strcmp(argv[i], "-res")) {
+            M_EXIT_IF_ERR(parse_weights(value, o->res, NB_RES));
+        } else if (!strcmp(argv[i], "-zipf")) {
+            o->zipf = atof(value);
+        } else if (!strcmp(argv[i], "-seed")) {
+            o->seed = strtoull(value, NULL, 10);
+        } else if (!strcmp(argv[i], "-image")) {
+            o->image = value;
+        } else if (!strcmp(argv[i], "-spawn")) {
+            o->spawn = value;
+        } else if (!strcmp(argv[i], "-csv")) {
+            o->csv = value;
+        } else {
+            M_EXIT_IF(1, ERR_INVALID_ARGUMENT, "unknown option %s", argv[i]);
+        }
+    }
+
+    M_EXIT_IF(o->port == 0 || o->clients == 0 || o->zipf < 0
+              || (o->requests == 0 && !(o->duration > 0)),
+              ERR_INVALID_ARGUMENT, "invalid options%s", "");
+
+    return ERR_NONE;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [options]\n"
+            "  -port N             port of the server on 127.0.0.1 (default %d)\n"
+            "  -spawn <imgstore>   start %s on that imgStore first\n"
+            "  -clients N          connections, each with one request in flight (default %d)\n"
+            "  -duration S         seconds to run (default %d)\n"
+            "  -requests N         requests to send in total, instead of a duration\n"
+            "  -mix R:I:D:L        weights of read, insert, delete and list (default %s)\n"
+            "  -res T:S:O          weights of thumb, small and orig reads (default %s)\n"
+            "  -zipf S             exponent of the imgID popularity (default %.2f)\n"
+            "  -seed N             seed of the random choices\n"
+            "  -image <jpeg>       image inserted (default %s)\n"
+            "  -csv <file>         also write the results there\n",
+            name, HTTP_DEF_PORT, HTTP_SERVER, LOAD_DEF_CLIENTS, LOAD_DEF_DURATION,
+            LOAD_DEF_MIX, LOAD_DEF_RES, LOAD_DEF_ZIPF, LOAD_DEF_IMAGE);
+}
+
+int main(int argc, char* argv[])
+{
+    load_options options = {
+        .port = HTTP_DEF_PORT, .clients = LOAD_DEF_CLIENTS, .duration = LOAD_DEF_DURATION,
+        .zipf = LOAD_DEF_ZIPF, .seed = 1, .image = LOAD_DEF_IMAGE
+    };
+
+    int ret = parse_options(argc, argv, &options);
+    if (ret != ERR_NONE) {
+        usage(argv[0]);
+        return ret;
+    }
+
+    load_shared shared = {.options = &options};
+    pthread_mutex_init(&shared.lock, NULL);
+
+    // Step 1: the image to insert, the server and its imgIDs
+    ret = read_disk_image(options.image, &shared.image, &shared.image_size);
+
+    pid_t server = -1;
+    if (ret == ERR_NONE && options.spawn != NULL
+        && (server = http_spawn_server(options.spawn, options.port, NULL)) < 0) {
+        fprintf(stderr, "cannot start %s on %s\n", HTTP_SERVER, options.spawn);
+        ret = ERR_IO;
+    }
+
+    if (ret == ERR_NONE) ret = load_ids(&shared);
+
+    // Step 2: run the clients
+    load_client* clients = calloc(options.clients, sizeof(load_client));
+    pthread_t* threads = calloc(options.clients, sizeof(pthread_t));
+    size_t started = 0;
+    double elapsed = 0;
+
+    if (ret == ERR_NONE && (clients == NULL || threads == NULL)) ret = ERR_OUT_OF_MEMORY;
+
+    if (ret == ERR_NONE) {
+        const double start = now_us();
+        shared.deadline = start + 1e6 * options.duration;
+
+        for (size_t i = 0; i < options.clients; ++i) {
+            clients[i].shared = &shared;
+            clients[i].index = i;
+            clients[i].fd = -1;
+            clients[i].rng = options.seed * 1000003 + i;
+
+            if (pthread_create(&threads[started], NULL, load_client_run, &clients[i]) == 0) {
+                ++started;
+            }
+        }
+
+        for (size_t i = 0; i < started; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+
+        elapsed = (now_us() - start) / 1e6;
+    }
+
+    // Step 3: report
+    if (ret == ERR_NONE) {
+        FILE* csv = (options.csv != NULL) ? fopen(options.csv, "w") : NULL;
+        latency_hist all;
+        memset(&all, 0, sizeof(all));
+        uint64_t all_errors = 0;
+
+        printf("%zu clients, %.1f s, %zu imgIDs\n" LATENCY_CSV_HEADER "\n", started, elapsed, shared.nb_ids);
+        if (csv != NULL) fprintf(csv, LATENCY_CSV_HEADER "\n");
+
+        for (size_t op = 0; op < NB_OPS; ++op) {
+            latency_hist h;
+            memset(&h, 0, sizeof(h));
+            uint64_t errors = 0;
+
+            for (size_t i = 0; i < started; ++i) {
+                latency_merge(&h, &clients[i].hist[op]);
+                errors += clients[i].errors[op];
+            }
+
+            latency_merge(&all, &h);
+            all_errors += errors;
+
+            if (h.total > 0) {
+                latency_print(stdout, s_op_names[op], &h, errors, elapsed);
+                if (csv != NULL) latency_print(csv, s_op_names[op], &h, errors, elapsed);
+            }
+        }
+
+        latency_print(stdout, "all", &all, all_errors, elapsed);
+        if (csv != NULL) {
+            latency_print(csv, "all", &all, all_errors, elapsed);
+            fclose(csv);
+        }
+    } else {
+        fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[ret]);
+    }
+
+    // Clean up: the images inserted and not deleted stay in the imgStore
+    for (size_t i = 0; clients != NULL && i < options.clients; ++i) {
+        for (size_t j = 0; j < clients[i].nb_inserted; ++j) free(clients[i].inserted[j]);
+        free(clients[i].inserted);
+    }
+    for (size_t i = 0; i < shared.nb_ids; ++i) free(shared.ids[i]);
+    free(shared.ids);
+    free(shared.zipf_cdf);
+    free(clients);
+    free(threads);
+    FREE_DEREF(shared.image);
+    pthread_mutex_destroy(&shared.lock);
+
+    http_stop_server(server);
+
+    return ret;
+}
@@ -0,0 +1,512 @@
+/**
+ * @file replay-imgStore.c
+ * @brief replays an access log of imgStore_server (-access_log) against a
+ *   server on the loopback interface, or against the library directly, at
+ *   the original pace, a multiple of it, or as fast as possible.
+ *
+ *   Requests are spread over the clients by imgID, so the requests on one
+ *   image keep their order. imgIDs are found back from their hash among the
+ *   imgIDs of the imgStore; unknown ones, like those of images uploaded
+ *   during the recording, are replaced by "r<hash>".
+ *
+ * @author ???
+ */
+#define _POSIX_C_SOURCE 200809L // for clock_gettime, nanosleep, kill
+
+#include "imgStore.h"
+#include "error.h"
+#include "util.h" // for atouint32
+#include "access_log.h"
+#include "latency.h"
+#include "http_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h> // for clock_gettime, nanosleep
+#include <pthread.h>
+#include <vips/vips.h>
+
+#define REPLAY_DEF_CLIENTS 4
+#define REPLAY_DEF_IMAGE "tests/data/papillon.jpg"
+#define REPLAY_ID_FMT "r%08x"
+
+static const char* const s_res_names[NB_RES] = {"thumb", "small", "orig"};
+
+typedef struct {
+    const char* log;
+    const char* store;  // replay against the library, if given
+    const char* spawn;  // imgStore to start a server on
+    uint16_t port;
+    size_t clients;
+    double speed;       // 0 for as fast as possible
+    const char* image;
+    const char* csv;
+} replay_options;
+
+// An imgID of the imgStore, by its hash
+typedef struct {
+    uint32_t hash;
+    const char* id;
+} replay_id;
+
+typedef struct {
+    const replay_options* options;
+    access_record* records;
+    size_t nb_records;
+    replay_id* ids;
+    size_t nb_ids;
+    char* image;
+    size_t image_size;
+    imgst_file* imgstfile;  // NULL when replaying against a server
+    double start_us;
+} replay_shared;
+
+typedef struct {
+    replay_shared* shared;
+    size_t index;
+    int fd;
+    latency_hist hist[NB_ACCESS];
+    uint64_t errors[NB_ACCESS];
+    uint64_t skipped;
+    latency_hist lag;   // how late requests started, compared to the log
+} replay_client;
+
+static double now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return 1e6 * (double) t.tv_sec + 1e-3 * (double) t.tv_nsec;
+}
+
+static int compare_ids(const void* a, const void* b)
+{
+    const uint32_t x = ((const replay_id*) a)->hash;
+    const uint32_t y = ((const replay_id*) b)->hash;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Finds back the imgID of a hash.
+ */
+static void replay_find_id(const replay_shared* s, uint32_t hash, char id[MAX_IMG_ID + 1])
+{
+    const replay_id key = {.hash = hash};
+    const replay_id* found = bsearch(&key, s->ids, s->nb_ids, sizeof(replay_id), compare_ids);
+
+    if (found != NULL) {
+        strncpy(id, found->id, MAX_IMG_ID);
+        id[MAX_IMG_ID] = '\0';
+    } else {
+        snprintf(id, MAX_IMG_ID + 1, REPLAY_ID_FMT, hash);
+    }
+}
+
+/**
+ * The image inserted for an imgID, made unique by a trailer.
+ */
+static int replay_image(const replay_shared* s, const char* id, char** image, size_t* size)
+{
+    M_EXIT_IF_NULL(*image = malloc(s->image_size + MAX_IMG_ID + 1), s->image_size + MAX_IMG_ID + 1);
+    memcpy(*image, s->image, s->image_size);
+    *size = s->image_size + (size_t) snprintf(*image + s->image_size, MAX_IMG_ID + 1, "%s", id);
+
+    return ERR_NONE;
+}
+
+/**
+ * Replays a record against the library.
+ *
+ * @return ERR_NONE, an error code, or -1 if the record is not replayable
+ */
+static int replay_library(replay_client* c, const access_record* r, const char* id)
+{
+    imgst_file* imgstfile = c->shared->imgstfile;
+
+    switch (r->endpoint) {
+    case ACCESS_READ: {
+        // Reads into a box fall back to the small resolution
+        const int res = (r->res >= 0 && r->res < NB_RES) ? r->res : RES_SMALL;
+        char* buffer = NULL;
+        uint32_t size = 0;
+        const int ret = do_read(id, res, &buffer, &size, imgstfile);
+        FREE_DEREF(buffer);
+        return ret;
+    }
+    case ACCESS_DELETE:
+        return do_delete(id, imgstfile);
+    case ACCESS_LIST: {
+        char* json = do_list(imgstfile, JSON);
+        const int ret = (json == NULL) ? ERR_IO : ERR_NONE;
+        FREE_DEREF(json);
+        return ret;
+    }
+    case ACCESS_INSERT: {
+        // The whole image goes with the first chunk, the rest is not replayed
+        if (r->request_bytes == 0 || r->offset != 0) return -1;
+
+        char* image = NULL;
+        size_t size = 0;
+        M_EXIT_IF_ERR(replay_image(c->shared, id, &image, &size));
+        const int ret = do_insert(image, size, id, imgstfile);
+        FREE_DEREF(image);
+        return ret;
+    }
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Replays a record against the server.
+ *
+ * @return ERR_NONE, an error code, or -1 if the record is not replayable
+ */
+static int replay_http(replay_client* c, const access_record* r, const char* id)
+{
+    const replay_shared* s = c->shared;
+    const uint16_t port = s->options->port;
+    char encoded[3 * MAX_IMG_ID + 1];
+    char target[HTTP_REQUEST_MAX];
+    int status = 0;
+    http_url_encode(id, encoded, sizeof(encoded));
+
+    switch (r->endpoint) {
+    case ACCESS_READ: {
+        const int res = (r->res >= 0 && r->res < NB_RES) ? r->res : RES_SMALL;
+        snprintf(target, sizeof(target), "/imgStore/read?res=%s&img_id=%s", s_res_names[res], encoded);
+        M_EXIT_IF_ERR(http_request(&c->fd, port, "GET", target, NULL, 0, &status, NULL));
+        return (status == 200) ? ERR_NONE : ERR_IO;
+    }
+    case ACCESS_DELETE:
+        snprintf(target, sizeof(target), "/imgStore/delete?img_id=%s", encoded);
+        M_EXIT_IF_ERR(http_request(&c->fd, port, "GET", target, NULL, 0, &status, NULL));
+        return (status == 302) ? ERR_NONE : ERR_IO;
+    case ACCESS_LIST:
+        M_EXIT_IF_ERR(http_request(&c->fd, port, "GET", "/imgStore/list", NULL, 0, &status, NULL));
+        return (status == 200) ? ERR_NONE : ERR_IO;
+    case ACCESS_INSERT: {
+        // The whole image goes with the first chunk, the commit follows as logged
+        char* image = NULL;
+        size_t size = 0;
+        M_EXIT_IF_ERR(replay_image(s, id, &image, &size));
+
+        int ret = -1;
+
+        if (r->request_bytes > 0 && r->offset == 0) {
+            snprintf(target, sizeof(target), "/imgStore/insert?offset=0&size=%zu&name=%s", size, encoded);
+            ret = http_request(&c->fd, port, "POST", target, image, size, &status, NULL);
+            ret = (ret == ERR_NONE && status != 200) ? ERR_IO : ret;
+        } else if (r->request_bytes == 0) {
+            snprintf(target, sizeof(target), "/imgStore/insert?offset=%zu&name=%s", size, encoded);
+            ret = http_request(&c->fd, port, "POST", target, NULL, 0, &status, NULL);
+            ret = (ret == ERR_NONE && status != 302) ? ERR_IO : ret;
+        }
+
+        FREE_DEREF(image);
+        return ret;
+    }
+    default:
+        return -1;
+    }
+}
+
+static void* replay_client_run(void* arg)
+{
+    replay_client* c = arg;
+    const replay_shared* s = c->shared;
+    const size_t nb_clients = s->options->clients;
+    const double t0 = (double) s->records[0].time_us;
+
+    for (size_t i = 0; i < s->nb_records; ++i) {
+        const access_record* r = &s->records[i];
+        const uint32_t key = (r->id_hash != 0) ? r->id_hash : (uint32_t) i;
+
+        if (key % nb_clients != c->index) {
+            continue;
+        }
+
+        // Wait until the request is due
+        double lag = 0;
+
+        if (s->options->speed > 0) {
+            const double due = s->start_us + ((double) r->time_us - t0) / s->options->speed;
+            const double now = now_us();
+
+            if (now < due) {
+                const uint64_t wait = (uint64_t)(due - now);
+                const struct timespec pause = {(time_t)(wait / 1000000), (long)(wait % 1000000) * 1000};
+                nanosleep(&pause, NULL);
+            } else {
+                lag = now - due;
+            }
+        }
+
+        char id[MAX_IMG_ID + 1];
+        replay_find_id(s, r->id_hash, id);
+
+        const double start = now_us();
+        const int ret = (s->imgstfile != NULL) ? replay_library(c, r, id) : replay_http(c, r, id);
+
+        if (ret < 0) {
+            c->skipped += 1;
+            continue;
+        }
+
+        const int endpoint = (r->endpoint < NB_ACCESS) ? r->endpoint : ACCESS_STATIC;
+        latency_record(&c->hist[endpoint], (uint64_t)(now_us() - start));
+        latency_record(&c->lag, (uint64_t) lag);
+        c->errors[endpoint] += (ret != ERR_NONE);
+    }
+
+    if (c->fd >= 0) close(c->fd);
+
+    return NULL;
+}
+
+/**
+ * Loads the whole log in memory.
+ */
+static int replay_load(const char* filename, replay_shared* s)
+{
+    FILE* log = NULL;
+    M_EXIT_IF_ERR(access_log_open_read(filename, &log));
+
+    fseek(log, 0, SEEK_END);
+    const long end = ftell(log);
+    fseek(log, (long) sizeof(access_log_header), SEEK_SET);
+
+    const size_t nb = (size_t)(end - (long) sizeof(access_log_header)) / sizeof(access_record);
+    s->records = calloc(nb + 1, sizeof(access_record));
+    M_EXIT_IF_ERR_DO_SOMETHING(s->records == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE, fclose(log));
+
+    s->nb_records = fread(s->records, sizeof(access_record), nb, log);
+    fclose(log);
+
+    M_EXIT_IF(s->nb_records == 0, ERR_IO, "no record in %s", filename);
+
+    return ERR_NONE;
+}
+
+/**
+ * Indexes the imgIDs of the imgStore by their hash.
+ */
+static int replay_index(replay_shared* s, char** names, size_t nb)
+{
+    M_EXIT_IF_NULL(s->ids = calloc(nb + 1, sizeof(replay_id)), (nb + 1) * sizeof(replay_id));
+
+    for (size_t i = 0; i < nb; ++i) {
+        s->ids[i].hash = access_log_hash(names[i]);
+        s->ids[i].id = names[i];
+    }
+
+    s->nb_ids = nb;
+    qsort(s->ids, nb, sizeof(replay_id), compare_ids);
+
+    return ERR_NONE;
+}
+
+static int parse_options(int argc, char* argv[], replay_options* o)
+{
+    for (int i = 1; i < argc; i += 2) {
+        M_EXIT_IF(i + 1 >= argc, ERR_NOT_ENOUGH_ARGUMENTS, "%s needs a value", argv[i]);
+        const char* value = argv[i + 1];
+
+        if (!strcmp(argv[i], "-log")) {
+            o->log = value;
+        } else if (!strcmp(argv[i], "-store")) {
+            o->store = value;
+        } else if (!strcmp(argv[i], "-spawn")) {
+            o->spawn = value;
+        } else if (!strcmp(argv[i], "-port")) {
+            o->port = atouint16(value);
+        } else if (!strcmp(argv[i], "-clients")) {
+            o->clients = atouint32(value);
+        } else if (!strcmp(argv[i], "-speed")) {
+            o->speed = atof(value);
+        } else if (!strcmp(argv[i], "-image")) {
+            o->image = value;
+        } else if (!strcmp(argv[i], "-csv")) {
+            o->csv = value;
+        } else {
+            M_EXIT_IF(1, ERR_INVALID_ARGUMENT, "unknown option %s", argv[i]);
+        }
+    }
+
+    M_EXIT_IF(o->log == NULL || o->port == 0 || o->clients == 0 || o->speed < 0
+              || (o->store != NULL && o->spawn != NULL),
+              ERR_INVALID_ARGUMENT, "invalid options%s", "");
+
+    // The library is not shared between threads
+    if (o->store != NULL) {
+        o->clients = 1;
+    }
+
+    return ERR_NONE;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s -log <access log> [options]\n"
+            "  -store <imgstore>   replay against the library on that imgStore\n"
+            "  -port N             otherwise, against the server on 127.0.0.1 (default %d)\n"
+            "  -spawn <imgstore>   start %s on that imgStore first\n"
+            "  -clients N          connections to the server (default %d)\n"
+            "  -speed X            pace, relative to the log; 0 for as fast as possible (default 1)\n"
+            "  -image <jpeg>       image inserted (default %s)\n"
+            "  -csv <file>         also write the results there\n",
+            name, HTTP_DEF_PORT, HTTP_SERVER, REPLAY_DEF_CLIENTS, REPLAY_DEF_IMAGE);
+}
+
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("unable to start VIPS");
+        return ERR_IMGLIB;
+    }
+
+    replay_options options = {
+        .port = HTTP_DEF_PORT, .clients = REPLAY_DEF_CLIENTS, .speed = 1,
+        .image = REPLAY_DEF_IMAGE
+    };
+
+    int ret = parse_options(argc, argv, &options);
+    if (ret != ERR_NONE) {
+        usage(argv[0]);
+        vips_shutdown();
+        return ret;
+    }
+
+    replay_shared shared = {.options = &options};
+    imgst_file imgstfile;
+    memset(&imgstfile, 0, sizeof(imgstfile));
+    char** names = NULL;
+    size_t nb_names = 0;
+    pid_t server = -1;
+
+    // Step 1: the log, the image to insert and the imgIDs of the imgStore
+    ret = replay_load(options.log, &shared);
+    if (ret == ERR_NONE) ret = read_disk_image(options.image, &shared.image, &shared.image_size);
+
+    if (ret == ERR_NONE && options.store != NULL) {
+        ret = do_open(options.store, "rb+", &imgstfile);
+
+        if (ret == ERR_NONE) {
+            shared.imgstfile = &imgstfile;
+            names = calloc(imgstfile.header.max_files + 1, sizeof(char*));
+            ret = (names == NULL) ? ERR_OUT_OF_MEMORY : ERR_NONE;
+        }
+
+        for (size_t i = 0; ret == ERR_NONE && i < imgstfile.header.max_files; ++i) {
+            if (imgstfile.metadata[i].is_valid == NON_EMPTY) {
+                names[nb_names++] = imgstfile.metadata[i].img_id;
+            }
+        }
+    } else if (ret == ERR_NONE) {
+        if (options.spawn != NULL
+            && (server = http_spawn_server(options.spawn, options.port, NULL)) < 0) {
+            fprintf(stderr, "cannot start %s on %s\n", HTTP_SERVER, options.spawn);
+            ret = ERR_IO;
+        }
+
+        if (ret == ERR_NONE) ret = http_list_ids(options.port, &names, &nb_names);
+    }
+
+    if (ret == ERR_NONE) ret = replay_index(&shared, names, nb_names);
+
+    // Step 2: replay
+    replay_client* clients = calloc(options.clients, sizeof(replay_client));
+    pthread_t* threads = calloc(options.clients, sizeof(pthread_t));
+    size_t started = 0;
+    double elapsed = 0;
+
+    if (ret == ERR_NONE && (clients == NULL || threads == NULL)) ret = ERR_OUT_OF_MEMORY;
+
+    if (ret == ERR_NONE) {
+        shared.start_us = now_us();
+
+        for (size_t i = 0; i < options.clients; ++i) {
+            clients[i].shared = &shared;
+            clients[i].index = i;
+            clients[i].fd = -1;
+        }
+
+        if (options.clients == 1) {
+            replay_client_run(&clients[0]);
+            started = 1;
+        } else {
+            for (size_t i = 0; i < options.clients; ++i) {
+                if (pthread_create(&threads[started], NULL, replay_client_run, &clients[i]) == 0) {
+                    ++started;
+                }
+            }
+            for (size_t i = 0; i < started; ++i) {
+                pthread_join(threads[i], NULL);
+            }
+        }
+
+        elapsed = (now_us() - shared.start_us) / 1e6;
+    }
+
+    // Step 3: report
+    if (ret == ERR_NONE) {
+        FILE* csv = (options.csv != NULL) ? fopen(options.csv, "w") : NULL;
+        latency_hist lag;
+        memset(&lag, 0, sizeof(lag));
+        uint64_t skipped = 0;
+
+        for (size_t i = 0; i < started; ++i) {
+            latency_merge(&lag, &clients[i].lag);
+            skipped += clients[i].skipped;
+        }
+
+        const double logged = (double)(shared.records[shared.nb_records - 1].time_us
+                                       - shared.records[0].time_us) / 1e6;
+        printf("%zu records over %.1f s replayed in %.1f s, %llu skipped, against %s\n"
+               LATENCY_CSV_HEADER "\n", shared.nb_records, logged, elapsed,
+               (unsigned long long) skipped, (options.store != NULL) ? "the library" : "the server");
+        if (csv != NULL) fprintf(csv, LATENCY_CSV_HEADER "\n");
+
+        for (int e = 0; e < NB_ACCESS; ++e) {
+            latency_hist h;
+            memset(&h, 0, sizeof(h));
+            uint64_t errors = 0;
+
+            for (size_t i = 0; i < started; ++i) {
+                latency_merge(&h, &clients[i].hist[e]);
+                errors += clients[i].errors[e];
+            }
+
+            if (h.total > 0) {
+                const char* name = access_log_uri(e);
+                latency_print(stdout, name, &h, errors, elapsed);
+                if (csv != NULL) latency_print(csv, name, &h, errors, elapsed);
+            }
+        }
+
+        latency_print(stdout, "lag", &lag, 0, elapsed);
+        if (csv != NULL) {
+            latency_print(csv, "lag", &lag, 0, elapsed);
+            fclose(csv);
+        }
+    } else {
+        fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[ret]);
+    }
+
+    // Clean up
+    if (options.store == NULL) {
+        for (size_t i = 0; i < nb_names; ++i) free(names[i]);
+    }
+    free(names);
+    free(shared.ids);
+    free(shared.records);
+    free(clients);
+    free(threads);
+    FREE_DEREF(shared.image);
+    if (shared.imgstfile != NULL) do_close(&imgstfile);
+    http_stop_server(server);
+    vips_shutdown();
+
+    return ret;
+}
@@ -0,0 +1,442 @@
+/**
+ * @file test-imgStore-behaviour.c
+ * @brief unit tests of the imgStore library on a scratch imgStore file:
+ *        variants, size buckets, resumed uploads, change log and writer lock.
+ */
+
+#include "tests.h"
+#include "imgStore.h"
+#include "variant.h"
+
+#include <stdio.h> // for remove
+#include <string.h> // for memcmp
+#include <openssl/sha.h> // for SHA256
+
+#define TEST_STORE "test-behaviour.imgst"
+#define TEST_CHANGES TEST_STORE CHANGE_LOG_EXT
+#define TEST_MAX_FILES 10
+#define TEST_IMAGE "tests/data/papillon.jpg"
+#define TEST_OTHER_IMAGE "tests/data/foret.jpg"
+
+// ======================================================================
+static void create_store(void)
+{
+    imgst_file imgstfile = {0};
+    imgstfile.header.max_files = TEST_MAX_FILES;
+    imgstfile.header.res_resized[0] = imgstfile.header.res_resized[1] = DEF_RES_THUMB;
+    imgstfile.header.res_resized[2] = imgstfile.header.res_resized[3] = DEF_RES_SMALL;
+    ck_assert_err_none(do_create(TEST_STORE, &imgstfile));
+    do_close(&imgstfile);
+}
+
+static void remove_store(void)
+{
+    remove(TEST_STORE);
+    remove(TEST_CHANGES);
+}
+
+static size_t read_image(const char* filename, char** buffer)
+{
+    FILE* file = fopen(filename, "rb");
+    ck_assert_ptr_nonnull(file);
+    ck_assert_int_eq(fseek(file, 0, SEEK_END), 0);
+    const long size = ftell(file);
+    ck_assert_int_gt(size, 0);
+    rewind(file);
+
+    *buffer = malloc((size_t) size);
+    ck_assert_ptr_nonnull(*buffer);
+    ck_assert_int_eq(fread(*buffer, (size_t) size, 1, file), 1);
+    fclose(file);
+
+    return (size_t) size;
+}
+
+static void insert_image(const char* filename, const char* img_id, imgst_file* imgstfile)
+{
+    char* image = NULL;
+    const size_t size = read_image(filename, &image);
+    ck_assert_err_none(do_insert(image, size, img_id, imgstfile));
+    free(image);
+}
+
+static int discard(const void* buffer, size_t size, void* arg)
+{
+    (void) buffer;
+    (void) size;
+    (void) arg;
+    return ERR_NONE;
+}
+
+// ======================================================================
+START_TEST(snap_to_bucket_rounds_up)
+{
+    const uint16_t buckets[] = {64, 128, 256};
+
+    ck_assert_int_eq(snap_to_bucket(0, buckets, 3), 0);
+    ck_assert_int_eq(snap_to_bucket(1, buckets, 3), 64);
+    ck_assert_int_eq(snap_to_bucket(64, buckets, 3), 64);
+    ck_assert_int_eq(snap_to_bucket(65, buckets, 3), 128);
+    ck_assert_int_eq(snap_to_bucket(256, buckets, 3), 256);
+    ck_assert_int_eq(snap_to_bucket(100000, buckets, 3), 256);
+    ck_assert_int_eq(snap_to_bucket(100, buckets, 0), 0);
+}
+END_TEST
+
+START_TEST(parse_buckets_accepts_increasing_lists)
+{
+    uint16_t buckets[MAX_VARIANT_BUCKETS];
+    size_t nb = 0;
+
+    ck_assert_err_none(parse_buckets("64,128,256", buckets, &nb));
+    ck_assert_int_eq(nb, 3);
+    ck_assert_int_eq(buckets[0], 64);
+    ck_assert_int_eq(buckets[1], 128);
+    ck_assert_int_eq(buckets[2], 256);
+
+    ck_assert_err_none(parse_buckets("320", buckets, &nb));
+    ck_assert_int_eq(nb, 1);
+    ck_assert_int_eq(buckets[0], 320);
+}
+END_TEST
+
+START_TEST(parse_buckets_rejects_invalid_lists)
+{
+    uint16_t buckets[MAX_VARIANT_BUCKETS];
+    size_t nb = 7;
+
+    ck_assert_invalid_arg(parse_buckets("", buckets, &nb));
+    ck_assert_invalid_arg(parse_buckets("64,,128", buckets, &nb));
+    ck_assert_invalid_arg(parse_buckets("64,", buckets, &nb));
+    ck_assert_int_eq(parse_buckets("128,64", buckets, &nb), ERR_RESOLUTIONS);
+    ck_assert_int_eq(parse_buckets("64,64", buckets, &nb), ERR_RESOLUTIONS);
+    ck_assert_int_eq(parse_buckets("0", buckets, &nb), ERR_RESOLUTIONS);
+
+    char many[MAX_VARIANT_BUCKETS * 4 + 8] = {0};
+    size_t len = 0;
+    for (int i = 1; i <= MAX_VARIANT_BUCKETS + 1; ++i) {
+        len += (size_t) snprintf(many + len, sizeof(many) - len, "%s%d", i == 1 ? "" : ",", i);
+    }
+    ck_assert_invalid_arg(parse_buckets(many, buckets, &nb));
+
+    // Left unchanged on failure
+    ck_assert_int_eq(nb, 7);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(variant_append_then_find)
+{
+    create_store();
+
+    imgst_file imgstfile = {0};
+    ck_assert_err_none(do_open(TEST_STORE, "rb+", &imgstfile));
+    insert_image(TEST_IMAGE, "pic1", &imgstfile);
+
+    size_t idx = 0;
+    ck_assert_err_none(findMetadataIndex(&idx, "pic1", &imgstfile));
+
+    const uint16_t box[DIMS] = {128, 96};
+    const uint16_t other[DIMS] = {256, 192};
+    const img_variant* variant = NULL;
+    ck_assert_int_eq(variant_find(&variant, idx, box, FMT_JPEG, &imgstfile), ERR_FILE_NOT_FOUND);
+
+    ck_assert_err_none(variant_append(idx, box, FMT_JPEG, "jpeg", 4, &imgstfile));
+    ck_assert_err_none(variant_append(idx, box, FMT_WEBP, "webp!", 5, &imgstfile));
+    ck_assert_int_eq(imgstfile.header.num_variants, 2);
+
+    ck_assert_err_none(variant_find(&variant, idx, box, FMT_WEBP, &imgstfile));
+    ck_assert_int_eq(variant->size, 5);
+    ck_assert_int_eq(variant->format, FMT_WEBP);
+    ck_assert_int_eq(variant->slot, idx);
+    ck_assert_int_eq(variant->box[0], box[0]);
+    ck_assert_int_eq(variant->box[1], box[1]);
+    ck_assert_int_eq(memcmp(variant->SHA, imgstfile.metadata[idx].SHA, SHA256_DIGEST_LENGTH), 0);
+    ck_assert_int_eq(variant_find(&variant, idx, other, FMT_JPEG, &imgstfile), ERR_FILE_NOT_FOUND);
+    do_close(&imgstfile);
+
+    // The records are read back from the file
+    ck_assert_err_none(do_open(TEST_STORE, "rb", &imgstfile));
+    ck_assert_int_eq(imgstfile.header.num_variants, 2);
+    ck_assert_err_none(variant_find(&variant, idx, box, FMT_JPEG, &imgstfile));
+    ck_assert_int_eq(variant->size, 4);
+
+    char content[4];
+    ck_assert_int_eq(fseek(imgstfile.file, (long) variant->offset, SEEK_SET), 0);
+    ck_assert_int_eq(fread(content, sizeof(content), 1, imgstfile.file), 1);
+    ck_assert_int_eq(memcmp(content, "jpeg", 4), 0);
+    do_close(&imgstfile);
+
+    remove_store();
+}
+END_TEST
+
+START_TEST(variant_load_ignores_inconsistent_chain)
+{
+    create_store();
+
+    imgst_file imgstfile = {0};
+    ck_assert_err_none(do_open(TEST_STORE, "rb+", &imgstfile));
+    insert_image(TEST_IMAGE, "pic1", &imgstfile);
+
+    const uint16_t box[DIMS] = {128, 96};
+    ck_assert_err_none(variant_append(0, box, FMT_JPEG, "jpeg", 4, &imgstfile));
+    do_close(&imgstfile);
+
+    // More records announced than chained, as left by an older imgStore
+    FILE* file = fopen(TEST_STORE, "rb+");
+    ck_assert_ptr_nonnull(file);
+    imgst_header header;
+    ck_assert_int_eq(fread(&header, sizeof(header), 1, file), 1);
+    header.num_variants = 2;
+    rewind(file);
+    ck_assert_int_eq(fwrite(&header, sizeof(header), 1, file), 1);
+    fclose(file);
+
+    ck_assert_err_none(do_open(TEST_STORE, "rb", &imgstfile));
+    ck_assert_int_eq(imgstfile.header.num_variants, 0);
+    ck_assert_ptr_null(imgstfile.variants);
+
+    const img_variant* variant = NULL;
+    ck_assert_int_eq(variant_find(&variant, 0, box, FMT_JPEG, &imgstfile), ERR_FILE_NOT_FOUND);
+
+    // The images are still there
+    char* image = NULL;
+    uint32_t size = 0;
+    ck_assert_err_none(do_read("pic1", RES_ORIG, &image, &size, &imgstfile));
+    free(image);
+    do_close(&imgstfile);
+
+    // A chain pointing into the metadata is ignored as well
+    file = fopen(TEST_STORE, "rb+");
+    ck_assert_ptr_nonnull(file);
+    header.num_variants = 1;
+    header.variant_head = sizeof(imgst_header);
+    ck_assert_int_eq(fwrite(&header, sizeof(header), 1, file), 1);
+    fclose(file);
+
+    ck_assert_err_none(do_open(TEST_STORE, "rb", &imgstfile));
+    ck_assert_int_eq(imgstfile.header.num_variants, 0);
+    ck_assert_ptr_null(imgstfile.variants);
+    do_close(&imgstfile);
+
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+START_TEST(upload_resumes_from_its_record)
+{
+    create_store();
+
+    char* image = NULL;
+    const size_t size = read_image(TEST_IMAGE, &image);
+    const size_t first = size / 3;
+
+    imgst_file imgstfile = {0};
+    ck_assert_err_none(do_open(TEST_STORE, "rb+", &imgstfile));
+
+    imgst_ingest ingest;
+    ck_assert_err_none(do_insert_begin(&ingest, "pic1", size, &imgstfile));
+    ck_assert_err_none(do_insert_append(&ingest, image, first, &imgstfile));
+
+    // What the server records of the upload
+    const uint64_t offset = ingest.offset;
+    const uint64_t reserved = ingest.reserved;
+    const uint64_t received = ingest.size;
+    ck_assert_int_eq(reserved, size);
+    ck_assert_int_eq(received, first);
+
+    // Appended meanwhile, after the extent
+    insert_image(TEST_OTHER_IMAGE, "pic2", &imgstfile);
+    size_t idx = 0;
+    ck_assert_err_none(findMetadataIndex(&idx, "pic2", &imgstfile));
+    ck_assert_int_eq(imgstfile.metadata[idx].offset[RES_ORIG], offset + reserved);
+
+    // Given up in memory, as by a server that restarts: the extent stays,
+    // since it no longer ends the file
+    do_insert_abort(&ingest, &imgstfile);
+    do_close(&imgstfile);
+    ck_assert_err_none(do_open(TEST_STORE, "rb+", &imgstfile));
+
+    ck_assert_err_none(do_insert_resume(&ingest, "pic1", offset, reserved, received, &imgstfile));
+    ck_assert_int_eq(ingest.size, first);
+    ck_assert_err_none(do_insert_append(&ingest, image + first, size - first, &imgstfile));
+    ck_assert_err_none(do_insert_commit(&ingest, &imgstfile));
+
+    // Written in place, with the SHA of the whole image
+    ck_assert_err_none(findMetadataIndex(&idx, "pic1", &imgstfile));
+    ck_assert_int_eq(imgstfile.metadata[idx].offset[RES_ORIG], offset);
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*) image, size, sha);
+    ck_assert_int_eq(memcmp(imgstfile.metadata[idx].SHA, sha, SHA256_DIGEST_LENGTH), 0);
+
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read("pic1", RES_ORIG, &read, &read_size, &imgstfile));
+    ck_assert_int_eq(read_size, size);
+    ck_assert_int_eq(memcmp(read, image, size), 0);
+    free(read);
+
+    do_close(&imgstfile);
+    free(image);
+    remove_store();
+}
+END_TEST
+
+START_TEST(upload_does_not_resume_into_a_lost_extent)
+{
+    create_store();
+
+    char* image = NULL;
+    const size_t size = read_image(TEST_IMAGE, &image);
+
+    imgst_file imgstfile = {0};
+    ck_assert_err_none(do_open(TEST_STORE, "rb+", &imgstfile));
+
+    imgst_ingest ingest;
+    ck_assert_err_none(do_insert_begin(&ingest, "pic1", size, &imgstfile));
+    ck_assert_err_none(do_insert_append(&ingest, image, size / 2, &imgstfile));
+    const uint64_t offset = ingest.offset;
+    const uint64_t reserved = ingest.reserved;
+    const uint64_t received = ingest.size;
+
+    // A chunk beyond the announced size is refused
+    ck_assert_invalid_arg(do_insert_append(&ingest, image, size, &imgstfile));
+
+    // Given up, the extent at the end of the file is truncated away
+    do_insert_abort(&ingest, &imgstfile);
+    do_close(&imgstfile);
+
+    ck_assert_err_none(do_open(TEST_STORE, "rb+", &imgstfile));
+    ck_assert_int_eq(do_insert_resume(&ingest, "pic1", offset, reserved, received, &imgstfile), ERR_IO);
+
+    // Another image took its place
+    insert_image(TEST_OTHER_IMAGE, "pic2", &imgstfile);
+    ck_assert_int_eq(imgstfile.metadata[0].offset[RES_ORIG], offset);
+    ck_assert_int_eq(do_insert_resume(&ingest, "pic1", offset, reserved, received, &imgstfile), ERR_IO);
+
+    do_close(&imgstfile);
+    free(image);
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+START_TEST(follower_reads_the_change_log)
+{
+    create_store();
+
+    imgst_file writer = {0};
+    ck_assert_err_none(do_open(TEST_STORE, "rb+", &writer));
+    ck_assert_err_none(change_log_open(TEST_STORE, 1, &writer));
+
+    imgst_follower follower;
+    imgst_file replica = {0};
+    ck_assert_err_none(do_follow_open(TEST_STORE, &follower, &replica));
+    ck_assert_int_eq(follow_pending(&follower, &replica), 0);
+
+    insert_image(TEST_IMAGE, "pic1", &writer);
+    insert_image(TEST_OTHER_IMAGE, "pic2", &writer);
+
+    ck_assert_err_none(change_log_commit(&writer));
+    ck_assert_int_eq(follow_pending(&follower, &replica), 1);
+
+    size_t nb_changed = 0;
+    ck_assert_err_none(do_follow(&follower, &replica, &nb_changed));
+    ck_assert_int_eq(nb_changed, 2);
+    ck_assert_int_eq(replica.header.num_files, 2);
+    ck_assert_int_eq(follow_pending(&follower, &replica), 0);
+
+    size_t idx = 0;
+    ck_assert_err_none(findMetadataIndex(&idx, "pic2", &replica));
+    ck_assert_int_eq(memcmp(&replica.metadata[idx], &writer.metadata[idx], sizeof(img_metadata)), 0);
+
+    // Only the changed slot is read again
+    ck_assert_err_none(do_delete("pic1", &writer));
+    ck_assert_err_none(change_log_commit(&writer));
+    ck_assert_err_none(do_follow(&follower, &replica, &nb_changed));
+    ck_assert_int_eq(nb_changed, 1);
+    ck_assert_int_eq(findMetadataIndex(&idx, "pic1", &replica), ERR_FILE_NOT_FOUND);
+    ck_assert_int_eq(replica.header.num_files, 1);
+
+    do_follow_close(&follower, &replica);
+    do_close(&writer);
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+START_TEST(writer_lock_is_exclusive)
+{
+    create_store();
+
+    imgst_file writer = {0};
+    imgst_file other = {0};
+    ck_assert_err_none(do_open(TEST_STORE, "rb+", &writer));
+    ck_assert_int_eq(do_open(TEST_STORE, "rb+", &other), ERR_IO);
+
+    // A reader does not need the lock
+    ck_assert_err_none(do_open(TEST_STORE, "rb", &other));
+    do_close(&other);
+
+    do_close(&writer);
+    remove_store();
+}
+END_TEST
+
+START_TEST(writer_lock_survives_export)
+{
+    create_store();
+
+    imgst_file writer = {0};
+    imgst_file other = {0};
+    ck_assert_err_none(do_open(TEST_STORE, "rb+", &writer));
+
+    // The export reads through a dup of the store descriptor and closes it
+    imgst_export export;
+    ck_assert_err_none(do_export_begin(&export, 1, &writer));
+    while (!export.done) {
+        ck_assert_err_none(do_export_next(&export, discard, NULL));
+    }
+    do_export_end(&export);
+
+    ck_assert_int_eq(do_open(TEST_STORE, "rb+", &other), ERR_IO);
+
+    do_close(&writer);
+    ck_assert_err_none(do_open(TEST_STORE, "rb+", &other));
+    do_close(&other);
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+Suite* behaviour_suite(void)
+{
+    Suite* s = suite_create("imgStore behaviour");
+
+    Add_Case(s, tc_buckets, "size buckets");
+    tcase_add_test(tc_buckets, snap_to_bucket_rounds_up);
+    tcase_add_test(tc_buckets, parse_buckets_accepts_increasing_lists);
+    tcase_add_test(tc_buckets, parse_buckets_rejects_invalid_lists);
+
+    Add_Case(s, tc_variants, "variants");
+    tcase_add_test(tc_variants, variant_append_then_find);
+    tcase_add_test(tc_variants, variant_load_ignores_inconsistent_chain);
+
+    Add_Case(s, tc_uploads, "uploads");
+    tcase_add_test(tc_uploads, upload_resumes_from_its_record);
+    tcase_add_test(tc_uploads, upload_does_not_resume_into_a_lost_extent);
+
+    Add_Case(s, tc_follow, "change log");
+    tcase_add_test(tc_follow, follower_reads_the_change_log);
+
+    Add_Case(s, tc_lock, "writer lock");
+    tcase_add_test(tc_lock, writer_lock_is_exclusive);
+    tcase_add_test(tc_lock, writer_lock_survives_export);
+
+    return s;
+}
+
+TEST_SUITE(behaviour_suite)
@@ -16,7 +16,8 @@
 #define SIZE_imgst_header   64
 #define SIZE_img_metadata  216
 
-#define SIZE_imgst_file   80
+#define SIZE_imgst_file  112
+#define SIZE_img_variant   64
 
 #define OFFSET_imgst_header_imgst_name       0
 #define OFFSET_imgst_header_imgst_version   32
@@ -31,9 +32,24 @@
 #define OFFSET_img_metadata_offset      184
 #define OFFSET_img_metadata_is_valid    208
 
+#define OFFSET_imgst_header_num_variants 52
+#define OFFSET_imgst_header_variant_head 56
+
+#define OFFSET_img_variant_SHA           0
+#define OFFSET_img_variant_next         32
+#define OFFSET_img_variant_offset       40
+#define OFFSET_img_variant_size         48
+#define OFFSET_img_variant_box          52
+#define OFFSET_img_variant_slot         56
+#define OFFSET_img_variant_format       60
+
 #define OFFSET_imgst_file_file           0
 #define OFFSET_imgst_file_header         8
 #define OFFSET_imgst_file_metadata      72
+#define OFFSET_imgst_file_variants      80
+#define OFFSET_imgst_file_content_index 88
+#define OFFSET_imgst_file_slot_seq      96
+#define OFFSET_imgst_file_changes      104
 
 // ======================================================================
 #define test_member(T, M)                                                       \
@@ -60,12 +76,15 @@ int main(int argc, char** argv)
     test_size(imgst_header);
     test_size(img_metadata);
     test_size(imgst_file  );
+    test_size(img_variant );
   
     test_member(imgst_header, imgst_name    );
     test_member(imgst_header, imgst_version );
     test_member(imgst_header, num_files  );
     test_member(imgst_header, max_files  );
     test_member(imgst_header, res_resized);
+    test_member(imgst_header, num_variants);
+    test_member(imgst_header, variant_head);
 
     test_member(img_metadata, img_id  );
     test_member(img_metadata, SHA      );
@@ -74,9 +93,21 @@ int main(int argc, char** argv)
     test_member(img_metadata, offset   );
     test_member(img_metadata, is_valid );
 
+    test_member(img_variant, SHA   );
+    test_member(img_variant, next  );
+    test_member(img_variant, offset);
+    test_member(img_variant, size  );
+    test_member(img_variant, box   );
+    test_member(img_variant, slot  );
+    test_member(img_variant, format);
+
     test_member(imgst_file, file    );
     test_member(imgst_file, header  );
     test_member(imgst_file, metadata);
+    test_member(imgst_file, variants);
+    test_member(imgst_file, content_index);
+    test_member(imgst_file, slot_seq);
+    test_member(imgst_file, changes);
 
     if ((argc > 1) && !strcmp(argv[1], "--ok")) status = 0;
     return status;
@@ -4,19 +4,29 @@
  *
  * @author Mia Primorac
  */
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+#define _DEFAULT_SOURCE // for flock
 
 #include "imgStore.h"
+#include "variant.h"
+#include "dedup.h"
+#include "trace.h"
 
 #include <stdlib.h> // for calloc
 #include <stdint.h> // for uint8_t
 #include <stdio.h> // for sprintf
+#include <ctype.h> // for isxdigit
+#include <string.h> // for strcmp, memcpy
+#include <time.h> // for clock_gettime
+#include <fcntl.h> // for fcntl
+#include <sys/file.h> // for flock
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 #include <vips/vips.h> // for vips image manips
 
 /**
  * Human-readable SHA
  */
-static void sha_to_string (const unsigned char* SHA, char* sha_string)
+void sha_to_string (const unsigned char* SHA, char* sha_string)
 {
     if (SHA == NULL) {
         return;
@@ -29,6 +39,29 @@ static void sha_to_string (const unsigned char* SHA, char* sha_string)
     sha_string[2*SHA256_DIGEST_LENGTH] = '\0';
 }
 
+/**
+ * SHA from its human-readable form
+ */
+int sha_from_string(const char* sha_string, unsigned char* SHA)
+{
+    M_REQUIRE_NON_NULL(sha_string);
+    M_REQUIRE_NON_NULL(SHA);
+
+    M_EXIT_IF(strlen(sha_string) != 2 * SHA256_DIGEST_LENGTH, ERR_INVALID_ARGUMENT,
+              "SHA of invalid length %zu", strlen(sha_string));
+
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        unsigned int byte = 0;
+        M_EXIT_IF(!isxdigit((unsigned char) sha_string[2*i])
+                  || !isxdigit((unsigned char) sha_string[2*i+1])
+                  || sscanf(&sha_string[2*i], "%2x", &byte) != 1,
+                  ERR_INVALID_ARGUMENT, "invalid SHA %s", sha_string);
+        SHA[i] = (unsigned char) byte;
+    }
+
+    return ERR_NONE;
+}
+
 /**
  * imgStore header display.
  */
@@ -46,6 +79,11 @@ void print_header(const imgst_header* header)
         printf("THUMBNAIL: %" PRIu16 " x %" PRIu16 "\tSMALL: %" PRIu16 " x %" PRIu16 "\n",
                header->res_resized[2 * RES_THUMB], header->res_resized[2 * RES_THUMB + 1],
                header->res_resized[2 * RES_SMALL], header->res_resized[2 * RES_SMALL + 1]);
+        // Only imgStores with variants change the expected output
+        if (header->num_variants > 0) {
+            printf("VARIANTS: %" PRIu32 "\n",
+                   header->num_variants);
+        }
         printf("***********IMGSTORE HEADER END***********\n");
         printf("*****************************************\n");
     }
@@ -97,6 +135,10 @@ int do_open(const char* imgst_filename, const char* open_mode, imgst_file* imgst
     // Init values
     imgstfile->metadata = NULL;
     imgstfile->file = NULL;
+    imgstfile->variants = NULL;
+    imgstfile->content_index = NULL;
+    imgstfile->slot_seq = NULL;
+    imgstfile->changes = NULL;
 
     // Open the file
     imgstfile->file = fopen(imgst_filename, open_mode);
@@ -107,9 +149,20 @@ int do_open(const char* imgst_filename, const char* open_mode, imgst_file* imgst
         return ERR_IO;
     }
 
+    // A single writer: the others would not see its changes in memory.
+    // flock belongs to the open file, so closing a dup (exports) keeps it
+    if (strcmp(open_mode, "rb+") == 0) {
+        if (flock(fileno(imgstfile->file), LOCK_EX | LOCK_NB) != 0) {
+            do_close(imgstfile);
+            return ERR_IO;
+        }
+    }
+
     // Read the header to glean information about the metadata
+    TRACE_BEGIN(read_header);
     size_t nb_elems_read = fread(&(imgstfile->header),
                                  sizeof(imgst_header), 1, imgstfile->file);
+    TRACE_END(read_header);
 
     // The (single) header should have been read.
     if (nb_elems_read != 1) {
@@ -120,15 +173,20 @@ int do_open(const char* imgst_filename, const char* open_mode, imgst_file* imgst
     // Dynamically allocate memory for every valid and invalid metadatum.
     imgstfile->metadata = calloc(imgstfile->header.max_files, sizeof(img_metadata));
 
+    // Sequence numbers of the metadata, for the readers without lock
+    imgstfile->slot_seq = calloc(imgstfile->header.max_files, sizeof(_Atomic uint32_t));
+
     // If allocating memory failed
-    if (imgstfile->metadata == NULL) {
+    if (imgstfile->metadata == NULL || imgstfile->slot_seq == NULL) {
         do_close(imgstfile);
         return ERR_OUT_OF_MEMORY;
     }
 
     // Read the metadata
+    TRACE_BEGIN(read_metadata);
     nb_elems_read += fread(imgstfile->metadata,
                            sizeof(img_metadata), imgstfile->header.max_files, imgstfile->file);
+    TRACE_END(read_metadata);
 
     // Check that the correct number of elements were read.
     if (nb_elems_read != imgstfile->header.max_files + 1) {
@@ -136,6 +194,19 @@ int do_open(const char* imgst_filename, const char* open_mode, imgst_file* imgst
         return ERR_IO;
     }
 
+    // Read the variant records
+    M_EXIT_IF_ERR_DO_SOMETHING(variant_load(imgstfile),
+                               do_close(imgstfile));
+
+    // Index the content of the valid images
+    M_EXIT_IF_ERR_DO_SOMETHING(sha_index_build(imgstfile),
+                               do_close(imgstfile));
+
+    // Keep the change log of the followers, if they have one
+    if (strcmp(open_mode, "rb+") == 0) {
+        change_log_open(imgst_filename, 0, imgstfile);
+    }
+
     return ERR_NONE;
 }
 /**
@@ -146,6 +217,14 @@ void do_close(imgst_file* imgstfile)
     /// Clean up the ->file and the ->metadata
 
     if (imgstfile != NULL) {
+        TRACE_BEGIN(do_close);
+
+        if (imgstfile->changes != NULL) {
+            change_log_commit(imgstfile);
+            fclose(imgstfile->changes->file);
+            FREE_DEREF(imgstfile->changes);
+        }
+
         if (imgstfile->file != NULL) {
             // Close and nullify the pointer
             fclose(imgstfile->file);
@@ -156,6 +235,15 @@ void do_close(imgst_file* imgstfile)
             // Free and nullify the pointer
             FREE_DEREF(imgstfile->metadata);
         }
+
+        if (imgstfile->slot_seq != NULL) {
+            FREE_DEREF(imgstfile->slot_seq);
+        }
+
+        variant_free(imgstfile);
+        sha_index_free(imgstfile);
+
+        TRACE_END(do_close);
     }
 }
 
@@ -176,6 +264,7 @@ int findMetadataIndex(size_t* idx, const char* img_id, const imgst_file* imgstfi
     }
 
     size_t i = 0;
+    TRACE_BEGIN(findMetadataIndex);
 
     while((i < imgstfile->header.max_files)
           && ((strcmp(imgstfile->metadata[i].img_id, img_id) != 0)
@@ -184,6 +273,8 @@ int findMetadataIndex(size_t* idx, const char* img_id, const imgst_file* imgstfi
         ++i;
     }
 
+    TRACE_END(findMetadataIndex);
+
     // If invalid metadata, return error
     if (validMetadataIndex(i, imgstfile) != ERR_NONE) {
         return ERR_FILE_NOT_FOUND;
@@ -238,7 +329,11 @@ int updateMetadata(const size_t idx, imgst_file* imgstfile)
     }
 
     // Attempt to overwrite the metadata.
-    if (fwrite(&(imgstfile->metadata[idx]), sizeof(img_metadata), 1, imgstfile->file) != 1) {
+    TRACE_BEGIN(updateMetadata);
+    const size_t written = fwrite(&(imgstfile->metadata[idx]), sizeof(img_metadata), 1, imgstfile->file);
+    TRACE_END(updateMetadata);
+
+    if (written != 1) {
         return ERR_IO;
     }
 
@@ -248,6 +343,197 @@ int updateMetadata(const size_t idx, imgst_file* imgstfile)
     return ERR_NONE;
 }
 
+/**
+ * Opens a change of the in-memory metadata at idx. Its sequence number is
+ * odd until metadata_publish.
+ */
+void metadata_begin(const size_t idx, imgst_file* imgstfile)
+{
+    // The contents written so far, for readers that bypass the FILE
+    fflush(imgstfile->file);
+
+    if (imgstfile->slot_seq != NULL) {
+        const uint32_t seq = atomic_load_explicit(&imgstfile->slot_seq[idx], memory_order_relaxed);
+        atomic_store_explicit(&imgstfile->slot_seq[idx], seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+}
+
+/**
+ * Publishes a change of the in-memory metadata at idx.
+ */
+void metadata_publish(const size_t idx, imgst_file* imgstfile)
+{
+    if (imgstfile->slot_seq != NULL) {
+        const uint32_t seq = atomic_load_explicit(&imgstfile->slot_seq[idx], memory_order_relaxed);
+        atomic_store_explicit(&imgstfile->slot_seq[idx], seq + 1, memory_order_release);
+    }
+
+    // For the followers, at the next change_log_commit
+    change_log* log = imgstfile->changes;
+
+    if (log != NULL) {
+        if (log->nb_pending < CHANGE_LOG_SIZE) {
+            log->pending[log->nb_pending] = (uint32_t) idx;
+        }
+        log->nb_pending += 1;
+    }
+}
+
+/**
+ * Tells whether the imgStore file is opened read-only.
+ */
+int is_read_only(const imgst_file* imgstfile)
+{
+    if (imgstfile == NULL || imgstfile->file == NULL) {
+        return 0;
+    }
+
+    const int flags = fcntl(fileno(imgstfile->file), F_GETFL);
+
+    return flags != -1 && (flags & O_ACCMODE) == O_RDONLY;
+}
+
+/**
+ * Opens the change log of the imgStore, writing its header if it is new.
+ */
+int change_log_open(const char* imgst_filename, const int create, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_EXIT_IF(imgstfile->changes != NULL, ERR_NONE, "the change log is already open", );
+
+    const size_t len = strlen(imgst_filename) + strlen(CHANGE_LOG_EXT) + 1;
+    char* filename = NULL;
+    M_EXIT_IF_NULL(filename = calloc(len, sizeof(char)), len);
+    snprintf(filename, len, "%s%s", imgst_filename, CHANGE_LOG_EXT);
+
+    FILE* file = fopen(filename, "rb+");
+
+    if (file == NULL && create) {
+        file = fopen(filename, "wb+");
+    }
+
+    FREE_DEREF(filename);
+    M_EXIT_IF(file == NULL, ERR_IO, "cannot open the change log", );
+
+    change_log_header header;
+    memset(&header, 0, sizeof(change_log_header));
+
+    if (fread(&header, sizeof(change_log_header), 1, file) != 1) {
+        // A new change log
+        memcpy(header.magic, CHANGE_LOG_MAGIC, CHANGE_LOG_MAGIC_LEN);
+        header.size = CHANGE_LOG_SIZE;
+        header.count = 0;
+
+        if (fseek(file, 0, SEEK_SET) != 0
+            || fwrite(&header, sizeof(change_log_header), 1, file) != 1
+            || fflush(file) != 0) {
+            fclose(file);
+            return ERR_IO;
+        }
+    }
+
+    if (memcmp(header.magic, CHANGE_LOG_MAGIC, CHANGE_LOG_MAGIC_LEN) || header.size != CHANGE_LOG_SIZE) {
+        fclose(file);
+        return ERR_IO;
+    }
+
+    change_log* log = calloc(1, sizeof(change_log));
+
+    if (log == NULL) {
+        fclose(file);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    log->file = file;
+    log->count = header.count;
+    imgstfile->changes = log;
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes the slots changed since the last call to the change log.
+ */
+int change_log_commit(imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    change_log* log = imgstfile->changes;
+
+    if (log == NULL || log->nb_pending == 0) {
+        return ERR_NONE;
+    }
+
+    // The slots first, then the records that point to them
+    M_EXIT_IF(fflush(imgstfile->file) != 0, ERR_IO, "cannot flush the imgStore file", );
+
+    // Too many at once: the count alone tells the followers to reload all
+    for (size_t i = 0; log->nb_pending <= CHANGE_LOG_SIZE && i < log->nb_pending; ++i) {
+        const change_record record = {imgstfile->header.imgst_version, log->pending[i]};
+        const long at = (long)(sizeof(change_log_header)
+                               + ((log->count + i) % CHANGE_LOG_SIZE) * sizeof(change_record));
+
+        M_EXIT_IF(fseek(log->file, at, SEEK_SET) != 0
+                  || fwrite(&record, sizeof(change_record), 1, log->file) != 1,
+                  ERR_IO, "cannot write the change log", );
+    }
+
+    // The count last: followers read the records it makes visible
+    change_log_header header;
+    memset(&header, 0, sizeof(change_log_header));
+    memcpy(header.magic, CHANGE_LOG_MAGIC, CHANGE_LOG_MAGIC_LEN);
+    header.size = CHANGE_LOG_SIZE;
+    header.count = log->count + log->nb_pending;
+
+    M_EXIT_IF(fseek(log->file, 0, SEEK_SET) != 0
+              || fwrite(&header, sizeof(change_log_header), 1, log->file) != 1
+              || fflush(log->file) != 0,
+              ERR_IO, "cannot write the change log", );
+
+    log->count = header.count;
+    log->nb_pending = 0;
+
+    return ERR_NONE;
+}
+
+/**
+ * Updates a range of consecutive metadata in the imgStore file at once
+ */
+int updateMetadataRange(const size_t first, const size_t nb, imgst_file* imgstfile)
+{
+    // Null pointer checks
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+    M_REQUIRE_NON_NULL(imgstfile->file);
+
+    // Check that the whole range exists (valid or not)
+    M_EXIT_IF(first > imgstfile->header.max_files || nb > imgstfile->header.max_files - first,
+              ERR_FILE_NOT_FOUND, "the metadata of that range doesn't exist", );
+
+    if (nb == 0) {
+        return ERR_NONE;
+    }
+
+    if (fseek(imgstfile->file, (long)(first * sizeof(img_metadata) + sizeof(imgst_header)), SEEK_SET) != 0) {
+        return ERR_IO;
+    }
+
+    // Overwrite the whole range with a single write
+    TRACE_BEGIN(updateMetadataRange);
+    const size_t written = fwrite(&(imgstfile->metadata[first]), sizeof(img_metadata), nb, imgstfile->file);
+    TRACE_END(updateMetadataRange);
+
+    if (written != nb) {
+        return ERR_IO;
+    }
+
+    rewind(imgstfile->file);
+
+    return ERR_NONE;
+}
+
 /**
  * Updates the header in the imgStore file
  */
@@ -260,7 +546,11 @@ int updateHeader(imgst_file* imgstfile)
     // Attempt to overwrite the header.
     rewind(imgstfile->file);
 
-    if (fwrite(&(imgstfile->header), sizeof(imgst_header), 1, imgstfile->file) != 1) {
+    TRACE_BEGIN(updateHeader);
+    const size_t written = fwrite(&(imgstfile->header), sizeof(imgst_header), 1, imgstfile->file);
+    TRACE_END(updateHeader);
+
+    if (written != 1) {
         return ERR_IO;
     }
 
@@ -406,3 +696,42 @@ int write_disk_image(const char* filename, const char* buffer, size_t size)
 
     return ERR_NONE;
 }
+
+static imgst_counters s_counters;
+
+/**
+ * Copies the counters of the library
+ */
+void get_counters(imgst_counters* counters)
+{
+    if (counters != NULL) {
+        *counters = s_counters;
+    }
+}
+
+/**
+ * Counts a resized image created in the given time
+ */
+void count_resize(uint64_t us)
+{
+    s_counters.resizes += 1;
+    s_counters.resize_us += us;
+}
+
+/**
+ * Counts an image whose content was already stored
+ */
+void count_dedup_hit(void)
+{
+    s_counters.dedup_hits += 1;
+}
+
+/**
+ * Monotonic time, in microseconds
+ */
+uint64_t monotonic_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000 + (uint64_t) t.tv_nsec / 1000;
+}
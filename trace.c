@@ -0,0 +1,321 @@
+/**
+ * @file trace.c
+ * @brief Lock-free per-thread rings of trace spans, dumped as Chrome trace JSON,
+ *        and time summed by span name
+ *
+ * @author ???
+ */
+#define _POSIX_C_SOURCE 200809L // for clock_gettime, open_memstream
+
+#include "trace.h"
+#include "error.h"
+
+#include <stdlib.h> // for calloc, free
+#include <string.h> // for strcmp
+#include <stdatomic.h>
+#include <pthread.h> // for pthread_key_create
+#include <time.h> // for clock_gettime
+
+#define TRACE_MASK (TRACE_RING_SIZE - 1)
+
+/**
+ * The spans of one thread. Only its thread writes events and head; dumps read
+ * them concurrently and drop the events that may have been overwritten meanwhile.
+ * Rings are never freed: those of finished threads are handed to new ones.
+ */
+struct trace_ring {
+    trace_event events[TRACE_RING_SIZE];
+    _Atomic uint64_t head; // number of events ever written
+    _Atomic uint64_t base; // events before it were forgotten by trace_reset
+    atomic_int owned; // 1 while a thread writes in it
+    unsigned tid;
+    struct trace_ring* next;
+};
+
+/**
+ * The time summed for one span name. The name is set once, by the first
+ * thread to close such a span; the sums are only ever added to.
+ */
+struct trace_sum {
+    const char* _Atomic name;
+    _Atomic uint64_t calls;
+    _Atomic uint64_t wall_ns;
+    _Atomic uint64_t cpu_ns;
+};
+
+int trace_flags = 0;
+
+static struct trace_sum s_sums[TRACE_MAX_PHASES];
+
+static struct trace_ring* _Atomic s_rings = NULL;
+static atomic_uint s_nb_rings = 0;
+static _Thread_local struct trace_ring* t_ring = NULL;
+
+static pthread_key_t s_ring_key;
+static pthread_once_t s_ring_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Hands the ring of a finishing thread over to the next new thread.
+ */
+static void release_ring(void* ring)
+{
+    atomic_store_explicit(&((struct trace_ring*) ring)->owned, 0, memory_order_release);
+}
+
+static void make_ring_key(void)
+{
+    pthread_key_create(&s_ring_key, release_ring);
+}
+
+/**
+ * Gives the ring of the calling thread: a released one, else a new one.
+ */
+static struct trace_ring* thread_ring(void)
+{
+    if (t_ring != NULL) {
+        return t_ring;
+    }
+
+    pthread_once(&s_ring_once, make_ring_key);
+
+    struct trace_ring* ring = atomic_load_explicit(&s_rings, memory_order_acquire);
+    for (; ring != NULL; ring = ring->next) {
+        int released = 0;
+        if (atomic_compare_exchange_strong(&ring->owned, &released, 1)) {
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct trace_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        atomic_init(&ring->owned, 1);
+        ring->tid = atomic_fetch_add(&s_nb_rings, 1) + 1;
+
+        ring->next = atomic_load_explicit(&s_rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&s_rings, &ring->next, ring,
+                memory_order_release, memory_order_relaxed));
+    }
+
+    pthread_setspecific(s_ring_key, ring);
+    t_ring = ring;
+
+    return ring;
+}
+
+/**
+ * Monotonic time, in nanoseconds.
+ */
+uint64_t trace_now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+/**
+ * CPU time of the calling thread, in nanoseconds.
+ */
+uint64_t trace_cpu_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+/**
+ * Gives the start of a span. The CPU time costs a system call: only TRACE_TIMING reads it.
+ */
+trace_start trace_now(void)
+{
+    return (trace_start) {
+        trace_now_ns(), (trace_flags & TRACE_TIMING) ? trace_cpu_ns() : 0
+    };
+}
+
+/**
+ * Records a span in the ring of the calling thread.
+ */
+static void ring_record(const char* name, const uint64_t start_ns, const uint64_t end_ns)
+{
+    struct trace_ring* ring = thread_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    const uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event* event = &ring->events[head & TRACE_MASK];
+    event->name = name;
+    event->start_ns = start_ns;
+    event->dur_ns = end_ns - start_ns;
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Adds a span to the sum of its name. The same name may come from several
+ * files, hence with several addresses.
+ */
+static void sum_record(const char* name, const uint64_t wall_ns, const uint64_t cpu_ns)
+{
+    for (size_t i = 0; i < TRACE_MAX_PHASES; ++i) {
+        const char* taken = atomic_load_explicit(&s_sums[i].name, memory_order_acquire);
+
+        if (taken == NULL && atomic_compare_exchange_strong(&s_sums[i].name, &taken, name)) {
+            taken = name;
+        }
+
+        if (taken == name || !strcmp(taken, name)) {
+            atomic_fetch_add_explicit(&s_sums[i].calls, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&s_sums[i].wall_ns, wall_ns, memory_order_relaxed);
+            atomic_fetch_add_explicit(&s_sums[i].cpu_ns, cpu_ns, memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+/**
+ * Hands a span from start until now to the consumers.
+ */
+void trace_record(const char* name, const trace_start* start)
+{
+    // The consumers were turned on during the span
+    if (start->wall_ns == 0) {
+        return;
+    }
+
+    const uint64_t end_ns = trace_now_ns();
+
+    // Before the ring of a new thread is allocated
+    if ((trace_flags & TRACE_TIMING) && start->cpu_ns != 0) {
+        sum_record(name, end_ns - start->wall_ns, trace_cpu_ns() - start->cpu_ns);
+    }
+
+    if (trace_flags & TRACE_RING) {
+        ring_record(name, start->wall_ns, end_ns);
+    }
+}
+
+/**
+ * Forgets the spans recorded so far, by all threads.
+ */
+void trace_reset(void)
+{
+    for (struct trace_ring* ring = atomic_load_explicit(&s_rings, memory_order_acquire);
+         ring != NULL; ring = ring->next) {
+        atomic_store(&ring->base, atomic_load_explicit(&ring->head, memory_order_acquire));
+    }
+}
+
+/**
+ * Writes the events of a ring still there after they were copied.
+ */
+static int write_ring(FILE* out, struct trace_ring* ring, trace_event* copy, int* first)
+{
+    const uint64_t base = atomic_load(&ring->base);
+    const uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t from = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+    from = (base > from) ? base : from;
+
+    for (uint64_t i = from; i < head; ++i) {
+        copy[i & TRACE_MASK] = ring->events[i & TRACE_MASK];
+    }
+
+    // The thread may have overwritten the oldest events while they were copied
+    const uint64_t after = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (after >= TRACE_RING_SIZE && after - TRACE_RING_SIZE + 1 > from) {
+        from = after - TRACE_RING_SIZE + 1;
+    }
+
+    for (uint64_t i = from; i < head; ++i) {
+        const trace_event* event = &copy[i & TRACE_MASK];
+        if (fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"imgStore\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                    "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}", *first ? "" : ",",
+                    event->name, ring->tid,
+                    (unsigned long long)(event->start_ns / 1000), (unsigned long long)(event->start_ns % 1000),
+                    (unsigned long long)(event->dur_ns / 1000), (unsigned long long)(event->dur_ns % 1000)) < 0) {
+            return ERR_IO;
+        }
+        *first = 0;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes the spans of all threads as Chrome trace JSON.
+ */
+int trace_write(FILE* out)
+{
+    M_REQUIRE_NON_NULL(out);
+
+    trace_event* copy = calloc(TRACE_RING_SIZE, sizeof(trace_event));
+    M_EXIT_IF_NULL(copy, TRACE_RING_SIZE * sizeof(trace_event));
+
+    int first = 1;
+    int ret = (fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out) < 0) ? ERR_IO : ERR_NONE;
+
+    for (struct trace_ring* ring = atomic_load_explicit(&s_rings, memory_order_acquire);
+         ring != NULL && ret == ERR_NONE; ring = ring->next) {
+        ret = write_ring(out, ring, copy, &first);
+    }
+
+    free(copy);
+
+    if (ret == ERR_NONE && fputs("\n]}\n", out) < 0) {
+        ret = ERR_IO;
+    }
+
+    return ret;
+}
+
+/**
+ * Writes the spans of all threads as Chrome trace JSON into a new buffer.
+ */
+int trace_dump(char** json, size_t* size)
+{
+    M_REQUIRE_NON_NULL(json);
+    M_REQUIRE_NON_NULL(size);
+
+    char* buffer = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&buffer, &length);
+    M_EXIT_IF_NULL(out, (size_t) 0);
+
+    const int ret = trace_write(out);
+
+    // The buffer and its length are only up to date once the stream is closed
+    if (fclose(out) != 0 || ret != ERR_NONE) {
+        free(buffer);
+        return (ret != ERR_NONE) ? ret : ERR_OUT_OF_MEMORY;
+    }
+
+    *json = buffer;
+    *size = length;
+
+    return ERR_NONE;
+}
+
+/**
+ * Gives the time summed by TRACE_TIMING, by span name.
+ */
+size_t trace_phases(trace_phase* phases, size_t max)
+{
+    size_t nb = 0;
+
+    for (size_t i = 0; phases != NULL && i < TRACE_MAX_PHASES && nb < max; ++i) {
+        const char* name = atomic_load_explicit(&s_sums[i].name, memory_order_acquire);
+        if (name == NULL) {
+            break;
+        }
+
+        phases[nb++] = (trace_phase) {
+            name, atomic_load(&s_sums[i].calls), atomic_load(&s_sums[i].wall_ns),
+            atomic_load(&s_sums[i].cpu_ns)
+        };
+    }
+
+    return nb;
+}
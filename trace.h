@@ -0,0 +1,160 @@
+#pragma once
+
+/**
+ * @file trace.h
+ * @brief Header file for trace.c.
+ *
+ * Trace spans around the phases of the hot paths (lookup, file I/O, decoding,
+ * resizing, encoding, metadata writes). They feed the consumers turned on in
+ * trace_flags:
+ *  - TRACE_RING: each thread records its spans in its own ring buffer, without
+ *    locks; the rings can be dumped at any time as Chrome trace JSON
+ *    (chrome://tracing, Perfetto).
+ *  - TRACE_TIMING: the wall and CPU time of the spans are summed by name.
+ *
+ * Spans are compiled in with -DIMGST_TRACE (make TRACE=1) and only cost a
+ * test of trace_flags while no consumer is on. By default (make TRACE=0),
+ * TRACE_BEGIN and TRACE_END expand to nothing and nothing is ever recorded.
+ *
+ * @author ???
+ */
+
+#include <stdio.h> // for FILE
+#include <stdint.h> // for uint64_t
+#include <stddef.h> // for size_t
+
+#define TRACE_RING_SIZE 4096 // spans kept per thread, a power of 2
+#define TRACE_MAX_PHASES 64 // span names summed by TRACE_TIMING
+
+/* consumers of the spans, for trace_flags */
+#define TRACE_RING 1
+#define TRACE_TIMING 2
+
+/**
+ * @brief One span: a phase of some thread, in nanoseconds.
+ */
+struct trace_event {
+    const char* name; // a string literal
+    uint64_t start_ns;
+    uint64_t dur_ns;
+};
+
+/**
+ * @brief When a span began: wall time, and CPU time of the thread for TRACE_TIMING.
+ */
+struct trace_start {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+};
+
+/**
+ * @brief The time spent in all the spans of a name, by all threads.
+ */
+struct trace_phase {
+    const char* name;
+    uint64_t calls;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+};
+
+typedef struct trace_event trace_event;
+typedef struct trace_start trace_start;
+typedef struct trace_phase trace_phase;
+
+/**
+ * @brief The TRACE_ consumers turned on, set before the spans of interest.
+ */
+extern int trace_flags;
+
+#ifdef IMGST_TRACE
+
+/**
+ * @brief Opens a span, until the TRACE_END of the same name in the same scope.
+ */
+#define TRACE_BEGIN(span) const trace_start span##_trace_start = trace_begin()
+
+/**
+ * @brief Closes a span and hands it to the consumers.
+ */
+#define TRACE_END(span) \
+    do { \
+        if (trace_flags) { \
+            trace_record(#span, &span##_trace_start); \
+        } \
+    } while (0)
+
+#else
+
+#define TRACE_BEGIN(span) do { } while (0)
+#define TRACE_END(span) do { } while (0)
+
+#endif
+
+/**
+ * @brief Monotonic time, in nanoseconds.
+ */
+uint64_t trace_now_ns(void);
+
+/**
+ * @brief CPU time of the calling thread, in nanoseconds.
+ */
+uint64_t trace_cpu_ns(void);
+
+/**
+ * @brief Gives the start of a span: now, or zeros while no consumer is on.
+ */
+trace_start trace_now(void);
+
+static inline trace_start trace_begin(void)
+{
+    if (trace_flags) {
+        return trace_now();
+    }
+
+    return (trace_start) {
+        0, 0
+    };
+}
+
+/**
+ * @brief Hands a span from start until now to the consumers.
+ *
+ * @param name The name of the span, must outlive the trace (a string literal)
+ * @param start When the span began, from trace_begin
+ */
+void trace_record(const char* name, const trace_start* start);
+
+/**
+ * @brief Forgets the spans recorded so far, by all threads.
+ */
+void trace_reset(void);
+
+/**
+ * @brief Writes the spans of all threads as Chrome trace JSON.
+ *
+ * @param out The stream to write to
+ *
+ * @return Some error code. 0 if no error.
+ */
+int trace_write(FILE* out);
+
+/**
+ * @brief Writes the spans of all threads as Chrome trace JSON into a new buffer.
+ *
+ * @param json Set to the buffer, NUL-terminated, to be freed by the caller
+ * @param size Set to the length of the JSON
+ *
+ * @return Some error code. 0 if no error.
+ */
+int trace_dump(char** json, size_t* size);
+
+/**
+ * @brief Gives the time summed by TRACE_TIMING, by span name, in the order
+ *        they were first seen.
+ *
+ * @param phases Array to fill
+ * @param max The capacity of the array
+ *
+ * @return The number of phases filled in
+ */
+size_t trace_phases(trace_phase* phases, size_t max);
@@ -0,0 +1,287 @@
+/**
+ * @file variant.c
+ * @brief imgStore library: variant records of arbitrary-width images
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+#include "variant.h"
+#include "util.h" // for atouint16
+#include "error.h"
+
+#include <stdlib.h> // for calloc, realloc
+#include <string.h> // for memcmp, strchr
+
+#define BUCKET_STRLEN 6 // strlen("65535") + 1
+
+/**
+ * Allocates an empty variant table for the given number of slots.
+ */
+static int variant_table_new(variant_table** table, const uint32_t max_files)
+{
+    variant_table* t = NULL;
+    M_EXIT_IF_NULL(t = calloc(1, sizeof(variant_table)), sizeof(variant_table));
+
+    t->head = calloc(max_files, sizeof(uint32_t));
+
+    if (t->head == NULL) {
+        FREE_DEREF(t);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    for (size_t i = 0; i < max_files; ++i) {
+        t->head[i] = NO_VARIANT;
+    }
+
+    *table = t;
+
+    return ERR_NONE;
+}
+
+/**
+ * Adds a record at the end of the table and links it to its slot.
+ */
+static int variant_table_add(variant_table* t, const img_variant* record)
+{
+    // Grow the arrays by doubling their capacity
+    if (t->nb == t->cap) {
+        const uint32_t cap = (t->cap == 0) ? 16 : 2 * t->cap;
+
+        img_variant* records = realloc(t->records, cap * sizeof(img_variant));
+        M_EXIT_IF_NULL(records, cap * sizeof(img_variant));
+        t->records = records;
+
+        uint32_t* next = realloc(t->next, cap * sizeof(uint32_t));
+        M_EXIT_IF_NULL(next, cap * sizeof(uint32_t));
+        t->next = next;
+
+        t->cap = cap;
+    }
+
+    // The new record becomes the head of its slot's chain
+    t->records[t->nb] = *record;
+    t->next[t->nb] = t->head[record->slot];
+    t->head[record->slot] = t->nb;
+    t->nb += 1;
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the variant records chained from the header into memory.
+ */
+int variant_load(imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->file);
+
+    imgstfile->variants = NULL;
+
+    const uint32_t nb = imgstfile->header.num_variants;
+
+    if (nb == 0 || imgstfile->header.variant_head == 0) {
+        return ERR_NONE;
+    }
+
+    // Records are chained from the most recent one, read them in a buffer first
+    img_variant* chain = NULL;
+    M_EXIT_IF_NULL(chain = calloc(nb, sizeof(img_variant)), nb * sizeof(img_variant));
+
+    // Content can only lie after the header and the metadata
+    const uint64_t content_start = sizeof(imgst_header)
+                                   + (uint64_t) imgstfile->header.max_files * sizeof(img_metadata);
+
+    uint64_t position = imgstfile->header.variant_head;
+    uint32_t read = 0;
+    int consistent = 1;
+
+    while (consistent && read < nb && position != 0) {
+        consistent = position >= content_start
+                     && fseek(imgstfile->file, (long) position, SEEK_SET) == 0
+                     && fread(&chain[read], sizeof(img_variant), 1, imgstfile->file) == 1
+                     && chain[read].slot < imgstfile->header.max_files
+                     && chain[read].format < NB_FMT
+                     && chain[read].next < position;
+
+        position = chain[read].next;
+        ++read;
+    }
+
+    rewind(imgstfile->file);
+
+    // Anything else than exactly num_variants records is left over from an
+    // older imgStore that did not use these header fields: ignore it.
+    if (!consistent || read != nb || position != 0) {
+        FREE_DEREF(chain);
+        imgstfile->header.num_variants = 0;
+        imgstfile->header.variant_head = 0;
+        return ERR_NONE;
+    }
+
+    // Build the table in the order the records were appended
+    M_EXIT_IF_ERR_DO_SOMETHING(variant_table_new(&imgstfile->variants, imgstfile->header.max_files),
+                               FREE_DEREF(chain));
+
+    for (uint32_t i = nb; i > 0; --i) {
+        M_EXIT_IF_ERR_DO_SOMETHING(variant_table_add(imgstfile->variants, &chain[i - 1]),
+                                   FREE_DEREF(chain); variant_free(imgstfile));
+    }
+
+    FREE_DEREF(chain);
+
+    return ERR_NONE;
+}
+
+/**
+ * Frees the in-memory variant table.
+ */
+void variant_free(imgst_file* imgstfile)
+{
+    if (imgstfile != NULL && imgstfile->variants != NULL) {
+        FREE_DEREF(imgstfile->variants->records);
+        FREE_DEREF(imgstfile->variants->next);
+        FREE_DEREF(imgstfile->variants->head);
+        FREE_DEREF(imgstfile->variants);
+    }
+}
+
+/**
+ * Finds the variant of an image for a given box and format.
+ */
+int variant_find(const img_variant** variant, const size_t idx, const uint16_t box[DIMS],
+                 const int format, const imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(variant);
+    M_REQUIRE_NON_NULL(box);
+    M_EXIT_IF_ERR(validMetadataIndex(idx, imgstfile));
+
+    const variant_table* t = imgstfile->variants;
+
+    if (t == NULL) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    // Walk the chain of the slot. Records left by a previous image in the
+    // same slot are told apart by their SHA.
+    for (uint32_t i = t->head[idx]; i != NO_VARIANT; i = t->next[i]) {
+        const img_variant* v = &t->records[i];
+
+        if (v->box[0] == box[0] && v->box[1] == box[1] && v->format == format
+            && !memcmp(v->SHA, imgstfile->metadata[idx].SHA, SHA256_DIGEST_LENGTH)) {
+
+            *variant = v;
+            return ERR_NONE;
+        }
+    }
+
+    return ERR_FILE_NOT_FOUND;
+}
+
+/**
+ * Appends a variant content and its record to the imgStore file.
+ */
+int variant_append(const size_t idx, const uint16_t box[DIMS], const int format,
+                   const void* buffer, const size_t size, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(box);
+    M_REQUIRE_NON_NULL(buffer);
+    M_EXIT_IF_ERR(validMetadataIndex(idx, imgstfile));
+    M_EXIT_IF(format < 0 || NB_FMT <= format, ERR_INVALID_ARGUMENT,
+              "invalid format code %d", format);
+
+    if (imgstfile->variants == NULL) {
+        M_EXIT_IF_ERR(variant_table_new(&imgstfile->variants, imgstfile->header.max_files));
+    }
+
+    // Append the content, directly followed by its record
+    if (fseek(imgstfile->file, 0, SEEK_END) != 0) {
+        return ERR_IO;
+    }
+
+    img_variant record = {
+        .next = imgstfile->header.variant_head,
+        .offset = (uint64_t) ftell(imgstfile->file),
+        .size = (uint32_t) size,
+        .box = {box[0], box[1]},
+        .slot = (uint32_t) idx,
+        .format = (uint16_t) format
+    };
+    memcpy(record.SHA, imgstfile->metadata[idx].SHA, SHA256_DIGEST_LENGTH);
+
+    if (fwrite(buffer, size, 1, imgstfile->file) != 1
+        || fwrite(&record, sizeof(img_variant), 1, imgstfile->file) != 1) {
+        return ERR_IO;
+    }
+
+    // The header is written last: it commits the record.
+    imgstfile->header.variant_head = record.offset + size;
+    imgstfile->header.num_variants += 1;
+    M_EXIT_IF_ERR(updateHeader(imgstfile));
+
+    return variant_table_add(imgstfile->variants, &record);
+}
+
+/**
+ * Snaps a requested dimension to a bucket.
+ */
+uint16_t snap_to_bucket(const uint32_t requested, const uint16_t* buckets, const size_t nb_buckets)
+{
+    if (requested == 0 || buckets == NULL || nb_buckets == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < nb_buckets; ++i) {
+        if (requested <= buckets[i]) {
+            return buckets[i];
+        }
+    }
+
+    return buckets[nb_buckets - 1];
+}
+
+/**
+ * Parses a comma separated list of increasing buckets.
+ */
+int parse_buckets(const char* str, uint16_t* buckets, size_t* nb_buckets)
+{
+    M_REQUIRE_NON_NULL(str);
+    M_REQUIRE_NON_NULL(buckets);
+    M_REQUIRE_NON_NULL(nb_buckets);
+
+    size_t nb = 0;
+    const char* start = str;
+
+    while (*start != '\0') {
+        M_EXIT_IF(nb >= MAX_VARIANT_BUCKETS, ERR_INVALID_ARGUMENT,
+                  "more than %d buckets", MAX_VARIANT_BUCKETS);
+
+        // Copy the next entry to convert it
+        const char* end = strchr(start, ',');
+        const size_t len = (end == NULL) ? strlen(start) : (size_t)(end - start);
+        M_EXIT_IF(len == 0 || len >= BUCKET_STRLEN, ERR_INVALID_ARGUMENT,
+                  "invalid bucket in %s", str);
+
+        char entry[BUCKET_STRLEN] = {0};
+        memcpy(entry, start, len);
+
+        // Buckets must be non-zero and strictly increasing
+        const uint16_t bucket = atouint16(entry);
+        M_EXIT_IF(bucket == 0 || (nb > 0 && bucket <= buckets[nb - 1]), ERR_RESOLUTIONS,
+                  "invalid bucket %s", entry);
+
+        buckets[nb++] = bucket;
+        start += len;
+
+        // A comma is followed by another bucket
+        if (*start == ',') {
+            ++start;
+            M_EXIT_IF(*start == '\0', ERR_INVALID_ARGUMENT, "invalid bucket in %s", str);
+        }
+    }
+
+    M_EXIT_IF(nb == 0, ERR_INVALID_ARGUMENT, "no bucket in %s", str);
+    *nb_buckets = nb;
+
+    return ERR_NONE;
+}
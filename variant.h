@@ -0,0 +1,98 @@
+#pragma once
+
+/**
+ * @file variant.h
+ * @brief Header file for variant.c.
+ *
+ * In-memory index of the variant records of an imgStore file.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+
+/* marks the end of a chain in the variant table */
+#define NO_VARIANT UINT32_MAX
+
+struct variant_table {
+    /* The variant records, in the order they were appended.
+     */
+    img_variant* records;
+
+    /* The number of records and the allocated capacity.
+     */
+    uint32_t nb;
+    uint32_t cap;
+
+    /* For each record, the index of the previous record of the same slot.
+     */
+    uint32_t* next;
+
+    /* For each slot, the index of its most recent record.
+     */
+    uint32_t* head;
+};
+
+/**
+ * @brief Reads the variant records chained from the header into memory.
+ *        An inconsistent chain (e.g. from an older imgStore) is ignored.
+ *
+ * @param imgstfile The imgStore file, with its header and metadata read.
+ */
+int variant_load(imgst_file* imgstfile);
+
+/**
+ * @brief Frees the in-memory variant table.
+ *
+ * @param imgstfile The imgStore file.
+ */
+void variant_free(imgst_file* imgstfile);
+
+/**
+ * @brief Finds the variant of an image for a given box and format.
+ *
+ * @param variant will point to the variant record
+ * @param idx The index of the image
+ * @param box The bounding box, Width x Height
+ * @param format The encoding (FMT_ code)
+ * @param imgstfile The imgStore file.
+ *
+ * @return ERR_FILE_NOT_FOUND if the variant has not been rendered yet.
+ */
+int variant_find(const img_variant** variant, const size_t idx, const uint16_t box[DIMS],
+                 const int format, const imgst_file* imgstfile);
+
+/**
+ * @brief Appends a variant content and its record to the imgStore file,
+ *        then updates the header.
+ *
+ * @param idx The index of the image
+ * @param box The bounding box, Width x Height
+ * @param format The encoding (FMT_ code)
+ * @param buffer The variant content
+ * @param size The variant content size
+ * @param imgstfile The imgStore file.
+ */
+int variant_append(const size_t idx, const uint16_t box[DIMS], const int format,
+                   const void* buffer, const size_t size, imgst_file* imgstfile);
+
+/**
+ * @brief Snaps a requested dimension to the smallest bucket that is at least
+ *        as large, or to the largest bucket if none is.
+ *
+ * @param requested The requested dimension, 0 if unconstrained
+ * @param buckets The buckets, in increasing order
+ * @param nb_buckets The number of buckets
+ *
+ * @return The bucket, 0 if unconstrained
+ */
+uint16_t snap_to_bucket(const uint32_t requested, const uint16_t* buckets, const size_t nb_buckets);
+
+/**
+ * @brief Parses a comma separated list of increasing buckets, eg. "64,128,256"
+ *
+ * @param str The string to parse
+ * @param buckets The array to fill, of size MAX_VARIANT_BUCKETS
+ * @param nb_buckets will point to the number of buckets read
+ */
+int parse_buckets(const char* str, uint16_t* buckets, size_t* nb_buckets);